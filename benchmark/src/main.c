@@ -0,0 +1,673 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "b6502/base.h"
+#include "b6502/component.h"
+#include "b6502/memory.h"
+#include "b6502/mos6502.h"
+#include "b6502/rc.h"
+#include "b6502/reset_manager.h"
+
+#ifndef KLAUS_ROM
+#  define KLAUS_ROM "test/resources/6502_functional_test.bin"
+#endif
+
+#define MEM_SIZE 0x10000
+#define MAX_REPETITIONS 1000
+#define MAX_SELECTED 32
+#define MAX_BASELINE 256
+#define NAME_SIZE 32
+
+// Where the functional test reports success, and how long it may take to get there.
+#define KLAUS_ENTRY 0x400
+#define KLAUS_SUCCESS 0x3469
+#define KLAUS_MAX_CYCLES 500000000
+
+// Where the synthetic programs are loaded, the data they use, and the MMIO device.
+#define PROGRAM_START 0x0200
+#define DATA_START 0x0300
+#define MMIO_START 0x4000
+#define MMIO_END 0x40FF
+
+// Instructions per call to mos6502_execute().
+#define CHUNK 4096
+
+typedef struct TestBench {
+  ResetManager* rm;
+  Mos6502* cpu;
+  Memory* mem;
+  Component* mmio;
+} TestBench;
+
+// A program looping forever at PROGRAM_START + loop, after an optional setup, that runs for a
+// fixed number of cycles. An empty program means the functional test image instead, which runs
+// until it succeeds.
+typedef struct Workload {
+  const char* name;
+  const char* description;
+  CpuVariant variant;
+  uint8_t program[48];
+  size_t size;
+  size_t loop;
+} Workload;
+
+typedef struct Engine {
+  const char* name;
+  bool (*enable)(Mos6502* cpu);
+  bool stepped;
+} Engine;
+
+typedef struct Options {
+  const char* klaus;
+  uint64_t cycles;
+  size_t repetitions;
+  size_t warmup;
+} Options;
+
+typedef struct Result {
+  const Workload* workload;
+  const Engine* engine;
+  uint64_t instructions;
+  uint64_t cycles;
+  size_t repetitions;
+  double median_ns;
+  double p90_ns;
+  double min_ns;
+  double mhz;
+  double mips;
+} Result;
+
+typedef struct BaselineEntry {
+  char workload[NAME_SIZE];
+  char engine[NAME_SIZE];
+  double median_ns;
+} BaselineEntry;
+
+// The operands of the indexed and indirect workloads point into DATA_START, and the zero page
+// pointers at $20-$27 too.
+static const Workload workloads[] = {
+    {"klaus", "the Klaus Dormann functional test, to completion", kNMOS6502, {0}, 0, 0},
+    {"klaus_65c02", "the same on the 65C02", kWDC65C02, {0}, 0, 0},
+    {"immediate",
+     "LDA/ADC/AND/ORA/EOR/CMP/LDX/LDY #imm",
+     kNMOS6502,
+     {0xA9, 0x12, 0x69, 0x34, 0x29, 0xF0, 0x09, 0x0F, 0xA2, 0x01, 0x49, 0x55, 0xC9, 0x20, 0xA0,
+      0x02},
+     16,
+     0},
+    {"zero_page",
+     "LDA/ADC/STA/INC/LDX/STX zp",
+     kNMOS6502,
+     {0xA5, 0x10, 0x65, 0x11, 0x85, 0x12, 0xE6, 0x13, 0xA6, 0x14, 0x86, 0x15},
+     12,
+     0},
+    {"zero_page_x",
+     "LDA/ADC/STA/INC/LDY/STY zp,X",
+     kNMOS6502,
+     {0xA2, 0x04, 0xB5, 0x10, 0x75, 0x11, 0x95, 0x12, 0xF6, 0x13, 0xB4, 0x14, 0x94, 0x15},
+     14,
+     2},
+    {"absolute",
+     "LDA/ADC/STA/INC/LDX/STX abs",
+     kNMOS6502,
+     {0xAD, 0x00, 0x03, 0x6D, 0x01, 0x03, 0x8D, 0x02, 0x03, 0xEE, 0x03, 0x03, 0xAE, 0x04, 0x03,
+      0x8E, 0x05, 0x03},
+     18,
+     0},
+    {"absolute_indexed",
+     "LDA/ADC/STA/INC abs,X and abs,Y, crossing pages",
+     kNMOS6502,
+     {0xA2, 0x80, 0xA0, 0xC0, 0xBD, 0xA0, 0x03, 0x79, 0x60, 0x03, 0x9D, 0x00, 0x03, 0xFE, 0x01,
+      0x03, 0x99, 0x02, 0x03},
+     19,
+     4},
+    {"indexed_indirect",
+     "LDA/ADC/STA (zp,X)",
+     kNMOS6502,
+     {0xA2, 0x02, 0xA1, 0x1E, 0x61, 0x20, 0x81, 0x22, 0xA1, 0x24},
+     10,
+     2},
+    {"indirect_indexed",
+     "LDA/ADC/STA (zp),Y",
+     kNMOS6502,
+     {0xA0, 0x10, 0xB1, 0x20, 0x71, 0x22, 0x91, 0x24, 0xB1, 0x26},
+     10,
+     2},
+    {"stack",
+     "PHA/PHP/PLP/PLA and JSR/RTS",
+     kNMOS6502,
+     {0x48, 0x08, 0x28, 0x68, 0x20, 0x0A, 0x02, 0x4C, 0x00, 0x02, 0xEA, 0x60},
+     12,
+     0},
+    {"branch",
+     "DEX/BNE countdowns",
+     kNMOS6502,
+     {0xA2, 0x00, 0xCA, 0xD0, 0xFD, 0xA0, 0x10, 0x88, 0xD0, 0xFD},
+     10,
+     0},
+    {"mmio",
+     "loads and stores to a device register page",
+     kNMOS6502,
+     {0xA2, 0x01, 0xAD, 0x00, 0x40, 0x8D, 0x01, 0x40, 0xBD, 0x02, 0x40, 0x9D, 0x03, 0x40, 0x2C,
+      0x04, 0x40, 0xE6, 0x10},
+     19,
+     2},
+    {"decimal",
+     "ADC/SBC in decimal mode",
+     kNMOS6502,
+     {0xF8, 0x18, 0xA9, 0x19, 0x69, 0x28, 0x65, 0x10, 0xE9, 0x07, 0xE5, 0x11, 0x85, 0x12},
+     14,
+     1},
+    {"decimal_65c02",
+     "ADC/SBC in decimal mode on the 65C02",
+     kWDC65C02,
+     {0xF8, 0x18, 0xA9, 0x19, 0x69, 0x28, 0x65, 0x10, 0xE9, 0x07, 0xE5, 0x11, 0x85, 0x12},
+     14,
+     1},
+};
+
+static bool enable_interpreter(Mos6502* UNUSED(cpu)) { return true; }
+
+static bool enable_block_cache(Mos6502* cpu) {
+  set_block_cache(cpu, true);
+  return true;
+}
+
+static bool enable_jit(Mos6502* cpu) { return set_jit(cpu, true); }
+
+static const Engine engines[] = {{"step", enable_interpreter, true},
+                                 {"fused", enable_interpreter, false},
+                                 {"blocks", enable_block_cache, false},
+                                 {"jit", enable_jit, false}};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static struct option long_options[] = {{"workload", required_argument, 0, 'w'},
+                                       {"engine", required_argument, 0, 'e'},
+                                       {"repetitions", required_argument, 0, 'r'},
+                                       {"warmup", required_argument, 0, 'u'},
+                                       {"cycles", required_argument, 0, 'c'},
+                                       {"klaus", required_argument, 0, 'k'},
+                                       {"format", required_argument, 0, 'f'},
+                                       {"output", required_argument, 0, 'o'},
+                                       {"baseline", required_argument, 0, 'b'},
+                                       {"threshold", required_argument, 0, 't'},
+                                       {"list", no_argument, 0, 'l'},
+                                       {"help", no_argument, 0, 'h'},
+                                       {0, 0, 0, 0}};
+
+static void print_help(void) {
+  printf(
+      "Usage: b6502-benchmark [options]\n"
+      "Measure how fast the b6502 core runs fixed workloads, without a display.\n\n"
+      "  -w, --workload NAME    run only this workload (repeatable, see --list)\n"
+      "  -e, --engine NAME      step, fused, blocks or jit (repeatable, default: all)\n"
+      "  -r, --repetitions N    measured runs of each workload (default: 5)\n"
+      "  -u, --warmup N         unmeasured runs before those (default: 1)\n"
+      "  -c, --cycles N         emulated cycles per run of a synthetic workload\n"
+      "                         (default: 20000000)\n"
+      "  -k, --klaus FILE       the functional test image (default: " KLAUS_ROM
+      ")\n"
+      "  -f, --format FORMAT    text, csv or json (default: text)\n"
+      "  -o, --output FILE      where to write the results (default: stdout)\n"
+      "  -b, --baseline FILE    compare against results saved with --format csv\n"
+      "  -t, --threshold PCT    how much slower than the baseline is a regression (default: 5)\n"
+      "  -l, --list             list the workloads\n"
+      "  -h, --help             show this help\n\n"
+      "The exit status is 1 when a workload regressed against the baseline.\n");
+}
+
+static bool parse_count(const char* str, uint64_t min, uint64_t max, uint64_t* count) {
+  char* end = NULL;
+  errno = 0;
+  const unsigned long long value = strtoull(str, &end, 0);
+  if (errno || !*str || *end || value < min || value > max) {
+    LOG_ERROR("Invalid count: %s\n", str);
+    return false;
+  }
+
+  *count = value;
+  return true;
+}
+
+static const Workload* find_workload(const char* name) {
+  for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+    if (!strcmp(name, workloads[i].name)) {
+      return &workloads[i];
+    }
+  }
+
+  LOG_ERROR("Unknown workload: %s\n", name);
+  return NULL;
+}
+
+static const Engine* find_engine(const char* name) {
+  for (size_t i = 0; i < NUM_ENGINES; i++) {
+    if (!strcmp(name, engines[i].name)) {
+      return &engines[i];
+    }
+  }
+
+  LOG_ERROR("Unknown engine: %s\n", name);
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/////////////////////////////////////////////////
+///     Test benches
+/////////////////////////////////////////////////
+
+static uint64_t mmio_accesses = 0;
+
+static uint8_t mmio_read(void* UNUSED(obj), uint16_t addr) {
+  mmio_accesses++;
+  return (uint8_t)addr;
+}
+
+static void mmio_write(void* UNUSED(obj), uint16_t UNUSED(addr), uint8_t UNUSED(val)) {
+  mmio_accesses++;
+}
+
+static bool bench_create(TestBench* bench, const Workload* workload, const Options* options) {
+  bench->rm = reset_manager_create();
+  bench->cpu = mos6502_create(bench->rm, workload->variant);
+  bench->mem = memory_generic_create(bench->rm, MEM_SIZE);
+  bench->mmio = rc_alloc(sizeof(*bench->mmio), NULL);
+  bench->mmio->read = mmio_read;
+  bench->mmio->write = mmio_write;
+
+  Mos6502* cpu = bench->cpu;
+  uint8_t* bytes = bench->mem->bytes;
+  map_handler(cpu->bus, bench->mem, 0, 0xFFFF);
+  map_handler(cpu->bus, bench->mmio, MMIO_START, MMIO_END);
+
+  // The synthetic loops would otherwise be fast-forwarded instead of run.
+  set_idle_skip(cpu, false);
+  if (!workload->size) {
+    if (read_rom(options->klaus, bytes, sizeof(*bytes), MEM_SIZE) == -1) {
+      return false;
+    }
+    cpu->pc = KLAUS_ENTRY;
+    set_breakpoint(cpu, KLAUS_SUCCESS);
+    return true;
+  }
+
+  for (size_t i = 0; i < 0x100; i++) {
+    bytes[DATA_START + i] = (uint8_t)(i * 7);
+  }
+  for (size_t ptr = 0x20; ptr < 0x28; ptr += 2) {
+    bytes[ptr] = (uint8_t)(ptr * 4);
+    bytes[ptr + 1] = DATA_START >> 8;
+  }
+
+  const uint16_t loop = (uint16_t)(PROGRAM_START + workload->loop);
+  memcpy(&bytes[PROGRAM_START], workload->program, workload->size);
+  bytes[PROGRAM_START + workload->size] = 0x4C;  // JMP loop
+  bytes[PROGRAM_START + workload->size + 1] = (uint8_t)loop;
+  bytes[PROGRAM_START + workload->size + 2] = (uint8_t)(loop >> 8);
+  cpu->pc = PROGRAM_START;
+  return true;
+}
+
+static void bench_destroy(TestBench* bench) {
+  rc_strong_release((void*)&bench->cpu);
+  rc_strong_release((void*)&bench->mmio);
+  rc_strong_release((void*)&bench->mem);
+  rc_strong_release((void*)&bench->rm);
+}
+
+// Run a workload until it ends, returning how many instructions it took, or 0 if it failed.
+static uint64_t run_workload(TestBench* bench, const Workload* workload, const Engine* engine,
+                             const Options* options) {
+  Mos6502* cpu = bench->cpu;
+  const bool klaus = !workload->size;
+  const uint64_t end = cpu->cycles + (klaus ? KLAUS_MAX_CYCLES : options->cycles);
+  uint64_t instructions = 0;
+
+  if (engine->stepped) {
+    while (cpu->cycles < end && !(klaus && cpu->pc == KLAUS_SUCCESS)) {
+      step(cpu);
+      instructions++;
+    }
+  } else {
+    while (cpu->cycles < end) {
+      instructions += mos6502_execute(cpu, CHUNK);
+      if (cpu->stop_reason == kStopBreakpoint || cpu->stop_reason == kStopJammed) {
+        break;
+      }
+    }
+  }
+
+  if (klaus && cpu->pc != KLAUS_SUCCESS) {
+    LOG_ERROR("%s failed at PC: 0x%04X\n", workload->name, cpu->pc);
+    return 0;
+  }
+  return instructions;
+}
+
+/////////////////////////////////////////////////
+///     Measurements
+/////////////////////////////////////////////////
+
+static int compare_doubles(const void* a, const void* b) {
+  const double x = *(const double*)a;
+  const double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// The nearest-rank percentile of sorted samples.
+static double percentile(const double* sorted, size_t n, size_t pct) {
+  size_t rank = (pct * n + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+static bool measure(const Workload* workload, const Engine* engine, const Options* options,
+                    Result* result, bool* skipped) {
+  static double seconds[MAX_REPETITIONS];
+  *skipped = false;
+
+  for (size_t i = 0; i < options->warmup + options->repetitions; i++) {
+    TestBench bench;
+    if (!bench_create(&bench, workload, options)) {
+      bench_destroy(&bench);
+      return false;
+    } else if (!engine->enable(bench.cpu)) {
+      // The JIT is not built on every host.
+      bench_destroy(&bench);
+      *skipped = true;
+      return true;
+    }
+
+    const uint64_t start = bench.cpu->cycles;
+    const double t0 = now();
+    const uint64_t instructions = run_workload(&bench, workload, engine, options);
+    const double elapsed = now() - t0;
+    const uint64_t cycles = bench.cpu->cycles - start;
+    bench_destroy(&bench);
+
+    if (!instructions) {
+      return false;
+    } else if (i >= options->warmup) {
+      seconds[i - options->warmup] = elapsed;
+      result->instructions = instructions;
+      result->cycles = cycles;
+    }
+  }
+
+  const size_t n = options->repetitions;
+  qsort(seconds, n, sizeof(*seconds), compare_doubles);
+  const double median = n % 2 ? seconds[n / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+  const double per_instruction = 1e9 / (double)result->instructions;
+
+  result->workload = workload;
+  result->engine = engine;
+  result->repetitions = n;
+  result->median_ns = median * per_instruction;
+  result->p90_ns = percentile(seconds, n, 90) * per_instruction;
+  result->min_ns = seconds[0] * per_instruction;
+  result->mhz = (double)result->cycles / median / 1e6;
+  result->mips = (double)result->instructions / median / 1e6;
+  return true;
+}
+
+/////////////////////////////////////////////////
+///     Reports
+/////////////////////////////////////////////////
+
+static void print_text(FILE* out, const Result* results, size_t n) {
+  fprintf(out, "%-18s %-7s %12s %12s %10s %10s %10s %9s %9s\n", "workload", "engine",
+          "instructions", "cycles", "median ns", "p90 ns", "min ns", "MHz", "MIPS");
+  for (size_t i = 0; i < n; i++) {
+    const Result* r = &results[i];
+    fprintf(out, "%-18s %-7s %12llu %12llu %10.3f %10.3f %10.3f %9.2f %9.2f\n", r->workload->name,
+            r->engine->name, (unsigned long long)r->instructions, (unsigned long long)r->cycles,
+            r->median_ns, r->p90_ns, r->min_ns, r->mhz, r->mips);
+  }
+}
+
+static void print_csv(FILE* out, const Result* results, size_t n) {
+  fprintf(out,
+          "workload,engine,instructions,cycles,repetitions,median_ns_per_instruction,"
+          "p90_ns_per_instruction,min_ns_per_instruction,median_mhz,median_mips\n");
+  for (size_t i = 0; i < n; i++) {
+    const Result* r = &results[i];
+    fprintf(out, "%s,%s,%llu,%llu,%zu,%.4f,%.4f,%.4f,%.3f,%.3f\n", r->workload->name,
+            r->engine->name, (unsigned long long)r->instructions, (unsigned long long)r->cycles,
+            r->repetitions, r->median_ns, r->p90_ns, r->min_ns, r->mhz, r->mips);
+  }
+}
+
+static void print_json(FILE* out, const Result* results, size_t n) {
+  fprintf(out, "{\n  \"results\": [");
+  for (size_t i = 0; i < n; i++) {
+    const Result* r = &results[i];
+    fprintf(out,
+            "%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, "
+            "\"cycles\": %llu, \"repetitions\": %zu, \"median_ns_per_instruction\": %.4f, "
+            "\"p90_ns_per_instruction\": %.4f, \"min_ns_per_instruction\": %.4f, "
+            "\"median_mhz\": %.3f, \"median_mips\": %.3f}",
+            i ? "," : "", r->workload->name, r->engine->name, (unsigned long long)r->instructions,
+            (unsigned long long)r->cycles, r->repetitions, r->median_ns, r->p90_ns, r->min_ns,
+            r->mhz, r->mips);
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+// Read the workload, engine and median of every row of a CSV report.
+static size_t load_baseline(const char* path, BaselineEntry* entries) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    LOG_ERROR("Error opening file: %s\n", strerror(errno));
+    return 0;
+  }
+
+  char line[512];
+  size_t n = 0;
+  int median_column = -1;
+  while (n < MAX_BASELINE && fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    BaselineEntry* entry = &entries[n];
+    char* saveptr = NULL;
+    int column = 0;
+    bool has_median = false;
+    for (char* field = strtok_r(line, ",", &saveptr); field;
+         field = strtok_r(NULL, ",", &saveptr), column++) {
+      if (median_column < 0 && !strcmp(field, "median_ns_per_instruction")) {
+        median_column = column;
+      } else if (column == 0) {
+        snprintf(entry->workload, NAME_SIZE, "%s", field);
+      } else if (column == 1) {
+        snprintf(entry->engine, NAME_SIZE, "%s", field);
+      } else if (column == median_column) {
+        char* end = NULL;
+        entry->median_ns = strtod(field, &end);
+        has_median = !*end && entry->median_ns > 0;
+      }
+    }
+    n += has_median;
+  }
+
+  fclose(f);
+  if (!n) {
+    LOG_ERROR("No results in %s\n", path);
+  }
+  return n;
+}
+
+// Print how every result compares to the baseline, returning whether any regressed.
+static bool compare_baseline(const Result* results, size_t n, const BaselineEntry* baseline,
+                             size_t baseline_size, double threshold) {
+  bool regressed = false;
+  fprintf(stderr, "%-18s %-7s %12s %12s %9s\n", "workload", "engine", "baseline ns", "median ns",
+          "change");
+  for (size_t i = 0; i < n; i++) {
+    const Result* r = &results[i];
+    const BaselineEntry* base = NULL;
+    for (size_t j = 0; j < baseline_size && !base; j++) {
+      if (!strcmp(baseline[j].workload, r->workload->name)
+          && !strcmp(baseline[j].engine, r->engine->name)) {
+        base = &baseline[j];
+      }
+    }
+
+    if (!base) {
+      fprintf(stderr, "%-18s %-7s %12s %12.3f %9s\n", r->workload->name, r->engine->name, "-",
+              r->median_ns, "new");
+      continue;
+    }
+
+    const double change = (r->median_ns - base->median_ns) / base->median_ns * 100;
+    const bool slower = change > threshold;
+    regressed |= slower;
+    fprintf(stderr, "%-18s %-7s %12.3f %12.3f %+8.1f%%%s\n", r->workload->name, r->engine->name,
+            base->median_ns, r->median_ns, change, slower ? "  REGRESSION" : "");
+  }
+  return regressed;
+}
+
+int main(int argc, char** argv) {
+  static Result results[MAX_SELECTED * MAX_SELECTED];
+  static BaselineEntry baseline[MAX_BASELINE];
+  const Workload* selected_workloads[MAX_SELECTED];
+  const Engine* selected_engines[MAX_SELECTED];
+  size_t num_workloads = 0;
+  size_t num_engines = 0;
+  Options options = {KLAUS_ROM, 20000000, 5, 1};
+  const char* format = "text";
+  const char* output = NULL;
+  const char* baseline_path = NULL;
+  uint64_t threshold = 5;
+  uint64_t count = 0;
+
+  int c = 0;
+  while ((c = getopt_long(argc, argv, "w:e:r:u:c:k:f:o:b:t:lh", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'w':
+        if (num_workloads == MAX_SELECTED
+            || !(selected_workloads[num_workloads++] = find_workload(optarg))) {
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'e':
+        if (num_engines == MAX_SELECTED
+            || !(selected_engines[num_engines++] = find_engine(optarg))) {
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'r':
+        if (!parse_count(optarg, 1, MAX_REPETITIONS, &count)) {
+          return EXIT_FAILURE;
+        }
+        options.repetitions = (size_t)count;
+        break;
+      case 'u':
+        if (!parse_count(optarg, 0, MAX_REPETITIONS, &count)) {
+          return EXIT_FAILURE;
+        }
+        options.warmup = (size_t)count;
+        break;
+      case 'c':
+        if (!parse_count(optarg, 1, UINT32_MAX, &options.cycles)) {
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'k':
+        options.klaus = optarg;
+        break;
+      case 'f':
+        if (strcmp(optarg, "text") && strcmp(optarg, "csv") && strcmp(optarg, "json")) {
+          LOG_ERROR("Unknown format: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        format = optarg;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'b':
+        baseline_path = optarg;
+        break;
+      case 't':
+        if (!parse_count(optarg, 0, 1000, &threshold)) {
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'l':
+        for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+          printf("%-18s %s\n", workloads[i].name, workloads[i].description);
+        }
+        return EXIT_SUCCESS;
+      case 'h':
+        print_help();
+        return EXIT_SUCCESS;
+      case '?':
+        return EXIT_FAILURE;
+      default:
+        abort();
+    }
+  }
+
+  if (!num_workloads) {
+    for (; num_workloads < NUM_WORKLOADS; num_workloads++) {
+      selected_workloads[num_workloads] = &workloads[num_workloads];
+    }
+  }
+  if (!num_engines) {
+    for (; num_engines < NUM_ENGINES; num_engines++) {
+      selected_engines[num_engines] = &engines[num_engines];
+    }
+  }
+
+  size_t baseline_size = 0;
+  if (baseline_path && !(baseline_size = load_baseline(baseline_path, baseline))) {
+    return EXIT_FAILURE;
+  }
+
+  size_t num_results = 0;
+  for (size_t i = 0; i < num_workloads; i++) {
+    for (size_t j = 0; j < num_engines; j++) {
+      bool skipped = false;
+      if (!measure(selected_workloads[i], selected_engines[j], &options, &results[num_results],
+                   &skipped)) {
+        LOG_ERROR("Could not run %s on %s\n", selected_workloads[i]->name,
+                  selected_engines[j]->name);
+        return EXIT_FAILURE;
+      }
+      num_results += !skipped;
+    }
+  }
+
+  FILE* out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    LOG_ERROR("Error opening file: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (!strcmp(format, "csv")) {
+    print_csv(out, results, num_results);
+  } else if (!strcmp(format, "json")) {
+    print_json(out, results, num_results);
+  } else {
+    print_text(out, results, num_results);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  if (baseline_size
+      && compare_baseline(results, num_results, baseline, baseline_size, (double)threshold)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
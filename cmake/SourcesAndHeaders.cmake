@@ -3,22 +3,38 @@ set(sources
     src/base.c
     src/bus.c
     src/display.c
+    src/machine.c
     src/memory.c
     src/mos6502.c
+    src/profiler.c
     src/rc.c
     src/reset_manager.c
+    src/scheduler.c
+    src/trace.c
     src/nes/ppu.c
 )
 
+set(jit_sources
+    src/jit.c
+)
+
 set(headers
+    include/b6502/aot.h
     include/b6502/base.h
+    include/b6502/block_cache.h
     include/b6502/bus.h
     include/b6502/component.h
     include/b6502/display.h
+    include/b6502/jit.h
+    include/b6502/machine.h
     include/b6502/memory.h
     include/b6502/mos6502.h
+    include/b6502/mos6502_variant.h
+    include/b6502/profiler.h
     include/b6502/rc.h
     include/b6502/reset_manager.h
+    include/b6502/scheduler.h
+    include/b6502/trace.h
     include/b6502/nes/ppu.h
 )
 
@@ -26,9 +42,27 @@ set(standalone
     src/main.c
 )
 
+set(recompiler
+    src/main.c
+)
+
+set(benchmark
+    src/main.c
+)
+
+set(tracedump
+    src/main.c
+)
+
 set(test_sources
     src/main.c
+    src/test_aot.c
+    src/test_machine.c
+    src/test_memory.c
     src/test_mos6502.c
+    src/test_profiler.c
     src/test_rc.c
+    src/test_scheduler.c
+    src/test_trace.c
 ) 
 # cmake-format: on
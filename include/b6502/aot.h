@@ -0,0 +1,168 @@
+#pragma once
+
+/**
+ * @file aot.h
+ * @brief Runtime support for ROMs recompiled ahead of time to C.
+ *
+ * The recompiler (see recompiler/) walks a ROM image from its vectors, recovers its basic blocks
+ * and emits C that runs them, one function per 256-byte page. Every instruction becomes a direct
+ * call to the executor of its variant, <variant>_aot_op_<opcode> (nmos6502_aot_op_0xA9 for LDA
+ * #imm on an NMOS 6502), which does exactly what the interpreter does, cycles included. Control
+ * flow to a known block on the same page is a goto. Everything else, like RTS and JMP (ind), goes
+ * back to a switch on the PC, and PCs that aren't the start of a recovered block are interpreted.
+ *
+ * A block is only entered when the batch can't stop inside it, and the generated code leaves a
+ * block early when a bus access raises an interrupt or writes to cached code, so a batch stops
+ * on the same instruction as it would in the interpreter. The bytes every block was recompiled
+ * from are checked whenever the bus reports a write to a page holding code, and blocks that no
+ * longer match are interpreted. A page whose code keeps changing is left to the interpreter.
+ *
+ * @see set_aot_program
+ */
+
+#include "b6502/base.h"
+#include "b6502/bus.h"
+#include "b6502/mos6502.h"
+
+/**
+ * @brief A basic block recovered by the recompiler.
+ */
+typedef struct AotBlock {
+  uint16_t start;
+  uint16_t size;
+  uint16_t length;
+  uint16_t max_cycles;
+  const uint8_t* bytes;
+} AotBlock;
+
+/**
+ * @brief The state of a batch that recompiled code runs in.
+ *
+ * opc is the PC of the last instruction executed, and stale has one entry per block.
+ */
+typedef struct AotBatch {
+  size_t count;
+  size_t executed;
+  uint64_t end;
+  uint64_t invalidations;
+  uint32_t breakpoint;
+  uint16_t opc;
+  const AotBlock* blocks;
+  const bool* stale;
+} AotBatch;
+
+/**
+ * @brief A ROM recompiled ahead of time.
+ *
+ * run() executes recovered blocks for as long as the batch allows, starting at cpu->pc, and
+ * returns when the CPU reaches code it has no block for or the batch has to stop.
+ */
+typedef struct AotProgram {
+  const char* name;
+  CpuVariant variant;
+  const AotBlock* blocks;
+  size_t num_blocks;
+  void (*run)(Mos6502* cpu, AotBatch* batch);
+} AotProgram;
+
+/**
+ * @brief Run a recompiled program instead of the interpreter for batch execution.
+ *
+ * mos6502_run(), mos6502_execute() and mos6502_run_until() use the program while it is set, and
+ * the block cache and the JIT are bypassed. The program must outlive its use, and must have been
+ * recompiled for the variant the CPU emulates.
+ *
+ * @param cpu The MOS6502 object.
+ * @param program The program, or NULL to go back to the interpreter.
+ * @return Whether the program is now in use.
+ */
+bool set_aot_program(Mos6502* cpu, const AotProgram* program);
+
+/**
+ * @brief Get how many times the bytes of a recompiled block were found changed.
+ * @param cpu The MOS6502 object.
+ * @return The number of blocks that were found stale, summed over every check.
+ */
+uint64_t aot_stale_blocks(const Mos6502* cpu);
+
+/**
+ * @brief Whether an interrupt would be taken before the next instruction.
+ * @param cpu The MOS6502 object.
+ */
+static inline bool aot_interrupt_pending(const Mos6502* cpu) {
+  return cpu->intr_status == kNMI || (cpu->intr_status == kIRQ && !(cpu->sr & I));
+}
+
+/**
+ * @brief Whether recompiled code can run a whole block without the batch stopping inside it.
+ * @param cpu The MOS6502 object.
+ * @param batch The batch.
+ * @param block The index of the block.
+ */
+static inline bool aot_enter_block(const Mos6502* cpu, const AotBatch* batch, size_t block) {
+  const AotBlock* b = &batch->blocks[block];
+  const uint32_t offset = (uint16_t)(batch->breakpoint - b->start);
+  return !batch->stale[block] && batch->count - batch->executed >= b->length
+         && cpu->cycles + b->max_cycles < batch->end
+         && (cpu->pc != batch->opc || !batch->executed)
+         && (offset >= b->size || batch->breakpoint == NO_BREAKPOINT)
+         && !aot_interrupt_pending(cpu) && cpu->bus->code_invalidations == batch->invalidations;
+}
+
+/**
+ * @brief Whether the last instruction made an interrupt pending or wrote to cached code.
+ * @param cpu The MOS6502 object.
+ * @param batch The batch.
+ */
+static inline bool aot_interrupted(const Mos6502* cpu, const AotBatch* batch) {
+  return aot_interrupt_pending(cpu) || cpu->bus->code_invalidations != batch->invalidations;
+}
+
+/**
+ * @brief Account for instructions that recompiled code has executed.
+ * @param batch The batch.
+ * @param count The number of instructions.
+ * @param last_pc The PC of the last of them.
+ */
+static inline void aot_retire(AotBatch* batch, size_t count, uint16_t last_pc) {
+  batch->executed += count;
+  batch->opc = last_pc;
+}
+
+// clang-format off
+#define AOT_OPCODES(X)                                                                             \
+  X(0x00) X(0x01) X(0x02) X(0x03) X(0x04) X(0x05) X(0x06) X(0x07) X(0x08) X(0x09) X(0x0A) X(0x0B) \
+  X(0x0C) X(0x0D) X(0x0E) X(0x0F) X(0x10) X(0x11) X(0x12) X(0x13) X(0x14) X(0x15) X(0x16) X(0x17) \
+  X(0x18) X(0x19) X(0x1A) X(0x1B) X(0x1C) X(0x1D) X(0x1E) X(0x1F) X(0x20) X(0x21) X(0x22) X(0x23) \
+  X(0x24) X(0x25) X(0x26) X(0x27) X(0x28) X(0x29) X(0x2A) X(0x2B) X(0x2C) X(0x2D) X(0x2E) X(0x2F) \
+  X(0x30) X(0x31) X(0x32) X(0x33) X(0x34) X(0x35) X(0x36) X(0x37) X(0x38) X(0x39) X(0x3A) X(0x3B) \
+  X(0x3C) X(0x3D) X(0x3E) X(0x3F) X(0x40) X(0x41) X(0x42) X(0x43) X(0x44) X(0x45) X(0x46) X(0x47) \
+  X(0x48) X(0x49) X(0x4A) X(0x4B) X(0x4C) X(0x4D) X(0x4E) X(0x4F) X(0x50) X(0x51) X(0x52) X(0x53) \
+  X(0x54) X(0x55) X(0x56) X(0x57) X(0x58) X(0x59) X(0x5A) X(0x5B) X(0x5C) X(0x5D) X(0x5E) X(0x5F) \
+  X(0x60) X(0x61) X(0x62) X(0x63) X(0x64) X(0x65) X(0x66) X(0x67) X(0x68) X(0x69) X(0x6A) X(0x6B) \
+  X(0x6C) X(0x6D) X(0x6E) X(0x6F) X(0x70) X(0x71) X(0x72) X(0x73) X(0x74) X(0x75) X(0x76) X(0x77) \
+  X(0x78) X(0x79) X(0x7A) X(0x7B) X(0x7C) X(0x7D) X(0x7E) X(0x7F) X(0x80) X(0x81) X(0x82) X(0x83) \
+  X(0x84) X(0x85) X(0x86) X(0x87) X(0x88) X(0x89) X(0x8A) X(0x8B) X(0x8C) X(0x8D) X(0x8E) X(0x8F) \
+  X(0x90) X(0x91) X(0x92) X(0x93) X(0x94) X(0x95) X(0x96) X(0x97) X(0x98) X(0x99) X(0x9A) X(0x9B) \
+  X(0x9C) X(0x9D) X(0x9E) X(0x9F) X(0xA0) X(0xA1) X(0xA2) X(0xA3) X(0xA4) X(0xA5) X(0xA6) X(0xA7) \
+  X(0xA8) X(0xA9) X(0xAA) X(0xAB) X(0xAC) X(0xAD) X(0xAE) X(0xAF) X(0xB0) X(0xB1) X(0xB2) X(0xB3) \
+  X(0xB4) X(0xB5) X(0xB6) X(0xB7) X(0xB8) X(0xB9) X(0xBA) X(0xBB) X(0xBC) X(0xBD) X(0xBE) X(0xBF) \
+  X(0xC0) X(0xC1) X(0xC2) X(0xC3) X(0xC4) X(0xC5) X(0xC6) X(0xC7) X(0xC8) X(0xC9) X(0xCA) X(0xCB) \
+  X(0xCC) X(0xCD) X(0xCE) X(0xCF) X(0xD0) X(0xD1) X(0xD2) X(0xD3) X(0xD4) X(0xD5) X(0xD6) X(0xD7) \
+  X(0xD8) X(0xD9) X(0xDA) X(0xDB) X(0xDC) X(0xDD) X(0xDE) X(0xDF) X(0xE0) X(0xE1) X(0xE2) X(0xE3) \
+  X(0xE4) X(0xE5) X(0xE6) X(0xE7) X(0xE8) X(0xE9) X(0xEA) X(0xEB) X(0xEC) X(0xED) X(0xEE) X(0xEF) \
+  X(0xF0) X(0xF1) X(0xF2) X(0xF3) X(0xF4) X(0xF5) X(0xF6) X(0xF7) X(0xF8) X(0xF9) X(0xFA) X(0xFB) \
+  X(0xFC) X(0xFD) X(0xFE) X(0xFF)
+// clang-format on
+
+#define AOT_DECLARE_HANDLERS(code)                               \
+  void nmos6502_aot_op_##code(Mos6502* cpu, uint16_t operand); \
+  void rp2a03_aot_op_##code(Mos6502* cpu, uint16_t operand);   \
+  void wdc65c02_aot_op_##code(Mos6502* cpu, uint16_t operand);
+
+/**
+ * @brief The executors of every opcode of every variant, which recompiled code calls directly.
+ */
+AOT_OPCODES(AOT_DECLARE_HANDLERS)
+
+#undef AOT_DECLARE_HANDLERS
@@ -133,6 +133,15 @@
 #  define INLINE inline
 #endif
 
+/**
+ * @brief Inline every call made inside a function, recursively where possible.
+ */
+#ifdef __GNUC__
+#  define FLATTEN __attribute__((flatten))
+#else
+#  define FLATTEN
+#endif
+
 /**
  * @brief A dummy function that can be used as a reset/write function for read-only devices.
  * @param obj A pointer to an object.
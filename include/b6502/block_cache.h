@@ -0,0 +1,105 @@
+#pragma once
+
+/**
+ * @file block_cache.h
+ * @brief Predecoded basic blocks.
+ *
+ * The block cache stores each basic block as a stream of decoded instructions: the fused handler
+ * for the opcode, its resolved operand, its base cycle cost and its length. The cache itself is
+ * driven by mos6502.c, and hot blocks can additionally be translated to native code by the JIT.
+ *
+ * @see set_block_cache
+ * @see set_jit
+ */
+
+#include "b6502/base.h"
+#include "b6502/mos6502.h"
+
+/**
+ * @brief The number of blocks in the cache, which is direct-mapped by start PC.
+ */
+#define BLOCK_CACHE_SIZE (size_t)(1024)
+
+/**
+ * @brief The maximum number of instructions in one block.
+ */
+#define MAX_BLOCK_LENGTH (size_t)(32)
+
+/**
+ * @brief A function variable that executes one predecoded instruction.
+ */
+typedef void (*decoded_handler)(Mos6502*, uint16_t operand);
+
+/**
+ * @brief A function variable that points to a block translated to native code.
+ *
+ * The native code returns the number of instructions it executed, which is less than the length
+ * of the block only when a write invalidated cached code along the way.
+ */
+typedef uint32_t (*native_block)(Mos6502*);
+
+struct DecodedInstruction;
+
+/**
+ * @brief A function variable that executes a predecoded instruction and the one after it.
+ *
+ * It returns false when it stopped after the first instruction because that raised an interrupt.
+ */
+typedef bool (*pair_handler)(Mos6502*, const struct DecodedInstruction* pair);
+
+/**
+ * @brief One predecoded instruction.
+ *
+ * pair is set when this instruction and the next form a superinstruction.
+ */
+typedef struct DecodedInstruction {
+  decoded_handler handler;
+  pair_handler pair;
+  uint16_t pc;
+  uint16_t operand;
+  uint8_t opcode;
+  uint8_t cycles;
+  uint8_t length;
+} DecodedInstruction;
+
+/**
+ * @brief The longest loop body that is considered for idle-loop skipping.
+ */
+#define MAX_IDLE_LOOP_LENGTH 8
+
+/**
+ * @brief A basic block.
+ *
+ * A block never covers more than two pages, so it only has to remember two page generations.
+ * idle is set when the block is a loop back to its own start that neither writes nor touches the
+ * stack, which makes it a candidate for idle-loop skipping. transfer is set when the block is an
+ * indexed copy or fill loop (LDA src / STA dst / INX / BNE and its variants) that block_run can
+ * run natively.
+ */
+typedef struct Block {
+  uint16_t start;
+  uint16_t size;
+  uint8_t length;
+  bool idle;
+  bool transfer;
+  uint8_t pages[2];
+  uint32_t generations[2];
+  uint32_t cycles;
+  uint32_t executions;
+  uint32_t native_generation;
+  native_block native;
+  DecodedInstruction instructions[MAX_BLOCK_LENGTH];
+} Block;
+
+/**
+ * @brief The block cache.
+ */
+struct BlockCache {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t transfers;
+  uint64_t superinstructions;
+  uint64_t* pairs;
+  struct Jit* jit;
+  Block blocks[BLOCK_CACHE_SIZE];
+};
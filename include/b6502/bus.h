@@ -2,19 +2,104 @@
 
 /// @file bus.h
 
+#include <stdbool.h>
+
 #include "b6502/base.h"
+#include "b6502/component.h"
 
 #define NUMBER_OF_PAGES (size_t)256
 
+/**
+ * @brief The number of register handlers a bus can hold, including the unused slot 0.
+ */
+#define MAX_BUS_REGISTERS (size_t)256
+
+/**
+ * @brief A handler for a byte-sized region of the bus.
+ * @see map_register
+ */
+typedef struct BusRegister {
+  void* obj;
+  read_handler read;
+  write_handler write;
+} BusRegister;
+
+/**
+ * @brief The number of bank windows a bus can hold.
+ */
+#define MAX_BANK_WINDOWS (size_t)16
+
+/**
+ * @brief A range of pages that shows one bank of a memory component at a time.
+ *
+ * obj is weakly retained. shown counts the window's pages that have not been remapped since, and
+ * the window lets go of obj when none are left.
+ *
+ * @see map_bank_window
+ */
+typedef struct BankWindow {
+  void* obj;
+  size_t first_page;
+  size_t pages;
+  size_t banks;
+  size_t bank;
+  size_t shown;
+} BankWindow;
+
 /**
  *  @brief A struct for the communication bus.
+ *
+ *  Besides the handlers, the bus tracks which pages hold code cached by the CPU. Writing to such
+ *  a page (or remapping it) bumps the page's generation, which invalidates every cached block
+ *  decoded from it.
+ *
+ *  Pages mapped to plain memory also get direct pointers to their backing bytes, so that read()
+ *  and write() are a single load or store there. The handlers are only called for other pages.
+ *
+ *  The map has two levels. Every page has a handler and a mirror mask that is applied to the
+ *  address before anything else sees it. A page can also have a table of registers, indexed by
+ *  the low byte of the masked address, whose handlers take precedence over the page's handler.
+ *
+ *  Pages in a bank window point into the selected bank through bank_pages, which switch_bank()
+ *  updates along with the direct pointers. page_windows holds the index plus one of the window a
+ *  page belongs to, or 0. Mapping anything else over a page takes it out of its window, so that
+ *  switching banks never overrides a newer mapping.
+ *
+ *  clock points to the cycle counter of the CPU driving the bus. Accesses that go through a
+ *  handler first catch the page's component up to it (registers count as part of the page's
+ *  component). Pages with direct pointers are plain memory and never need catching up.
  */
 typedef struct {
   void* handlers[NUMBER_OF_PAGES];
+  uint16_t page_masks[NUMBER_OF_PAGES];
+  uint8_t* register_pages[NUMBER_OF_PAGES];
+  BusRegister registers[MAX_BUS_REGISTERS];
+  size_t register_count;
+  uint8_t* read_pages[NUMBER_OF_PAGES];
+  uint8_t* write_pages[NUMBER_OF_PAGES];
+  uint8_t* bank_pages[NUMBER_OF_PAGES];
+  uint8_t page_windows[NUMBER_OF_PAGES];
+  BankWindow windows[MAX_BANK_WINDOWS];
+  size_t window_count;
+  uint32_t frame_switches;
+  uint64_t bank_switches;
+  bool code_pages[NUMBER_OF_PAGES];
+  uint32_t page_generation[NUMBER_OF_PAGES];
+  uint64_t code_invalidations;
+  uint64_t* clock;
 } Bus;
 
+/**
+ * @brief Constructor for an empty communication bus.
+ */
+Bus* bus_create(void);
+
 /**
  * @brief Add a component to the communication bus.
+ *
+ * Memory components that use generic_read() or generic_write() are accessed through the page's
+ * direct pointers instead of their handlers.
+ *
  * @param bus A pointer to the communication bus.
  * @param obj A pointer to the component.
  * @param start The start address of where to begin mapping the component.
@@ -22,13 +107,132 @@ typedef struct {
  */
 void map_handler(Bus* bus, void* obj, uint16_t start, uint16_t end);
 
+/**
+ * @brief Add a component to the communication bus, mirrored through an address mask.
+ *
+ * The component sees (addr & mask) instead of addr, e.g. mapping 2KB of RAM over $0000-$1FFF
+ * with the mask $07FF. Mirrors of plain memory get direct pointers like any other page. A
+ * Memory component is not mapped if a masked address could fall outside of it, which is what
+ * lets generic_read() and generic_write() skip the bounds check.
+ *
+ * @param bus A pointer to the communication bus.
+ * @param obj A pointer to the component.
+ * @param start The start address of where to begin mapping the component.
+ * @param end The end address of where to stop mapping the component.
+ * @param mask The mask applied to every address in the mapped pages.
+ */
+void map_mirrored(Bus* bus, void* obj, uint16_t start, uint16_t end, uint16_t mask);
+
+/**
+ * @brief Map handlers for a range of bytes, overriding the page's component there.
+ *
+ * The range is given in masked addresses, so a register mapped at $2002 also answers on every
+ * page that mirrors onto $2002. Either handler may be NULL: reads then return 0 and writes are
+ * ignored.
+ *
+ * @param bus A pointer to the communication bus.
+ * @param obj The object passed to the handlers.
+ * @param start The first masked address of the register.
+ * @param end The last masked address of the register.
+ * @param read_fn The read handler.
+ * @param write_fn The write handler.
+ */
+void map_register(Bus* bus, void* obj, uint16_t start, uint16_t end, read_handler read_fn,
+                  write_handler write_fn);
+
+/**
+ * @brief Catch every component on the bus up to the clock, e.g. at the end of a frame.
+ * @param bus A pointer to the communication bus.
+ */
+void sync_devices(Bus* bus);
+
+/**
+ * @brief Map a memory component as a set of banks, shown one at a time in a window of pages.
+ *
+ * The memory is split into banks the size of the window, and bank 0 is selected. The component
+ * is mapped once here, so that switch_bank() only has to update the page table. The memory must
+ * use generic_read(). Writes go to the page table when it uses generic_write(), and otherwise to
+ * its write handler, e.g. for a mapper's bank registers. Pages of the window that are mapped over
+ * later are no longer switched.
+ *
+ * @param bus A pointer to the communication bus.
+ * @param obj A pointer to the memory component holding every bank (weakly retained).
+ * @param start The start address of the window.
+ * @param end The end address of the window.
+ * @return The window's index, or -1 on error.
+ */
+int map_bank_window(Bus* bus, void* obj, uint16_t start, uint16_t end);
+
+/**
+ * @brief Select the bank shown in a window. Bank numbers wrap around the number of banks.
+ * @param bus A pointer to the communication bus.
+ * @param window The window's index.
+ * @param bank The bank to show.
+ */
+void switch_bank(Bus* bus, size_t window, size_t bank);
+
+/**
+ * @brief Get the number of bank switches since the last call, and start counting again.
+ *
+ * Calling this once per frame gives the bank switches per frame. bus->bank_switches keeps the
+ * total.
+ *
+ * @param bus A pointer to the communication bus.
+ * @return The number of bank switches.
+ */
+uint32_t frame_bank_switches(Bus* bus);
+
+/**
+ * @brief Invalidate any code cached from a page.
+ * @param bus A pointer to the communication bus.
+ * @param page The page number.
+ */
+void invalidate_page(Bus* bus, size_t page);
+
+/**
+ * @brief The page that code and write invalidation are tracked on for an address.
+ *
+ * This is the page of the masked address, so that writing through one mirror invalidates code
+ * that was cached from another.
+ *
+ * @param bus A pointer to the communication bus.
+ * @param addr The address.
+ * @return The page number.
+ */
+static inline size_t code_page(const Bus* bus, uint16_t addr) {
+  return (size_t)(addr & bus->page_masks[addr / NUMBER_OF_PAGES]) / NUMBER_OF_PAGES;
+}
+
+/**
+ * @brief Read a byte through the handler of the page, ignoring its direct pointer.
+ * @param bus A pointer to the communication bus.
+ * @param addr The address to read one byte from.
+ * @return The byte that was read, or 0 if nothing is mapped there.
+ */
+uint8_t handler_read(Bus* bus, uint16_t addr);
+
+/**
+ * @brief Write a byte through the handler of the page, ignoring its direct pointer.
+ * @param bus A pointer to the communication bus.
+ * @param addr The address to write the byte.
+ * @param val The byte to write.
+ */
+void handler_write(Bus* bus, uint16_t addr, uint8_t val);
+
 /**
  * @brief Request a read from the communication bus.
  * @param bus A pointer to the communication bus.
  * @param addr The address to read one byte from.
  * @return The byte that was read.
  */
-uint8_t read(Bus* bus, uint16_t addr);
+static inline uint8_t read(Bus* bus, uint16_t addr) {
+  const uint8_t* page = bus->read_pages[addr / NUMBER_OF_PAGES];
+  if (LIKELY(page)) {
+    return page[addr % NUMBER_OF_PAGES];
+  }
+
+  return handler_read(bus, addr);
+}
 
 /**
  * @brief Request a write to the communication bus.
@@ -36,4 +240,61 @@ uint8_t read(Bus* bus, uint16_t addr);
  * @param addr The address to write the byte.
  * @param val The byte to write.
  */
-void write(Bus* bus, uint16_t addr, uint8_t val);
+static inline void write(Bus* bus, uint16_t addr, uint8_t val) {
+  const size_t page = addr / NUMBER_OF_PAGES;
+  if (LIKELY(bus->write_pages[page])) {
+    bus->write_pages[page][addr % NUMBER_OF_PAGES] = val;
+  } else {
+    handler_write(bus, addr, val);
+  }
+
+  const size_t code = code_page(bus, addr);
+  if (UNLIKELY(bus->code_pages[code])) {
+    invalidate_page(bus, code);
+  }
+}
+
+/**
+ * @brief Read consecutive bytes from the communication bus.
+ *
+ * Pages with direct pointers are copied with memcpy(), and the handlers are only called for the
+ * rest. Addresses wrap around at 0xFFFF.
+ *
+ * @param bus A pointer to the communication bus.
+ * @param addr The address of the first byte.
+ * @param dst Where to store the bytes.
+ * @param len The number of bytes.
+ * @return The number of cycles the transfer takes (one per byte).
+ */
+uint32_t bus_read_block(Bus* bus, uint16_t addr, uint8_t* dst, size_t len);
+
+/**
+ * @brief Write consecutive bytes to the communication bus.
+ *
+ * Pages with direct pointers are copied with memcpy(), and the handlers are only called for the
+ * rest. Cached code is invalidated as if the bytes were written one at a time.
+ *
+ * @param bus A pointer to the communication bus.
+ * @param addr The address of the first byte.
+ * @param src The bytes to write.
+ * @param len The number of bytes.
+ * @return The number of cycles the transfer takes (one per byte).
+ */
+uint32_t bus_write_block(Bus* bus, uint16_t addr, const uint8_t* src, size_t len);
+
+/**
+ * @brief Copy a block of bytes from one range of addresses to another, like a DMA controller.
+ *
+ * Both the source and the destination addresses go up by one for every byte, and the bytes are
+ * copied in ascending order, so an overlapping copy behaves like the byte-by-byte hardware
+ * transfer. The CPU is expected to stall for the returned number of cycles, e.g. with
+ * mos6502_stall(). A transfer into a single port, such as NES OAM DMA writing every byte to $2004,
+ * is not a block copy: read the bytes with bus_read_block() and hand them to the port's device.
+ *
+ * @param bus A pointer to the communication bus.
+ * @param src The address of the first byte to read.
+ * @param dst The address of the first byte to write.
+ * @param len The number of bytes.
+ * @return The number of cycles the transfer takes (a read and a write per byte).
+ */
+uint32_t bus_dma(Bus* bus, uint16_t src, uint16_t dst, size_t len);
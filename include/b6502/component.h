@@ -16,10 +16,36 @@ typedef uint8_t (*read_handler)(void *, uint16_t addr);
  */
 typedef void (*write_handler)(void *, uint16_t addr, uint8_t val);
 
+/**
+ *  @brief A function variable that points to the catch-up function of a bus component
+ *
+ *  The component runs from the cycle it was last synchronized to until the given cycle.
+ */
+typedef void (*catch_up_handler)(void *, uint64_t cycle);
+
 /**
  *  @brief A generic struct for devices on the communication bus.
+ *
+ *  Devices with a catch_up handler are synchronized lazily: the bus catches them up to the CPU's
+ *  cycle right before any access to them, and they run in large batches instead of alongside
+ *  every instruction. synced is the cycle a device has been caught up to.
  */
 typedef struct Component {
   read_handler read;
   write_handler write;
+  catch_up_handler catch_up;
+  uint64_t synced;
 } Component;
+
+/**
+ * @brief Run a component until a cycle, if it is behind and has a catch_up handler.
+ * @param obj A pointer to the component.
+ * @param cycle The cycle to catch up to.
+ */
+static inline void sync_component(void *obj, uint64_t cycle) {
+  Component *c = obj;
+  if (c->catch_up && c->synced < cycle) {
+    c->catch_up(obj, cycle);
+    c->synced = cycle;
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+/**
+ * @file jit.h
+ * @brief Dynamic recompiler from 6502 basic blocks to x86-64.
+ *
+ * Blocks from the block cache that have run JIT_THRESHOLD times are translated into native code
+ * in an mmap'd code cache. Common loads, stores, transfers, increments, flag operations,
+ * immediate logic and compares, and the branch or jump that ends a block are emitted natively.
+ * Every other instruction is a call to its interpreter handler. Memory accesses call back into
+ * read() and write(), and each instruction adds its cycles as it runs, so cpu->cycles stays exact.
+ *
+ * The JIT is only built for Linux x86-64, and only when the B6502_ENABLE_JIT CMake option is on
+ * (which defines B6502_JIT).
+ */
+
+#include "b6502/block_cache.h"
+
+/**
+ * @brief The number of times a block is interpreted before it is translated.
+ */
+#define JIT_THRESHOLD (uint32_t)(16)
+
+/**
+ * @brief The size in bytes of the executable code cache.
+ */
+#define JIT_CODE_SIZE (size_t)(4 * 1024 * 1024)
+
+/**
+ * @brief The JIT state: the code cache and its allocation cursor.
+ */
+typedef struct Jit Jit;
+
+/**
+ * @brief Constructor for the JIT.
+ * @return The JIT, or NULL if executable memory could not be mapped.
+ */
+Jit* jit_create(void);
+
+/**
+ * @brief Get the native code for a block, translating it if it has become hot.
+ * @param jit The JIT.
+ * @param block The block.
+ * @return The native code, or NULL if the block should be interpreted.
+ */
+native_block jit_lookup(Jit* jit, Block* block);
+
+/**
+ * @brief Get the number of blocks translated since the JIT was created.
+ * @param jit The JIT.
+ * @return The number of blocks.
+ */
+uint64_t jit_compiled(const Jit* jit);
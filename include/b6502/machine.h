@@ -0,0 +1,71 @@
+#pragma once
+
+/**
+ * @file machine.h
+ * @brief A whole emulated system allocated in one block.
+ *
+ * A machine is described up front by a MachineConfig, and its CPU, bus, scheduler, reset manager
+ * and memories are then all allocated in a single arena (see rc_arena_create()), in the order
+ * they are used most: the CPU's registers, the bus's page table, the scheduler, then RAM with its
+ * zero page and stack, then ROM. Each object starts on a cache line of its own.
+ *
+ * The components are ordinary reference-counted objects, so everything that takes a Mos6502 or a
+ * Memory takes them as usual, and other devices can still be mapped onto the bus. Releasing the
+ * machine frees the whole arena at once when nothing else holds on to its components.
+ */
+
+#include "b6502/memory.h"
+#include "b6502/mos6502.h"
+#include "b6502/rc.h"
+#include "b6502/reset_manager.h"
+
+/**
+ * @brief The layout of a machine.
+ */
+typedef struct MachineConfig {
+  CpuVariant variant;
+
+  // RAM mapped from $0000 up to ram_end, mirrored if ram_end is past ram_size (a power of two)
+  size_t ram_size;
+  uint16_t ram_end;
+
+  // ROM mapped from rom_start up to $FFFF, mirrored the same way, or no ROM if rom_size is 0
+  size_t rom_size;
+  uint16_t rom_start;
+
+  // Whether to ask for the arena to be backed by huge pages
+  bool huge_pages;
+} MachineConfig;
+
+/**
+ * @brief A system whose components all live in one arena.
+ *
+ * rom is NULL without ROM. Its bytes are filled in by the caller, e.g. with read_rom().
+ */
+typedef struct Machine {
+  RcArena* arena;
+  ResetManager* rm;
+  Mos6502* cpu;
+  Memory* ram;
+  Memory* rom;
+} Machine;
+
+/**
+ * @brief Constructor for a machine.
+ * @param config The layout of the machine.
+ * @return The machine, or NULL if its arena could not be allocated.
+ */
+Machine* machine_create(const MachineConfig* config);
+
+/**
+ * @brief Copy a machine with a single memcpy() of its arena.
+ *
+ * The copy has the same registers, cycle count, scheduled events and memory, and goes its own
+ * way from there. Devices that were mapped onto the bus from outside the arena are shared with
+ * the original, not copied. The block cache and the JIT start out empty, and the AOT program,
+ * profiler and tracer are not attached to the copy.
+ *
+ * @param machine The machine.
+ * @return The copy, or NULL if its arena could not be allocated.
+ */
+Machine* machine_clone(const Machine* machine);
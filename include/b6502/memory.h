@@ -8,11 +8,20 @@
 
 /**
  *  @brief A generic struct for memory devices (RAM, ROM, etc.)
+ *
+ *  bytes is normally its own reference-counted allocation. Memory that is backed by something
+ *  else, like a mapped ROM image, keeps a strong reference to that in owner instead.
+ *
+ *  Mirrored RAM repeats alias_size bytes of physical memory over all of size, every copy being a
+ *  view of the same pages, so that a write to one copy shows up in all of them. alias_size is 0
+ *  for any other memory.
  */
 typedef struct {
   struct Component;
   size_t size;
   uint8_t* bytes;
+  void* owner;
+  size_t alias_size;
 } Memory;
 
 /**
@@ -23,6 +32,21 @@ typedef struct {
  */
 Memory* rom_create(size_t size, read_handler read);
 
+/**
+ * @brief A constructor for read-only memory devices backed by a ROM image mapped from a file.
+ *
+ * The file is mapped read-only instead of being copied, so the ROM lives in the page cache. Every
+ * device created for the same file shares one mapping, which is unmapped along with the last of
+ * them, up to 16 mapped files at a time. The device's size is the size of the file, and writes to
+ * it are ignored. Devices can be created from any thread.
+ *
+ * @param path The filesystem path of the ROM.
+ * @param populate Whether to read the whole file in right away, for a warm start, instead of
+ * faulting its pages in as they are first accessed.
+ * @return The memory device that was created, or NULL if the file could not be mapped.
+ */
+Memory* rom_map(const char* path, bool populate);
+
 /**
  * @brief A constructor for volatile memory devices.
  * @param size The size of the memory device.
@@ -31,6 +55,25 @@ Memory* rom_create(size_t size, read_handler read);
 Memory* ram_create(ResetManager* rm, size_t size, read_handler read, write_handler write,
                    reset_handler reset);
 
+/**
+ * @brief A constructor for generic memory devices that repeat over a larger span of addresses.
+ *
+ * The size bytes of RAM are mapped span / size times back to back, so bytes is one flat pointer
+ * across every mirror and the MMU resolves them, e.g. 8KB for the 2KB of RAM that the NES mirrors
+ * over $0000-$1FFF. The device is then mapped with map_mirrored() as usual, and the bus points
+ * each mirrored page at its own copy.
+ *
+ * The mirrors can only be built out of whole host pages. If size is not a multiple of the host's
+ * page size, or the mappings fail, this returns plain memory of size bytes instead, which
+ * map_mirrored() mirrors through its mask.
+ *
+ * @param rm The reset manager.
+ * @param size The size of the RAM.
+ * @param span The number of bytes it repeats over, a multiple of size.
+ * @return The memory device that was created.
+ */
+Memory* ram_mirrored_create(ResetManager* rm, size_t size, size_t span);
+
 /**
  * @brief A constructor for generic memory devices.
  * @param size The size of the memory device.
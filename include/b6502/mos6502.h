@@ -2,10 +2,13 @@
 
 /// @file mos6502.h
 
+#include <stdbool.h>
+
 #include "b6502/base.h"
 #include "b6502/bus.h"
 #include "b6502/rc.h"
 #include "b6502/reset_manager.h"
+#include "b6502/scheduler.h"
 
 /**
  * @brief The location of the NMI vector.
@@ -44,8 +47,23 @@ typedef enum AddressingMode {
   kZeroP,
   kZeroPX,
   kZeroPY,
+  kZeroPInd,  // 65C02 (zp)
+  kAbsXInd,   // 65C02 JMP (abs,X)
+  kZeroPRel,  // 65C02 BBR and BBS: a zero page address, then a branch offset
 } AddressingMode;
 
+/**
+ * @brief The CPU variants the core is built for.
+ *
+ * Each variant has its own opcode table, and the handlers, engines and superinstructions generated
+ * from it, so instructions never check which variant they run on.
+ */
+typedef enum CpuVariant {
+  kNMOS6502,   // The original NMOS 6502, undocumented opcodes included
+  kRicoh2A03,  // The NES's 6502, which ignores the D flag
+  kWDC65C02,   // The CMOS 65C02, with its new opcodes and a JMP (ind) that crosses pages
+} CpuVariant;
+
 /**
  * @brief The interrupt status of a 6502.
  */
@@ -55,6 +73,26 @@ typedef enum Interrupt {
   kNMI,
 } Interrupt;
 
+/**
+ * @brief Why the last batch of instructions stopped.
+ *
+ * @see mos6502_run
+ * @see mos6502_execute
+ */
+typedef enum StopReason {
+  kStopBudget,
+  kStopCount,
+  kStopInterrupt,
+  kStopHalt,
+  kStopBreakpoint,
+  kStopJammed,  // A KIL (or STP on the 65C02) locked the CPU up until the next reset
+} StopReason;
+
+/**
+ * @brief A breakpoint value that never matches a PC.
+ */
+#define NO_BREAKPOINT (uint32_t)(0x10000)
+
 /**
  * @brief Representation of the status register bit flags.
  */
@@ -69,6 +107,57 @@ typedef enum Flags {
   N = 1 << 7,
 } Flags;
 
+/**
+ * @brief A cache of predecoded basic blocks, keyed by start PC.
+ * @see set_block_cache
+ */
+typedef struct BlockCache BlockCache;
+
+/**
+ * @brief The state of a program recompiled ahead of time.
+ * @see set_aot_program
+ */
+typedef struct AotState AotState;
+
+/**
+ * @brief Hot-spot counters for emulated code.
+ * @see set_profiler
+ */
+typedef struct Profiler Profiler;
+
+/**
+ * @brief A ring buffer of instruction trace records.
+ * @see set_tracer
+ */
+typedef struct Tracer Tracer;
+
+/**
+ * @brief The opcode table and engines of a CPU variant.
+ */
+typedef struct CpuCore CpuCore;
+
+/**
+ * @brief What the opcode table says about an opcode.
+ */
+typedef struct OpcodeInfo {
+  const char* name;
+  AddressingMode mode;
+  uint32_t cycles;
+  uint8_t length;
+} OpcodeInfo;
+
+/**
+ * @brief Counters for judging the block cache.
+ */
+typedef struct BlockCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t invalidations;
+  uint64_t compiled;
+  uint64_t transfers;
+  uint64_t superinstructions;
+} BlockCacheStats;
+
 /**
  * @brief The MOS6502 struct.
  */
@@ -84,8 +173,16 @@ typedef struct Mos6502 {
   uint8_t y;
   uint8_t sr;
 
+  // Lazily evaluated N, Z, C and V (only used when built with B6502_LAZY_FLAGS). N and V are bit 7
+  // of flag_n and flag_v, Z is set when flag_z is zero and C is flag_c. sr is only exact outside
+  // of step() and the batch engines, where these are folded back into it.
+  uint8_t flag_n;
+  uint8_t flag_z;
+  uint8_t flag_c;
+  uint8_t flag_v;
+
   // Helpers
-  uint32_t cycles;
+  uint64_t cycles;
   uint16_t addr;
   uint8_t data;
   AddressingMode current_mode;
@@ -93,12 +190,39 @@ typedef struct Mos6502 {
   // Interrupt status
   Interrupt intr_status;
 
+  // Batch execution
+  uint32_t breakpoint;
+  StopReason stop_reason;
+  BlockCache* blocks;
+  AotState* aot;
+
+  // Hooks in step(). The profiler is only used when built with B6502_PROFILER.
+  Profiler* profiler;
+  Tracer* tracer;
+
+  // Timed events, with cycles as the timebase
+  Scheduler* scheduler;
+
+  // Idle-loop skipping
+  bool skip_idle;
+  uint64_t skipped_cycles;
+
+  // Set by KIL, and only cleared by a reset. jams counts how many times it happened.
+  bool jammed;
+  uint64_t jams;
+
+  // The variant, and the opcode table and engines built for it
+  CpuVariant variant;
+  const CpuCore* core;
+
 } Mos6502;
 
 /**
  * @brief Constructor for a MOS6502 object.
+ * @param rm The reset manager.
+ * @param variant The CPU to emulate.
  */
-Mos6502* mos6502_create(ResetManager* rm);
+Mos6502* mos6502_create(ResetManager* rm, CpuVariant variant);
 
 /**
  * @brief Raise an IRQ
@@ -117,7 +241,204 @@ void raise_irq(Mos6502* cpu);
 void raise_nmi(Mos6502* cpu);
 
 /**
- * @brief Execute one CPU instruction.
+ * @brief Look up an opcode in the opcode table of a CPU variant.
+ * @param variant The CPU variant.
+ * @param opcode The opcode.
+ * @param info Its name, addressing mode, base cycle cost and length.
+ */
+void get_opcode_info(CpuVariant variant, uint8_t opcode, OpcodeInfo* info);
+
+/**
+ * @brief Execute one CPU instruction. Does nothing while the CPU is jammed.
  * @param cpu The MOS6502 object.
  */
 void step(Mos6502* cpu);
+
+/**
+ * @brief Execute a batch of CPU instructions with the fused, threaded engine.
+ *
+ * Every opcode has its own handler with the addressing mode and operation inlined together, and
+ * handlers jump straight to the next one through a computed goto on GCC/Clang (a switch is used
+ * elsewhere, or when B6502_PORTABLE_DISPATCH is defined). The results are identical to calling
+ * step() count times, except that execution ends early on a halt, a breakpoint or a jam.
+ *
+ * @param cpu The MOS6502 object.
+ * @param count The number of instructions to execute.
+ * @return The number of instructions that were executed.
+ */
+size_t mos6502_execute(Mos6502* cpu, size_t count);
+
+/**
+ * @brief Run instructions until a cycle budget is used up.
+ *
+ * The registers are cached in locals for the whole batch and written back on return, so bus
+ * handlers must not rely on them while the batch is running. A pending interrupt is serviced on
+ * entry. The batch also ends early when an interrupt is raised, when the CPU halts (an instruction
+ * that jumps to itself), or when the PC reaches the breakpoint. The reason is stored in
+ * cpu->stop_reason. The last instruction may overrun the budget. A jammed CPU returns right away,
+ * with kStopJammed.
+ *
+ * @param cpu The MOS6502 object.
+ * @param cycle_budget The number of cycles to run for.
+ * @return The number of cycles actually used.
+ */
+uint32_t mos6502_run(Mos6502* cpu, uint32_t cycle_budget);
+
+/**
+ * @brief Run until a cycle, firing the scheduler's events as their deadlines pass.
+ *
+ * Instructions run in batches that end at the next event's deadline, so nothing is polled per
+ * instruction. An event fires after the instruction that reaches its deadline. Execution also
+ * ends early at the breakpoint, and when the CPU jams.
+ *
+ * @param cpu The MOS6502 object.
+ * @param cycle The cycle to run until. The last instruction may overrun it.
+ * @return The number of cycles actually used.
+ */
+uint64_t mos6502_run_until(Mos6502* cpu, uint64_t cycle);
+
+/**
+ * @brief Enable or disable idle-loop skipping (enabled by default).
+ *
+ * A loop that provably can't leave before an interrupt or the next event is fast-forwarded
+ * instead of emulated, adding whole iterations to cpu->cycles and cpu->skipped_cycles. This
+ * covers JMP * and branches to themselves in every engine, and with the block cache, loops of up
+ * to MAX_IDLE_LOOP_LENGTH instructions like LDA flag / BEQ -. Such a loop may only load from
+ * plain memory (not from device registers, which can have side effects), must not write or use
+ * the stack, and must come back to its start with unchanged registers.
+ *
+ * @param cpu The MOS6502 object.
+ * @param enabled Whether to skip idle loops.
+ */
+void set_idle_skip(Mos6502* cpu, bool enabled);
+
+/**
+ * @brief Schedule an IRQ or an NMI to be raised at a cycle.
+ * @param cpu The MOS6502 object.
+ * @param cycle The cycle at which the interrupt is raised.
+ * @param type kIRQ or kNMI.
+ * @return The event's id, for cancel_event() on cpu->scheduler, or 0 if the scheduler is full.
+ */
+uint32_t schedule_interrupt(Mos6502* cpu, uint64_t cycle, Interrupt type);
+
+/**
+ * @brief Stall the CPU, e.g. while a DMA transfer owns the bus.
+ *
+ * This may be called between runs, or from a bus handler while one is in progress.
+ *
+ * @param cpu The MOS6502 object.
+ * @param cycles The number of cycles to stall for.
+ * @see bus_dma
+ */
+void mos6502_stall(Mos6502* cpu, uint32_t cycles);
+
+/**
+ * @brief Stop batch execution when the PC reaches an address.
+ * @param cpu The MOS6502 object.
+ * @param addr The address to stop at.
+ */
+void set_breakpoint(Mos6502* cpu, uint16_t addr);
+
+/**
+ * @brief Remove the breakpoint.
+ * @param cpu The MOS6502 object.
+ */
+void clear_breakpoint(Mos6502* cpu);
+
+/**
+ * @brief Enable or disable the basic-block cache for batch execution.
+ *
+ * With the cache enabled, mos6502_run() and mos6502_execute() decode each basic block once into a
+ * stream of handlers with resolved operands, and replay it on every later visit. A write through
+ * write() to a page holding cached code invalidates every block on that page, so self-modifying
+ * and RAM-resident code stay correct.
+ *
+ * @param cpu The MOS6502 object.
+ * @param enabled Whether to use the cache.
+ */
+void set_block_cache(Mos6502* cpu, bool enabled);
+
+/**
+ * @brief Enable or disable the x86-64 JIT for hot blocks.
+ *
+ * Enabling the JIT also enables the block cache. Blocks that run often are translated to native
+ * code, and run as a whole: the budget of mos6502_run() may be overrun by up to one block, and an
+ * interrupt raised by a bus access inside a block is noticed at the end of the block.
+ *
+ * @see jit.h
+ *
+ * @param cpu The MOS6502 object.
+ * @param enabled Whether to use the JIT.
+ * @return Whether the JIT is now in use. Always false when the JIT was not built.
+ */
+bool set_jit(Mos6502* cpu, bool enabled);
+
+/**
+ * @brief Attach a profiler to the CPU, or detach it with NULL.
+ *
+ * While a profiler is attached, mos6502_execute(), mos6502_run() and mos6502_run_until() run one
+ * step() at a time whichever engine is enabled, so that the profiler sees every instruction.
+ *
+ * @see profiler.h
+ *
+ * @param cpu The MOS6502 object.
+ * @param profiler The profiler, which the CPU retains.
+ * @return Whether a profiler is now attached. Always false when the profiler was not built.
+ */
+bool set_profiler(Mos6502* cpu, Profiler* profiler);
+
+/**
+ * @brief Attach a tracer to the CPU, or detach it with NULL.
+ *
+ * While a tracer is attached, mos6502_execute(), mos6502_run() and mos6502_run_until() run one
+ * step() at a time whichever engine is enabled, so that every instruction is traced.
+ *
+ * @see trace.h
+ *
+ * @param cpu The MOS6502 object.
+ * @param tracer The tracer, which the CPU retains.
+ */
+void set_tracer(Mos6502* cpu, Tracer* tracer);
+
+/**
+ * @brief Enable or disable counting adjacent opcode pairs.
+ *
+ * The block cache runs frequent pairs such as DEX/BNE or CMP #imm/BNE as superinstructions: one
+ * dispatch for both, with the flags that the second instruction overwrites never written by the
+ * first. The set of pairs is a built-in table. These counters show which pairs a program really
+ * runs, so the table can be tuned with dump_pair_frequencies(). Enabling them also enables the
+ * block cache, and only pairs inside a basic block are counted.
+ *
+ * @param cpu The MOS6502 object.
+ * @param enabled Whether to count pairs. Disabling discards the counts.
+ */
+void set_pair_profiling(Mos6502* cpu, bool enabled);
+
+/**
+ * @brief Get how often one opcode was followed by another since profiling was enabled.
+ * @param cpu The MOS6502 object.
+ * @param first The first opcode.
+ * @param second The second opcode.
+ * @return The count, or 0 when profiling is disabled.
+ */
+uint64_t pair_frequency(const Mos6502* cpu, uint8_t first, uint8_t second);
+
+/**
+ * @brief Print the most frequent opcode pairs, most frequent first.
+ *
+ * Each line has the format of the built-in pair table, with the pair's count and its share of all
+ * pairs, and says whether the pair is fused.
+ *
+ * @param cpu The MOS6502 object.
+ * @param out The stream to print to.
+ * @param limit The maximum number of pairs to print.
+ */
+void dump_pair_frequencies(const Mos6502* cpu, FILE* out, size_t limit);
+
+/**
+ * @brief Get the hit, miss, invalidation, translation, native transfer loop and superinstruction
+ * counters of the block cache.
+ * @param cpu The MOS6502 object.
+ * @param stats The counters.
+ */
+void get_block_cache_stats(const Mos6502* cpu, BlockCacheStats* stats);
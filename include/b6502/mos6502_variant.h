@@ -0,0 +1,149 @@
+/**
+ * @file mos6502_variant.h
+ * @brief The engines of one CPU variant, generated from its opcode table.
+ *
+ * Only mos6502.c includes this, once per variant, with VARIANT_OPCODES(X) set to the variant's
+ * opcode table, VARIANT(name) prefixing the names of what is generated, and
+ * VARIANT_INTERRUPT_CLEARS set to the flags the variant clears when it takes an interrupt. Every
+ * handler is specialized to its variant, so nothing checks which variant is running.
+ */
+
+static const struct Opcode VARIANT(opcodes)[NUM_OF_OPCODES] = {VARIANT_OPCODES(OPCODE_ENTRY)};
+
+VARIANT_OPCODES(DECODED_HANDLER)
+
+static const decoded_handler VARIANT(decoded_handlers)[NUM_OF_OPCODES]
+    = {VARIANT_OPCODES(DECODED_ENTRY)};
+
+VARIANT_OPCODES(AOT_HANDLER)
+
+SUPER_STEP_BRANCH(0xCA, 0xD0, x, -1, false)  // DEX BNE
+SUPER_STEP_BRANCH(0x88, 0xD0, y, -1, false)  // DEY BNE
+SUPER_STEP_BRANCH(0xE8, 0xD0, x, 1, false)   // INX BNE
+SUPER_STEP_BRANCH(0xC8, 0xD0, y, 1, false)   // INY BNE
+SUPER_STEP_BRANCH(0xCA, 0xF0, x, -1, true)   // DEX BEQ
+SUPER_STEP_BRANCH(0x88, 0xF0, y, -1, true)   // DEY BEQ
+SUPER_STEP_COMPARE(0xC8, 0xC0, y, 1)         // INY CPY #imm
+SUPER_STEP_COMPARE(0xE8, 0xE0, x, 1)         // INX CPX #imm
+SUPER_STEP_COMPARE(0x88, 0xC0, y, -1)        // DEY CPY #imm
+SUPER_STEP_COMPARE(0xCA, 0xE0, x, -1)        // DEX CPX #imm
+SUPER_COMPARE_BRANCH(0xC9, 0xD0, a, false)   // CMP #imm BNE
+SUPER_COMPARE_BRANCH(0xC9, 0xF0, a, true)    // CMP #imm BEQ
+SUPER_COMPARE_BRANCH(0xE0, 0xD0, x, false)   // CPX #imm BNE
+SUPER_COMPARE_BRANCH(0xC0, 0xD0, y, false)   // CPY #imm BNE
+SUPER_PAIR(0xC5, 0xD0)                       // CMP zp BNE
+SUPER_PAIR(0xA9, 0x85)                       // LDA #imm STA zp
+SUPER_PAIR(0xA9, 0x8D)                       // LDA #imm STA abs
+SUPER_PAIR(0xA5, 0x85)                       // LDA zp STA zp
+SUPER_PAIR(0xA5, 0x8D)                       // LDA zp STA abs
+SUPER_PAIR(0xAD, 0x85)                       // LDA abs STA zp
+SUPER_PAIR(0xAD, 0x8D)                       // LDA abs STA abs
+SUPER_PAIR(0x18, 0x69)                       // CLC ADC #imm
+SUPER_PAIR(0x18, 0x65)                       // CLC ADC zp
+SUPER_PAIR(0x18, 0x6D)                       // CLC ADC abs
+
+// The pairs that run as superinstructions, each with how often it ran in the one workload the
+// tree has: 6502_functional_test.bin run to its success trap with set_pair_profiling(), 24873792
+// pairs in all. dump_pair_frequencies() prints lines in this format, without addressing modes.
+// CMP zp BNE and LDA zp STA abs are that profile's top fused pairs, at 194 and 12 per mille. The
+// other pairs are the counted-loop, compare-and-branch, copy and add idioms of typical game code,
+// which the functional test barely runs, so they are kept without measured weight.
+static const Superinstruction VARIANT(superinstructions)[] = {
+    SUPER(0xCA, 0xD0),  // DEX BNE: 0
+    SUPER(0x88, 0xD0),  // DEY BNE: 0
+    SUPER(0xE8, 0xD0),  // INX BNE: 0
+    SUPER(0xC8, 0xD0),  // INY BNE: 0
+    SUPER(0xCA, 0xF0),  // DEX BEQ: 126
+    SUPER(0x88, 0xF0),  // DEY BEQ: 1
+    SUPER(0xC8, 0xC0),  // INY CPY #imm: 0
+    SUPER(0xE8, 0xE0),  // INX CPX #imm: 40
+    SUPER(0x88, 0xC0),  // DEY CPY #imm: 24
+    SUPER(0xCA, 0xE0),  // DEX CPX #imm: 20
+    SUPER(0xC9, 0xD0),  // CMP #imm BNE: 366
+    SUPER(0xC9, 0xF0),  // CMP #imm BEQ: 3
+    SUPER(0xE0, 0xD0),  // CPX #imm BNE: 175
+    SUPER(0xC0, 0xD0),  // CPY #imm BNE: 46
+    SUPER(0xC5, 0xD0),  // CMP zp BNE: 4850260
+    SUPER(0xA9, 0x85),  // LDA #imm STA zp: 468
+    SUPER(0xA9, 0x8D),  // LDA #imm STA abs: 51
+    SUPER(0xA5, 0x85),  // LDA zp STA zp: 514
+    SUPER(0xA5, 0x8D),  // LDA zp STA abs: 303055
+    SUPER(0xAD, 0x85),  // LDA abs STA zp: 0
+    SUPER(0xAD, 0x8D),  // LDA abs STA abs: 0
+    SUPER(0x18, 0x69),  // CLC ADC #imm: 126
+    SUPER(0x18, 0x65),  // CLC ADC zp: 0
+    SUPER(0x18, 0x6D),  // CLC ADC abs: 0
+};
+
+#ifdef THREADED_DISPATCH
+#  pragma GCC diagnostic push
+#  pragma GCC diagnostic ignored "-Wpedantic"
+#  ifdef __clang__
+#    pragma GCC diagnostic ignored "-Wgnu-label-as-value"
+#  endif
+#endif
+
+/*
+ * Run instructions until batch_done(). The registers are copied into a local, so once everything
+ * is flattened into this function the compiler keeps them in host registers for the whole batch.
+ * The interrupt line is still read from the real CPU, since bus handlers may raise interrupts
+ * while the batch runs. The bus clock points at the local cycle counter meanwhile, so that devices
+ * are caught up to the right cycle.
+ */
+static FLATTEN size_t VARIANT(fused_run)(Mos6502* cpu, size_t count, uint32_t budget) {
+  Mos6502 regs = *cpu;
+  Batch batch = {count, 0, regs.cycles, budget, cpu->breakpoint, regs.pc};
+
+  load_flags(&regs);
+  regs.bus->clock = &regs.cycles;
+  poll_interrupts(&regs, &cpu->intr_status);
+  if (!count) {
+    goto stop;
+  }
+
+#ifdef THREADED_DISPATCH
+  static const void* const dispatch[NUM_OF_OPCODES] = {VARIANT_OPCODES(FUSED_LABEL)};
+  FUSED_DISPATCH();
+  VARIANT_OPCODES(FUSED_HANDLER)
+#else
+  for (;;) {
+    batch.opc = regs.pc;
+    switch (read(regs.bus, batch.opc)) { VARIANT_OPCODES(FUSED_CASE) }
+    batch.executed++;
+    if (UNLIKELY(batch_done(&batch, &regs, cpu->intr_status))) {
+      goto stop;
+    }
+  }
+#endif
+
+stop:
+  cpu->stop_reason = batch_stop_reason(&batch, &regs, cpu->intr_status);
+  store_flags(&regs);
+  regs.bus->clock = &cpu->cycles;
+  cpu->pc = regs.pc;
+  cpu->sp = regs.sp;
+  cpu->a = regs.a;
+  cpu->x = regs.x;
+  cpu->y = regs.y;
+  cpu->sr = regs.sr;
+  cpu->cycles = regs.cycles;
+  cpu->addr = regs.addr;
+  cpu->data = regs.data;
+  cpu->current_mode = regs.current_mode;
+  cpu->jammed = regs.jammed;
+  cpu->jams = regs.jams;
+  return batch.executed;
+}
+
+#ifdef THREADED_DISPATCH
+#  pragma GCC diagnostic pop
+#endif
+
+static const CpuCore VARIANT(core) = {
+    .opcodes = VARIANT(opcodes),
+    .decoded_handlers = VARIANT(decoded_handlers),
+    .superinstructions = VARIANT(superinstructions),
+    .num_superinstructions = sizeof(VARIANT(superinstructions)) / sizeof(Superinstruction),
+    .fused_run = VARIANT(fused_run),
+    .interrupt_clears = VARIANT_INTERRUPT_CLEARS,
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+/**
+ * @file profiler.h
+ * @brief Hot-spot profiler for emulated code.
+ *
+ * While a profiler is attached with set_profiler(), every instruction goes through step(), which
+ * reports it here. Its cycles and execution count are added to its PC and to its opcode, and JSR,
+ * BRK, interrupts and the returns from them are followed on a shadow call stack, so that cycles
+ * are also attributed to subroutines (inclusive and exclusive) and to whole call paths.
+ *
+ * With a sample period of N, only every Nth instruction is added to the counters, weighted by N.
+ * The call stack still follows every instruction, so calls and inclusive cycles stay exact.
+ *
+ * The hook in step() is only built when the B6502_ENABLE_PROFILER CMake option is on (which
+ * defines B6502_PROFILER). Otherwise step() is unchanged and set_profiler() always fails.
+ */
+
+#include <stdio.h>
+
+#include "b6502/base.h"
+#include "b6502/mos6502.h"
+
+/**
+ * @brief The deepest call stack that is followed. Deeper calls count towards their caller.
+ */
+#define PROFILER_MAX_DEPTH (size_t)(256)
+
+/**
+ * @brief The number of distinct call paths that are kept apart.
+ */
+#define PROFILER_MAX_PATHS (size_t)(65536)
+
+/**
+ * @brief Set in ProfilerPath.routine for an interrupt (or BRK) handler.
+ */
+#define PROFILER_INTERRUPT (uint32_t)(1 << 16)
+
+/**
+ * @brief The path of the code that runs outside of any known subroutine.
+ */
+#define PROFILER_ROOT (uint32_t)(0)
+
+/**
+ * @brief A subroutine or interrupt handler on the shadow call stack.
+ *
+ * sp is the stack pointer right after the call pushed its return address. The routine has
+ * returned once the stack pointer is above that again.
+ */
+typedef struct ProfilerFrame {
+  uint64_t start;
+  uint32_t path;
+  uint16_t entry;
+  uint8_t sp;
+} ProfilerFrame;
+
+/**
+ * @brief A call path: a routine, and the path it was called from.
+ */
+typedef struct ProfilerPath {
+  uint64_t cycles;
+  uint32_t parent;
+  uint32_t routine;
+} ProfilerPath;
+
+/**
+ * @brief The counters of the profiler, indexed by PC, opcode or subroutine entry point.
+ */
+struct Profiler {
+  CpuVariant variant;
+  uint32_t sample_period;
+  uint32_t countdown;
+
+  // Every instruction and cycle seen, sampled or not
+  uint64_t instructions;
+  uint64_t cycles;
+
+  uint64_t pc_count[0x10000];
+  uint64_t pc_cycles[0x10000];
+  uint64_t opcode_count[256];
+  uint64_t opcode_cycles[256];
+
+  uint64_t calls[0x10000];
+  uint64_t exclusive[0x10000];
+  uint64_t inclusive[0x10000];
+  uint32_t active[0x10000];
+
+  ProfilerFrame stack[PROFILER_MAX_DEPTH];
+  size_t depth;
+
+  ProfilerPath paths[PROFILER_MAX_PATHS];
+  uint32_t num_paths;
+  uint32_t path_slots[2 * PROFILER_MAX_PATHS];
+};
+
+/**
+ * @brief Constructor for a profiler.
+ * @param variant The CPU variant being profiled, to name its opcodes.
+ * @param sample_period Count every Nth instruction, or every instruction when 0 or 1.
+ */
+Profiler* profiler_create(CpuVariant variant, uint32_t sample_period);
+
+/**
+ * @brief Record an interrupt being taken, before the first instruction of its handler.
+ * @param profiler The profiler.
+ * @param handler The address of the handler.
+ * @param sp The stack pointer after the interrupt pushed PC and SR.
+ */
+void profile_interrupt(Profiler* profiler, uint16_t handler, uint8_t sp);
+
+/**
+ * @brief Record one instruction, after it ran.
+ * @param profiler The profiler.
+ * @param pc The address of the instruction.
+ * @param opcode The opcode.
+ * @param cycles The cycles it took, with the interrupt taken right before it, if any.
+ * @param next_pc The PC after the instruction.
+ * @param sp The stack pointer after the instruction.
+ */
+void profile_instruction(Profiler* profiler, uint16_t pc, uint8_t opcode, uint32_t cycles,
+                         uint16_t next_pc, uint8_t sp);
+
+/**
+ * @brief Get the inclusive cycles of a subroutine, counting the calls still running.
+ * @param profiler The profiler.
+ * @param entry The entry point of the subroutine.
+ * @return The cycles spent in it and in everything it called.
+ */
+uint64_t profiler_inclusive(const Profiler* profiler, uint16_t entry);
+
+/**
+ * @brief Print the hottest PCs, opcodes and subroutines.
+ * @param profiler The profiler.
+ * @param out Where to print.
+ * @param limit The maximum number of lines of each table.
+ */
+void profiler_write_flat(const Profiler* profiler, FILE* out, size_t limit);
+
+/**
+ * @brief Print the cycles of every call path as folded stacks, e.g. for flamegraph.pl.
+ *
+ * Each line is a path from main through sub_XXXX and int_XXXX frames, and its exclusive cycles.
+ *
+ * @param profiler The profiler.
+ * @param out Where to print.
+ */
+void profiler_write_folded(const Profiler* profiler, FILE* out);
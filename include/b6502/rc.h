@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /**
@@ -16,6 +17,19 @@
  * freed unless 'weak_count' is also 0. Objects that hold weak references can check if the object is
  * still valid via rc_weak_check().
  *
+ * Small objects come out of size-class slabs instead of calloc(). Each thread keeps its own free
+ * list and bump pointer for every class, so allocating is a pop or a bump and freeing is a push,
+ * without locks. When a thread exits, its free slots go to a shared pool that other threads take
+ * from before reserving more. The slabs' memory is kept for reuse and never given back to the
+ * heap. Built with B6502_RC_DEBUG, freed slots are poisoned, and an assertion checks that nothing
+ * wrote to them before they are handed out again.
+ *
+ * Objects allocated with rc_alloc_shared() can have their references taken and dropped from any
+ * thread, with atomic counts: the release of the last reference synchronizes with every earlier
+ * release, and rc_upgrade() never revives an object whose last strong reference is gone. Other
+ * objects keep plain counts that cost nothing extra, unless built with B6502_RC_ATOMIC, which
+ * makes every object shared. Either way, only the counts are thread-safe, not the objects.
+ *
  * @code{.c}
  * int * num = rc_alloc(1, NULL);
  * assert(rc_count(num) == 1);
@@ -33,7 +47,44 @@
 typedef void (*Destructor)(void *);
 
 /**
- * @brief A wrapper around calloc() that adds reference counting.
+ * @brief The alignment of objects allocated in an arena, one cache line.
+ */
+#define RC_ARENA_ALIGN (size_t)64
+
+/**
+ * @brief One block of memory that reference-counted objects are allocated from back to back.
+ * @see rc_arena_create
+ */
+typedef struct RcArena RcArena;
+
+/**
+ * @brief The number of slab size classes, with slots of 64 bytes up to 4KB, header included.
+ */
+#define RC_SLAB_CLASSES (size_t)7
+
+/**
+ * @brief The usage of one slab size class.
+ */
+typedef struct RcSlabStats {
+  size_t slot_size;
+  size_t live;
+  size_t peak;
+} RcSlabStats;
+
+/**
+ * @brief The usage of every slab size class.
+ *
+ * live_bytes is the bytes in the slots of live objects, reserved_bytes the bytes taken from the
+ * heap for slabs.
+ */
+typedef struct RcStats {
+  RcSlabStats classes[RC_SLAB_CLASSES];
+  size_t live_bytes;
+  size_t reserved_bytes;
+} RcStats;
+
+/**
+ * @brief Allocate a zeroed object with reference counting.
  * @see rc_array_alloc if you want to add reference counting to an array.
  * @param size The size of the object.
  * @param destructor A function pointer to the device's destructor.
@@ -41,6 +92,14 @@ typedef void (*Destructor)(void *);
  */
 void *rc_alloc(size_t size, Destructor destructor);
 
+/**
+ * @brief Allocate a zeroed object whose references can be shared between threads.
+ * @param size The size of the object.
+ * @param destructor A function pointer to the device's destructor.
+ * @return A pointer to the object that was allocated.
+ */
+void *rc_alloc_shared(size_t size, Destructor destructor);
+
 /**
  * @brief Increment the strong reference count of an object.
  * @param obj A pointer to the object.
@@ -121,3 +180,66 @@ void *rc_upgrade(void **obj);
  * @return A pointer to the object, NULL if the object is no longer valid.
  */
 void *rc_downcast(void **obj);
+
+/**
+ * @brief Get the usage of the slabs, across all threads.
+ * @param stats Where to store the usage.
+ */
+void rc_get_stats(RcStats *stats);
+
+/**
+ * @brief Create an arena for objects to be allocated in with rc_arena_enter().
+ *
+ * Objects in an arena are reference-counted as usual, but are laid out in the order they were
+ * allocated, each on its own cache line, and are never freed on their own. The arena is freed in
+ * one go once all of its objects are gone and its creator has released it. Objects only go in the
+ * first 4GB of an arena.
+ *
+ * @param capacity The bytes available to objects, see rc_arena_footprint().
+ * @param huge_pages Whether to ask for the arena to be backed by huge pages.
+ * @return The arena, or NULL if it could not be allocated.
+ */
+RcArena *rc_arena_create(size_t capacity, bool huge_pages);
+
+/**
+ * @brief Get the bytes an object of a given size takes in an arena.
+ * @param size The size of the object.
+ * @return The bytes it takes, header and padding included.
+ */
+size_t rc_arena_footprint(size_t size);
+
+/**
+ * @brief Allocate every following rc_alloc() on this thread in an arena.
+ *
+ * Allocations that don't fit still fall back to the heap.
+ *
+ * @param arena The arena, or NULL to allocate from the heap again.
+ */
+void rc_arena_enter(RcArena *arena);
+
+/**
+ * @brief Release the creator's reference to an arena.
+ * @param arena The value of the arena's pointer.
+ */
+void rc_arena_release(RcArena **arena);
+
+/**
+ * @brief Copy an arena and every object in it with a single memcpy().
+ *
+ * The copy is a new arena with the same objects and reference counts, and with the creator's
+ * reference if the original still had it. Pointers between the objects still point into the
+ * original, so the caller must move them by the returned offset.
+ *
+ * @param arena The arena.
+ * @param offset Where to store the address of the copy minus the address of the original.
+ * @return The copy, or NULL if it could not be allocated.
+ */
+RcArena *rc_arena_clone(const RcArena *arena, ptrdiff_t *offset);
+
+/**
+ * @brief Check whether an object is allocated in an arena.
+ * @param arena The arena.
+ * @param obj A pointer to the object, or any other address.
+ * @return Whether the address falls within the arena.
+ */
+bool rc_arena_contains(const RcArena *arena, const void *obj);
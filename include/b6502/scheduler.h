@@ -0,0 +1,89 @@
+#pragma once
+
+/**
+ *  @file scheduler.h
+ *  @brief A queue of timed events for the devices around the CPU.
+ *
+ * Devices that need to act at a certain time (a PPU reaching vblank, a timer expiring, an
+ * interrupt line being asserted) schedule an event instead of being stepped alongside the CPU.
+ * Timestamps are absolute values of the CPU's 64-bit cycle counter. The events are kept in a
+ * binary min-heap, so the CPU only has to compare its cycle counter against the earliest deadline
+ * to know how far it can run on its own.
+ */
+
+#include "b6502/base.h"
+
+#define MAX_EVENTS 64
+
+/**
+ * @brief A deadline that is never reached.
+ */
+#define NO_DEADLINE UINT64_MAX
+
+/**
+ *  @brief A function variable that points to the handler of an event.
+ *  @param obj The object the event was scheduled for.
+ *  @param deadline The event's deadline. The CPU may already be past it.
+ */
+typedef void (*event_handler)(void* obj, uint64_t deadline);
+
+/**
+ *  @brief A scheduled event.
+ */
+typedef struct Event {
+  uint64_t deadline;
+  uint32_t id;
+  void* obj;
+  event_handler handler;
+} Event;
+
+/**
+ *  @brief A min-heap of events ordered by deadline.
+ */
+typedef struct Scheduler {
+  size_t num_events;
+  uint32_t next_id;
+  Event events[MAX_EVENTS];
+} Scheduler;
+
+/**
+ *  @brief Constructor for a scheduler.
+ */
+Scheduler* scheduler_create(void);
+
+/**
+ * @brief Schedule an event.
+ * @param scheduler The scheduler.
+ * @param deadline The cycle at which the event fires.
+ * @param handler The handler to call.
+ * @param obj The object passed to the handler (weakly retained).
+ * @return An id for cancel_event(), or 0 if MAX_EVENTS events are already pending.
+ */
+uint32_t schedule_event(Scheduler* scheduler, uint64_t deadline, event_handler handler,
+                        void* obj);
+
+/**
+ * @brief Remove an event that has not fired yet. Unknown ids are ignored.
+ * @param scheduler The scheduler.
+ * @param id The id returned by schedule_event().
+ */
+void cancel_event(Scheduler* scheduler, uint32_t id);
+
+/**
+ * @brief Get the deadline of the earliest event.
+ * @param scheduler The scheduler.
+ * @return The deadline, or NO_DEADLINE if there are no events.
+ */
+static inline uint64_t next_deadline(const Scheduler* scheduler) {
+  return scheduler->num_events ? scheduler->events[0].deadline : NO_DEADLINE;
+}
+
+/**
+ * @brief Fire every event whose deadline is at or before a cycle, earliest first.
+ *
+ * Handlers may schedule new events. Those fire in the same call if they are already due.
+ *
+ * @param scheduler The scheduler.
+ * @param cycle The current cycle.
+ */
+void run_events(Scheduler* scheduler, uint64_t cycle);
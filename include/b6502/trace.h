@@ -0,0 +1,175 @@
+#pragma once
+
+/**
+ * @file trace.h
+ * @brief Binary instruction traces.
+ *
+ * A tracer attached with set_tracer() gets one fixed-size record per instruction that step()
+ * runs, with the state right before the instruction: the PC, the opcode and its operand, the
+ * registers and the cycle count. Records go into a ring buffer, so the last N instructions before
+ * a crash or a KIL are always at hand. The ring is either in memory, or in a file that is mapped
+ * into memory, which the kernel keeps even if the process dies.
+ *
+ * Nothing is formatted while tracing. The records are rendered as text afterwards, one line per
+ * instruction in the format of nestest.log, by tracer_export() or by b6502-tracedump for a file.
+ *
+ * Without a tracer, step() pays a single branch.
+ */
+
+#include <stdio.h>
+
+#include "b6502/base.h"
+#include "b6502/mos6502.h"
+
+/**
+ * @brief The magic number at the start of a trace file.
+ */
+#define TRACE_MAGIC "B6502TRC"
+
+/**
+ * @brief The version of the trace file format.
+ */
+#define TRACE_VERSION (uint32_t)(1)
+
+/**
+ * @brief A trigger PC that never matches.
+ */
+#define TRACE_NO_PC UINT32_MAX
+
+/**
+ * @brief A trigger cycle that is never reached.
+ */
+#define TRACE_NO_CYCLE UINT64_MAX
+
+/**
+ * @brief The state of the CPU right before an instruction.
+ */
+typedef struct TraceRecord {
+  uint64_t cycle;
+  uint16_t pc;
+  uint8_t opcode;
+  uint8_t length;
+  uint8_t operand[2];
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t sp;
+  uint8_t sr;
+} TraceRecord;
+
+/**
+ * @brief The start of a trace, followed by capacity records.
+ *
+ * The record written last is at (written - 1) % capacity. The header is updated along with every
+ * record, so a trace file is complete whenever the process stops.
+ */
+typedef struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;
+  uint64_t written;
+  uint32_t variant;
+} TraceHeader;
+
+/**
+ * @brief A ring buffer of trace records.
+ */
+struct Tracer {
+  TraceHeader* header;
+  TraceRecord* records;
+  uint64_t mask;
+  size_t mapped_size;
+
+  // Capturing starts at the first instruction at trigger_pc, or at or after trigger_cycle
+  uint32_t trigger_pc;
+  uint64_t trigger_cycle;
+  bool capturing;
+};
+
+/**
+ * @brief Constructor for a tracer that keeps its records in memory.
+ * @param variant The CPU variant being traced, to name its opcodes.
+ * @param capacity The number of records kept, rounded up to a power of two.
+ * @return The tracer, or NULL if the memory could not be allocated.
+ */
+Tracer* tracer_create(CpuVariant variant, size_t capacity);
+
+/**
+ * @brief Constructor for a tracer that keeps its records in a memory-mapped file.
+ * @param variant The CPU variant being traced, to name its opcodes.
+ * @param path The file, which is created or overwritten.
+ * @param capacity The number of records kept, rounded up to a power of two.
+ * @return The tracer, or NULL if the file could not be mapped.
+ */
+Tracer* tracer_create_file(CpuVariant variant, const char* path, size_t capacity);
+
+/**
+ * @brief Only start capturing at a PC or a cycle, whichever comes first.
+ *
+ * A new tracer captures from the first instruction.
+ *
+ * @param tracer The tracer.
+ * @param pc The PC, or TRACE_NO_PC.
+ * @param cycle The cycle, or TRACE_NO_CYCLE.
+ */
+void tracer_set_trigger(Tracer* tracer, uint32_t pc, uint64_t cycle);
+
+/**
+ * @brief Append a record, once the trigger has fired.
+ * @param tracer The tracer.
+ * @param record The record.
+ */
+static inline void trace_append(Tracer* tracer, const TraceRecord* record) {
+  if (UNLIKELY(!tracer->capturing)) {
+    if (record->pc != tracer->trigger_pc && record->cycle < tracer->trigger_cycle) {
+      return;
+    }
+    tracer->capturing = true;
+  }
+  tracer->records[tracer->header->written++ & tracer->mask] = *record;
+}
+
+/**
+ * @brief Get the number of records in the ring.
+ * @param tracer The tracer.
+ * @return The number of records, at most the capacity.
+ */
+size_t tracer_count(const Tracer* tracer);
+
+/**
+ * @brief Get a record from the ring.
+ * @param tracer The tracer.
+ * @param index 0 for the oldest record, up to tracer_count() - 1 for the newest.
+ * @return The record.
+ */
+const TraceRecord* tracer_record(const Tracer* tracer, size_t index);
+
+/**
+ * @brief Render a record as a line of nestest.log, without the newline.
+ *
+ * e.g. "C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:7". The
+ * values in memory that nestest.log shows after some operands are not known offline, so they are
+ * left out.
+ *
+ * @param variant The CPU variant that ran the instruction.
+ * @param record The record.
+ * @param buffer Where to write the line.
+ * @param size The size of the buffer.
+ */
+void format_trace_record(CpuVariant variant, const TraceRecord* record, char* buffer, size_t size);
+
+/**
+ * @brief Render every record in the ring as text, oldest first.
+ * @param tracer The tracer.
+ * @param out Where to print.
+ */
+void tracer_export(const Tracer* tracer, FILE* out);
+
+/**
+ * @brief Render every record in a trace file as text, oldest first.
+ * @param path The trace file.
+ * @param out Where to print.
+ * @return Whether the file could be read.
+ */
+bool trace_export_file(const char* path, FILE* out);
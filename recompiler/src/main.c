@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b6502/base.h"
+#include "b6502/mos6502.h"
+
+#define ADDRESS_SPACE 0x10000
+#define MAX_ENTRIES 64
+#define MAX_RECOMPILED_LENGTH 64
+
+typedef struct Image {
+  const char* path;
+  uint8_t bytes[ADDRESS_SPACE];
+  size_t base;
+  size_t size;
+} Image;
+
+typedef struct Instruction {
+  uint16_t pc;
+  uint16_t operand;
+  uint8_t opcode;
+} Instruction;
+
+typedef struct RecoveredBlock {
+  uint16_t start;
+  uint16_t size;
+  uint32_t max_cycles;
+  size_t length;
+  Instruction instructions[MAX_RECOMPILED_LENGTH];
+  uint16_t successors[2];
+  size_t num_successors;
+} RecoveredBlock;
+
+// A CPU variant as it is named on the command line, in the names of its executors, and in C.
+typedef struct Variant {
+  const char* name;
+  const char* prefix;
+  const char* constant;
+  CpuVariant variant;
+} Variant;
+
+typedef struct Program {
+  const Variant* variant;
+  RecoveredBlock* blocks;
+  size_t num_blocks;
+  size_t capacity;
+  int32_t block_at[ADDRESS_SPACE];
+} Program;
+
+static const Variant variants[] = {{"nmos", "nmos6502", "kNMOS6502", kNMOS6502},
+                                   {"2a03", "rp2a03", "kRicoh2A03", kRicoh2A03},
+                                   {"65c02", "wdc65c02", "kWDC65C02", kWDC65C02}};
+
+static struct option long_options[] = {{"rom", required_argument, 0, 'r'},
+                                       {"base", required_argument, 0, 'b'},
+                                       {"entry", required_argument, 0, 'e'},
+                                       {"name", required_argument, 0, 'n'},
+                                       {"variant", required_argument, 0, 'v'},
+                                       {"output", required_argument, 0, 'o'},
+                                       {"help", no_argument, 0, 'h'},
+                                       {0, 0, 0, 0}};
+
+static void print_help(void) {
+  printf(
+      "Usage: b6502-recompile --rom FILE [options]\n"
+      "Recompile a 6502 ROM image to C that runs on the b6502 core.\n\n"
+      "  -r, --rom FILE     the ROM image\n"
+      "  -b, --base ADDR    where the image is loaded (default: it ends at $FFFF)\n"
+      "  -e, --entry ADDR   an entry point besides the vectors (repeatable)\n"
+      "  -n, --name NAME    the name of the AotProgram to define (default: aot_program)\n"
+      "  -v, --variant CPU  nmos, 2a03 or 65c02 (default: nmos)\n"
+      "  -o, --output FILE  where to write the C source (default: stdout)\n"
+      "  -h, --help         show this help\n");
+}
+
+static bool parse_address(const char* str, size_t* addr) {
+  char* end = NULL;
+  errno = 0;
+  const unsigned long value = strtoul(str[0] == '$' ? str + 1 : str, &end, str[0] == '$' ? 16 : 0);
+  if (errno || !*str || *end || value >= ADDRESS_SPACE) {
+    LOG_ERROR("Invalid address: %s\n", str);
+    return false;
+  }
+
+  *addr = value;
+  return true;
+}
+
+static bool load_image(Image* image, const char* path, bool has_base, size_t base) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    LOG_ERROR("Error opening file: %s\n", strerror(errno));
+    return false;
+  }
+
+  uint8_t* buffer = malloc(ADDRESS_SPACE + 1);
+  const size_t size = buffer ? fread(buffer, 1, ADDRESS_SPACE + 1, f) : 0;
+  fclose(f);
+  if (!size || size > ADDRESS_SPACE || (has_base && base + size > ADDRESS_SPACE)) {
+    LOG_ERROR("%s doesn't fit in the address space\n", path);
+    free(buffer);
+    return false;
+  }
+
+  image->path = path;
+  image->size = size;
+  image->base = has_base ? base : ADDRESS_SPACE - size;
+  memcpy(image->bytes + image->base, buffer, size);
+  free(buffer);
+  return true;
+}
+
+static inline bool in_image(const Image* image, size_t addr, size_t len) {
+  return addr >= image->base && addr + len <= image->base + image->size;
+}
+
+static inline uint16_t read16(const Image* image, size_t addr) {
+  return (uint16_t)(image->bytes[addr] | image->bytes[addr + 1] << 8);
+}
+
+static const Variant* parse_variant(const char* str) {
+  for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+    if (!strcmp(str, variants[i].name)) {
+      return &variants[i];
+    }
+  }
+
+  LOG_ERROR("Unknown CPU variant: %s\n", str);
+  return NULL;
+}
+
+static bool accesses_bus(const OpcodeInfo* info) {
+  static const char* const stack_ops[] = {"PHA", "PHP", "PLA", "PLP", "PHX", "PHY",
+                                          "PLX", "PLY", "JSR", "RTS", "RTI", "BRK"};
+  if (info->mode != kImpl && info->mode != kImm && info->mode != kAcc && info->mode != kRel) {
+    return true;
+  }
+
+  for (size_t i = 0; i < sizeof(stack_ops) / sizeof(stack_ops[0]); i++) {
+    if (!strcmp(info->name, stack_ops[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether an instruction can make an interrupt pending, and so has to be followed by a check.
+static bool may_interrupt(const OpcodeInfo* info) {
+  return accesses_bus(info) || !strcmp(info->name, "CLI");
+}
+
+static bool ends_block(const OpcodeInfo* info) {
+  static const char* const names[] = {"JMP", "JSR", "RTS", "RTI", "BRK", "KIL", "STP", "WAI"};
+  if (info->mode == kRel || info->mode == kZeroPRel) {
+    return true;
+  }
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (!strcmp(info->name, names[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The most cycles an instruction can take: indexed reads may cross a page, and a taken branch
+// costs one more cycle, or two when it crosses a page. ADC and SBC take one more in decimal mode
+// on the 65C02.
+static uint32_t max_cycles(CpuVariant variant, const OpcodeInfo* info) {
+  const uint32_t decimal =
+      variant == kWDC65C02 && (!strcmp(info->name, "ADC") || !strcmp(info->name, "SBC"));
+  switch (info->mode) {
+    case kAbsX:
+    case kAbsY:
+    case kIndIdx:
+      return info->cycles + decimal + 1;
+    case kRel:
+    case kZeroPRel:
+      return info->cycles + 2;
+    default:
+      return info->cycles + decimal;
+  }
+}
+
+static void decode(const Image* image, CpuVariant variant, RecoveredBlock* block,
+                   uint16_t start) {
+  block->start = start;
+  size_t pc = start;
+  while (block->length < MAX_RECOMPILED_LENGTH) {
+    if (!in_image(image, pc, 1)) {
+      break;
+    }
+    OpcodeInfo info;
+    get_opcode_info(variant, image->bytes[pc], &info);
+    if (!in_image(image, pc, info.length)) {
+      break;
+    }
+
+    Instruction* insn = &block->instructions[block->length++];
+    insn->pc = (uint16_t)pc;
+    insn->opcode = image->bytes[pc];
+    insn->operand = info.length == 3   ? read16(image, pc + 1)
+                    : info.length == 2 ? image->bytes[pc + 1]
+                                       : 0;
+    block->max_cycles += max_cycles(variant, &info);
+    pc += info.length;
+
+    if (info.mode == kRel) {
+      block->successors[block->num_successors++] = (uint16_t)((uint16_t)pc + (int8_t)insn->operand);
+      block->successors[block->num_successors++] = (uint16_t)pc;
+    } else if (info.mode == kZeroPRel) {
+      // The branch offset of BBR and BBS follows the zero page address.
+      block->successors[block->num_successors++] =
+          (uint16_t)((uint16_t)pc + (int8_t)(insn->operand >> 8));
+      block->successors[block->num_successors++] = (uint16_t)pc;
+    } else if (!strcmp(info.name, "JSR")) {
+      block->successors[block->num_successors++] = insn->operand;
+      block->successors[block->num_successors++] = (uint16_t)pc;
+    } else if (!strcmp(info.name, "JMP") && info.mode == kAbs) {
+      block->successors[block->num_successors++] = insn->operand;
+    } else if (!strcmp(info.name, "BRK")) {
+      // RTI from the handler returns past the signature byte that follows BRK.
+      block->successors[block->num_successors++] = (uint16_t)(pc + 1);
+    } else if (info.mode == kInd && in_image(image, insn->operand, 1)) {
+      // The target of JMP (ind) is whatever the pointer holds when it runs, so this is a guess,
+      // but a good one when the pointer is initialized in the image. Only the 65C02 carries into
+      // the high byte of the pointer.
+      const uint16_t high =
+          variant == kWDC65C02
+              ? (uint16_t)(insn->operand + 1)
+              : (uint16_t)((insn->operand & 0xFF00) | ((insn->operand + 1) & 0xFF));
+      if (in_image(image, high, 1)) {
+        block->successors[block->num_successors++] =
+            (uint16_t)(image->bytes[insn->operand] | image->bytes[high] << 8);
+      }
+    }
+
+    if (ends_block(&info)) {
+      block->size = (uint16_t)(pc - start);
+      return;
+    }
+  }
+
+  block->size = (uint16_t)(pc - start);
+  if (pc < ADDRESS_SPACE) {
+    block->successors[block->num_successors++] = (uint16_t)pc;
+  }
+}
+
+// Walk the image from its entry points, following every branch, jump and call.
+static bool recover_blocks(const Image* image, Program* program, const size_t* entries,
+                           size_t num_entries) {
+  uint16_t* worklist = malloc(ADDRESS_SPACE * sizeof(*worklist));
+  if (!worklist) {
+    return false;
+  }
+
+  size_t pending = 0;
+  for (size_t i = 0; i < ADDRESS_SPACE; i++) {
+    program->block_at[i] = -1;
+  }
+  for (size_t i = 0; i < num_entries; i++) {
+    if (in_image(image, entries[i], 1) && program->block_at[entries[i]] == -1) {
+      program->block_at[entries[i]] = 0;
+      worklist[pending++] = (uint16_t)entries[i];
+    }
+  }
+
+  while (pending) {
+    const uint16_t start = worklist[--pending];
+    if (program->num_blocks == program->capacity) {
+      program->capacity = program->capacity ? 2 * program->capacity : 256;
+      RecoveredBlock* blocks = realloc(program->blocks, program->capacity * sizeof(*blocks));
+      if (!blocks) {
+        free(worklist);
+        return false;
+      }
+      program->blocks = blocks;
+    }
+
+    RecoveredBlock* block = &program->blocks[program->num_blocks];
+    memset(block, 0, sizeof(*block));
+    decode(image, program->variant->variant, block, start);
+    if (!block->length) {
+      program->block_at[start] = -2;
+      continue;
+    }
+
+    program->block_at[start] = (int32_t)(program->num_blocks++);
+    for (size_t i = 0; i < block->num_successors; i++) {
+      const uint16_t next = block->successors[i];
+      if (in_image(image, next, 1) && program->block_at[next] == -1) {
+        program->block_at[next] = 0;
+        worklist[pending++] = next;
+      }
+    }
+  }
+
+  free(worklist);
+  return true;
+}
+
+// Emit the blocks that start on a page. The function returns true when the PC leaves the page
+// after a block, and false when the batch has to go back to the interpreter.
+static void emit_page(FILE* out, const Program* program, size_t page) {
+  fprintf(out, "static bool page_%02zX(Mos6502* cpu, AotBatch* batch) {\n", page);
+  fprintf(out, "dispatch:\n  switch (cpu->pc) {\n");
+  for (size_t i = 0; i < program->num_blocks; i++) {
+    if (program->blocks[i].start / NUMBER_OF_PAGES == page) {
+      fprintf(out, "    case 0x%04X:\n      goto block_%zu;\n", program->blocks[i].start, i);
+    }
+  }
+  fprintf(out, "    default:\n      return cpu->pc >> 8 != 0x%02zX;\n  }\n", page);
+
+  for (size_t i = 0; i < program->num_blocks; i++) {
+    const RecoveredBlock* block = &program->blocks[i];
+    if (block->start / NUMBER_OF_PAGES != page) {
+      continue;
+    }
+
+    fprintf(out, "\nblock_%zu:  // $%04X\n", i, block->start);
+    fprintf(out, "  if (!aot_enter_block(cpu, batch, %zu)) {\n    return false;\n  }\n", i);
+    for (size_t j = 0; j < block->length; j++) {
+      const Instruction* insn = &block->instructions[j];
+      OpcodeInfo info;
+      get_opcode_info(program->variant->variant, insn->opcode, &info);
+      fprintf(out, "  %s_aot_op_0x%02X(cpu, 0x%04X);  // %s\n", program->variant->prefix,
+              insn->opcode, insn->operand, info.name);
+      if (j + 1 < block->length && may_interrupt(&info)) {
+        fprintf(out, "  if (aot_interrupted(cpu, batch)) {\n");
+        fprintf(out, "    aot_retire(batch, %zu, 0x%04X);\n    return false;\n  }\n", j + 1,
+                insn->pc);
+      }
+    }
+
+    fprintf(out, "  aot_retire(batch, %zu, 0x%04X);\n", block->length,
+            block->instructions[block->length - 1].pc);
+    for (size_t j = 0; j < block->num_successors; j++) {
+      const uint16_t next = block->successors[j];
+      if (program->block_at[next] >= 0 && next / NUMBER_OF_PAGES == page) {
+        fprintf(out, "  if (cpu->pc == 0x%04X) {\n    goto block_%d;\n  }\n", next,
+                program->block_at[next]);
+      }
+    }
+    fprintf(out, "  goto dispatch;\n");
+  }
+  fprintf(out, "}\n\n");
+}
+
+static void emit(FILE* out, const Image* image, const Program* program, const char* name) {
+  fprintf(out, "// Generated by b6502-recompile from %s. Do not edit.\n\n", image->path);
+  fprintf(out, "#include \"b6502/aot.h\"\n\n");
+
+  fprintf(out, "static const uint8_t code[] = {");
+  for (size_t i = 0, n = 0; i < program->num_blocks; i++) {
+    const RecoveredBlock* block = &program->blocks[i];
+    for (size_t j = 0; j < block->size; j++, n++) {
+      fprintf(out, "%s0x%02X,", n % 12 ? " " : "\n    ", image->bytes[block->start + j]);
+    }
+  }
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out, "static const AotBlock blocks[] = {\n");
+  for (size_t i = 0, offset = 0; i < program->num_blocks; i++) {
+    const RecoveredBlock* block = &program->blocks[i];
+    fprintf(out, "    {0x%04X, %u, %zu, %u, code + %zu},\n", block->start, block->size,
+            block->length, block->max_cycles, offset);
+    offset += block->size;
+  }
+  fprintf(out, "};\n\n");
+
+  // One function per page keeps the functions small enough to compile quickly. Control flow
+  // within a page is a goto, and run() calls the function of the page the PC moves to.
+  bool has_page[NUMBER_OF_PAGES] = {false};
+  for (size_t i = 0; i < program->num_blocks; i++) {
+    has_page[program->blocks[i].start / NUMBER_OF_PAGES] = true;
+  }
+
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    if (has_page[page]) {
+      emit_page(out, program, page);
+    }
+  }
+
+  fprintf(out, "static bool (*const pages[])(Mos6502*, AotBatch*) = {");
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    fprintf(out, "%s", page % 4 ? " " : "\n    ");
+    if (has_page[page]) {
+      fprintf(out, "page_%02zX,", page);
+    } else {
+      fprintf(out, "NULL,");
+    }
+  }
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out, "static void run(Mos6502* cpu, AotBatch* batch) {\n");
+  fprintf(out, "  while (pages[cpu->pc >> 8] && pages[cpu->pc >> 8](cpu, batch)) {\n  }\n}\n\n");
+
+  fprintf(out, "const AotProgram %s = {\"%s\", %s, blocks, %zu, run};\n", name, name,
+          program->variant->constant, program->num_blocks);
+}
+
+int main(int argc, char** argv) {
+  static Image image;
+  static Program program;
+  size_t entries[MAX_ENTRIES + 3];
+  size_t num_entries = 0;
+  const char* rom = NULL;
+  const char* name = "aot_program";
+  const char* output = NULL;
+  bool has_base = false;
+  size_t base = 0;
+  program.variant = &variants[0];
+
+  int c = 0;
+  while ((c = getopt_long(argc, argv, "r:b:e:n:v:o:h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'r':
+        rom = optarg;
+        break;
+      case 'b':
+        if (!parse_address(optarg, &base)) {
+          return EXIT_FAILURE;
+        }
+        has_base = true;
+        break;
+      case 'e':
+        if (num_entries == MAX_ENTRIES) {
+          LOG_ERROR("At most %d entry points can be given\n", MAX_ENTRIES);
+          return EXIT_FAILURE;
+        }
+        if (!parse_address(optarg, &entries[num_entries++])) {
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'n':
+        name = optarg;
+        break;
+      case 'v':
+        program.variant = parse_variant(optarg);
+        if (!program.variant) {
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'h':
+        print_help();
+        return EXIT_SUCCESS;
+      case '?':
+        return EXIT_FAILURE;
+      default:
+        abort();
+    }
+  }
+
+  if (!rom) {
+    print_help();
+    return EXIT_FAILURE;
+  } else if (!load_image(&image, rom, has_base, base)) {
+    return EXIT_FAILURE;
+  }
+
+  const size_t vectors[] = {NMI_VECTOR, RES_VECTOR, IRQ_VECTOR};
+  for (size_t i = 0; i < 3; i++) {
+    if (in_image(&image, vectors[i], 2)) {
+      entries[num_entries++] = read16(&image, vectors[i]);
+    }
+  }
+
+  if (!recover_blocks(&image, &program, entries, num_entries)) {
+    LOG_ERROR("Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  FILE* out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    LOG_ERROR("Error opening file: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  emit(out, &image, &program, name);
+  if (out != stdout) {
+    fclose(out);
+    LOG_INFO("Recompiled %zu blocks to %s\n", program.num_blocks, output);
+  }
+
+  free(program.blocks);
+  return EXIT_SUCCESS;
+}
@@ -1,22 +1,255 @@
 #include "b6502/bus.h"
 
 #include "b6502/component.h"
+#include "b6502/memory.h"
 #include "b6502/rc.h"
 
+#define PAGE(addr) ((size_t)(addr) / NUMBER_OF_PAGES)
+
+static void deinit(void *obj) {
+  Bus *bus = obj;
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    if (bus->handlers[page]) {
+      rc_weak_release((void *)&bus->handlers[page]);
+    }
+    if (bus->register_pages[page]) {
+      rc_strong_release((void *)&bus->register_pages[page]);
+    }
+  }
+
+  for (size_t i = 1; i < bus->register_count; i++) {
+    if (bus->registers[i].obj) {
+      rc_weak_release((void *)&bus->registers[i].obj);
+    }
+  }
+  for (size_t i = 0; i < bus->window_count; i++) {
+    if (bus->windows[i].obj) {
+      rc_weak_release((void *)&bus->windows[i].obj);
+    }
+  }
+}
+
+Bus *bus_create(void) {
+  Bus *bus = rc_alloc(sizeof(*bus), deinit);
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    bus->page_masks[page] = 0xFFFF;
+  }
+  bus->register_count = 1;
+  return bus;
+}
+
+static inline bool is_memory(const Component *c) {
+  return c && (c->read == generic_read || c->write == generic_write);
+}
+
+// The page that an address in the given page lands on once it is masked.
+static inline size_t masked_page(const Bus *bus, size_t page) {
+  return PAGE((page * NUMBER_OF_PAGES) & bus->page_masks[page]);
+}
+
+// The bytes behind a page, if it is plain memory that covers all of it and has no registers.
+static uint8_t *direct_page(const Bus *bus, size_t page, bool handled_generically) {
+  const Memory *mem = bus->handlers[page];
+  const uint16_t mask = bus->page_masks[page];
+  const size_t unmasked = page * NUMBER_OF_PAGES;
+  const size_t base = unmasked & mask;
+  if (!handled_generically || (mask & 0xFF) != 0xFF || bus->register_pages[PAGE(base)]) {
+    return NULL;
+  } else if (bus->bank_pages[page]) {
+    return bus->bank_pages[page];
+  }
+
+  // Mirrored RAM has a copy of the page at its own address, which keeps mirrors contiguous.
+  if (mem->alias_size && unmasked < mem->size
+      && unmasked % mem->alias_size == base % mem->alias_size) {
+    return mem->bytes + unmasked;
+  }
+  return mem->bytes + base;
+}
+
+static void refresh_page(Bus *bus, size_t page) {
+  const Component *c = bus->handlers[page];
+  bus->read_pages[page] = direct_page(bus, page, c && c->read == generic_read);
+  bus->write_pages[page] = direct_page(bus, page, c && c->write == generic_write);
+  invalidate_page(bus, masked_page(bus, page));
+}
+
+// Take a page away from what was mapped there, and from the bank window it was part of.
+static void unmap_page(Bus *bus, size_t page) {
+  if (bus->handlers[page]) {
+    rc_weak_release((void *)&bus->handlers[page]);
+  }
+
+  // Code is tracked on masked pages, so both the old and the new target are invalidated.
+  invalidate_page(bus, masked_page(bus, page));
+  bus->bank_pages[page] = NULL;
+  if (bus->page_windows[page]) {
+    BankWindow *window = &bus->windows[bus->page_windows[page] - 1];
+    bus->page_windows[page] = 0;
+    if (!--window->shown && window->obj) {
+      rc_weak_release((void *)&window->obj);
+    }
+  }
+}
+
 void map_handler(Bus *bus, void *obj, uint16_t start, uint16_t end) {
-  size_t page_start = start / NUMBER_OF_PAGES;
-  size_t page_end = end / NUMBER_OF_PAGES;
-  for (size_t i = page_start; i <= page_end; i++) {
-    if (bus->handlers[i]) {
-      rc_weak_release((void *)&bus->handlers[i]);
+  map_mirrored(bus, obj, start, end, 0xFFFF);
+}
+
+void map_mirrored(Bus *bus, void *obj, uint16_t start, uint16_t end, uint16_t mask) {
+  if (is_memory(obj)) {
+    const Memory *mem = obj;
+    for (size_t page = PAGE(start); page <= PAGE(end); page++) {
+      if ((((page * NUMBER_OF_PAGES) & mask) | (mask & 0xFF)) >= mem->size) {
+        LOG_ERROR("Memory of size 0x%zX can't be mapped at 0x%04X-0x%04X with mask 0x%04X\n",
+                  mem->size, start, end, mask);
+        return;
+      }
     }
+  }
 
-    bus->handlers[i] = rc_weak_retain(obj);
+  for (size_t page = PAGE(start); page <= PAGE(end); page++) {
+    unmap_page(bus, page);
+    bus->handlers[page] = rc_weak_retain(obj);
+    bus->page_masks[page] = mask;
+    refresh_page(bus, page);
   }
 }
 
-uint8_t read(Bus *bus, uint16_t addr) {
-  size_t page = addr / NUMBER_OF_PAGES;
+// Only the pages still in the window are switched, and nothing is once its memory is gone.
+static void show_bank(Bus *bus, size_t index, size_t bank) {
+  BankWindow *window = &bus->windows[index];
+  if (!window->obj || !rc_weak_check(&window->obj)) {
+    return;
+  }
+
+  const Memory *mem = window->obj;
+  window->bank = bank % window->banks;
+  uint8_t *bytes = mem->bytes + window->bank * window->pages * NUMBER_OF_PAGES;
+  for (size_t i = 0; i < window->pages; i++) {
+    const size_t page = window->first_page + i;
+    if (bus->page_windows[page] == index + 1) {
+      bus->bank_pages[page] = bytes + i * NUMBER_OF_PAGES;
+      refresh_page(bus, page);
+    }
+  }
+}
+
+int map_bank_window(Bus *bus, void *obj, uint16_t start, uint16_t end) {
+  const Memory *mem = obj;
+  const size_t pages = PAGE(end) - PAGE(start) + 1;
+  if (bus->window_count == MAX_BANK_WINDOWS || mem->read != generic_read
+      || mem->size < pages * NUMBER_OF_PAGES) {
+    LOG_ERROR("Unable to map a bank window at 0x%04X-0x%04X\n", start, end);
+    return -1;
+  }
+
+  const size_t index = bus->window_count++;
+  for (size_t page = PAGE(start); page <= PAGE(end); page++) {
+    unmap_page(bus, page);
+    bus->handlers[page] = rc_weak_retain(obj);
+    bus->page_masks[page] = 0xFFFF;
+    bus->page_windows[page] = (uint8_t)(index + 1);
+  }
+
+  BankWindow *window = &bus->windows[index];
+  window->obj = rc_weak_retain(obj);
+  window->first_page = PAGE(start);
+  window->pages = pages;
+  window->banks = mem->size / (pages * NUMBER_OF_PAGES);
+  window->shown = pages;
+  show_bank(bus, index, 0);
+  return (int)index;
+}
+
+void switch_bank(Bus *bus, size_t window, size_t bank) {
+  show_bank(bus, window, bank);
+  bus->frame_switches += 1;
+  bus->bank_switches += 1;
+}
+
+uint32_t frame_bank_switches(Bus *bus) {
+  uint32_t switches = bus->frame_switches;
+  bus->frame_switches = 0;
+  return switches;
+}
+
+void map_register(Bus *bus, void *obj, uint16_t start, uint16_t end, read_handler read_fn,
+                  write_handler write_fn) {
+  if (bus->register_count == MAX_BUS_REGISTERS) {
+    LOG_ERROR("No room for a register at 0x%04X-0x%04X\n", start, end);
+    return;
+  }
+
+  const size_t index = bus->register_count++;
+  bus->registers[index].obj = rc_weak_retain(obj);
+  bus->registers[index].read = read_fn;
+  bus->registers[index].write = write_fn;
+
+  for (size_t addr = start; addr <= end; addr++) {
+    uint8_t **table = &bus->register_pages[PAGE(addr)];
+    if (!*table) {
+      *table = rc_alloc(NUMBER_OF_PAGES, NULL);
+    }
+    (*table)[addr % NUMBER_OF_PAGES] = (uint8_t)index;
+  }
+
+  // Every page that mirrors onto the registers loses its direct pointers.
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    const size_t target = masked_page(bus, page);
+    if (target >= PAGE(start) && target <= PAGE(end)) {
+      refresh_page(bus, page);
+    }
+  }
+}
+
+void invalidate_page(Bus *bus, size_t page) {
+  bus->page_generation[page] += 1;
+  if (bus->code_pages[page]) {
+    bus->code_pages[page] = false;
+    bus->code_invalidations += 1;
+  }
+}
+
+// The register mapped at a masked address, if any.
+static inline const BusRegister *find_register(const Bus *bus, uint16_t addr) {
+  const uint8_t *table = bus->register_pages[PAGE(addr)];
+  if (table && table[addr % NUMBER_OF_PAGES]) {
+    return &bus->registers[table[addr % NUMBER_OF_PAGES]];
+  }
+  return NULL;
+}
+
+void sync_devices(Bus *bus) {
+  if (!bus->clock) {
+    return;
+  }
+
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    if (bus->handlers[page]) {
+      sync_component(bus->handlers[page], *bus->clock);
+    }
+  }
+}
+
+static inline void sync_page(Bus *bus, size_t page) {
+  if (bus->clock && bus->handlers[page]) {
+    sync_component(bus->handlers[page], *bus->clock);
+  }
+}
+
+uint8_t handler_read(Bus *bus, uint16_t addr) {
+  size_t page = PAGE(addr);
+  sync_page(bus, page);
+  addr &= bus->page_masks[page];
+
+  const BusRegister *reg = find_register(bus, addr);
+  if (reg) {
+    return reg->read ? reg->read(reg->obj, addr) : 0;
+  } else if (bus->bank_pages[page]) {
+    return bus->bank_pages[page][addr % NUMBER_OF_PAGES];
+  }
+
   Component *c = bus->handlers[page];
   if (LIKELY(c)) {
     return c->read(bus->handlers[page], addr);
@@ -25,10 +258,104 @@ uint8_t read(Bus *bus, uint16_t addr) {
   }
 }
 
-void write(Bus *bus, uint16_t addr, uint8_t val) {
-  size_t page = addr / NUMBER_OF_PAGES;
+void handler_write(Bus *bus, uint16_t addr, uint8_t val) {
+  size_t page = PAGE(addr);
+  sync_page(bus, page);
+  addr &= bus->page_masks[page];
+
+  const BusRegister *reg = find_register(bus, addr);
+  if (reg) {
+    if (reg->write) {
+      reg->write(reg->obj, addr, val);
+    }
+    return;
+  }
+
   Component *c = bus->handlers[page];
-  if (c->write) {
+  if (bus->bank_pages[page] && c->write == generic_write) {
+    bus->bank_pages[page][addr % NUMBER_OF_PAGES] = val;
+  } else if (c->write) {
     c->write(bus->handlers[page], addr, val);
   }
 }
+
+// The number of bytes from addr to the end of its page, capped at len.
+static inline size_t page_chunk(uint16_t addr, size_t len) {
+  const size_t left = NUMBER_OF_PAGES - addr % NUMBER_OF_PAGES;
+  return len < left ? len : left;
+}
+
+static inline void invalidate_written(Bus *bus, uint16_t addr) {
+  const size_t code = code_page(bus, addr);
+  if (UNLIKELY(bus->code_pages[code])) {
+    invalidate_page(bus, code);
+  }
+}
+
+uint32_t bus_read_block(Bus *bus, uint16_t addr, uint8_t *dst, size_t len) {
+  for (size_t done = 0; done < len;) {
+    const size_t chunk = page_chunk(addr, len - done);
+    const uint8_t *page = bus->read_pages[PAGE(addr)];
+    if (page) {
+      memcpy(dst + done, page + addr % NUMBER_OF_PAGES, chunk);
+    } else {
+      for (size_t i = 0; i < chunk; i++) {
+        dst[done + i] = handler_read(bus, (uint16_t)(addr + i));
+      }
+    }
+
+    done += chunk;
+    addr = (uint16_t)(addr + chunk);
+  }
+
+  return (uint32_t)len;
+}
+
+uint32_t bus_write_block(Bus *bus, uint16_t addr, const uint8_t *src, size_t len) {
+  for (size_t done = 0; done < len;) {
+    const size_t chunk = page_chunk(addr, len - done);
+    uint8_t *page = bus->write_pages[PAGE(addr)];
+    if (page) {
+      memcpy(page + addr % NUMBER_OF_PAGES, src + done, chunk);
+      invalidate_written(bus, addr);
+    } else {
+      for (size_t i = 0; i < chunk; i++) {
+        write(bus, (uint16_t)(addr + i), src[done + i]);
+      }
+    }
+
+    done += chunk;
+    addr = (uint16_t)(addr + chunk);
+  }
+
+  return (uint32_t)len;
+}
+
+uint32_t bus_dma(Bus *bus, uint16_t src, uint16_t dst, size_t len) {
+  for (size_t done = 0; done < len;) {
+    const size_t src_chunk = page_chunk(src, len - done);
+    const size_t chunk = page_chunk(dst, src_chunk);
+    const uint8_t *from = bus->read_pages[PAGE(src)];
+    uint8_t *to = bus->write_pages[PAGE(dst)];
+    if (from && to) {
+      from += src % NUMBER_OF_PAGES;
+      to += dst % NUMBER_OF_PAGES;
+    }
+
+    // A forward overlap would read bytes that this copy has already written.
+    if (from && to && (to <= from || to >= from + chunk)) {
+      memmove(to, from, chunk);
+      invalidate_written(bus, dst);
+    } else {
+      for (size_t i = 0; i < chunk; i++) {
+        write(bus, (uint16_t)(dst + i), read(bus, (uint16_t)(src + i)));
+      }
+    }
+
+    done += chunk;
+    src = (uint16_t)(src + chunk);
+    dst = (uint16_t)(dst + chunk);
+  }
+
+  return (uint32_t)(2 * len);
+}
@@ -0,0 +1,654 @@
+#include "b6502/jit.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "b6502/bus.h"
+#include "b6502/rc.h"
+
+/// Native code keeps the CPU pointer in rbx, the bus in r12, and the bus' invalidation counter
+/// from block entry in r13. All three are callee-saved, so they survive calls into the bus and
+/// into interpreter handlers.
+
+// The largest block that can be emitted, with plenty of headroom.
+#define MAX_BLOCK_CODE (size_t)(4096)
+
+#define OFFSET(field) (uint8_t)(offsetof(Mos6502, field))
+
+_Static_assert(offsetof(Mos6502, current_mode) < 128, "registers must be reachable with a disp8");
+
+struct Jit {
+  uint8_t* code;
+  size_t used;
+  uint32_t generation;
+  uint64_t compiled;
+};
+
+// The Z and N flags for each value. Every cache shares the table, so it is filled once.
+static uint8_t zn_flags[256];
+static pthread_once_t zn_flags_once = PTHREAD_ONCE_INIT;
+
+static void fill_zn_flags(void) {
+  for (size_t i = 0; i < 256; i++) {
+    zn_flags[i] = (uint8_t)((i == 0 ? Z : 0) | (i & N));
+  }
+}
+
+/////////////////////////////////////////////////
+///     Emitter
+/////////////////////////////////////////////////
+
+typedef struct Emitter {
+  uint8_t* p;
+} Emitter;
+
+static inline void emit8(Emitter* e, uint8_t b) { *e->p++ = b; }
+
+static inline void emit16(Emitter* e, uint16_t v) {
+  emit8(e, (uint8_t)v);
+  emit8(e, (uint8_t)(v >> 8));
+}
+
+static inline void emit32(Emitter* e, uint32_t v) {
+  emit16(e, (uint16_t)v);
+  emit16(e, (uint16_t)(v >> 16));
+}
+
+static inline void emit64(Emitter* e, uint64_t v) {
+  emit32(e, (uint32_t)v);
+  emit32(e, (uint32_t)(v >> 32));
+}
+
+static inline void emit_bytes(Emitter* e, const uint8_t* bytes, size_t n) {
+  memcpy(e->p, bytes, n);
+  e->p += n;
+}
+
+// Forward jumps are emitted with a placeholder and patched once the target is known.
+static inline uint8_t* emit_jcc8(Emitter* e, uint8_t opcode) {
+  emit8(e, opcode);
+  emit8(e, 0);
+  return e->p - 1;
+}
+
+static inline void patch8(Emitter* e, uint8_t* at) { *at = (uint8_t)(e->p - (at + 1)); }
+
+static void emit_prologue(Emitter* e) {
+  static const uint8_t prologue[] = {
+      0x53,              // push rbx
+      0x41, 0x54,        // push r12
+      0x41, 0x55,        // push r13
+      0x48, 0x89, 0xFB,  // mov rbx, rdi
+  };
+  emit_bytes(e, prologue, sizeof(prologue));
+
+  // mov r12, [rbx + bus]
+  emit8(e, 0x4C);
+  emit8(e, 0x8B);
+  emit8(e, 0x63);
+  emit8(e, OFFSET(bus));
+
+  // mov r13, [r12 + code_invalidations]
+  emit8(e, 0x4D);
+  emit8(e, 0x8B);
+  emit8(e, 0xAC);
+  emit8(e, 0x24);
+  emit32(e, (uint32_t)offsetof(Bus, code_invalidations));
+}
+
+static void emit_return(Emitter* e, uint32_t executed) {
+  static const uint8_t epilogue[] = {
+      0x41, 0x5D,  // pop r13
+      0x41, 0x5C,  // pop r12
+      0x5B,        // pop rbx
+      0xC3,        // ret
+  };
+
+  // mov eax, executed
+  emit8(e, 0xB8);
+  emit32(e, executed);
+  emit_bytes(e, epilogue, sizeof(epilogue));
+}
+
+static inline void emit_rbx_disp8(Emitter* e, uint8_t opcode, uint8_t modrm, uint8_t disp) {
+  emit8(e, opcode);
+  emit8(e, modrm);
+  emit8(e, disp);
+}
+
+// add qword [rbx + cycles], n
+static inline void emit_add_cycles(Emitter* e, uint8_t n) {
+  emit8(e, 0x48);
+  emit_rbx_disp8(e, 0x83, 0x43, OFFSET(cycles));
+  emit8(e, n);
+}
+
+// mov word [rbx + pc], pc
+static inline void emit_set_pc(Emitter* e, uint16_t pc) {
+  emit8(e, 0x66);
+  emit_rbx_disp8(e, 0xC7, 0x43, OFFSET(pc));
+  emit16(e, pc);
+}
+
+// mov byte [rbx + reg], imm
+static inline void emit_set_reg(Emitter* e, uint8_t reg, uint8_t imm) {
+  emit_rbx_disp8(e, 0xC6, 0x43, reg);
+  emit8(e, imm);
+}
+
+// movzx eax, byte [rbx + reg]
+static inline void emit_load_reg(Emitter* e, uint8_t reg) {
+  emit8(e, 0x0F);
+  emit_rbx_disp8(e, 0xB6, 0x43, reg);
+}
+
+// mov byte [rbx + reg], al
+static inline void emit_store_reg(Emitter* e, uint8_t reg) { emit_rbx_disp8(e, 0x88, 0x43, reg); }
+
+// and byte [rbx + sr], mask
+static inline void emit_and_sr(Emitter* e, uint8_t mask) {
+  emit_rbx_disp8(e, 0x80, 0x63, OFFSET(sr));
+  emit8(e, mask);
+}
+
+// or byte [rbx + sr], mask
+static inline void emit_or_sr(Emitter* e, uint8_t mask) {
+  emit_rbx_disp8(e, 0x80, 0x4B, OFFSET(sr));
+  emit8(e, mask);
+}
+
+static inline void emit_call(Emitter* e, uint64_t target) {
+  // mov rax, target; call rax
+  emit8(e, 0x48);
+  emit8(e, 0xB8);
+  emit64(e, target);
+  emit8(e, 0xFF);
+  emit8(e, 0xD0);
+}
+
+// Set N and Z from al.
+static void emit_zn(Emitter* e) {
+#ifdef B6502_LAZY_FLAGS
+  emit_store_reg(e, OFFSET(flag_n));
+  emit_store_reg(e, OFFSET(flag_z));
+#else
+  static const uint8_t lookup[] = {
+      0x0F, 0xB6, 0xC0,  // movzx eax, al
+  };
+  emit_bytes(e, lookup, sizeof(lookup));
+
+  // mov rdx, zn_flags; movzx edx, byte [rdx + rax]
+  emit8(e, 0x48);
+  emit8(e, 0xBA);
+  emit64(e, (uint64_t)(uintptr_t)zn_flags);
+  emit8(e, 0x0F);
+  emit8(e, 0xB6);
+  emit8(e, 0x14);
+  emit8(e, 0x02);
+
+  emit_and_sr(e, (uint8_t)~(N | Z));
+  // or byte [rbx + sr], dl
+  emit_rbx_disp8(e, 0x08, 0x53, OFFSET(sr));
+#endif
+}
+
+// Set C from cl.
+static void emit_carry(Emitter* e) {
+#ifdef B6502_LAZY_FLAGS
+  emit_rbx_disp8(e, 0x88, 0x4B, OFFSET(flag_c));  // mov byte [rbx + flag_c], cl
+#else
+  emit_and_sr(e, (uint8_t)~C);
+  emit_rbx_disp8(e, 0x08, 0x4B, OFFSET(sr));  // or byte [rbx + sr], cl
+#endif
+}
+
+// Set or clear C or V.
+static void emit_set_flag(Emitter* e, Flags f, bool v) {
+#ifdef B6502_LAZY_FLAGS
+  if (f == C) {
+    emit_set_reg(e, OFFSET(flag_c), v);
+    return;
+  } else if (f == V) {
+    emit_set_reg(e, OFFSET(flag_v), v ? 0x80 : 0x00);
+    return;
+  }
+#endif
+  if (v) {
+    emit_or_sr(e, (uint8_t)f);
+  } else {
+    emit_and_sr(e, (uint8_t)~f);
+  }
+}
+
+// Leave the block if a write invalidated any cached code, since the rest of it may be stale.
+static void emit_invalidation_check(Emitter* e, bool set_pc, uint16_t next_pc, uint32_t executed) {
+  // cmp r13, [r12 + code_invalidations]
+  emit8(e, 0x4D);
+  emit8(e, 0x3B);
+  emit8(e, 0xAC);
+  emit8(e, 0x24);
+  emit32(e, (uint32_t)offsetof(Bus, code_invalidations));
+
+  uint8_t* skip = emit_jcc8(e, 0x74);  // je
+  if (set_pc) {
+    emit_set_pc(e, next_pc);
+  }
+  emit_return(e, executed);
+  patch8(e, skip);
+}
+
+// The direct page pointer is looked up when the read runs, since pages may be remapped after the
+// block is translated.
+static void emit_read(Emitter* e, uint16_t addr) {
+  // mov rax, [r12 + read_pages + page * 8]
+  emit8(e, 0x49);
+  emit8(e, 0x8B);
+  emit8(e, 0x84);
+  emit8(e, 0x24);
+  emit32(e, (uint32_t)(offsetof(Bus, read_pages) + (addr / NUMBER_OF_PAGES) * sizeof(uint8_t*)));
+
+  static const uint8_t test[] = {
+      0x48, 0x85, 0xC0,  // test rax, rax
+  };
+  emit_bytes(e, test, sizeof(test));
+  uint8_t* slow = emit_jcc8(e, 0x74);  // jz
+
+  // movzx eax, byte [rax + offset]
+  emit8(e, 0x0F);
+  emit8(e, 0xB6);
+  emit8(e, 0x80);
+  emit32(e, addr % NUMBER_OF_PAGES);
+  uint8_t* done = emit_jcc8(e, 0xEB);  // jmp
+
+  static const uint8_t bus_arg[] = {
+      0x4C, 0x89, 0xE7,  // mov rdi, r12
+  };
+  patch8(e, slow);
+  emit_bytes(e, bus_arg, sizeof(bus_arg));
+  emit8(e, 0xBE);  // mov esi, addr
+  emit32(e, addr);
+  emit_call(e, (uint64_t)(uintptr_t)&handler_read);
+  patch8(e, done);
+}
+
+static void emit_write(Emitter* e, uint16_t addr, uint8_t reg) {
+  static const uint8_t bus_arg[] = {
+      0x4C, 0x89, 0xE7,  // mov rdi, r12
+  };
+  emit_bytes(e, bus_arg, sizeof(bus_arg));
+  emit8(e, 0xBE);  // mov esi, addr
+  emit32(e, addr);
+  emit8(e, 0x0F);  // movzx edx, byte [rbx + reg]
+  emit_rbx_disp8(e, 0xB6, 0x53, reg);
+  emit_call(e, (uint64_t)(uintptr_t)&write);
+}
+
+static void emit_fallback(Emitter* e, const DecodedInstruction* insn) {
+  static const uint8_t cpu_arg[] = {
+      0x48, 0x89, 0xDF,  // mov rdi, rbx
+  };
+  emit_bytes(e, cpu_arg, sizeof(cpu_arg));
+  emit8(e, 0xBE);  // mov esi, operand
+  emit32(e, insn->operand);
+  emit_call(e, (uint64_t)(uintptr_t)insn->handler);
+}
+
+/////////////////////////////////////////////////
+///     Translation
+/////////////////////////////////////////////////
+
+// Loads, transfers and increments: the result ends up in al and sets N and Z.
+static bool emit_register_op(Emitter* e, const DecodedInstruction* insn) {
+  const uint8_t zp = (uint8_t)insn->operand;
+  switch (insn->opcode) {
+    case 0xA9:  // LDA #
+    case 0xA2:  // LDX #
+    case 0xA0: {  // LDY #
+      uint8_t reg = insn->opcode == 0xA9 ? OFFSET(a) : insn->opcode == 0xA2 ? OFFSET(x) : OFFSET(y);
+      emit_set_reg(e, reg, (uint8_t)insn->operand);
+#ifdef B6502_LAZY_FLAGS
+      emit_set_reg(e, OFFSET(flag_n), (uint8_t)insn->operand);
+      emit_set_reg(e, OFFSET(flag_z), (uint8_t)insn->operand);
+#else
+      emit_and_sr(e, (uint8_t)~(N | Z));
+      if (zn_flags[(uint8_t)insn->operand]) {
+        emit_or_sr(e, zn_flags[(uint8_t)insn->operand]);
+      }
+#endif
+      return true;
+    }
+    case 0xA5:  // LDA zp
+      emit_read(e, zp);
+      emit_store_reg(e, OFFSET(a));
+      break;
+    case 0xA6:  // LDX zp
+      emit_read(e, zp);
+      emit_store_reg(e, OFFSET(x));
+      break;
+    case 0xA4:  // LDY zp
+      emit_read(e, zp);
+      emit_store_reg(e, OFFSET(y));
+      break;
+    case 0xAD:  // LDA abs
+      emit_read(e, insn->operand);
+      emit_store_reg(e, OFFSET(a));
+      break;
+    case 0xAE:  // LDX abs
+      emit_read(e, insn->operand);
+      emit_store_reg(e, OFFSET(x));
+      break;
+    case 0xAC:  // LDY abs
+      emit_read(e, insn->operand);
+      emit_store_reg(e, OFFSET(y));
+      break;
+    case 0xAA:  // TAX
+      emit_load_reg(e, OFFSET(a));
+      emit_store_reg(e, OFFSET(x));
+      break;
+    case 0xA8:  // TAY
+      emit_load_reg(e, OFFSET(a));
+      emit_store_reg(e, OFFSET(y));
+      break;
+    case 0x8A:  // TXA
+      emit_load_reg(e, OFFSET(x));
+      emit_store_reg(e, OFFSET(a));
+      break;
+    case 0x98:  // TYA
+      emit_load_reg(e, OFFSET(y));
+      emit_store_reg(e, OFFSET(a));
+      break;
+    case 0xBA:  // TSX
+      emit_load_reg(e, OFFSET(sp));
+      emit_store_reg(e, OFFSET(x));
+      break;
+    case 0x9A:  // TXS
+      emit_load_reg(e, OFFSET(x));
+      emit_store_reg(e, OFFSET(sp));
+      return true;
+    case 0xE8:  // INX
+    case 0xCA:  // DEX
+      emit_load_reg(e, OFFSET(x));
+      emit8(e, 0xFE);
+      emit8(e, insn->opcode == 0xE8 ? 0xC0 : 0xC8);  // inc al / dec al
+      emit_store_reg(e, OFFSET(x));
+      break;
+    case 0xC8:  // INY
+    case 0x88:  // DEY
+      emit_load_reg(e, OFFSET(y));
+      emit8(e, 0xFE);
+      emit8(e, insn->opcode == 0xC8 ? 0xC0 : 0xC8);
+      emit_store_reg(e, OFFSET(y));
+      break;
+    case 0x29:  // AND #
+    case 0x09:  // ORA #
+    case 0x49:  // EOR #
+      emit_load_reg(e, OFFSET(a));
+      emit8(e, insn->opcode == 0x29 ? 0x24 : insn->opcode == 0x09 ? 0x0C : 0x34);
+      emit8(e, (uint8_t)insn->operand);
+      emit_store_reg(e, OFFSET(a));
+      break;
+    default:
+      return false;
+  }
+
+  emit_zn(e);
+  return true;
+}
+
+static bool emit_compare(Emitter* e, const DecodedInstruction* insn) {
+  switch (insn->opcode) {
+    case 0xC9:  // CMP #
+      emit_load_reg(e, OFFSET(a));
+      break;
+    case 0xE0:  // CPX #
+      emit_load_reg(e, OFFSET(x));
+      break;
+    case 0xC0:  // CPY #
+      emit_load_reg(e, OFFSET(y));
+      break;
+    default:
+      return false;
+  }
+
+  static const uint8_t carry[] = {
+      0x0F, 0x93, 0xC1,  // setae cl
+  };
+  emit8(e, 0x3C);  // cmp al, imm
+  emit8(e, (uint8_t)insn->operand);
+  emit_bytes(e, carry, sizeof(carry));
+  emit8(e, 0x2C);  // sub al, imm
+  emit8(e, (uint8_t)insn->operand);
+  emit_zn(e);
+  emit_carry(e);
+  return true;
+}
+
+static bool emit_flag_op(Emitter* e, const DecodedInstruction* insn) {
+  switch (insn->opcode) {
+    case 0x18:  // CLC
+      emit_set_flag(e, C, false);
+      return true;
+    case 0x38:  // SEC
+      emit_set_flag(e, C, true);
+      return true;
+    case 0x58:  // CLI
+      emit_set_flag(e, I, false);
+      return true;
+    case 0x78:  // SEI
+      emit_set_flag(e, I, true);
+      return true;
+    case 0xB8:  // CLV
+      emit_set_flag(e, V, false);
+      return true;
+    case 0xD8:  // CLD
+      emit_set_flag(e, D, false);
+      return true;
+    case 0xF8:  // SED
+      emit_set_flag(e, D, true);
+      return true;
+    case 0xEA:  // NOP
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool emit_store(Emitter* e, const DecodedInstruction* insn, uint32_t executed) {
+  uint16_t addr = insn->operand;
+  uint8_t reg;
+  switch (insn->opcode) {
+    case 0x85:  // STA zp
+      addr = (uint8_t)addr;
+      reg = OFFSET(a);
+      break;
+    case 0x86:  // STX zp
+      addr = (uint8_t)addr;
+      reg = OFFSET(x);
+      break;
+    case 0x84:  // STY zp
+      addr = (uint8_t)addr;
+      reg = OFFSET(y);
+      break;
+    case 0x8D:  // STA abs
+      reg = OFFSET(a);
+      break;
+    case 0x8E:  // STX abs
+      reg = OFFSET(x);
+      break;
+    case 0x8C:  // STY abs
+      reg = OFFSET(y);
+      break;
+    default:
+      return false;
+  }
+
+  emit_write(e, addr, reg);
+  emit_invalidation_check(e, true, (uint16_t)(insn->pc + insn->length), executed);
+  return true;
+}
+
+// Branches and JMP only ever end a block, and their targets are known at translation time.
+static bool emit_control_flow(Emitter* e, const DecodedInstruction* insn, uint32_t executed) {
+  const uint16_t next = (uint16_t)(insn->pc + insn->length);
+  if (insn->opcode == 0x4C) {  // JMP abs
+    emit_set_pc(e, insn->operand);
+    emit_return(e, executed);
+    return true;
+  }
+
+  // Every branch is xxy10000: xx selects the flag and y whether it is taken on set or clear.
+  if ((insn->opcode & 0x1F) != 0x10) {
+    return false;
+  }
+
+  uint8_t field = OFFSET(sr);
+  uint8_t mask;
+  bool set_when_zero = false;
+  switch (insn->opcode & 0xC0) {
+    case 0x00:
+      mask = N;
+      break;
+    case 0x40:
+      mask = V;
+      break;
+    case 0x80:
+      mask = C;
+      break;
+    default:
+      mask = Z;
+      break;
+  }
+
+#ifdef B6502_LAZY_FLAGS
+  switch (mask) {
+    case N:
+      field = OFFSET(flag_n);
+      mask = 0x80;
+      break;
+    case V:
+      field = OFFSET(flag_v);
+      mask = 0x80;
+      break;
+    case C:
+      field = OFFSET(flag_c);
+      mask = 0x01;
+      break;
+    default:
+      field = OFFSET(flag_z);
+      mask = 0xFF;
+      set_when_zero = true;
+      break;
+  }
+#endif
+
+  const bool if_set = (insn->opcode & 0x20) != 0;
+  const uint16_t target = (uint16_t)(next + (int8_t)insn->operand);
+  emit_rbx_disp8(e, 0xF6, 0x43, field);  // test byte [rbx + field], mask
+  emit8(e, mask);
+  uint8_t* taken = emit_jcc8(e, if_set != set_when_zero ? 0x75 : 0x74);
+  emit_set_pc(e, next);
+  emit_return(e, executed);
+  patch8(e, taken);
+  emit_add_cycles(e, (uint8_t)((next >> 8) != (target >> 8) ? 2 : 1));
+  emit_set_pc(e, target);
+  emit_return(e, executed);
+  return true;
+}
+
+static native_block translate(Jit* jit, const Block* block) {
+  if (jit->used + MAX_BLOCK_CODE > JIT_CODE_SIZE) {
+    // Out of room: drop every translation and start over.
+    jit->used = 0;
+    jit->generation += 1;
+  }
+
+  Emitter e = {jit->code + jit->used};
+  uint8_t* const start = e.p;
+  bool pc_synced = true;
+
+  emit_prologue(&e);
+  for (uint32_t i = 0; i < block->length; i++) {
+    const DecodedInstruction* insn = &block->instructions[i];
+    const bool last = i + 1 == block->length;
+
+    uint8_t* const rewind = e.p;
+    emit_add_cycles(&e, insn->cycles);
+    if (last && emit_control_flow(&e, insn, i + 1)) {
+      goto done;
+    }
+
+    if (emit_register_op(&e, insn) || emit_compare(&e, insn) || emit_flag_op(&e, insn)
+        || emit_store(&e, insn, i + 1)) {
+      pc_synced = false;
+      continue;
+    }
+
+    // Anything else goes through the interpreter handler, which adds its own cycles and updates
+    // the PC itself.
+    e.p = rewind;
+    if (!pc_synced) {
+      emit_set_pc(&e, insn->pc);
+    }
+    emit_fallback(&e, insn);
+    pc_synced = true;
+    if (last) {
+      emit_return(&e, i + 1);
+      goto done;
+    }
+    emit_invalidation_check(&e, false, 0, i + 1);
+  }
+
+  emit_set_pc(&e, (uint16_t)(block->start + block->size));
+  emit_return(&e, block->length);
+
+done:
+  jit->used += (size_t)(e.p - start);
+  jit->compiled += 1;
+
+  native_block native;
+  memcpy(&native, &start, sizeof(native));
+  return native;
+}
+
+/////////////////////////////////////////////////
+///     Public API
+/////////////////////////////////////////////////
+
+static void deinit(void* obj) {
+  Jit* jit = obj;
+  munmap(jit->code, JIT_CODE_SIZE);
+}
+
+Jit* jit_create(void) {
+  void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    LOG_ERROR("Unable to map the JIT code cache: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  pthread_once(&zn_flags_once, fill_zn_flags);
+
+  Jit* jit = rc_alloc(sizeof(*jit), deinit);
+  jit->code = code;
+  jit->generation = 1;
+  return jit;
+}
+
+native_block jit_lookup(Jit* jit, Block* block) {
+  if (block->native && block->native_generation == jit->generation) {
+    return block->native;
+  }
+
+  if (++block->executions < JIT_THRESHOLD) {
+    return NULL;
+  }
+
+  block->native = translate(jit, block);
+  block->native_generation = jit->generation;
+  return block->native;
+}
+
+uint64_t jit_compiled(const Jit* jit) { return jit->compiled; }
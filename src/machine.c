@@ -0,0 +1,164 @@
+#include "b6502/machine.h"
+
+#include "b6502/block_cache.h"
+#include "b6502/bus.h"
+#include "b6502/rc.h"
+#include "b6502/scheduler.h"
+
+static void machine_deinit(void* obj) {
+  Machine* machine = obj;
+  rc_strong_release((void*)&machine->cpu);
+  rc_strong_release((void*)&machine->ram);
+  if (machine->rom) {
+    rc_strong_release((void*)&machine->rom);
+  }
+  rc_strong_release((void*)&machine->rm);
+}
+
+static size_t machine_footprint(const MachineConfig* config) {
+  size_t size = rc_arena_footprint(sizeof(Machine)) + rc_arena_footprint(sizeof(ResetManager))
+                + rc_arena_footprint(sizeof(Mos6502)) + rc_arena_footprint(sizeof(Bus))
+                + rc_arena_footprint(sizeof(Scheduler)) + rc_arena_footprint(sizeof(Memory))
+                + rc_arena_footprint(config->ram_size);
+  if (config->rom_size) {
+    size += rc_arena_footprint(sizeof(Memory)) + rc_arena_footprint(config->rom_size);
+  }
+  return size;
+}
+
+Machine* machine_create(const MachineConfig* config) {
+  RcArena* arena = rc_arena_create(machine_footprint(config), config->huge_pages);
+  if (!arena) {
+    LOG_ERROR("Out of memory\n");
+    return NULL;
+  }
+
+  // The allocations are laid out in this order, the hottest ones next to each other.
+  rc_arena_enter(arena);
+  Machine* machine = rc_alloc(sizeof(*machine), machine_deinit);
+  machine->arena = arena;
+  machine->rm = reset_manager_create();
+  machine->cpu = mos6502_create(machine->rm, config->variant);
+  machine->ram = memory_generic_create(machine->rm, config->ram_size);
+  if (config->rom_size) {
+    machine->rom = rom_create(config->rom_size, generic_read);
+  }
+  rc_arena_enter(NULL);
+  rc_arena_release(&arena);
+
+  Bus* bus = machine->cpu->bus;
+  map_mirrored(bus, machine->ram, 0x0000, config->ram_end, (uint16_t)(config->ram_size - 1));
+  if (machine->rom) {
+    map_mirrored(bus, machine->rom, config->rom_start, 0xFFFF, (uint16_t)(config->rom_size - 1));
+  }
+  return machine;
+}
+
+/////////////////////////////////////////////////
+///     Cloning
+/////////////////////////////////////////////////
+
+typedef struct Relocation {
+  const RcArena* from;
+  ptrdiff_t offset;
+} Relocation;
+
+// Move a pointer into the original arena to the same place in the copy.
+static void* moved(const Relocation* r, void* ptr) {
+  return ptr && rc_arena_contains(r->from, ptr) ? (uint8_t*)ptr + r->offset : ptr;
+}
+
+// Objects outside the arena are shared by the copy, which needs references of its own to them.
+static void* weak_reference(const Relocation* r, void* obj) {
+  if (obj && !rc_arena_contains(r->from, obj)) {
+    return rc_weak_retain(obj);
+  }
+  return moved(r, obj);
+}
+
+static void relocate_bus(const Relocation* r, Bus* bus) {
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    bus->handlers[page] = weak_reference(r, bus->handlers[page]);
+    bus->read_pages[page] = moved(r, bus->read_pages[page]);
+    bus->write_pages[page] = moved(r, bus->write_pages[page]);
+    bus->bank_pages[page] = moved(r, bus->bank_pages[page]);
+
+    // Register tables are written by map_register(), so the copy gets tables of its own.
+    const uint8_t* table = bus->register_pages[page];
+    if (table && !rc_arena_contains(r->from, table)) {
+      bus->register_pages[page] = rc_alloc(NUMBER_OF_PAGES, NULL);
+      memcpy(bus->register_pages[page], table, NUMBER_OF_PAGES);
+    } else {
+      bus->register_pages[page] = moved(r, bus->register_pages[page]);
+    }
+  }
+
+  for (size_t i = 1; i < bus->register_count; i++) {
+    bus->registers[i].obj = weak_reference(r, bus->registers[i].obj);
+  }
+  for (size_t i = 0; i < bus->window_count; i++) {
+    bus->windows[i].obj = weak_reference(r, bus->windows[i].obj);
+  }
+  bus->clock = moved(r, bus->clock);
+}
+
+static void relocate_cpu(const Relocation* r, Mos6502* cpu) {
+  cpu->bus = moved(r, cpu->bus);
+  cpu->scheduler = moved(r, cpu->scheduler);
+  cpu->blocks = NULL;
+  cpu->aot = NULL;
+  cpu->profiler = NULL;
+  cpu->tracer = NULL;
+
+  relocate_bus(r, cpu->bus);
+  for (size_t i = 0; i < cpu->scheduler->num_events; i++) {
+    cpu->scheduler->events[i].obj = weak_reference(r, cpu->scheduler->events[i].obj);
+  }
+}
+
+// The copy gets the original's reference counts, which are only right if nothing outside holds on
+// to the machine's components.
+static bool only_held_by_machine(const Machine* machine) {
+  return rc_strong_count((void*)machine) == 1 && rc_strong_count(machine->rm) == 1
+         && rc_strong_count(machine->cpu) == 1 && rc_strong_count(machine->cpu->bus) == 1
+         && rc_strong_count(machine->cpu->scheduler) == 1 && rc_strong_count(machine->ram) == 1
+         && (!machine->rom || rc_strong_count(machine->rom) == 1);
+}
+
+Machine* machine_clone(const Machine* machine) {
+  if (!only_held_by_machine(machine)) {
+    LOG_ERROR("Unable to clone a machine whose components are held elsewhere\n");
+    return NULL;
+  }
+
+  Relocation r = {machine->arena, 0};
+  RcArena* arena = rc_arena_clone(machine->arena, &r.offset);
+  if (!arena) {
+    LOG_ERROR("Out of memory\n");
+    return NULL;
+  }
+
+  Machine* clone = moved(&r, (void*)machine);
+  clone->arena = arena;
+  clone->rm = moved(&r, clone->rm);
+  clone->cpu = moved(&r, clone->cpu);
+  clone->ram = moved(&r, clone->ram);
+  clone->rom = moved(&r, clone->rom);
+  clone->ram->bytes = moved(&r, clone->ram->bytes);
+  if (clone->rom) {
+    clone->rom->bytes = moved(&r, clone->rom->bytes);
+  }
+  for (size_t i = 0; i < clone->rm->num_devices; i++) {
+    clone->rm->devices[i].obj = weak_reference(&r, clone->rm->devices[i].obj);
+  }
+  relocate_cpu(&r, clone->cpu);
+
+  const BlockCache* blocks = machine->cpu->blocks;
+  if (blocks) {
+    set_block_cache(clone->cpu, true);
+    if (blocks->jit) {
+      set_jit(clone->cpu, true);
+    }
+  }
+  return clone;
+}
@@ -1,28 +1,170 @@
+#define _GNU_SOURCE
+
 #include "b6502/memory.h"
 
-#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "b6502/rc.h"
 #include "b6502/reset_manager.h"
 
+#define MAX_ROM_IMAGES (size_t)16
+
+/**
+ * @brief A ROM file mapped into memory, identified by its inode and modification time.
+ */
+typedef struct RomImage {
+  uint8_t* bytes;
+  size_t size;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+} RomImage;
+
+// Weak references to the mapped images, so that mapping a file again shares its mapping. The
+// images are shared between threads, and the table is only touched with the lock held.
+static RomImage* rom_images[MAX_ROM_IMAGES];
+static pthread_mutex_t rom_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief The views of the physical pages behind mirrored RAM.
+ */
+typedef struct RamViews {
+  uint8_t* bytes;
+  size_t span;
+} RamViews;
+
 static void deinit(void* obj) {
   Memory* mem = obj;
-  rc_strong_release((void*)&mem->bytes);
+  if (mem->owner) {
+    rc_strong_release((void*)&mem->owner);
+  } else {
+    rc_strong_release((void*)&mem->bytes);
+  }
 }
 
 Memory* rom_create(size_t size, read_handler read) {
   Memory* mem = rc_alloc(sizeof(*mem), deinit);
-  mem->bytes = calloc(size, sizeof(*mem->bytes));
+  mem->bytes = rc_alloc(size * sizeof(*mem->bytes), NULL);
+  mem->size = size;
   mem->read = read;
   mem->write = NULL;
   return mem;
 }
 
+static void rom_image_deinit(void* obj) {
+  RomImage* image = obj;
+  munmap(image->bytes, image->size);
+}
+
+static bool same_file(const RomImage* image, const struct stat* st) {
+  return image->dev == st->st_dev && image->ino == st->st_ino
+         && image->size == (size_t)st->st_size && image->mtime.tv_sec == st->st_mtim.tv_sec
+         && image->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Take a strong reference to the image in a slot. The slot is emptied if the image is gone, or
+// is being destroyed by another thread.
+static RomImage* upgrade_rom_image(size_t i) {
+  RomImage* weak = rom_images[i];
+  rom_images[i] = NULL;
+  RomImage* image = rc_upgrade((void*)&weak);
+  if (image) {
+    rom_images[i] = rc_weak_retain(image);
+  }
+  return image;
+}
+
+// Find a live mapping of a file, dropping the references to images that are gone on the way.
+static RomImage* find_rom_image(const struct stat* st) {
+  for (size_t i = 0; i < MAX_ROM_IMAGES; i++) {
+    RomImage* image = rom_images[i] ? upgrade_rom_image(i) : NULL;
+    if (image && same_file(image, st)) {
+      return image;
+    }
+    if (image) {
+      rc_strong_release((void*)&image);
+    }
+  }
+  return NULL;
+}
+
+static void register_rom_image(RomImage* image, const char* path) {
+  for (size_t i = 0; i < MAX_ROM_IMAGES; i++) {
+    if (!rom_images[i]) {
+      rom_images[i] = rc_weak_retain(image);
+      return;
+    }
+  }
+
+  // The image still works, it just isn't shared with later mappings of the file.
+  LOG_ERROR("More than %zu ROM images are mapped, %s won't be shared\n", MAX_ROM_IMAGES, path);
+}
+
+static RomImage* map_rom_image(int fd, const struct stat* st, bool populate) {
+  const size_t size = (size_t)st->st_size;
+  const int flags = MAP_PRIVATE | (populate ? MAP_POPULATE : 0);
+  void* bytes = mmap(NULL, size, PROT_READ, flags, fd, 0);
+  if (bytes == MAP_FAILED) {
+    return NULL;
+  }
+  if (populate) {
+    madvise(bytes, size, MADV_WILLNEED);
+  }
+
+  RomImage* image = rc_alloc_shared(sizeof(*image), rom_image_deinit);
+  image->bytes = bytes;
+  image->size = size;
+  image->dev = st->st_dev;
+  image->ino = st->st_ino;
+  image->mtime = st->st_mtim;
+  return image;
+}
+
+Memory* rom_map(const char* path, bool populate) {
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    LOG_ERROR("Error opening file: %s\n", strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  // The lock is held while mapping, so that two threads mapping the same file share one mapping.
+  pthread_mutex_lock(&rom_images_lock);
+  RomImage* image = find_rom_image(&st);
+  if (!image && st.st_size > 0) {
+    image = map_rom_image(fd, &st, populate);
+    if (image) {
+      register_rom_image(image, path);
+    }
+  }
+  pthread_mutex_unlock(&rom_images_lock);
+  close(fd);
+  if (!image) {
+    LOG_ERROR("Unable to map %s\n", path);
+    return NULL;
+  }
+
+  Memory* mem = rc_alloc(sizeof(*mem), deinit);
+  mem->bytes = image->bytes;
+  mem->size = image->size;
+  mem->owner = image;
+  mem->read = generic_read;
+  mem->write = NULL;
+  return mem;
+}
+
 Memory* ram_create(ResetManager* rm, size_t size, read_handler read, write_handler write,
                    reset_handler reset) {
   Memory* mem = rc_alloc(sizeof(*mem), deinit);
-  mem->bytes = calloc(size, sizeof(*mem->bytes));
+  mem->bytes = rc_alloc(size * sizeof(*mem->bytes), NULL);
   mem->size = size;
   mem->read = read;
   mem->write = write;
@@ -31,6 +173,67 @@ Memory* ram_create(ResetManager* rm, size_t size, read_handler read, write_handl
   return mem;
 }
 
+static void ram_views_deinit(void* obj) {
+  RamViews* views = obj;
+  munmap(views->bytes, views->span);
+}
+
+// Reserve span bytes of address space, then map the same size bytes of a memfd over each part.
+static uint8_t* map_ram_views(size_t size, size_t span) {
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size <= 0 || !size || size % (size_t)page_size || span % size) {
+    return NULL;
+  }
+
+  const int fd = memfd_create("b6502-ram", MFD_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  uint8_t* bytes = NULL;
+  void* reserved = MAP_FAILED;
+  if (ftruncate(fd, (off_t)size) == 0) {
+    reserved = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (reserved != MAP_FAILED) {
+    bytes = reserved;
+    for (size_t offset = 0; offset < span; offset += size) {
+      if (mmap(bytes + offset, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+          == MAP_FAILED) {
+        munmap(bytes, span);
+        bytes = NULL;
+        break;
+      }
+    }
+  }
+
+  // The views keep the memory alive without the descriptor.
+  close(fd);
+  return bytes;
+}
+
+Memory* ram_mirrored_create(ResetManager* rm, size_t size, size_t span) {
+  uint8_t* bytes = map_ram_views(size, span);
+  if (!bytes) {
+    return memory_generic_create(rm, size);
+  }
+
+  RamViews* views = rc_alloc(sizeof(*views), ram_views_deinit);
+  views->bytes = bytes;
+  views->span = span;
+
+  Memory* mem = rc_alloc(sizeof(*mem), deinit);
+  mem->bytes = bytes;
+  mem->size = span;
+  mem->owner = views;
+  mem->alias_size = size;
+  mem->read = generic_read;
+  mem->write = generic_write;
+  add_rm_device(rm, mem, generic_reset);
+
+  return mem;
+}
+
 Memory* memory_generic_create(ResetManager* rm, size_t size) {
   Memory* mem = rc_alloc(sizeof(*mem), deinit);
   mem->bytes = rc_alloc(size * sizeof(*mem->bytes), NULL);
@@ -42,19 +245,18 @@ Memory* memory_generic_create(ResetManager* rm, size_t size) {
   return mem;
 }
 
+// The bus only maps memory where every address it can pass is in bounds.
 uint8_t generic_read(void* obj, uint16_t addr) {
   Memory* mem = obj;
-  assert(addr < mem->size);
   return mem->bytes[addr];
 }
 
 void generic_write(void* obj, uint16_t addr, uint8_t val) {
   Memory* mem = obj;
-  assert(addr < mem->size);
   mem->bytes[addr] = val;
 }
 
 void generic_reset(void* obj) {
   Memory* mem = obj;
-  memset(mem->bytes, 0, mem->size);
+  memset(mem->bytes, 0, mem->alias_size ? mem->alias_size : mem->size);
 }
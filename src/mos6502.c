@@ -1,10 +1,23 @@
 #include "b6502/mos6502.h"
 
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "b6502/aot.h"
+#include "b6502/block_cache.h"
 #include "b6502/bus.h"
 #include "b6502/reset_manager.h"
+#include "b6502/trace.h"
+
+#ifdef B6502_JIT
+#  include "b6502/jit.h"
+#endif
+
+#ifdef B6502_PROFILER
+#  include "b6502/profiler.h"
+#endif
 
 /// Be warned, many explicit casts. GCC's -Wconversion is a picky son of a bitch.
 
@@ -26,6 +39,64 @@ static inline uint16_t buggy_read16(Bus* bus, uint16_t addr) {
              : read16(bus, addr);
 }
 
+#ifdef B6502_LAZY_FLAGS
+// N, Z, C and V live in their own bytes while instructions run, so setting one is a plain store
+// instead of a read-modify-write of sr. They are folded back into sr only when it is read.
+static inline void set_flag(Mos6502* cpu, Flags f, bool v) {
+  switch (f) {
+    case N:
+      cpu->flag_n = v ? 0x80 : 0x00;
+      break;
+    case Z:
+      cpu->flag_z = !v;
+      break;
+    case C:
+      cpu->flag_c = v;
+      break;
+    case V:
+      cpu->flag_v = v ? 0x80 : 0x00;
+      break;
+    default:
+      if (v) {
+        cpu->sr = (uint8_t)(cpu->sr | f);
+      } else {
+        cpu->sr = (uint8_t)(cpu->sr & ~f);
+      }
+      break;
+  }
+}
+
+static inline bool get_flag(Mos6502* cpu, Flags f) {
+  switch (f) {
+    case N:
+      return cpu->flag_n & 0x80;
+    case Z:
+      return !cpu->flag_z;
+    case C:
+      return cpu->flag_c;
+    case V:
+      return cpu->flag_v & 0x80;
+    default:
+      return (bool)(cpu->sr & f);
+  }
+}
+
+// V is bit 7 of src.
+static inline void set_overflow(Mos6502* cpu, uint8_t src) { cpu->flag_v = src; }
+
+static inline uint8_t get_sr(const Mos6502* cpu) {
+  return (uint8_t)((cpu->sr & ~(N | Z | C | V)) | (cpu->flag_n & N) | (cpu->flag_z ? 0 : Z)
+                   | (cpu->flag_c ? C : 0) | ((cpu->flag_v & 0x80) >> 1));
+}
+
+static inline void put_sr(Mos6502* cpu, uint8_t sr) {
+  cpu->sr = sr;
+  cpu->flag_n = sr;
+  cpu->flag_z = !(sr & Z);
+  cpu->flag_c = sr & C;
+  cpu->flag_v = (uint8_t)(sr << 1);
+}
+#else
 static inline void set_flag(Mos6502* cpu, Flags f, bool v) {
   if (v) {
     cpu->sr = (uint8_t)(cpu->sr | f);
@@ -36,6 +107,19 @@ static inline void set_flag(Mos6502* cpu, Flags f, bool v) {
 
 static inline bool get_flag(Mos6502* cpu, Flags f) { return (bool)(cpu->sr & f); }
 
+static inline void set_overflow(Mos6502* cpu, uint8_t src) { set_flag(cpu, V, src & 0x80); }
+
+static inline uint8_t get_sr(const Mos6502* cpu) { return cpu->sr; }
+
+static inline void put_sr(Mos6502* cpu, uint8_t sr) { cpu->sr = sr; }
+#endif
+
+// sr is the authoritative copy outside of step() and the batch engines; these move the flags in
+// and out of the lazy representation around them.
+static inline void load_flags(Mos6502* cpu) { put_sr(cpu, cpu->sr); }
+
+static inline void store_flags(Mos6502* cpu) { cpu->sr = get_sr(cpu); }
+
 static inline uint8_t pop8(Mos6502* cpu) { return read(cpu->bus, STACK(++cpu->sp)); }
 
 static inline uint16_t pop16(Mos6502* cpu) {
@@ -52,17 +136,21 @@ static inline void push16(Mos6502* cpu, uint16_t val) {
   write(cpu->bus, STACK(cpu->sp--), (uint8_t)val);
 }
 
-static INLINE void push_sr(Mos6502* cpu) { push8(cpu, (uint8_t)(cpu->sr | 0x30)); }
+static INLINE void push_sr(Mos6502* cpu) { push8(cpu, (uint8_t)(get_sr(cpu) | 0x30)); }
 
 static inline void zn(Mos6502* cpu, uint8_t val) {
+#ifdef B6502_LAZY_FLAGS
+  cpu->flag_n = cpu->flag_z = val;
+#else
   set_flag(cpu, Z, val == 0x00);
   set_flag(cpu, N, (val & 0x80) == 0x80);
+#endif
 }
 
 static void branch(Mos6502* cpu, bool condition) {
   if (condition) {
     cpu->cycles += 1;
-    int8_t offset = (int8_t)(read(cpu->bus, (uint16_t)(cpu->pc - 1)));
+    int8_t offset = (int8_t)(cpu->data);
     uint16_t new_pc = (uint16_t)(cpu->pc + offset);
     if (cross(cpu->pc, new_pc)) {
       cpu->cycles += 1;
@@ -86,7 +174,7 @@ static void interrupt(Mos6502* cpu, uint16_t vector) {
   if (read(cpu->bus, (uint16_t)(cpu->pc - 2)) == 0x00) {  // if BRK
     push_sr(cpu);
   } else {
-    push8(cpu, cpu->sr);
+    push8(cpu, get_sr(cpu));
   }
 
   cpu->pc = read16(cpu->bus, vector);
@@ -97,47 +185,58 @@ static void interrupt(Mos6502* cpu, uint16_t vector) {
 ///     Addressing Modes
 /////////////////////////////////////////////////
 
-static int absolute(Mos6502* cpu) {
-  cpu->addr = read16(cpu->bus, (uint16_t)(cpu->pc + 1));
+// The operand bytes are fetched by the caller (or come predecoded from the block cache), so a
+// mode handler only resolves the effective address and data.
+
+static inline uint16_t fetch_operand(Bus* bus, uint16_t pc, uint8_t length) {
+  switch (length) {
+    case 2:
+      return read(bus, (uint16_t)(pc + 1));
+    case 3:
+      return read16(bus, (uint16_t)(pc + 1));
+    default:
+      return 0;
+  }
+}
+
+static int absolute(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = operand;
   cpu->data = read(cpu->bus, cpu->addr);
   return 0;
 }
 
-static int absx(Mos6502* cpu) {
-  uint16_t orig_addr = read16(cpu->bus, (uint16_t)(cpu->pc + 1));
-  cpu->addr = (uint16_t)(cpu->x + orig_addr);
+static int absx(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = (uint16_t)(cpu->x + operand);
   cpu->data = read(cpu->bus, cpu->addr);
-  if (cross(orig_addr, cpu->addr)) {
+  if (cross(operand, cpu->addr)) {
     return 1;
   }
   return 0;
 }
 
-static int absy(Mos6502* cpu) {
-  uint16_t orig_addr = read16(cpu->bus, (uint16_t)(cpu->pc + 1));
-  cpu->addr = (uint16_t)(cpu->y + orig_addr);
+static int absy(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = (uint16_t)(cpu->y + operand);
   cpu->data = read(cpu->bus, cpu->addr);
-  if (cross(orig_addr, cpu->addr)) {
+  if (cross(operand, cpu->addr)) {
     return 1;
   }
   return 0;
 }
 
-static int acc(Mos6502* cpu) {
+static int acc(Mos6502* cpu, uint16_t UNUSED(operand)) {
   cpu->data = cpu->a;
   return 0;
 }
 
-static int imm(Mos6502* cpu) {
-  cpu->data = read(cpu->bus, (uint16_t)(cpu->pc + 1));
+static int imm(Mos6502* cpu, uint16_t operand) {
+  cpu->data = (uint8_t)operand;
   return 0;
 }
 
-static int impl(Mos6502* UNUSED(cpu)) { return 0; }
+static int impl(Mos6502* UNUSED(cpu), uint16_t UNUSED(operand)) { return 0; }
 
-static int indidx(Mos6502* cpu) {
-  uint8_t ptr = read(cpu->bus, (uint16_t)(cpu->pc + 1));
-  uint16_t ptr2 = read16(cpu->bus, ptr);
+static int indidx(Mos6502* cpu, uint16_t operand) {
+  uint16_t ptr2 = read16(cpu->bus, (uint8_t)operand);
   cpu->addr = (uint16_t)(cpu->y + ptr2);
   cpu->data = read(cpu->bus, cpu->addr);
   if (cross(cpu->addr, ptr2)) {
@@ -146,66 +245,101 @@ static int indidx(Mos6502* cpu) {
   return 0;
 }
 
-static int ind(Mos6502* cpu) {
-  cpu->addr = buggy_read16(cpu->bus, read16(cpu->bus, (uint16_t)(cpu->pc + 1)));
+static int ind(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = buggy_read16(cpu->bus, operand);
   return 0;
 }
 
-static int idxind(Mos6502* cpu) {
-  uint8_t ptr = cpu->x + read(cpu->bus, (uint16_t)(cpu->pc + 1));
+static int idxind(Mos6502* cpu, uint16_t operand) {
+  uint8_t ptr = (uint8_t)(cpu->x + operand);
   cpu->addr = read16(cpu->bus, (uint16_t)ptr);
   cpu->data = read(cpu->bus, cpu->addr);
   return 0;
 }
 
-static int rel(Mos6502* UNUSED(cpu)) { return 0; }
+// The branch offset is kept in data for branch().
+static int rel(Mos6502* cpu, uint16_t operand) {
+  cpu->data = (uint8_t)operand;
+  return 0;
+}
 
-static int zerop(Mos6502* cpu) {
-  cpu->addr = read(cpu->bus, cpu->pc + 1);
+static int zerop(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = (uint8_t)operand;
   cpu->data = read(cpu->bus, cpu->addr);
   return 0;
 }
 
-static int zeropx(Mos6502* cpu) {
-  uint8_t addr = (uint8_t)(cpu->x + read(cpu->bus, (uint16_t)(cpu->pc + 1)));
+static int zeropx(Mos6502* cpu, uint16_t operand) {
+  uint8_t addr = (uint8_t)(cpu->x + operand);
   cpu->addr = addr;
   cpu->data = read(cpu->bus, cpu->addr);
   return 0;
 }
 
-static int zeropy(Mos6502* cpu) {
-  uint8_t addr = (uint8_t)(cpu->y + read(cpu->bus, (uint16_t)(cpu->pc + 1)));
+static int zeropy(Mos6502* cpu, uint16_t operand) {
+  uint8_t addr = (uint8_t)(cpu->y + operand);
   cpu->addr = addr;
   cpu->data = read(cpu->bus, cpu->addr);
   return 0;
 }
 
+// The 65C02 modes. Its JMP (ind) reads the high byte of the pointer from the next page.
+static int ind_cmos(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = read16(cpu->bus, operand);
+  return 0;
+}
+
+static int absxind(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = read16(cpu->bus, (uint16_t)(cpu->x + operand));
+  return 0;
+}
+
+static int zpind(Mos6502* cpu, uint16_t operand) {
+  const uint8_t ptr = (uint8_t)operand;
+  cpu->addr = (uint16_t)(read(cpu->bus, (uint8_t)(ptr + 1)) << 8 | read(cpu->bus, ptr));
+  cpu->data = read(cpu->bus, cpu->addr);
+  return 0;
+}
+
+// BBR and BBS test the zero page byte in data, and keep the branch offset in the high byte of
+// addr.
+static int zprel(Mos6502* cpu, uint16_t operand) {
+  cpu->addr = operand;
+  cpu->data = read(cpu->bus, (uint8_t)operand);
+  return 0;
+}
+
 /////////////////////////////////////////////////
 ///     Opcodes
 /////////////////////////////////////////////////
 
-static int op_adc(Mos6502* cpu) {
+// Binary mode, which is all the 2A03 has.
+static int op_adc_binary(Mos6502* cpu) {
   uint16_t result = (uint16_t)(cpu->a + cpu->data + get_flag(cpu, C));
-  set_flag(cpu, Z, (uint8_t)(result) == 0);
-  if (get_flag(cpu, D)) {
-    if (((cpu->a & 0xF) + (cpu->data & 0xF) + (get_flag(cpu, C))) > 9) {
-      result = (uint16_t)(result + 6);
-    }
+  set_flag(cpu, C, result > 0xFF);
+  set_overflow(cpu, (uint8_t)(~(cpu->a ^ cpu->data) & (cpu->a ^ result)));
+  zn(cpu, cpu->a = (uint8_t)(result));
+  return 1;
+}
 
-    set_flag(cpu, N, (uint8_t)(result & 0x80) == 0x80);
-    set_flag(cpu, V, !((cpu->a ^ cpu->data) & 0x80) && ((cpu->a ^ result) & 0x80));
-    if (result > 0x99) {
-      result = (uint16_t)(result + 96);
-    }
+static int op_adc(Mos6502* cpu) {
+  if (!get_flag(cpu, D)) {
+    return op_adc_binary(cpu);
+  }
 
-    set_flag(cpu, C, result > 0x99);
+  uint16_t result = (uint16_t)(cpu->a + cpu->data + get_flag(cpu, C));
+  set_flag(cpu, Z, (uint8_t)(result) == 0);
+  if (((cpu->a & 0xF) + (cpu->data & 0xF) + (get_flag(cpu, C))) > 9) {
+    result = (uint16_t)(result + 6);
+  }
 
-  } else {
-    set_flag(cpu, N, (uint8_t)(result & 0x80) == 0x80);
-    set_flag(cpu, C, result > 0xFF);
-    set_flag(cpu, V, !((cpu->a ^ cpu->data) & 0x80) && ((cpu->a ^ result) & 0x80));
+  set_flag(cpu, N, (uint8_t)(result & 0x80) == 0x80);
+  set_overflow(cpu, (uint8_t)(~(cpu->a ^ cpu->data) & (cpu->a ^ result)));
+  if (result > 0x99) {
+    result = (uint16_t)(result + 96);
   }
 
+  set_flag(cpu, C, result > 0x99);
   cpu->a = (uint8_t)(result);
 
   return 1;
@@ -241,7 +375,7 @@ static int op_beq(Mos6502* cpu) {
 static int op_bit(Mos6502* cpu) {
   set_flag(cpu, Z, (cpu->a & cpu->data) == 0);
   set_flag(cpu, N, (cpu->data & 0x80) == 0x80);
-  set_flag(cpu, V, ((cpu->data & 0x40) >> 0x6) == 0x1);
+  set_overflow(cpu, (uint8_t)(cpu->data << 1));
   return 0;
 }
 
@@ -408,7 +542,7 @@ static int op_pla(Mos6502* cpu) {
 }
 
 static int op_plp(Mos6502* cpu) {
-  cpu->sr = pop_sr(cpu);
+  put_sr(cpu, pop_sr(cpu));
   return 0;
 }
 
@@ -431,7 +565,7 @@ static int op_ror(Mos6502* cpu) {
 }
 
 static int op_rti(Mos6502* cpu) {
-  cpu->sr = pop_sr(cpu);
+  put_sr(cpu, pop_sr(cpu));
   cpu->pc = pop16(cpu);
   return 0;
 }
@@ -441,19 +575,31 @@ static int op_rts(Mos6502* cpu) {
   return 0;
 }
 
+static int op_sbc_binary(Mos6502* cpu) {
+  uint16_t result = (uint16_t)(cpu->a - cpu->data - !get_flag(cpu, C));
+  zn(cpu, (uint8_t)(result));
+  set_overflow(cpu, (uint8_t)((cpu->a ^ result) & (cpu->a ^ cpu->data)));
+  set_flag(cpu, C, result < 0x100);
+  cpu->a = (uint8_t)(result);
+  return 1;
+}
+
 static int op_sbc(Mos6502* cpu) {
+  if (!get_flag(cpu, D)) {
+    return op_sbc_binary(cpu);
+  }
+
   uint16_t result = (uint16_t)(cpu->a - cpu->data - !get_flag(cpu, C));
   zn(cpu, (uint8_t)(result));
-  set_flag(cpu, V, ((cpu->a ^ result) & 0x80) && ((cpu->a ^ cpu->data) & 0x80));
-  if (get_flag(cpu, D)) {
-    if (((cpu->a & 0xF) - (!get_flag(cpu, C))) < (cpu->data & 0xF)) {
-      result = (uint16_t)(result - 6);
-    }
+  set_overflow(cpu, (uint8_t)((cpu->a ^ result) & (cpu->a ^ cpu->data)));
+  if (((cpu->a & 0xF) - (!get_flag(cpu, C))) < (cpu->data & 0xF)) {
+    result = (uint16_t)(result - 6);
+  }
 
-    if (result > 0x99) {
-      result = (uint16_t)(result - 0x60);
-    }
+  if (result > 0x99) {
+    result = (uint16_t)(result - 0x60);
   }
+
   set_flag(cpu, C, result < 0x100);
   cpu->a = (uint8_t)(result);
   return 1;
@@ -519,6 +665,182 @@ static int op_tya(Mos6502* cpu) {
   return 0;
 }
 
+/////////////////////////////////////////////////
+///     65C02 Opcodes
+/////////////////////////////////////////////////
+
+// Decimal mode sets N and Z from the decimal result on the 65C02, and takes an extra cycle.
+static int op_adc_cmos(Mos6502* cpu) {
+  if (!get_flag(cpu, D)) {
+    return op_adc_binary(cpu);
+  }
+
+  int low = (cpu->a & 0xF) + (cpu->data & 0xF) + get_flag(cpu, C);
+  if (low > 9) {
+    low = ((low + 6) & 0xF) + 0x10;
+  }
+
+  int result = (cpu->a & 0xF0) + (cpu->data & 0xF0) + low;
+  set_overflow(cpu, (uint8_t)(~(cpu->a ^ cpu->data) & (cpu->a ^ result)));
+  if (result > 0x9F) {
+    result += 0x60;
+  }
+
+  set_flag(cpu, C, result > 0xFF);
+  zn(cpu, cpu->a = (uint8_t)(result));
+  cpu->cycles += 1;
+  return 1;
+}
+
+static int op_sbc_cmos(Mos6502* cpu) {
+  if (!get_flag(cpu, D)) {
+    return op_sbc_binary(cpu);
+  }
+
+  const int borrow = !get_flag(cpu, C);
+  const int low = (cpu->a & 0xF) - (cpu->data & 0xF) - borrow;
+  int result = cpu->a - cpu->data - borrow;
+  set_overflow(cpu, (uint8_t)((cpu->a ^ result) & (cpu->a ^ cpu->data)));
+  set_flag(cpu, C, result >= 0);
+  if (result < 0) {
+    result -= 0x60;
+  }
+
+  if (low < 0) {
+    result -= 6;
+  }
+
+  zn(cpu, cpu->a = (uint8_t)(result));
+  cpu->cycles += 1;
+  return 1;
+}
+
+// The 65C02 spends the extra cycle of abs,X shifts and rotates only when the page is crossed, and
+// BIT abs,X pays for crossing one like the other reads.
+static int op_asl_cmos(Mos6502* cpu) {
+  (void)(op_asl(cpu));
+  return 1;
+}
+
+static int op_bit_cmos(Mos6502* cpu) {
+  (void)(op_bit(cpu));
+  return 1;
+}
+
+static int op_lsr_cmos(Mos6502* cpu) {
+  (void)(op_lsr(cpu));
+  return 1;
+}
+
+static int op_rol_cmos(Mos6502* cpu) {
+  (void)(op_rol(cpu));
+  return 1;
+}
+
+static int op_ror_cmos(Mos6502* cpu) {
+  (void)(op_ror(cpu));
+  return 1;
+}
+
+// The 65C02 clears D when it takes an interrupt, BRK included.
+static int op_brk_cmos(Mos6502* cpu) {
+  (void)(op_brk(cpu));
+  set_flag(cpu, D, false);
+  return 0;
+}
+
+// BIT #imm only sets Z.
+static int op_bit_imm(Mos6502* cpu) {
+  set_flag(cpu, Z, (cpu->a & cpu->data) == 0);
+  return 0;
+}
+
+static int op_bra(Mos6502* cpu) {
+  branch(cpu, true);
+  return 0;
+}
+
+static int op_phx(Mos6502* cpu) {
+  push8(cpu, cpu->x);
+  return 0;
+}
+
+static int op_phy(Mos6502* cpu) {
+  push8(cpu, cpu->y);
+  return 0;
+}
+
+static int op_plx(Mos6502* cpu) {
+  zn(cpu, cpu->x = pop8(cpu));
+  return 0;
+}
+
+static int op_ply(Mos6502* cpu) {
+  zn(cpu, cpu->y = pop8(cpu));
+  return 0;
+}
+
+static int op_stz(Mos6502* cpu) {
+  write(cpu->bus, cpu->addr, 0);
+  return 0;
+}
+
+static int op_trb(Mos6502* cpu) {
+  set_flag(cpu, Z, (cpu->a & cpu->data) == 0);
+  cpu->data = (uint8_t)(cpu->data & ~cpu->a);
+  write_data(cpu);
+  return 0;
+}
+
+static int op_tsb(Mos6502* cpu) {
+  set_flag(cpu, Z, (cpu->a & cpu->data) == 0);
+  cpu->data = (uint8_t)(cpu->data | cpu->a);
+  write_data(cpu);
+  return 0;
+}
+
+// WAI stays on itself until an interrupt is pending, which the batch engines see as a halt.
+// Taking the interrupt, or an IRQ while I is set, moves past it (see poll_interrupts()).
+static int op_wai(Mos6502* cpu) {
+  cpu->pc = (uint16_t)(cpu->pc - 1);
+  return 0;
+}
+
+// RMBn and SMBn clear and set bit n of a zero page byte. BBRn and BBSn branch when it is clear
+// and set.
+#define BIT_OPCODES(n)                                                          \
+  static int op_rmb##n(Mos6502* cpu) {                                          \
+    write(cpu->bus, cpu->addr, (uint8_t)(cpu->data & ~(1 << (n))));            \
+    return 0;                                                                   \
+  }                                                                             \
+  static int op_smb##n(Mos6502* cpu) {                                          \
+    write(cpu->bus, cpu->addr, (uint8_t)(cpu->data | 1 << (n)));                \
+    return 0;                                                                   \
+  }                                                                             \
+  static int op_bbr##n(Mos6502* cpu) {                                          \
+    const bool set = cpu->data & 1 << (n);                                      \
+    cpu->data = (uint8_t)(cpu->addr >> 8);                                      \
+    branch(cpu, !set);                                                          \
+    return 0;                                                                   \
+  }                                                                             \
+  static int op_bbs##n(Mos6502* cpu) {                                          \
+    const bool set = cpu->data & 1 << (n);                                      \
+    cpu->data = (uint8_t)(cpu->addr >> 8);                                      \
+    branch(cpu, set);                                                           \
+    return 0;                                                                   \
+  }
+
+BIT_OPCODES(0)
+BIT_OPCODES(1)
+BIT_OPCODES(2)
+BIT_OPCODES(3)
+BIT_OPCODES(4)
+BIT_OPCODES(5)
+BIT_OPCODES(6)
+BIT_OPCODES(7)
+
+#undef BIT_OPCODES
+
 /////////////////////////////////////////////////
 ///     Undocumented Opcodes
 /////////////////////////////////////////////////
@@ -575,16 +897,23 @@ static int op_ins(Mos6502* cpu) {
   return 0;
 }
 
+static int op_ins_binary(Mos6502* cpu) {
+  cpu->data = (uint8_t)(cpu->data + 1);
+  (void)(op_sbc_binary(cpu));
+  return 0;
+}
+
 // https://www.pagetable.com/?p=39
+// This instruction locks up the 6502 completely until it is reset. It stays on itself, so the
+// batch engines stop as on a halt, and nothing runs until cpu_reset() clears the flag.
 static int op_kil(Mos6502* cpu) {
-  LOG_ERROR("KIL instruction! Please reset the emulator!\n");
-  LOG_ERROR("PC: 0x%04X\n", cpu->pc);
+  cpu->pc = (uint16_t)(cpu->pc - 1);
+  cpu->jammed = true;
+  cpu->jams += 1;
+  LOG_ERROR("KIL instruction at PC 0x%04X, the CPU is jammed until it is reset\n", cpu->pc);
   LOG_ERROR("State: A:0x%02X X:0x%02X Y:0x%02X SP:0x%02X SR:0x%02X\n", cpu->a, cpu->x, cpu->y,
-            cpu->sp, cpu->sr);
-  for (;;) {
-    // This instruction locks up the 6502 completely, and needs to be reset in order to continue
-    // This will leak memory
-  }
+            cpu->sp, get_sr(cpu));
+  return 0;
 }
 
 static int op_las(Mos6502* cpu) {
@@ -624,6 +953,12 @@ static int op_rra(Mos6502* cpu) {
   return 0;
 }
 
+static int op_rra_binary(Mos6502* cpu) {
+  (void)(op_ror(cpu));
+  (void)(op_adc_binary(cpu));
+  return 0;
+}
+
 static int op_say(Mos6502* cpu) {
   cpu->data = (uint8_t)(cpu->y & ((cpu->addr >> 8) + 1));
   write_data(cpu);
@@ -658,6 +993,7 @@ static int op_xas(Mos6502* cpu) {
   return 0;
 }
 
+typedef int (*mode_handler)(Mos6502*, uint16_t operand);
 typedef int (*handler)(Mos6502*);
 
 struct Opcode {
@@ -665,150 +1001,1459 @@ struct Opcode {
   AddressingMode mode;
   uint32_t cycles;
   uint8_t length;
-  handler mode_handler;
+  mode_handler mode_handler;
   handler opcode_handler;
 };
 
-static const struct Opcode opcodes[NUM_OF_OPCODES] = {
-    {"BRK", kImpl, 7, 1, &impl, &op_brk},     {"ORA", kIdxInd, 6, 2, &idxind, &op_ora},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"ASO", kIdxInd, 8, 2, &idxind, &op_aso},
-    {"NOP", kZeroP, 3, 2, &zerop, &op_nop},   {"ORA", kZeroP, 3, 2, &zerop, &op_ora},
-    {"ASL", kZeroP, 5, 2, &zerop, &op_asl},   {"ASO", kZeroP, 5, 2, &zerop, &op_aso},
-    {"PHP", kImpl, 3, 1, &impl, &op_php},     {"ORA", kImm, 2, 2, &imm, &op_ora},
-    {"ASL", kAcc, 2, 1, &acc, &op_asl},       {"ANC", kImm, 2, 2, &imm, &op_anc},
-    {"NOP", kAbs, 4, 3, &absolute, &op_nop},  {"ORA", kAbs, 4, 3, &absolute, &op_ora},
-    {"ASL", kAbs, 6, 3, &absolute, &op_asl},  {"ASO", kAbs, 6, 3, &absolute, &op_aso},
-    {"BPL", kRel, 2, 2, &rel, &op_bpl},       {"ORA", kIndIdx, 5, 2, &indidx, &op_ora},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"ASO", kIndIdx, 8, 2, &indidx, &op_aso},
-    {"NOP", kZeroPX, 4, 2, &zeropx, &op_nop}, {"ORA", kZeroPX, 4, 2, &zeropx, &op_ora},
-    {"ASL", kZeroPX, 6, 2, &zeropx, &op_asl}, {"ASO", kZeroPX, 6, 2, &zeropx, &op_aso},
-    {"CLC", kImpl, 2, 1, &impl, &op_clc},     {"ORA", kAbsY, 4, 3, &absy, &op_ora},
-    {"NOP", kImpl, 2, 1, &impl, &op_nop},     {"ASO", kAbsY, 7, 3, &absy, &op_aso},
-    {"NOP", kAbsX, 4, 3, &absx, &op_nop},     {"ORA", kAbsX, 4, 3, &absx, &op_ora},
-    {"ASL", kAbsX, 7, 3, &absx, &op_asl},     {"ASO", kAbsX, 7, 3, &absx, &op_aso},
-    {"JSR", kAbs, 6, 3, &absolute, &op_jsr},  {"AND", kIdxInd, 6, 2, &idxind, &op_and},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"RLA", kIdxInd, 8, 2, &idxind, &op_rla},
-    {"BIT", kZeroP, 3, 2, &zerop, &op_bit},   {"AND", kZeroP, 3, 2, &zerop, &op_and},
-    {"ROL", kZeroP, 5, 2, &zerop, &op_rol},   {"RLA", kZeroP, 5, 2, &zerop, &op_rla},
-    {"PLP", kImpl, 4, 1, &impl, &op_plp},     {"AND", kImm, 2, 2, &imm, &op_and},
-    {"ROL", kAcc, 2, 1, &acc, &op_rol},       {"ANC", kImm, 2, 2, &imm, &op_anc},
-    {"BIT", kAbs, 4, 3, &absolute, &op_bit},  {"AND", kAbs, 4, 3, &absolute, &op_and},
-    {"ROL", kAbs, 6, 3, &absolute, &op_rol},  {"RLA", kAbs, 6, 3, &absolute, &op_rla},
-    {"BMI", kRel, 2, 2, &rel, &op_bmi},       {"AND", kIndIdx, 5, 2, &indidx, &op_and},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"RLA", kIndIdx, 8, 2, &indidx, &op_rla},
-    {"NOP", kZeroPX, 4, 2, &zeropx, &op_nop}, {"AND", kZeroPX, 4, 2, &zeropx, &op_and},
-    {"ROL", kZeroPX, 6, 2, &zeropx, &op_rol}, {"RLA", kZeroPX, 6, 2, &zeropx, &op_rla},
-    {"SEC", kImpl, 2, 1, &impl, &op_sec},     {"AND", kAbsY, 4, 3, &absy, &op_and},
-    {"NOP", kImpl, 2, 1, &impl, &op_nop},     {"RLA", kAbsY, 7, 3, &absy, &op_rla},
-    {"NOP", kAbsX, 4, 3, &absx, &op_nop},     {"AND", kAbsX, 4, 3, &absx, &op_and},
-    {"ROL", kAbsX, 7, 3, &absx, &op_rol},     {"RLA", kAbsX, 7, 3, &absx, &op_rla},
-    {"RTI", kImpl, 6, 1, &impl, &op_rti},     {"EOR", kIdxInd, 6, 2, &idxind, &op_eor},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"LSE", kIdxInd, 8, 2, &idxind, &op_lse},
-    {"NOP", kZeroP, 3, 2, &zerop, &op_nop},   {"EOR", kZeroP, 3, 2, &zerop, &op_eor},
-    {"LSR", kZeroP, 5, 2, &zerop, &op_lsr},   {"LSE", kZeroP, 5, 2, &zerop, &op_lse},
-    {"PHA", kImpl, 3, 1, &impl, &op_pha},     {"EOR", kImm, 2, 2, &imm, &op_eor},
-    {"LSR", kAcc, 2, 1, &acc, &op_lsr},       {"ALR", kImm, 2, 2, &imm, &op_alr},
-    {"JMP", kAbs, 3, 3, &absolute, &op_jmp},  {"EOR", kAbs, 4, 3, &absolute, &op_eor},
-    {"LSR", kAbs, 6, 3, &absolute, &op_lsr},  {"LSE", kAbs, 6, 3, &absolute, &op_lse},
-    {"BVC", kRel, 2, 2, &rel, &op_bvc},       {"EOR", kIndIdx, 5, 2, &indidx, &op_eor},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"LSE", kIndIdx, 8, 2, &indidx, &op_lse},
-    {"NOP", kZeroPX, 4, 2, &zeropx, &op_nop}, {"EOR", kZeroPX, 4, 2, &zeropx, &op_eor},
-    {"LSR", kZeroPX, 6, 2, &zeropx, &op_lsr}, {"LSE", kZeroPX, 6, 2, &zeropx, &op_lse},
-    {"CLI", kImpl, 2, 1, &impl, &op_cli},     {"EOR", kAbsY, 4, 3, &absy, &op_eor},
-    {"NOP", kImpl, 2, 1, &impl, &op_nop},     {"LSE", kAbsY, 7, 3, &absy, &op_lse},
-    {"NOP", kAbsX, 4, 3, &absx, &op_nop},     {"EOR", kAbsX, 4, 3, &absx, &op_eor},
-    {"LSR", kAbsX, 7, 3, &absx, &op_lsr},     {"LSE", kAbsX, 7, 3, &absx, &op_lse},
-    {"RTS", kImpl, 6, 1, &impl, &op_rts},     {"ADC", kIdxInd, 6, 2, &idxind, &op_adc},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"RRA", kIdxInd, 8, 2, &idxind, &op_rra},
-    {"NOP", kZeroP, 3, 2, &zerop, &op_nop},   {"ADC", kZeroP, 3, 2, &zerop, &op_adc},
-    {"ROR", kZeroP, 5, 2, &zerop, &op_ror},   {"RRA", kZeroP, 5, 2, &zerop, &op_rra},
-    {"PLA", kImpl, 4, 1, &impl, &op_pla},     {"ADC", kImm, 2, 2, &imm, &op_adc},
-    {"ROR", kAcc, 2, 1, &acc, &op_ror},       {"ARR", kImm, 2, 2, &imm, &op_arr},
-    {"JMP", kInd, 5, 3, &ind, &op_jmp},       {"ADC", kAbs, 4, 3, &absolute, &op_adc},
-    {"ROR", kAbs, 6, 3, &absolute, &op_ror},  {"RRA", kAbs, 6, 3, &absolute, &op_rra},
-    {"BVS", kRel, 2, 2, &rel, &op_bvs},       {"ADC", kIndIdx, 5, 2, &indidx, &op_adc},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"RRA", kIndIdx, 8, 2, &indidx, &op_rra},
-    {"NOP", kZeroPX, 4, 2, &zeropx, &op_nop}, {"ADC", kZeroPX, 4, 2, &zeropx, &op_adc},
-    {"ROR", kZeroPX, 6, 2, &zeropx, &op_ror}, {"RRA", kZeroPX, 6, 2, &zeropx, &op_rra},
-    {"SEI", kImpl, 2, 1, &impl, &op_sei},     {"ADC", kAbsY, 4, 3, &absy, &op_adc},
-    {"NOP", kImpl, 2, 1, &impl, &op_nop},     {"RRA", kAbsY, 7, 3, &absy, &op_rra},
-    {"NOP", kAbsX, 4, 3, &absx, &op_nop},     {"ADC", kAbsX, 4, 3, &absx, &op_adc},
-    {"ROR", kAbsX, 7, 3, &absx, &op_ror},     {"RRA", kAbsX, 7, 3, &absx, &op_rra},
-    {"NOP", kImm, 6, 2, &imm, &op_nop},       {"STA", kIdxInd, 6, 2, &idxind, &op_sta},
-    {"NOP", kImm, 2, 2, &imm, &op_nop},       {"AXS", kIdxInd, 6, 2, &idxind, &op_axs},
-    {"STY", kZeroP, 3, 2, &zerop, &op_sty},   {"STA", kZeroP, 3, 2, &zerop, &op_sta},
-    {"STX", kZeroP, 3, 2, &zerop, &op_stx},   {"AXS", kZeroP, 3, 2, &zerop, &op_axs},
-    {"DEY", kImpl, 2, 1, &impl, &op_dey},     {"NOP", kImm, 2, 2, &imm, &op_nop},
-    {"TXA", kImpl, 2, 1, &impl, &op_txa},     {"XAA", kImm, 2, 2, &imm, &op_xaa},
-    {"STY", kAbs, 4, 3, &absolute, &op_sty},  {"STA", kAbs, 4, 3, &absolute, &op_sta},
-    {"STX", kAbs, 4, 3, &absolute, &op_stx},  {"AXS", kAbs, 4, 3, &absolute, &op_axs},
-    {"BCC", kRel, 2, 2, &rel, &op_bcc},       {"STA", kIndIdx, 6, 2, &indidx, &op_sta},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"AXA", kIndIdx, 6, 2, &indidx, &op_axa},
-    {"STY", kZeroPX, 4, 2, &zeropx, &op_sty}, {"STA", kZeroPX, 4, 2, &zeropx, &op_sta},
-    {"STX", kZeroPY, 4, 2, &zeropy, &op_stx}, {"AXS", kZeroPY, 4, 2, &zeropy, &op_axs},
-    {"TYA", kImpl, 2, 1, &impl, &op_tya},     {"STA", kAbsY, 5, 3, &absy, &op_sta},
-    {"TXS", kImpl, 2, 1, &impl, &op_txs},     {"TAS", kAbsY, 5, 3, &absy, &op_tas},
-    {"SAY", kAbsX, 5, 3, &absx, &op_say},     {"STA", kAbsX, 5, 3, &absx, &op_sta},
-    {"XAS", kAbsY, 5, 3, &absy, &op_xas},     {"AXA", kAbsY, 5, 3, &absy, &op_axa},
-    {"LDY", kImm, 2, 2, &imm, &op_ldy},       {"LDA", kIdxInd, 6, 2, &idxind, &op_lda},
-    {"LDX", kImm, 2, 2, &imm, &op_ldx},       {"LAX", kIdxInd, 6, 2, &idxind, &op_lax},
-    {"LDY", kZeroP, 3, 2, &zerop, &op_ldy},   {"LDA", kZeroP, 3, 2, &zerop, &op_lda},
-    {"LDX", kZeroP, 3, 2, &zerop, &op_ldx},   {"LAX", kZeroP, 3, 2, &zerop, &op_lax},
-    {"TAY", kImpl, 2, 1, &impl, &op_tay},     {"LDA", kImm, 2, 2, &imm, &op_lda},
-    {"TAX", kImpl, 2, 1, &impl, &op_tax},     {"OAL", kImm, 2, 2, &imm, &op_oal},
-    {"LDY", kAbs, 4, 3, &absolute, &op_ldy},  {"LDA", kAbs, 4, 3, &absolute, &op_lda},
-    {"LDX", kAbs, 4, 3, &absolute, &op_ldx},  {"LAX", kAbs, 4, 3, &absolute, &op_lax},
-    {"BCS", kRel, 2, 2, &rel, &op_bcs},       {"LDA", kIndIdx, 5, 2, &indidx, &op_lda},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"LAX", kIndIdx, 5, 2, &indidx, &op_lax},
-    {"LDY", kZeroPX, 4, 2, &zeropx, &op_ldy}, {"LDA", kZeroPX, 4, 2, &zeropx, &op_lda},
-    {"LDX", kZeroPY, 4, 2, &zeropy, &op_ldx}, {"LAX", kZeroPY, 4, 2, &zeropy, &op_lax},
-    {"CLV", kImpl, 2, 1, &impl, &op_clv},     {"LDA", kAbsY, 4, 3, &absy, &op_lda},
-    {"TSX", kImpl, 2, 1, &impl, &op_tsx},     {"LAS", kAbsY, 4, 3, &absy, &op_las},
-    {"LDY", kAbsX, 4, 3, &absx, &op_ldy},     {"LDA", kAbsX, 4, 3, &absx, &op_lda},
-    {"LDX", kAbsY, 4, 3, &absy, &op_ldx},     {"LAX", kAbsY, 4, 3, &absy, &op_lax},
-    {"CPY", kImm, 2, 2, &imm, &op_cpy},       {"CMP", kIdxInd, 6, 2, &idxind, &op_cmp},
-    {"NOP", kImm, 2, 2, &imm, &op_nop},       {"DCM", kIdxInd, 8, 2, &idxind, &op_dcm},
-    {"CPY", kZeroP, 3, 2, &zerop, &op_cpy},   {"CMP", kZeroP, 3, 2, &zerop, &op_cmp},
-    {"DEC", kZeroP, 5, 2, &zerop, &op_dec},   {"DCM", kZeroP, 5, 2, &zerop, &op_dcm},
-    {"INY", kImpl, 2, 1, &impl, &op_iny},     {"CMP", kImm, 2, 2, &imm, &op_cmp},
-    {"DEX", kImpl, 2, 1, &impl, &op_dex},     {"SAX", kImm, 2, 2, &imm, &op_sax},
-    {"CPY", kAbs, 4, 3, &absolute, &op_cpy},  {"CMP", kAbs, 4, 3, &absolute, &op_cmp},
-    {"DEC", kAbs, 6, 3, &absolute, &op_dec},  {"DCM", kAbs, 6, 3, &absolute, &op_dcm},
-    {"BNE", kRel, 2, 2, &rel, &op_bne},       {"CMP", kIndIdx, 5, 2, &indidx, &op_cmp},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"DCM", kIndIdx, 8, 2, &indidx, &op_dcm},
-    {"NOP", kZeroPX, 4, 2, &zeropx, &op_nop}, {"CMP", kZeroPX, 4, 2, &zeropx, &op_cmp},
-    {"DEC", kZeroPX, 6, 2, &zeropx, &op_dec}, {"DCM", kZeroPX, 6, 2, &zeropx, &op_dcm},
-    {"CLD", kImpl, 2, 1, &impl, &op_cld},     {"CMP", kAbsY, 4, 3, &absy, &op_cmp},
-    {"NOP", kImpl, 2, 1, &impl, &op_nop},     {"DCM", kAbsY, 7, 3, &absy, &op_dcm},
-    {"NOP", kAbsX, 4, 3, &absx, &op_nop},     {"CMP", kAbsX, 4, 3, &absx, &op_cmp},
-    {"DEC", kAbsX, 7, 3, &absx, &op_dec},     {"DCM", kAbsX, 7, 3, &absx, &op_dcm},
-    {"CPX", kImm, 2, 2, &imm, &op_cpx},       {"SBC", kIdxInd, 6, 2, &idxind, &op_sbc},
-    {"NOP", kImm, 2, 2, &imm, &op_nop},       {"INS", kIdxInd, 8, 2, &idxind, &op_ins},
-    {"CPX", kZeroP, 3, 2, &zerop, &op_cpx},   {"SBC", kZeroP, 3, 2, &zerop, &op_sbc},
-    {"INC", kZeroP, 5, 2, &zerop, &op_inc},   {"INS", kZeroP, 5, 2, &zerop, &op_ins},
-    {"INX", kImpl, 2, 1, &impl, &op_inx},     {"SBC", kImm, 2, 2, &imm, &op_sbc},
-    {"NOP", kImpl, 2, 1, &impl, &op_nop},     {"SBC", kImm, 2, 2, &imm, &op_sbc},
-    {"CPX", kAbs, 4, 3, &absolute, &op_cpx},  {"SBC", kAbs, 4, 3, &absolute, &op_sbc},
-    {"INC", kAbs, 6, 3, &absolute, &op_inc},  {"INS", kAbs, 6, 3, &absolute, &op_ins},
-    {"BEQ", kRel, 2, 2, &rel, &op_beq},       {"SBC", kIndIdx, 5, 2, &indidx, &op_sbc},
-    {"KIL", kImpl, 2, 1, &impl, &op_kil},     {"INS", kIndIdx, 8, 2, &indidx, &op_ins},
-    {"NOP", kZeroPX, 4, 2, &zeropx, &op_nop}, {"SBC", kZeroPX, 4, 2, &zeropx, &op_sbc},
-    {"INC", kZeroPX, 6, 2, &zeropx, &op_inc}, {"INS", kZeroPX, 6, 2, &zeropx, &op_ins},
-    {"SED", kImpl, 2, 1, &impl, &op_sed},     {"SBC", kAbsY, 4, 3, &absy, &op_sbc},
-    {"NOP", kImpl, 2, 1, &impl, &op_nop},     {"INS", kAbsY, 7, 3, &absy, &op_ins},
-    {"NOP", kAbsX, 4, 3, &absx, &op_nop},     {"SBC", kAbsX, 4, 3, &absx, &op_sbc},
-    {"INC", kAbsX, 7, 3, &absx, &op_inc},     {"INS", kAbsX, 7, 3, &absx, &op_ins},
+/**
+ * The opcode tables, written as X-macros so that every execution engine of every variant is
+ * generated from the same metadata. Each entry is X(opcode, mnemonic, mode, cycles, length,
+ * mode_handler, opcode_handler).
+ *
+ * The NMOS 6502 and the 2A03 only differ in decimal mode, which the 2A03 doesn't have.
+ */
+#define NMOS_OPCODES(X, adc_op, sbc_op, rra_op, ins_op) \
+  X(0x00, BRK, kImpl, 7, 1, impl, op_brk)     \
+  X(0x01, ORA, kIdxInd, 6, 2, idxind, op_ora) \
+  X(0x02, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x03, ASO, kIdxInd, 8, 2, idxind, op_aso) \
+  X(0x04, NOP, kZeroP, 3, 2, zerop, op_nop)   \
+  X(0x05, ORA, kZeroP, 3, 2, zerop, op_ora)   \
+  X(0x06, ASL, kZeroP, 5, 2, zerop, op_asl)   \
+  X(0x07, ASO, kZeroP, 5, 2, zerop, op_aso)   \
+  X(0x08, PHP, kImpl, 3, 1, impl, op_php)     \
+  X(0x09, ORA, kImm, 2, 2, imm, op_ora)       \
+  X(0x0A, ASL, kAcc, 2, 1, acc, op_asl)       \
+  X(0x0B, ANC, kImm, 2, 2, imm, op_anc)       \
+  X(0x0C, NOP, kAbs, 4, 3, absolute, op_nop)  \
+  X(0x0D, ORA, kAbs, 4, 3, absolute, op_ora)  \
+  X(0x0E, ASL, kAbs, 6, 3, absolute, op_asl)  \
+  X(0x0F, ASO, kAbs, 6, 3, absolute, op_aso)  \
+  X(0x10, BPL, kRel, 2, 2, rel, op_bpl)       \
+  X(0x11, ORA, kIndIdx, 5, 2, indidx, op_ora) \
+  X(0x12, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x13, ASO, kIndIdx, 8, 2, indidx, op_aso) \
+  X(0x14, NOP, kZeroPX, 4, 2, zeropx, op_nop) \
+  X(0x15, ORA, kZeroPX, 4, 2, zeropx, op_ora) \
+  X(0x16, ASL, kZeroPX, 6, 2, zeropx, op_asl) \
+  X(0x17, ASO, kZeroPX, 6, 2, zeropx, op_aso) \
+  X(0x18, CLC, kImpl, 2, 1, impl, op_clc)     \
+  X(0x19, ORA, kAbsY, 4, 3, absy, op_ora)     \
+  X(0x1A, NOP, kImpl, 2, 1, impl, op_nop)     \
+  X(0x1B, ASO, kAbsY, 7, 3, absy, op_aso)     \
+  X(0x1C, NOP, kAbsX, 4, 3, absx, op_nop)     \
+  X(0x1D, ORA, kAbsX, 4, 3, absx, op_ora)     \
+  X(0x1E, ASL, kAbsX, 7, 3, absx, op_asl)     \
+  X(0x1F, ASO, kAbsX, 7, 3, absx, op_aso)     \
+  X(0x20, JSR, kAbs, 6, 3, absolute, op_jsr)  \
+  X(0x21, AND, kIdxInd, 6, 2, idxind, op_and) \
+  X(0x22, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x23, RLA, kIdxInd, 8, 2, idxind, op_rla) \
+  X(0x24, BIT, kZeroP, 3, 2, zerop, op_bit)   \
+  X(0x25, AND, kZeroP, 3, 2, zerop, op_and)   \
+  X(0x26, ROL, kZeroP, 5, 2, zerop, op_rol)   \
+  X(0x27, RLA, kZeroP, 5, 2, zerop, op_rla)   \
+  X(0x28, PLP, kImpl, 4, 1, impl, op_plp)     \
+  X(0x29, AND, kImm, 2, 2, imm, op_and)       \
+  X(0x2A, ROL, kAcc, 2, 1, acc, op_rol)       \
+  X(0x2B, ANC, kImm, 2, 2, imm, op_anc)       \
+  X(0x2C, BIT, kAbs, 4, 3, absolute, op_bit)  \
+  X(0x2D, AND, kAbs, 4, 3, absolute, op_and)  \
+  X(0x2E, ROL, kAbs, 6, 3, absolute, op_rol)  \
+  X(0x2F, RLA, kAbs, 6, 3, absolute, op_rla)  \
+  X(0x30, BMI, kRel, 2, 2, rel, op_bmi)       \
+  X(0x31, AND, kIndIdx, 5, 2, indidx, op_and) \
+  X(0x32, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x33, RLA, kIndIdx, 8, 2, indidx, op_rla) \
+  X(0x34, NOP, kZeroPX, 4, 2, zeropx, op_nop) \
+  X(0x35, AND, kZeroPX, 4, 2, zeropx, op_and) \
+  X(0x36, ROL, kZeroPX, 6, 2, zeropx, op_rol) \
+  X(0x37, RLA, kZeroPX, 6, 2, zeropx, op_rla) \
+  X(0x38, SEC, kImpl, 2, 1, impl, op_sec)     \
+  X(0x39, AND, kAbsY, 4, 3, absy, op_and)     \
+  X(0x3A, NOP, kImpl, 2, 1, impl, op_nop)     \
+  X(0x3B, RLA, kAbsY, 7, 3, absy, op_rla)     \
+  X(0x3C, NOP, kAbsX, 4, 3, absx, op_nop)     \
+  X(0x3D, AND, kAbsX, 4, 3, absx, op_and)     \
+  X(0x3E, ROL, kAbsX, 7, 3, absx, op_rol)     \
+  X(0x3F, RLA, kAbsX, 7, 3, absx, op_rla)     \
+  X(0x40, RTI, kImpl, 6, 1, impl, op_rti)     \
+  X(0x41, EOR, kIdxInd, 6, 2, idxind, op_eor) \
+  X(0x42, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x43, LSE, kIdxInd, 8, 2, idxind, op_lse) \
+  X(0x44, NOP, kZeroP, 3, 2, zerop, op_nop)   \
+  X(0x45, EOR, kZeroP, 3, 2, zerop, op_eor)   \
+  X(0x46, LSR, kZeroP, 5, 2, zerop, op_lsr)   \
+  X(0x47, LSE, kZeroP, 5, 2, zerop, op_lse)   \
+  X(0x48, PHA, kImpl, 3, 1, impl, op_pha)     \
+  X(0x49, EOR, kImm, 2, 2, imm, op_eor)       \
+  X(0x4A, LSR, kAcc, 2, 1, acc, op_lsr)       \
+  X(0x4B, ALR, kImm, 2, 2, imm, op_alr)       \
+  X(0x4C, JMP, kAbs, 3, 3, absolute, op_jmp)  \
+  X(0x4D, EOR, kAbs, 4, 3, absolute, op_eor)  \
+  X(0x4E, LSR, kAbs, 6, 3, absolute, op_lsr)  \
+  X(0x4F, LSE, kAbs, 6, 3, absolute, op_lse)  \
+  X(0x50, BVC, kRel, 2, 2, rel, op_bvc)       \
+  X(0x51, EOR, kIndIdx, 5, 2, indidx, op_eor) \
+  X(0x52, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x53, LSE, kIndIdx, 8, 2, indidx, op_lse) \
+  X(0x54, NOP, kZeroPX, 4, 2, zeropx, op_nop) \
+  X(0x55, EOR, kZeroPX, 4, 2, zeropx, op_eor) \
+  X(0x56, LSR, kZeroPX, 6, 2, zeropx, op_lsr) \
+  X(0x57, LSE, kZeroPX, 6, 2, zeropx, op_lse) \
+  X(0x58, CLI, kImpl, 2, 1, impl, op_cli)     \
+  X(0x59, EOR, kAbsY, 4, 3, absy, op_eor)     \
+  X(0x5A, NOP, kImpl, 2, 1, impl, op_nop)     \
+  X(0x5B, LSE, kAbsY, 7, 3, absy, op_lse)     \
+  X(0x5C, NOP, kAbsX, 4, 3, absx, op_nop)     \
+  X(0x5D, EOR, kAbsX, 4, 3, absx, op_eor)     \
+  X(0x5E, LSR, kAbsX, 7, 3, absx, op_lsr)     \
+  X(0x5F, LSE, kAbsX, 7, 3, absx, op_lse)     \
+  X(0x60, RTS, kImpl, 6, 1, impl, op_rts)     \
+  X(0x61, ADC, kIdxInd, 6, 2, idxind, adc_op) \
+  X(0x62, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x63, RRA, kIdxInd, 8, 2, idxind, rra_op) \
+  X(0x64, NOP, kZeroP, 3, 2, zerop, op_nop)   \
+  X(0x65, ADC, kZeroP, 3, 2, zerop, adc_op)   \
+  X(0x66, ROR, kZeroP, 5, 2, zerop, op_ror)   \
+  X(0x67, RRA, kZeroP, 5, 2, zerop, rra_op)   \
+  X(0x68, PLA, kImpl, 4, 1, impl, op_pla)     \
+  X(0x69, ADC, kImm, 2, 2, imm, adc_op)       \
+  X(0x6A, ROR, kAcc, 2, 1, acc, op_ror)       \
+  X(0x6B, ARR, kImm, 2, 2, imm, op_arr)       \
+  X(0x6C, JMP, kInd, 5, 3, ind, op_jmp)       \
+  X(0x6D, ADC, kAbs, 4, 3, absolute, adc_op)  \
+  X(0x6E, ROR, kAbs, 6, 3, absolute, op_ror)  \
+  X(0x6F, RRA, kAbs, 6, 3, absolute, rra_op)  \
+  X(0x70, BVS, kRel, 2, 2, rel, op_bvs)       \
+  X(0x71, ADC, kIndIdx, 5, 2, indidx, adc_op) \
+  X(0x72, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x73, RRA, kIndIdx, 8, 2, indidx, rra_op) \
+  X(0x74, NOP, kZeroPX, 4, 2, zeropx, op_nop) \
+  X(0x75, ADC, kZeroPX, 4, 2, zeropx, adc_op) \
+  X(0x76, ROR, kZeroPX, 6, 2, zeropx, op_ror) \
+  X(0x77, RRA, kZeroPX, 6, 2, zeropx, rra_op) \
+  X(0x78, SEI, kImpl, 2, 1, impl, op_sei)     \
+  X(0x79, ADC, kAbsY, 4, 3, absy, adc_op)     \
+  X(0x7A, NOP, kImpl, 2, 1, impl, op_nop)     \
+  X(0x7B, RRA, kAbsY, 7, 3, absy, rra_op)     \
+  X(0x7C, NOP, kAbsX, 4, 3, absx, op_nop)     \
+  X(0x7D, ADC, kAbsX, 4, 3, absx, adc_op)     \
+  X(0x7E, ROR, kAbsX, 7, 3, absx, op_ror)     \
+  X(0x7F, RRA, kAbsX, 7, 3, absx, rra_op)     \
+  X(0x80, NOP, kImm, 6, 2, imm, op_nop)       \
+  X(0x81, STA, kIdxInd, 6, 2, idxind, op_sta) \
+  X(0x82, NOP, kImm, 2, 2, imm, op_nop)       \
+  X(0x83, AXS, kIdxInd, 6, 2, idxind, op_axs) \
+  X(0x84, STY, kZeroP, 3, 2, zerop, op_sty)   \
+  X(0x85, STA, kZeroP, 3, 2, zerop, op_sta)   \
+  X(0x86, STX, kZeroP, 3, 2, zerop, op_stx)   \
+  X(0x87, AXS, kZeroP, 3, 2, zerop, op_axs)   \
+  X(0x88, DEY, kImpl, 2, 1, impl, op_dey)     \
+  X(0x89, NOP, kImm, 2, 2, imm, op_nop)       \
+  X(0x8A, TXA, kImpl, 2, 1, impl, op_txa)     \
+  X(0x8B, XAA, kImm, 2, 2, imm, op_xaa)       \
+  X(0x8C, STY, kAbs, 4, 3, absolute, op_sty)  \
+  X(0x8D, STA, kAbs, 4, 3, absolute, op_sta)  \
+  X(0x8E, STX, kAbs, 4, 3, absolute, op_stx)  \
+  X(0x8F, AXS, kAbs, 4, 3, absolute, op_axs)  \
+  X(0x90, BCC, kRel, 2, 2, rel, op_bcc)       \
+  X(0x91, STA, kIndIdx, 6, 2, indidx, op_sta) \
+  X(0x92, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0x93, AXA, kIndIdx, 6, 2, indidx, op_axa) \
+  X(0x94, STY, kZeroPX, 4, 2, zeropx, op_sty) \
+  X(0x95, STA, kZeroPX, 4, 2, zeropx, op_sta) \
+  X(0x96, STX, kZeroPY, 4, 2, zeropy, op_stx) \
+  X(0x97, AXS, kZeroPY, 4, 2, zeropy, op_axs) \
+  X(0x98, TYA, kImpl, 2, 1, impl, op_tya)     \
+  X(0x99, STA, kAbsY, 5, 3, absy, op_sta)     \
+  X(0x9A, TXS, kImpl, 2, 1, impl, op_txs)     \
+  X(0x9B, TAS, kAbsY, 5, 3, absy, op_tas)     \
+  X(0x9C, SAY, kAbsX, 5, 3, absx, op_say)     \
+  X(0x9D, STA, kAbsX, 5, 3, absx, op_sta)     \
+  X(0x9E, XAS, kAbsY, 5, 3, absy, op_xas)     \
+  X(0x9F, AXA, kAbsY, 5, 3, absy, op_axa)     \
+  X(0xA0, LDY, kImm, 2, 2, imm, op_ldy)       \
+  X(0xA1, LDA, kIdxInd, 6, 2, idxind, op_lda) \
+  X(0xA2, LDX, kImm, 2, 2, imm, op_ldx)       \
+  X(0xA3, LAX, kIdxInd, 6, 2, idxind, op_lax) \
+  X(0xA4, LDY, kZeroP, 3, 2, zerop, op_ldy)   \
+  X(0xA5, LDA, kZeroP, 3, 2, zerop, op_lda)   \
+  X(0xA6, LDX, kZeroP, 3, 2, zerop, op_ldx)   \
+  X(0xA7, LAX, kZeroP, 3, 2, zerop, op_lax)   \
+  X(0xA8, TAY, kImpl, 2, 1, impl, op_tay)     \
+  X(0xA9, LDA, kImm, 2, 2, imm, op_lda)       \
+  X(0xAA, TAX, kImpl, 2, 1, impl, op_tax)     \
+  X(0xAB, OAL, kImm, 2, 2, imm, op_oal)       \
+  X(0xAC, LDY, kAbs, 4, 3, absolute, op_ldy)  \
+  X(0xAD, LDA, kAbs, 4, 3, absolute, op_lda)  \
+  X(0xAE, LDX, kAbs, 4, 3, absolute, op_ldx)  \
+  X(0xAF, LAX, kAbs, 4, 3, absolute, op_lax)  \
+  X(0xB0, BCS, kRel, 2, 2, rel, op_bcs)       \
+  X(0xB1, LDA, kIndIdx, 5, 2, indidx, op_lda) \
+  X(0xB2, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0xB3, LAX, kIndIdx, 5, 2, indidx, op_lax) \
+  X(0xB4, LDY, kZeroPX, 4, 2, zeropx, op_ldy) \
+  X(0xB5, LDA, kZeroPX, 4, 2, zeropx, op_lda) \
+  X(0xB6, LDX, kZeroPY, 4, 2, zeropy, op_ldx) \
+  X(0xB7, LAX, kZeroPY, 4, 2, zeropy, op_lax) \
+  X(0xB8, CLV, kImpl, 2, 1, impl, op_clv)     \
+  X(0xB9, LDA, kAbsY, 4, 3, absy, op_lda)     \
+  X(0xBA, TSX, kImpl, 2, 1, impl, op_tsx)     \
+  X(0xBB, LAS, kAbsY, 4, 3, absy, op_las)     \
+  X(0xBC, LDY, kAbsX, 4, 3, absx, op_ldy)     \
+  X(0xBD, LDA, kAbsX, 4, 3, absx, op_lda)     \
+  X(0xBE, LDX, kAbsY, 4, 3, absy, op_ldx)     \
+  X(0xBF, LAX, kAbsY, 4, 3, absy, op_lax)     \
+  X(0xC0, CPY, kImm, 2, 2, imm, op_cpy)       \
+  X(0xC1, CMP, kIdxInd, 6, 2, idxind, op_cmp) \
+  X(0xC2, NOP, kImm, 2, 2, imm, op_nop)       \
+  X(0xC3, DCM, kIdxInd, 8, 2, idxind, op_dcm) \
+  X(0xC4, CPY, kZeroP, 3, 2, zerop, op_cpy)   \
+  X(0xC5, CMP, kZeroP, 3, 2, zerop, op_cmp)   \
+  X(0xC6, DEC, kZeroP, 5, 2, zerop, op_dec)   \
+  X(0xC7, DCM, kZeroP, 5, 2, zerop, op_dcm)   \
+  X(0xC8, INY, kImpl, 2, 1, impl, op_iny)     \
+  X(0xC9, CMP, kImm, 2, 2, imm, op_cmp)       \
+  X(0xCA, DEX, kImpl, 2, 1, impl, op_dex)     \
+  X(0xCB, SAX, kImm, 2, 2, imm, op_sax)       \
+  X(0xCC, CPY, kAbs, 4, 3, absolute, op_cpy)  \
+  X(0xCD, CMP, kAbs, 4, 3, absolute, op_cmp)  \
+  X(0xCE, DEC, kAbs, 6, 3, absolute, op_dec)  \
+  X(0xCF, DCM, kAbs, 6, 3, absolute, op_dcm)  \
+  X(0xD0, BNE, kRel, 2, 2, rel, op_bne)       \
+  X(0xD1, CMP, kIndIdx, 5, 2, indidx, op_cmp) \
+  X(0xD2, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0xD3, DCM, kIndIdx, 8, 2, indidx, op_dcm) \
+  X(0xD4, NOP, kZeroPX, 4, 2, zeropx, op_nop) \
+  X(0xD5, CMP, kZeroPX, 4, 2, zeropx, op_cmp) \
+  X(0xD6, DEC, kZeroPX, 6, 2, zeropx, op_dec) \
+  X(0xD7, DCM, kZeroPX, 6, 2, zeropx, op_dcm) \
+  X(0xD8, CLD, kImpl, 2, 1, impl, op_cld)     \
+  X(0xD9, CMP, kAbsY, 4, 3, absy, op_cmp)     \
+  X(0xDA, NOP, kImpl, 2, 1, impl, op_nop)     \
+  X(0xDB, DCM, kAbsY, 7, 3, absy, op_dcm)     \
+  X(0xDC, NOP, kAbsX, 4, 3, absx, op_nop)     \
+  X(0xDD, CMP, kAbsX, 4, 3, absx, op_cmp)     \
+  X(0xDE, DEC, kAbsX, 7, 3, absx, op_dec)     \
+  X(0xDF, DCM, kAbsX, 7, 3, absx, op_dcm)     \
+  X(0xE0, CPX, kImm, 2, 2, imm, op_cpx)       \
+  X(0xE1, SBC, kIdxInd, 6, 2, idxind, sbc_op) \
+  X(0xE2, NOP, kImm, 2, 2, imm, op_nop)       \
+  X(0xE3, INS, kIdxInd, 8, 2, idxind, ins_op) \
+  X(0xE4, CPX, kZeroP, 3, 2, zerop, op_cpx)   \
+  X(0xE5, SBC, kZeroP, 3, 2, zerop, sbc_op)   \
+  X(0xE6, INC, kZeroP, 5, 2, zerop, op_inc)   \
+  X(0xE7, INS, kZeroP, 5, 2, zerop, ins_op)   \
+  X(0xE8, INX, kImpl, 2, 1, impl, op_inx)     \
+  X(0xE9, SBC, kImm, 2, 2, imm, sbc_op)       \
+  X(0xEA, NOP, kImpl, 2, 1, impl, op_nop)     \
+  X(0xEB, SBC, kImm, 2, 2, imm, sbc_op)       \
+  X(0xEC, CPX, kAbs, 4, 3, absolute, op_cpx)  \
+  X(0xED, SBC, kAbs, 4, 3, absolute, sbc_op)  \
+  X(0xEE, INC, kAbs, 6, 3, absolute, op_inc)  \
+  X(0xEF, INS, kAbs, 6, 3, absolute, ins_op)  \
+  X(0xF0, BEQ, kRel, 2, 2, rel, op_beq)       \
+  X(0xF1, SBC, kIndIdx, 5, 2, indidx, sbc_op) \
+  X(0xF2, KIL, kImpl, 2, 1, impl, op_kil)     \
+  X(0xF3, INS, kIndIdx, 8, 2, indidx, ins_op) \
+  X(0xF4, NOP, kZeroPX, 4, 2, zeropx, op_nop) \
+  X(0xF5, SBC, kZeroPX, 4, 2, zeropx, sbc_op) \
+  X(0xF6, INC, kZeroPX, 6, 2, zeropx, op_inc) \
+  X(0xF7, INS, kZeroPX, 6, 2, zeropx, ins_op) \
+  X(0xF8, SED, kImpl, 2, 1, impl, op_sed)     \
+  X(0xF9, SBC, kAbsY, 4, 3, absy, sbc_op)     \
+  X(0xFA, NOP, kImpl, 2, 1, impl, op_nop)     \
+  X(0xFB, INS, kAbsY, 7, 3, absy, ins_op)     \
+  X(0xFC, NOP, kAbsX, 4, 3, absx, op_nop)     \
+  X(0xFD, SBC, kAbsX, 4, 3, absx, sbc_op)     \
+  X(0xFE, INC, kAbsX, 7, 3, absx, op_inc)     \
+  X(0xFF, INS, kAbsX, 7, 3, absx, ins_op)
+
+#define NMOS6502_OPCODES(X) NMOS_OPCODES(X, op_adc, op_sbc, op_rra, op_ins)
+#define RP2A03_OPCODES(X) \
+  NMOS_OPCODES(X, op_adc_binary, op_sbc_binary, op_rra_binary, op_ins_binary)
+
+// The 65C02 has no undocumented opcodes: the unused ones are NOPs of various lengths and cycle
+// counts. STP stops the CPU like KIL.
+#define WDC65C02_OPCODES(X) \
+  X(0x00, BRK, kImpl, 7, 1, impl, op_brk_cmos)      \
+  X(0x01, ORA, kIdxInd, 6, 2, idxind, op_ora)       \
+  X(0x02, NOP, kImm, 2, 2, imm, op_nop)             \
+  X(0x03, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x04, TSB, kZeroP, 5, 2, zerop, op_tsb)         \
+  X(0x05, ORA, kZeroP, 3, 2, zerop, op_ora)         \
+  X(0x06, ASL, kZeroP, 5, 2, zerop, op_asl)         \
+  X(0x07, RMB0, kZeroP, 5, 2, zerop, op_rmb0)       \
+  X(0x08, PHP, kImpl, 3, 1, impl, op_php)           \
+  X(0x09, ORA, kImm, 2, 2, imm, op_ora)             \
+  X(0x0A, ASL, kAcc, 2, 1, acc, op_asl)             \
+  X(0x0B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x0C, TSB, kAbs, 6, 3, absolute, op_tsb)        \
+  X(0x0D, ORA, kAbs, 4, 3, absolute, op_ora)        \
+  X(0x0E, ASL, kAbs, 6, 3, absolute, op_asl)        \
+  X(0x0F, BBR0, kZeroPRel, 5, 3, zprel, op_bbr0)    \
+  X(0x10, BPL, kRel, 2, 2, rel, op_bpl)             \
+  X(0x11, ORA, kIndIdx, 5, 2, indidx, op_ora)       \
+  X(0x12, ORA, kZeroPInd, 5, 2, zpind, op_ora)      \
+  X(0x13, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x14, TRB, kZeroP, 5, 2, zerop, op_trb)         \
+  X(0x15, ORA, kZeroPX, 4, 2, zeropx, op_ora)       \
+  X(0x16, ASL, kZeroPX, 6, 2, zeropx, op_asl)       \
+  X(0x17, RMB1, kZeroP, 5, 2, zerop, op_rmb1)       \
+  X(0x18, CLC, kImpl, 2, 1, impl, op_clc)           \
+  X(0x19, ORA, kAbsY, 4, 3, absy, op_ora)           \
+  X(0x1A, INC, kAcc, 2, 1, acc, op_inc)             \
+  X(0x1B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x1C, TRB, kAbs, 6, 3, absolute, op_trb)        \
+  X(0x1D, ORA, kAbsX, 4, 3, absx, op_ora)           \
+  X(0x1E, ASL, kAbsX, 6, 3, absx, op_asl_cmos)      \
+  X(0x1F, BBR1, kZeroPRel, 5, 3, zprel, op_bbr1)    \
+  X(0x20, JSR, kAbs, 6, 3, absolute, op_jsr)        \
+  X(0x21, AND, kIdxInd, 6, 2, idxind, op_and)       \
+  X(0x22, NOP, kImm, 2, 2, imm, op_nop)             \
+  X(0x23, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x24, BIT, kZeroP, 3, 2, zerop, op_bit)         \
+  X(0x25, AND, kZeroP, 3, 2, zerop, op_and)         \
+  X(0x26, ROL, kZeroP, 5, 2, zerop, op_rol)         \
+  X(0x27, RMB2, kZeroP, 5, 2, zerop, op_rmb2)       \
+  X(0x28, PLP, kImpl, 4, 1, impl, op_plp)           \
+  X(0x29, AND, kImm, 2, 2, imm, op_and)             \
+  X(0x2A, ROL, kAcc, 2, 1, acc, op_rol)             \
+  X(0x2B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x2C, BIT, kAbs, 4, 3, absolute, op_bit)        \
+  X(0x2D, AND, kAbs, 4, 3, absolute, op_and)        \
+  X(0x2E, ROL, kAbs, 6, 3, absolute, op_rol)        \
+  X(0x2F, BBR2, kZeroPRel, 5, 3, zprel, op_bbr2)    \
+  X(0x30, BMI, kRel, 2, 2, rel, op_bmi)             \
+  X(0x31, AND, kIndIdx, 5, 2, indidx, op_and)       \
+  X(0x32, AND, kZeroPInd, 5, 2, zpind, op_and)      \
+  X(0x33, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x34, BIT, kZeroPX, 4, 2, zeropx, op_bit)       \
+  X(0x35, AND, kZeroPX, 4, 2, zeropx, op_and)       \
+  X(0x36, ROL, kZeroPX, 6, 2, zeropx, op_rol)       \
+  X(0x37, RMB3, kZeroP, 5, 2, zerop, op_rmb3)       \
+  X(0x38, SEC, kImpl, 2, 1, impl, op_sec)           \
+  X(0x39, AND, kAbsY, 4, 3, absy, op_and)           \
+  X(0x3A, DEC, kAcc, 2, 1, acc, op_dec)             \
+  X(0x3B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x3C, BIT, kAbsX, 4, 3, absx, op_bit_cmos)      \
+  X(0x3D, AND, kAbsX, 4, 3, absx, op_and)           \
+  X(0x3E, ROL, kAbsX, 6, 3, absx, op_rol_cmos)      \
+  X(0x3F, BBR3, kZeroPRel, 5, 3, zprel, op_bbr3)    \
+  X(0x40, RTI, kImpl, 6, 1, impl, op_rti)           \
+  X(0x41, EOR, kIdxInd, 6, 2, idxind, op_eor)       \
+  X(0x42, NOP, kImm, 2, 2, imm, op_nop)             \
+  X(0x43, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x44, NOP, kZeroP, 3, 2, zerop, op_nop)         \
+  X(0x45, EOR, kZeroP, 3, 2, zerop, op_eor)         \
+  X(0x46, LSR, kZeroP, 5, 2, zerop, op_lsr)         \
+  X(0x47, RMB4, kZeroP, 5, 2, zerop, op_rmb4)       \
+  X(0x48, PHA, kImpl, 3, 1, impl, op_pha)           \
+  X(0x49, EOR, kImm, 2, 2, imm, op_eor)             \
+  X(0x4A, LSR, kAcc, 2, 1, acc, op_lsr)             \
+  X(0x4B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x4C, JMP, kAbs, 3, 3, absolute, op_jmp)        \
+  X(0x4D, EOR, kAbs, 4, 3, absolute, op_eor)        \
+  X(0x4E, LSR, kAbs, 6, 3, absolute, op_lsr)        \
+  X(0x4F, BBR4, kZeroPRel, 5, 3, zprel, op_bbr4)    \
+  X(0x50, BVC, kRel, 2, 2, rel, op_bvc)             \
+  X(0x51, EOR, kIndIdx, 5, 2, indidx, op_eor)       \
+  X(0x52, EOR, kZeroPInd, 5, 2, zpind, op_eor)      \
+  X(0x53, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x54, NOP, kZeroPX, 4, 2, zeropx, op_nop)       \
+  X(0x55, EOR, kZeroPX, 4, 2, zeropx, op_eor)       \
+  X(0x56, LSR, kZeroPX, 6, 2, zeropx, op_lsr)       \
+  X(0x57, RMB5, kZeroP, 5, 2, zerop, op_rmb5)       \
+  X(0x58, CLI, kImpl, 2, 1, impl, op_cli)           \
+  X(0x59, EOR, kAbsY, 4, 3, absy, op_eor)           \
+  X(0x5A, PHY, kImpl, 3, 1, impl, op_phy)           \
+  X(0x5B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x5C, NOP, kAbs, 8, 3, absolute, op_nop)        \
+  X(0x5D, EOR, kAbsX, 4, 3, absx, op_eor)           \
+  X(0x5E, LSR, kAbsX, 6, 3, absx, op_lsr_cmos)      \
+  X(0x5F, BBR5, kZeroPRel, 5, 3, zprel, op_bbr5)    \
+  X(0x60, RTS, kImpl, 6, 1, impl, op_rts)           \
+  X(0x61, ADC, kIdxInd, 6, 2, idxind, op_adc_cmos)  \
+  X(0x62, NOP, kImm, 2, 2, imm, op_nop)             \
+  X(0x63, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x64, STZ, kZeroP, 3, 2, zerop, op_stz)         \
+  X(0x65, ADC, kZeroP, 3, 2, zerop, op_adc_cmos)    \
+  X(0x66, ROR, kZeroP, 5, 2, zerop, op_ror)         \
+  X(0x67, RMB6, kZeroP, 5, 2, zerop, op_rmb6)       \
+  X(0x68, PLA, kImpl, 4, 1, impl, op_pla)           \
+  X(0x69, ADC, kImm, 2, 2, imm, op_adc_cmos)        \
+  X(0x6A, ROR, kAcc, 2, 1, acc, op_ror)             \
+  X(0x6B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x6C, JMP, kInd, 6, 3, ind_cmos, op_jmp)        \
+  X(0x6D, ADC, kAbs, 4, 3, absolute, op_adc_cmos)   \
+  X(0x6E, ROR, kAbs, 6, 3, absolute, op_ror)        \
+  X(0x6F, BBR6, kZeroPRel, 5, 3, zprel, op_bbr6)    \
+  X(0x70, BVS, kRel, 2, 2, rel, op_bvs)             \
+  X(0x71, ADC, kIndIdx, 5, 2, indidx, op_adc_cmos)  \
+  X(0x72, ADC, kZeroPInd, 5, 2, zpind, op_adc_cmos) \
+  X(0x73, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x74, STZ, kZeroPX, 4, 2, zeropx, op_stz)       \
+  X(0x75, ADC, kZeroPX, 4, 2, zeropx, op_adc_cmos)  \
+  X(0x76, ROR, kZeroPX, 6, 2, zeropx, op_ror)       \
+  X(0x77, RMB7, kZeroP, 5, 2, zerop, op_rmb7)       \
+  X(0x78, SEI, kImpl, 2, 1, impl, op_sei)           \
+  X(0x79, ADC, kAbsY, 4, 3, absy, op_adc_cmos)      \
+  X(0x7A, PLY, kImpl, 4, 1, impl, op_ply)           \
+  X(0x7B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x7C, JMP, kAbsXInd, 6, 3, absxind, op_jmp)     \
+  X(0x7D, ADC, kAbsX, 4, 3, absx, op_adc_cmos)      \
+  X(0x7E, ROR, kAbsX, 6, 3, absx, op_ror_cmos)      \
+  X(0x7F, BBR7, kZeroPRel, 5, 3, zprel, op_bbr7)    \
+  X(0x80, BRA, kRel, 2, 2, rel, op_bra)             \
+  X(0x81, STA, kIdxInd, 6, 2, idxind, op_sta)       \
+  X(0x82, NOP, kImm, 2, 2, imm, op_nop)             \
+  X(0x83, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x84, STY, kZeroP, 3, 2, zerop, op_sty)         \
+  X(0x85, STA, kZeroP, 3, 2, zerop, op_sta)         \
+  X(0x86, STX, kZeroP, 3, 2, zerop, op_stx)         \
+  X(0x87, SMB0, kZeroP, 5, 2, zerop, op_smb0)       \
+  X(0x88, DEY, kImpl, 2, 1, impl, op_dey)           \
+  X(0x89, BIT, kImm, 2, 2, imm, op_bit_imm)         \
+  X(0x8A, TXA, kImpl, 2, 1, impl, op_txa)           \
+  X(0x8B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x8C, STY, kAbs, 4, 3, absolute, op_sty)        \
+  X(0x8D, STA, kAbs, 4, 3, absolute, op_sta)        \
+  X(0x8E, STX, kAbs, 4, 3, absolute, op_stx)        \
+  X(0x8F, BBS0, kZeroPRel, 5, 3, zprel, op_bbs0)    \
+  X(0x90, BCC, kRel, 2, 2, rel, op_bcc)             \
+  X(0x91, STA, kIndIdx, 6, 2, indidx, op_sta)       \
+  X(0x92, STA, kZeroPInd, 5, 2, zpind, op_sta)      \
+  X(0x93, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x94, STY, kZeroPX, 4, 2, zeropx, op_sty)       \
+  X(0x95, STA, kZeroPX, 4, 2, zeropx, op_sta)       \
+  X(0x96, STX, kZeroPY, 4, 2, zeropy, op_stx)       \
+  X(0x97, SMB1, kZeroP, 5, 2, zerop, op_smb1)       \
+  X(0x98, TYA, kImpl, 2, 1, impl, op_tya)           \
+  X(0x99, STA, kAbsY, 5, 3, absy, op_sta)           \
+  X(0x9A, TXS, kImpl, 2, 1, impl, op_txs)           \
+  X(0x9B, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0x9C, STZ, kAbs, 4, 3, absolute, op_stz)        \
+  X(0x9D, STA, kAbsX, 5, 3, absx, op_sta)           \
+  X(0x9E, STZ, kAbsX, 5, 3, absx, op_stz)           \
+  X(0x9F, BBS1, kZeroPRel, 5, 3, zprel, op_bbs1)    \
+  X(0xA0, LDY, kImm, 2, 2, imm, op_ldy)             \
+  X(0xA1, LDA, kIdxInd, 6, 2, idxind, op_lda)       \
+  X(0xA2, LDX, kImm, 2, 2, imm, op_ldx)             \
+  X(0xA3, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xA4, LDY, kZeroP, 3, 2, zerop, op_ldy)         \
+  X(0xA5, LDA, kZeroP, 3, 2, zerop, op_lda)         \
+  X(0xA6, LDX, kZeroP, 3, 2, zerop, op_ldx)         \
+  X(0xA7, SMB2, kZeroP, 5, 2, zerop, op_smb2)       \
+  X(0xA8, TAY, kImpl, 2, 1, impl, op_tay)           \
+  X(0xA9, LDA, kImm, 2, 2, imm, op_lda)             \
+  X(0xAA, TAX, kImpl, 2, 1, impl, op_tax)           \
+  X(0xAB, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xAC, LDY, kAbs, 4, 3, absolute, op_ldy)        \
+  X(0xAD, LDA, kAbs, 4, 3, absolute, op_lda)        \
+  X(0xAE, LDX, kAbs, 4, 3, absolute, op_ldx)        \
+  X(0xAF, BBS2, kZeroPRel, 5, 3, zprel, op_bbs2)    \
+  X(0xB0, BCS, kRel, 2, 2, rel, op_bcs)             \
+  X(0xB1, LDA, kIndIdx, 5, 2, indidx, op_lda)       \
+  X(0xB2, LDA, kZeroPInd, 5, 2, zpind, op_lda)      \
+  X(0xB3, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xB4, LDY, kZeroPX, 4, 2, zeropx, op_ldy)       \
+  X(0xB5, LDA, kZeroPX, 4, 2, zeropx, op_lda)       \
+  X(0xB6, LDX, kZeroPY, 4, 2, zeropy, op_ldx)       \
+  X(0xB7, SMB3, kZeroP, 5, 2, zerop, op_smb3)       \
+  X(0xB8, CLV, kImpl, 2, 1, impl, op_clv)           \
+  X(0xB9, LDA, kAbsY, 4, 3, absy, op_lda)           \
+  X(0xBA, TSX, kImpl, 2, 1, impl, op_tsx)           \
+  X(0xBB, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xBC, LDY, kAbsX, 4, 3, absx, op_ldy)           \
+  X(0xBD, LDA, kAbsX, 4, 3, absx, op_lda)           \
+  X(0xBE, LDX, kAbsY, 4, 3, absy, op_ldx)           \
+  X(0xBF, BBS3, kZeroPRel, 5, 3, zprel, op_bbs3)    \
+  X(0xC0, CPY, kImm, 2, 2, imm, op_cpy)             \
+  X(0xC1, CMP, kIdxInd, 6, 2, idxind, op_cmp)       \
+  X(0xC2, NOP, kImm, 2, 2, imm, op_nop)             \
+  X(0xC3, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xC4, CPY, kZeroP, 3, 2, zerop, op_cpy)         \
+  X(0xC5, CMP, kZeroP, 3, 2, zerop, op_cmp)         \
+  X(0xC6, DEC, kZeroP, 5, 2, zerop, op_dec)         \
+  X(0xC7, SMB4, kZeroP, 5, 2, zerop, op_smb4)       \
+  X(0xC8, INY, kImpl, 2, 1, impl, op_iny)           \
+  X(0xC9, CMP, kImm, 2, 2, imm, op_cmp)             \
+  X(0xCA, DEX, kImpl, 2, 1, impl, op_dex)           \
+  X(0xCB, WAI, kImpl, 3, 1, impl, op_wai)           \
+  X(0xCC, CPY, kAbs, 4, 3, absolute, op_cpy)        \
+  X(0xCD, CMP, kAbs, 4, 3, absolute, op_cmp)        \
+  X(0xCE, DEC, kAbs, 6, 3, absolute, op_dec)        \
+  X(0xCF, BBS4, kZeroPRel, 5, 3, zprel, op_bbs4)    \
+  X(0xD0, BNE, kRel, 2, 2, rel, op_bne)             \
+  X(0xD1, CMP, kIndIdx, 5, 2, indidx, op_cmp)       \
+  X(0xD2, CMP, kZeroPInd, 5, 2, zpind, op_cmp)      \
+  X(0xD3, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xD4, NOP, kZeroPX, 4, 2, zeropx, op_nop)       \
+  X(0xD5, CMP, kZeroPX, 4, 2, zeropx, op_cmp)       \
+  X(0xD6, DEC, kZeroPX, 6, 2, zeropx, op_dec)       \
+  X(0xD7, SMB5, kZeroP, 5, 2, zerop, op_smb5)       \
+  X(0xD8, CLD, kImpl, 2, 1, impl, op_cld)           \
+  X(0xD9, CMP, kAbsY, 4, 3, absy, op_cmp)           \
+  X(0xDA, PHX, kImpl, 3, 1, impl, op_phx)           \
+  X(0xDB, STP, kImpl, 3, 1, impl, op_kil)           \
+  X(0xDC, NOP, kAbs, 4, 3, absolute, op_nop)        \
+  X(0xDD, CMP, kAbsX, 4, 3, absx, op_cmp)           \
+  X(0xDE, DEC, kAbsX, 7, 3, absx, op_dec)           \
+  X(0xDF, BBS5, kZeroPRel, 5, 3, zprel, op_bbs5)    \
+  X(0xE0, CPX, kImm, 2, 2, imm, op_cpx)             \
+  X(0xE1, SBC, kIdxInd, 6, 2, idxind, op_sbc_cmos)  \
+  X(0xE2, NOP, kImm, 2, 2, imm, op_nop)             \
+  X(0xE3, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xE4, CPX, kZeroP, 3, 2, zerop, op_cpx)         \
+  X(0xE5, SBC, kZeroP, 3, 2, zerop, op_sbc_cmos)    \
+  X(0xE6, INC, kZeroP, 5, 2, zerop, op_inc)         \
+  X(0xE7, SMB6, kZeroP, 5, 2, zerop, op_smb6)       \
+  X(0xE8, INX, kImpl, 2, 1, impl, op_inx)           \
+  X(0xE9, SBC, kImm, 2, 2, imm, op_sbc_cmos)        \
+  X(0xEA, NOP, kImpl, 2, 1, impl, op_nop)           \
+  X(0xEB, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xEC, CPX, kAbs, 4, 3, absolute, op_cpx)        \
+  X(0xED, SBC, kAbs, 4, 3, absolute, op_sbc_cmos)   \
+  X(0xEE, INC, kAbs, 6, 3, absolute, op_inc)        \
+  X(0xEF, BBS6, kZeroPRel, 5, 3, zprel, op_bbs6)    \
+  X(0xF0, BEQ, kRel, 2, 2, rel, op_beq)             \
+  X(0xF1, SBC, kIndIdx, 5, 2, indidx, op_sbc_cmos)  \
+  X(0xF2, SBC, kZeroPInd, 5, 2, zpind, op_sbc_cmos) \
+  X(0xF3, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xF4, NOP, kZeroPX, 4, 2, zeropx, op_nop)       \
+  X(0xF5, SBC, kZeroPX, 4, 2, zeropx, op_sbc_cmos)  \
+  X(0xF6, INC, kZeroPX, 6, 2, zeropx, op_inc)       \
+  X(0xF7, SMB7, kZeroP, 5, 2, zerop, op_smb7)       \
+  X(0xF8, SED, kImpl, 2, 1, impl, op_sed)           \
+  X(0xF9, SBC, kAbsY, 4, 3, absy, op_sbc_cmos)      \
+  X(0xFA, PLX, kImpl, 4, 1, impl, op_plx)           \
+  X(0xFB, NOP, kImpl, 1, 1, impl, op_nop)           \
+  X(0xFC, NOP, kAbs, 4, 3, absolute, op_nop)        \
+  X(0xFD, SBC, kAbsX, 4, 3, absx, op_sbc_cmos)      \
+  X(0xFE, INC, kAbsX, 7, 3, absx, op_inc)           \
+  X(0xFF, BBS7, kZeroPRel, 5, 3, zprel, op_bbs7)
+
+#define OPCODE_ENTRY(code, name, mode, cyc, len, mode_fn, op_fn) \
+  {#name, mode, cyc, len, &mode_fn, &op_fn},
+
+typedef struct Superinstruction {
+  uint8_t first;
+  uint8_t second;
+  pair_handler handler;
+} Superinstruction;
+
+// The opcode table of a variant and everything generated from it (see mos6502_variant.h).
+struct CpuCore {
+  const struct Opcode* opcodes;
+  const decoded_handler* decoded_handlers;
+  const Superinstruction* superinstructions;
+  size_t num_superinstructions;
+  size_t (*fused_run)(Mos6502* cpu, size_t count, uint32_t budget);
+  uint8_t interrupt_clears;  // The flags cleared when an interrupt is taken
+};
+
+/////////////////////////////////////////////////
+///     Execution
+/////////////////////////////////////////////////
+
+// Computed gotos are a GNU extension; anything else gets the portable switch.
+#if defined(__GNUC__) && !defined(B6502_PORTABLE_DISPATCH)
+#  define THREADED_DISPATCH
+#endif
+
+// Execute one instruction whose operand bytes have already been fetched. Every engine expands
+// this with its own opcode metadata, either constant or looked up in the core's opcode table.
+#define EXECUTE(cpu, mode, cyc, len, mode_fn, op_fn, operand)   \
+  do {                                                         \
+    (cpu)->current_mode = mode;                                \
+    int mode_cycles = mode_fn((cpu), (operand));               \
+    (cpu)->cycles += cyc;                                      \
+    (cpu)->pc = (uint16_t)((cpu)->pc + len);                   \
+    int opcode_cycles = op_fn(cpu);                            \
+    (cpu)->cycles += (uint32_t)(mode_cycles & opcode_cycles);  \
+  } while (0)
+
+static inline bool interrupt_pending(Interrupt status, uint8_t sr) {
+  return status == kNMI || (status == kIRQ && !(sr & I));
+}
+
+static inline bool waiting(Mos6502* cpu) {
+  return cpu->core->opcodes[read(cpu->bus, cpu->pc)].opcode_handler == &op_wai;
+}
+
+// The interrupt line is kept separately from the registers so that the batch engine can service
+// interrupts on its cached copy while still acknowledging them on the real CPU. An IRQ wakes a
+// 65C02 up from WAI even when I is set, without being taken.
+static inline void poll_interrupts(Mos6502* cpu, Interrupt* status) {
+  if (LIKELY(!interrupt_pending(*status, cpu->sr))) {
+    if (UNLIKELY(*status == kIRQ) && waiting(cpu)) {
+      cpu->pc = (uint16_t)(cpu->pc + 1);
+    }
+    return;
+  }
+
+  if (waiting(cpu)) {
+    cpu->pc = (uint16_t)(cpu->pc + 1);
+  }
+  interrupt(cpu, *status == kNMI ? NMI_VECTOR : IRQ_VECTOR);
+  cpu->sr = (uint8_t)(cpu->sr & ~cpu->core->interrupt_clears);
+  *status = kNone;
+}
+
+// Bookkeeping shared by the batch engines.
+typedef struct Batch {
+  size_t count;
+  size_t executed;
+  uint64_t start;
+  uint32_t budget;
+  uint32_t breakpoint;
+  uint16_t opc;
+} Batch;
+
+// A PC that did not move means the program is stuck in JMP * or a branch to itself.
+static inline bool batch_done(const Batch* batch, const Mos6502* regs, Interrupt status) {
+  return batch->executed == batch->count || regs->cycles - batch->start >= batch->budget
+         || regs->pc == batch->opc || regs->pc == batch->breakpoint
+         || interrupt_pending(status, regs->sr);
+}
+
+static inline StopReason batch_stop_reason(const Batch* batch, const Mos6502* regs,
+                                           Interrupt status) {
+  if (regs->jammed) {
+    return kStopJammed;
+  } else if (batch->executed && regs->pc == batch->opc) {
+    return kStopHalt;
+  } else if (regs->pc == batch->breakpoint) {
+    return kStopBreakpoint;
+  } else if (interrupt_pending(status, regs->sr)) {
+    return kStopInterrupt;
+  } else if (batch->executed == batch->count) {
+    return kStopCount;
+  }
+
+  return kStopBudget;
+}
+
+/////////////////////////////////////////////////
+///     Fused Engine
+/////////////////////////////////////////////////
+
+// One specialized handler per opcode: the addressing mode and the operation are both known at
+// compile time, so they are inlined together instead of going through the opcode table twice.
+#define FUSED_BODY(mode, cyc, len, mode_fn, op_fn) \
+  EXECUTE(&regs, mode, cyc, len, mode_fn, op_fn, fetch_operand(regs.bus, regs.pc, len))
+
+#ifdef THREADED_DISPATCH
+#  define FUSED_DISPATCH() \
+    batch.opc = regs.pc;   \
+    goto* dispatch[read(regs.bus, batch.opc)]
+#  define FUSED_LABEL(code, name, mode, cyc, len, mode_fn, op_fn) &&fused_##code,
+#  define FUSED_HANDLER(code, name, mode, cyc, len, mode_fn, op_fn) \
+    fused_##code : FUSED_BODY(mode, cyc, len, mode_fn, op_fn);      \
+    batch.executed++;                                               \
+    if (UNLIKELY(batch_done(&batch, &regs, cpu->intr_status))) {    \
+      goto stop;                                                    \
+    }                                                               \
+    FUSED_DISPATCH();
+#else
+#  define FUSED_CASE(code, name, mode, cyc, len, mode_fn, op_fn) \
+    case code:                                                   \
+      FUSED_BODY(mode, cyc, len, mode_fn, op_fn);                \
+      break;
+#endif
+
+/////////////////////////////////////////////////
+///     Block Cache
+/////////////////////////////////////////////////
+
+#define DECODED_HANDLER(code, name, mode, cyc, len, mode_fn, op_fn)     \
+  static void VARIANT(decoded_##code)(Mos6502* cpu, uint16_t operand) { \
+    EXECUTE(cpu, mode, cyc, len, mode_fn, op_fn, operand);              \
+  }
+#define DECODED_ENTRY(code, name, mode, cyc, len, mode_fn, op_fn) &VARIANT(decoded_##code),
+
+#define AOT_HANDLER(code, name, mode, cyc, len, mode_fn, op_fn) \
+  void VARIANT(aot_op_##code)(Mos6502* cpu, uint16_t operand) { \
+    VARIANT(decoded_##code)(cpu, operand);                      \
+  }
+
+/////////////////////////////////////////////////
+///     Superinstructions
+/////////////////////////////////////////////////
+
+#define SUPER_HANDLER(first, second) \
+  static bool VARIANT(super_##first##_##second)(Mos6502* cpu, const DecodedInstruction* pair)
+
+// Both halves in one dispatch. An interrupt raised by a bus access of the first half is taken
+// between the two, as it would be without fusion.
+#define SUPER_PAIR(first, second)                                 \
+  SUPER_HANDLER(first, second) {                                  \
+    VARIANT(decoded_##first)(cpu, pair[0].operand);               \
+    if (UNLIKELY(interrupt_pending(cpu->intr_status, cpu->sr))) { \
+      return false;                                               \
+    }                                                             \
+    VARIANT(decoded_##second)(cpu, pair[1].operand);              \
+    return true;                                                  \
+  }
+
+// INX/INY/DEX/DEY, then CMP/CPX/CPY #imm, which overwrites the N and Z of the step.
+#define SUPER_STEP_COMPARE(first, second, reg, delta) \
+  SUPER_HANDLER(first, second) {                      \
+    cpu->reg = (uint8_t)(cpu->reg + (delta));         \
+    cpu->data = (uint8_t)(pair[1].operand);           \
+    set_flag(cpu, C, cpu->reg >= cpu->data);          \
+    zn(cpu, (uint8_t)(cpu->reg - cpu->data));         \
+    cpu->cycles += 4;                                 \
+    cpu->pc = (uint16_t)(cpu->pc + 3);                \
+    return true;                                      \
+  }
+
+// INX/INY/DEX/DEY, then BNE/BEQ on the register itself rather than on Z.
+#define SUPER_STEP_BRANCH(first, second, reg, delta, if_zero) \
+  SUPER_HANDLER(first, second) {                              \
+    zn(cpu, cpu->reg = (uint8_t)(cpu->reg + (delta)));        \
+    cpu->cycles += 4;                                         \
+    cpu->pc = (uint16_t)(cpu->pc + 3);                        \
+    cpu->data = (uint8_t)(pair[1].operand);                   \
+    branch(cpu, (cpu->reg == 0) == (if_zero));                \
+    return true;                                              \
+  }
+
+// CMP/CPX/CPY #imm, then BNE/BEQ on the comparison itself rather than on Z.
+#define SUPER_COMPARE_BRANCH(first, second, reg, if_equal) \
+  SUPER_HANDLER(first, second) {                           \
+    const uint8_t value = (uint8_t)(pair[0].operand);      \
+    set_flag(cpu, C, cpu->reg >= value);                   \
+    zn(cpu, (uint8_t)(cpu->reg - value));                  \
+    cpu->cycles += 4;                                      \
+    cpu->pc = (uint16_t)(cpu->pc + 4);                     \
+    cpu->data = (uint8_t)(pair[1].operand);                \
+    branch(cpu, (cpu->reg == value) == (if_equal));        \
+    return true;                                           \
+  }
+
+#define SUPER(first, second) {first, second, &VARIANT(super_##first##_##second)}
+
+/////////////////////////////////////////////////
+///     CPU Variants
+/////////////////////////////////////////////////
+
+#define VARIANT_PASTE(prefix, name) prefix##name
+#define VARIANT_EXPAND(prefix, name) VARIANT_PASTE(prefix, name)
+#define VARIANT(name) VARIANT_EXPAND(VARIANT_PREFIX, name)
+
+#define VARIANT_PREFIX nmos6502_
+#define VARIANT_OPCODES(X) NMOS6502_OPCODES(X)
+#define VARIANT_INTERRUPT_CLEARS 0
+#include "b6502/mos6502_variant.h"
+#undef VARIANT_PREFIX
+#undef VARIANT_OPCODES
+#undef VARIANT_INTERRUPT_CLEARS
+
+#define VARIANT_PREFIX rp2a03_
+#define VARIANT_OPCODES(X) RP2A03_OPCODES(X)
+#define VARIANT_INTERRUPT_CLEARS 0
+#include "b6502/mos6502_variant.h"
+#undef VARIANT_PREFIX
+#undef VARIANT_OPCODES
+#undef VARIANT_INTERRUPT_CLEARS
+
+#define VARIANT_PREFIX wdc65c02_
+#define VARIANT_OPCODES(X) WDC65C02_OPCODES(X)
+#define VARIANT_INTERRUPT_CLEARS D
+#include "b6502/mos6502_variant.h"
+#undef VARIANT_PREFIX
+#undef VARIANT_OPCODES
+#undef VARIANT_INTERRUPT_CLEARS
+
+static const CpuCore* const cores[] = {
+    [kNMOS6502] = &nmos6502_core,
+    [kRicoh2A03] = &rp2a03_core,
+    [kWDC65C02] = &wdc65c02_core,
+};
+
+#undef VARIANT_PASTE
+#undef VARIANT_EXPAND
+#undef VARIANT
+#undef OPCODE_ENTRY
+#undef FUSED_BODY
+#ifdef THREADED_DISPATCH
+#  undef FUSED_DISPATCH
+#  undef FUSED_LABEL
+#  undef FUSED_HANDLER
+#else
+#  undef FUSED_CASE
+#endif
+#undef DECODED_HANDLER
+#undef DECODED_ENTRY
+#undef AOT_HANDLER
+#undef SUPER_HANDLER
+#undef SUPER_PAIR
+#undef SUPER_STEP_COMPARE
+#undef SUPER_STEP_BRANCH
+#undef SUPER_COMPARE_BRANCH
+#undef SUPER
+
+static const Superinstruction* find_superinstruction(const CpuCore* core, uint8_t first,
+                                                     uint8_t second) {
+  for (size_t i = 0; i < core->num_superinstructions; i++) {
+    if (core->superinstructions[i].first == first && core->superinstructions[i].second == second) {
+      return &core->superinstructions[i];
+    }
+  }
+  return NULL;
+}
+
+static inline bool ends_block(const struct Opcode* op) {
+  return op->mode == kRel || op->mode == kZeroPRel || op->opcode_handler == &op_jmp
+         || op->opcode_handler == &op_jsr || op->opcode_handler == &op_rts
+         || op->opcode_handler == &op_rti || op->opcode_handler == &op_brk
+         || op->opcode_handler == &op_brk_cmos || op->opcode_handler == &op_kil
+         || op->opcode_handler == &op_wai;
+}
+
+static inline bool block_current(const Bus* bus, const Block* block) {
+  return block->generations[0] == bus->page_generation[block->pages[0]]
+         && block->generations[1] == bus->page_generation[block->pages[1]];
+}
+
+// Instructions that can be part of an idle loop: they only read, and only from fixed addresses.
+static bool idle_safe(const struct Opcode* op) {
+  if (op->mode != kImm && op->mode != kZeroP && op->mode != kAbs && op->mode != kImpl) {
+    return false;
+  }
+
+  const handler h = op->opcode_handler;
+  return h == &op_lda || h == &op_ldx || h == &op_ldy || h == &op_bit || h == &op_cmp
+         || h == &op_cpx || h == &op_cpy || h == &op_and || h == &op_ora || h == &op_eor
+         || h == &op_nop || h == &op_tax || h == &op_tay || h == &op_txa || h == &op_tya
+         || h == &op_tsx || h == &op_txs || h == &op_clc || h == &op_sec || h == &op_clv
+         || h == &op_cld || h == &op_sed;
+}
+
+// The index register that a copy or fill loop steps with INX/DEX (1) or INY/DEY (2), or 0.
+static int transfer_index(uint8_t opcode) {
+  switch (opcode) {
+    case 0xBD:  // LDA abs,X
+    case 0x9D:  // STA abs,X
+    case 0xE8:  // INX
+    case 0xCA:  // DEX
+      return 1;
+    case 0xB9:  // LDA abs,Y
+    case 0xB1:  // LDA (zp),Y
+    case 0x99:  // STA abs,Y
+    case 0x91:  // STA (zp),Y
+    case 0xC8:  // INY
+    case 0x88:  // DEY
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+// [LDA src,i] / STA dst,i / IN-/DE-i / BNE start, all on the same index register.
+static bool is_transfer_loop(const CpuCore* core, const Block* block) {
+  if (block->length != 3 && block->length != 4) {
+    return false;
+  }
+
+  const DecodedInstruction* insn = block->instructions;
+  const DecodedInstruction* last = &insn[block->length - 1];
+  if (last->opcode != 0xD0
+      || (uint16_t)(last->pc + last->length + (int8_t)last->operand) != block->start) {
+    return false;
+  }
+
+  const int index = transfer_index(insn[block->length - 2].opcode);
+  const DecodedInstruction* store = &insn[block->length - 3];
+  if (!index || core->opcodes[store->opcode].opcode_handler != &op_sta
+      || transfer_index(store->opcode) != index) {
+    return false;
+  }
+
+  return block->length == 3
+         || (core->opcodes[insn[0].opcode].opcode_handler == &op_lda
+             && transfer_index(insn[0].opcode) == index);
+}
+
+// A short loop that jumps back to the start of its own block without writing anything.
+static bool is_idle_loop(const CpuCore* core, const Block* block) {
+  if (block->length > MAX_IDLE_LOOP_LENGTH) {
+    return false;
+  }
+
+  const DecodedInstruction* last = &block->instructions[block->length - 1];
+  uint16_t target;
+  if (core->opcodes[last->opcode].mode == kRel) {
+    target = (uint16_t)(last->pc + last->length + (int8_t)last->operand);
+  } else if (last->opcode == 0x4C) {  // JMP abs
+    target = last->operand;
+  } else {
+    return false;
+  }
+
+  if (target != block->start) {
+    return false;
+  }
+
+  for (size_t i = 0; i + 1 < block->length; i++) {
+    if (!idle_safe(&core->opcodes[block->instructions[i].opcode])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void decode_block(const CpuCore* core, Bus* bus, Block* block, uint16_t pc) {
+  block->start = pc;
+  block->length = 0;
+  block->cycles = 0;
+  block->executions = 0;
+  block->native = NULL;
+  block->pages[0] = (uint8_t)code_page(bus, pc);
+
+  uint16_t last = pc;
+  while (block->length < MAX_BLOCK_LENGTH) {
+    const uint8_t opcode = read(bus, pc);
+    const struct Opcode* op = &core->opcodes[opcode];
+    DecodedInstruction* insn = &block->instructions[block->length++];
+    insn->handler = core->decoded_handlers[opcode];
+    insn->pc = pc;
+    insn->opcode = opcode;
+    insn->operand = fetch_operand(bus, pc, op->length);
+    insn->cycles = (uint8_t)(op->cycles);
+    insn->length = op->length;
+    block->cycles += op->cycles;
+    last = (uint16_t)(pc + op->length - 1);
+    pc = (uint16_t)(pc + op->length);
+    if (ends_block(op)) {
+      break;
+    }
+  }
+
+  block->size = (uint16_t)(pc - block->start);
+  block->pages[1] = (uint8_t)code_page(bus, last);
+  for (size_t i = 0; i < 2; i++) {
+    bus->code_pages[block->pages[i]] = true;
+    block->generations[i] = bus->page_generation[block->pages[i]];
+  }
+  block->idle = is_idle_loop(core, block);
+  block->transfer = is_transfer_loop(core, block);
+
+  for (size_t i = 0; i < block->length; i++) {
+    DecodedInstruction* insn = &block->instructions[i];
+    const Superinstruction* super =
+        i + 1 < block->length ? find_superinstruction(core, insn->opcode, insn[1].opcode) : NULL;
+    insn->pair = super ? super->handler : NULL;
+  }
+}
+
+static Block* lookup_block(Mos6502* cpu, uint16_t pc) {
+  BlockCache* cache = cpu->blocks;
+  Block* block = &cache->blocks[pc & (BLOCK_CACHE_SIZE - 1)];
+  if (LIKELY(block->length && block->start == pc && block_current(cpu->bus, block))) {
+    cache->hits++;
+    return block;
+  }
+
+  cache->misses++;
+  decode_block(cpu->core, cpu->bus, block, pc);
+  return block;
+}
+
+#ifdef B6502_JIT
+// A translated block runs to completion, so it is only used when the whole block fits in what is
+// left of the batch and the breakpoint is not inside it. Interrupts raised by the block's own bus
+// accesses are noticed at the end of the block.
+static inline bool fits_batch(const Batch* batch, const Block* block) {
+  const uint32_t offset = (uint16_t)(batch->breakpoint - block->start);
+  return batch->count - batch->executed >= block->length
+         && (batch->breakpoint == NO_BREAKPOINT || offset == 0 || offset >= block->size);
+}
+#endif
+
+// A pair can run as a superinstruction when the batch could not have stopped between its two
+// halves. The first half never takes more than one cycle over its base cost, and never writes.
+static inline bool fits_pair(const Batch* batch, const Mos6502* cpu,
+                             const DecodedInstruction* insn) {
+  return batch->count - batch->executed >= 2 && insn[1].pc != batch->breakpoint
+         && cpu->cycles - batch->start + insn->cycles + 1 < batch->budget;
+}
+
+static void count_pairs(uint64_t* pairs, const Block* block) {
+  for (size_t i = 0; i + 1 < block->length; i++) {
+    pairs[block->instructions[i].opcode * NUM_OF_OPCODES + block->instructions[i + 1].opcode]++;
+  }
+}
+
+// Resolve the address an indexed LDA/STA of a transfer loop accesses, if it is plain memory.
+// (zp),Y reads its pointer on every iteration, since the loop may be overwriting it.
+static bool transfer_address(const Bus* bus, const DecodedInstruction* insn, uint8_t index,
+                             uint16_t* base, uint16_t* addr) {
+  if (insn->opcode == 0x91 || insn->opcode == 0xB1) {  // STA (zp),Y and LDA (zp),Y
+    const uint8_t* zp = bus->read_pages[0];
+    if (!zp || (uint8_t)insn->operand == 0xFF) {
+      return false;
+    }
+    *base = (uint16_t)(zp[insn->operand] | zp[insn->operand + 1] << 8);
+  } else {
+    *base = insn->operand;
+  }
+
+  *addr = (uint16_t)(*base + index);
+  return bus->read_pages[*addr / NUMBER_OF_PAGES] != NULL;
+}
+
+// Run the iterations of a copy or fill loop that end with the branch taken, as long as they stay
+// on plain memory and within the batch. The final iteration is left to the interpreter, so the
+// result is exactly what interpreting every instruction would have produced.
+static bool run_transfer_loop(Mos6502* cpu, const Block* block, Batch* batch) {
+  const DecodedInstruction* insn = block->instructions;
+  const DecodedInstruction* load = block->length == 4 ? &insn[0] : NULL;
+  const DecodedInstruction* store = &insn[block->length - 3];
+  const DecodedInstruction* step = &insn[block->length - 2];
+  const DecodedInstruction* loop = &insn[block->length - 1];
+  const uint16_t offset = (uint16_t)(batch->breakpoint - block->start);
+  if (batch->breakpoint != NO_BREAKPOINT && offset < block->size) {
+    return false;
+  }
+
+  Bus* bus = cpu->bus;
+  uint8_t* index = transfer_index(step->opcode) == 1 ? &cpu->x : &cpu->y;
+  const uint8_t delta = step->opcode == 0xE8 || step->opcode == 0xC8 ? 1 : 0xFF;
+  const uint32_t fixed = (uint32_t)(store->cycles + step->cycles + loop->cycles + 1)
+                         + cross((uint16_t)(loop->pc + loop->length), block->start);
+  const uint64_t end = batch->start + batch->budget;
+  size_t iterations = 0;
+  while (batch->executed + block->length <= batch->count && (uint8_t)(*index + delta)) {
+    uint32_t cycles = fixed;
+    uint16_t base;
+    uint16_t from = 0;
+    uint16_t to;
+    if (load) {
+      if (!transfer_address(bus, load, *index, &base, &from)) {
+        break;
+      }
+      cycles += load->cycles + cross(base, from);
+    }
+    if (!transfer_address(bus, store, *index, &base, &to) || !bus->write_pages[to / NUMBER_OF_PAGES]
+        || cpu->cycles + cycles >= end) {
+      break;
+    }
+
+    if (load) {
+      cpu->a = bus->read_pages[from / NUMBER_OF_PAGES][from % NUMBER_OF_PAGES];
+    }
+    bus->write_pages[to / NUMBER_OF_PAGES][to % NUMBER_OF_PAGES] = cpu->a;
+    *index = (uint8_t)(*index + delta);
+    cpu->cycles += cycles;
+    batch->executed += block->length;
+    iterations++;
+
+    const size_t code = code_page(bus, to);
+    if (UNLIKELY(bus->code_pages[code])) {
+      invalidate_page(bus, code);
+      break;
+    }
+  }
+
+  if (!iterations) {
+    return false;
+  }
+
+  zn(cpu, *index);
+  cpu->pc = block->start;
+  batch->opc = loop->pc;
+  cpu->blocks->transfers += 1;
+  return true;
+}
+
+// The state that an idle loop must come back to unchanged.
+typedef struct IdleState {
+  uint64_t cycles;
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t sp;
+  uint8_t sr;
+} IdleState;
+
+static inline void save_idle_state(const Mos6502* cpu, IdleState* state) {
+  state->cycles = cpu->cycles;
+  state->a = cpu->a;
+  state->x = cpu->x;
+  state->y = cpu->y;
+  state->sp = cpu->sp;
+  state->sr = get_sr(cpu);
+}
+
+// Skip whole iterations of an idle loop up to the end of the batch, once an iteration is seen to
+// end in the state it started in. Without writes, nothing the loop reads can change until a
+// device event or an interrupt ends the batch, so every further iteration would be the same.
+static void skip_idle_loop(Mos6502* cpu, const Block* block, const IdleState* before,
+                           Batch* batch) {
+  const uint16_t offset = (uint16_t)(batch->breakpoint - block->start);
+  if (cpu->pc != block->start || (batch->breakpoint != NO_BREAKPOINT && offset < block->size)
+      || cpu->a != before->a || cpu->x != before->x || cpu->y != before->y
+      || cpu->sp != before->sp || get_sr(cpu) != before->sr) {
+    return;
+  }
+
+  // Device registers may change or have side effects when read, so only plain memory qualifies.
+  for (size_t i = 0; i < block->length; i++) {
+    const DecodedInstruction* insn = &block->instructions[i];
+    const AddressingMode mode = cpu->core->opcodes[insn->opcode].mode;
+    if ((mode == kZeroP || mode == kAbs)
+        && !cpu->bus->read_pages[insn->operand / NUMBER_OF_PAGES]) {
+      return;
+    }
+  }
+
+  const uint64_t iteration = cpu->cycles - before->cycles;
+  const uint64_t end = batch->start + batch->budget;
+  if (!iteration || cpu->cycles >= end) {
+    return;
+  }
+
+  uint64_t iterations = (end - cpu->cycles) / iteration;
+  const uint64_t left = (batch->count - batch->executed) / block->length;
+  if (iterations > left) {
+    iterations = left;
+  }
+
+  cpu->cycles += iterations * iteration;
+  cpu->skipped_cycles += iterations * iteration;
+  batch->executed += (size_t)(iterations * block->length);
+}
+
+/*
+ * Run predecoded blocks until batch_done(). A write that invalidates any code page ends the
+ * current block early, so a block that modifies its own instructions is decoded again before the
+ * modified instruction runs. Hot blocks are handed to the JIT when it is enabled.
+ */
+static size_t block_run(Mos6502* cpu, size_t count, uint32_t budget) {
+  Batch batch = {count, 0, cpu->cycles, budget, cpu->breakpoint, cpu->pc};
+
+  load_flags(cpu);
+  poll_interrupts(cpu, &cpu->intr_status);
+  if (!count) {
+    goto stop;
+  }
+
+  for (;;) {
+    Block* block = lookup_block(cpu, cpu->pc);
+    if (UNLIKELY(cpu->blocks->pairs)) {
+      count_pairs(cpu->blocks->pairs, block);
+    }
+
+    const bool may_idle = block->idle && cpu->skip_idle;
+    IdleState idle = {0};
+    if (UNLIKELY(may_idle)) {
+      save_idle_state(cpu, &idle);
+    }
+
+    if (UNLIKELY(block->transfer) && run_transfer_loop(cpu, block, &batch)) {
+      if (UNLIKELY(batch_done(&batch, cpu, cpu->intr_status))) {
+        goto stop;
+      }
+      continue;
+    }
+
+#ifdef B6502_JIT
+    if (cpu->blocks->jit && fits_batch(&batch, block)) {
+      native_block native = jit_lookup(cpu->blocks->jit, block);
+      if (native) {
+        uint32_t executed = native(cpu);
+        batch.executed += executed;
+        batch.opc = block->instructions[executed - 1].pc;
+        if (UNLIKELY(batch_done(&batch, cpu, cpu->intr_status))) {
+          goto stop;
+        }
+        if (UNLIKELY(may_idle)) {
+          skip_idle_loop(cpu, block, &idle, &batch);
+        }
+        continue;
+      }
+    }
+#endif
+
+    const uint64_t invalidations = cpu->bus->code_invalidations;
+    for (size_t i = 0; i < block->length; i++) {
+      const DecodedInstruction* insn = &block->instructions[i];
+      if (insn->pair && fits_pair(&batch, cpu, insn)) {
+        batch.opc = insn[1].pc;
+        if (LIKELY(insn->pair(cpu, insn))) {
+          cpu->blocks->superinstructions += 1;
+          batch.executed += 2;
+          i++;
+        } else {
+          batch.opc = insn->pc;
+          batch.executed++;
+        }
+      } else {
+        batch.opc = cpu->pc;
+        insn->handler(cpu, insn->operand);
+        batch.executed++;
+      }
+
+      if (UNLIKELY(batch_done(&batch, cpu, cpu->intr_status))) {
+        goto stop;
+      }
+
+      if (UNLIKELY(cpu->bus->code_invalidations != invalidations)) {
+        break;
+      }
+    }
+
+    if (UNLIKELY(may_idle)) {
+      skip_idle_loop(cpu, block, &idle, &batch);
+    }
+  }
+
+stop:
+  cpu->stop_reason = batch_stop_reason(&batch, cpu, cpu->intr_status);
+  store_flags(cpu);
+  return batch.executed;
+}
+
+/////////////////////////////////////////////////
+///     Ahead-of-time recompiled code
+/////////////////////////////////////////////////
+
+// How many times the code on a page can be found changed before the page is left to the
+// interpreter for good.
+#define MAX_AOT_PAGE_REWRITES 8
+
+struct AotState {
+  const AotProgram* program;
+  uint64_t invalidations;
+  uint64_t stale_blocks;
+  // The blocks on each page are page_blocks[page_start[page]] to page_blocks[page_start[page + 1]]
+  uint32_t page_start[NUMBER_OF_PAGES + 1];
+  uint32_t* page_blocks;
+  // The pages holding blocks that are still watched for writes
+  uint8_t watched[NUMBER_OF_PAGES];
+  size_t num_watched;
+  uint8_t rewrites[NUMBER_OF_PAGES];
+  bool stale[];
 };
 
+static void aot_state_deinit(void* obj) {
+  AotState* aot = obj;
+  if (aot->page_blocks) {
+    rc_strong_release((void*)&aot->page_blocks);
+  }
+}
+
+// Index the blocks by the pages they start and end on.
+static void index_aot_pages(const Bus* bus, AotState* aot) {
+  const AotProgram* program = aot->program;
+  uint32_t count[NUMBER_OF_PAGES + 1] = {0};
+  for (size_t i = 0; i < program->num_blocks; i++) {
+    const AotBlock* block = &program->blocks[i];
+    const size_t first = code_page(bus, block->start);
+    const size_t last = code_page(bus, (uint16_t)(block->start + block->size - 1));
+    count[first + 1] += 1;
+    if (last != first) {
+      count[last + 1] += 1;
+    }
+  }
+  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+    aot->page_start[page + 1] = aot->page_start[page] + count[page + 1];
+    count[page] = aot->page_start[page];
+    if (aot->page_start[page + 1] != aot->page_start[page]) {
+      aot->watched[aot->num_watched++] = (uint8_t)page;
+    }
+  }
+
+  aot->page_blocks = rc_alloc((aot->page_start[NUMBER_OF_PAGES] + 1) * sizeof(uint32_t), NULL);
+  for (size_t i = 0; i < program->num_blocks; i++) {
+    const AotBlock* block = &program->blocks[i];
+    const size_t first = code_page(bus, block->start);
+    const size_t last = code_page(bus, (uint16_t)(block->start + block->size - 1));
+    aot->page_blocks[count[first]++] = (uint32_t)i;
+    if (last != first) {
+      aot->page_blocks[count[last]++] = (uint32_t)i;
+    }
+  }
+}
+
+static bool aot_block_matches(const Bus* bus, const AotState* aot, const AotBlock* block) {
+  const uint16_t last = (uint16_t)(block->start + block->size - 1);
+  if (aot->rewrites[code_page(bus, block->start)] == MAX_AOT_PAGE_REWRITES
+      || aot->rewrites[code_page(bus, last)] == MAX_AOT_PAGE_REWRITES) {
+    return false;
+  }
+
+  for (size_t i = 0; i < block->size; i++) {
+    const uint16_t addr = (uint16_t)(block->start + i);
+    const uint8_t* page = bus->read_pages[addr / NUMBER_OF_PAGES];
+    if (!page || page[addr % NUMBER_OF_PAGES] != block->bytes[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Compare the blocks on every watched page the bus reported a write to with the bytes they were
+ * recompiled from, and have the bus report the next write to the page. Blocks that don't match
+ * are interpreted, but their page stays watched in case the code is written back, unless that
+ * keeps happening: self-modifying code and data sharing a page with code would have every block
+ * on the page checked over and over.
+ */
+static void validate_aot(Mos6502* cpu, AotState* aot) {
+  Bus* bus = cpu->bus;
+  for (size_t i = 0; i < aot->num_watched;) {
+    const uint8_t page = aot->watched[i];
+    if (bus->code_pages[page]) {
+      i++;
+      continue;
+    }
+
+    bool rewritten = false;
+    for (uint32_t j = aot->page_start[page]; j < aot->page_start[page + 1]; j++) {
+      const uint32_t index = aot->page_blocks[j];
+      const bool stale = !aot_block_matches(bus, aot, &aot->program->blocks[index]);
+      rewritten |= stale;
+      aot->stale[index] = stale;
+      aot->stale_blocks += stale;
+    }
+
+    if (rewritten && ++aot->rewrites[page] == MAX_AOT_PAGE_REWRITES) {
+      for (uint32_t j = aot->page_start[page]; j < aot->page_start[page + 1]; j++) {
+        aot->stale[aot->page_blocks[j]] = true;
+      }
+      aot->watched[i] = aot->watched[--aot->num_watched];
+    } else {
+      bus->code_pages[page] = true;
+      i++;
+    }
+  }
+  aot->invalidations = bus->code_invalidations;
+}
+
+/*
+ * Run recompiled blocks until batch_done(). The recompiled code returns whenever it reaches a PC
+ * it has no usable block for, and that instruction is interpreted.
+ */
+static size_t aot_run(Mos6502* cpu, size_t count, uint32_t budget) {
+  Batch batch = {count, 0, cpu->cycles, budget, cpu->breakpoint, cpu->pc};
+  AotState* aot = cpu->aot;
+
+  load_flags(cpu);
+  poll_interrupts(cpu, &cpu->intr_status);
+  if (!count) {
+    goto stop;
+  }
+
+  for (;;) {
+    if (UNLIKELY(cpu->bus->code_invalidations != aot->invalidations)) {
+      validate_aot(cpu, aot);
+    }
+
+    AotBatch run = {.count = batch.count,
+                    .executed = batch.executed,
+                    .end = batch.start + batch.budget,
+                    .invalidations = aot->invalidations,
+                    .breakpoint = batch.breakpoint,
+                    .opc = batch.opc,
+                    .blocks = aot->program->blocks,
+                    .stale = aot->stale};
+    aot->program->run(cpu, &run);
+    if (run.executed != batch.executed) {
+      batch.executed = run.executed;
+      batch.opc = run.opc;
+      if (UNLIKELY(batch_done(&batch, cpu, cpu->intr_status))) {
+        goto stop;
+      }
+    }
+
+    const uint8_t opcode = read(cpu->bus, cpu->pc);
+    batch.opc = cpu->pc;
+    cpu->core->decoded_handlers[opcode](
+        cpu, fetch_operand(cpu->bus, cpu->pc, cpu->core->opcodes[opcode].length));
+    batch.executed++;
+    if (UNLIKELY(batch_done(&batch, cpu, cpu->intr_status))) {
+      goto stop;
+    }
+  }
+
+stop:
+  cpu->stop_reason = batch_stop_reason(&batch, cpu, cpu->intr_status);
+  store_flags(cpu);
+  return batch.executed;
+}
+
+// Traced and profiled code runs through step(), which is where the tracer and profiler are hooked
+// in.
+static size_t stepped_run(Mos6502* cpu, size_t count, uint32_t budget) {
+  Batch batch = {count, 0, cpu->cycles, budget, cpu->breakpoint, cpu->pc};
+  while (batch.executed < count) {
+    batch.opc = cpu->pc;
+    step(cpu);
+    batch.executed++;
+    if (UNLIKELY(batch_done(&batch, cpu, cpu->intr_status))) {
+      break;
+    }
+  }
+
+  cpu->stop_reason = batch_stop_reason(&batch, cpu, cpu->intr_status);
+  return batch.executed;
+}
+
+static size_t run_batch(Mos6502* cpu, size_t count, uint32_t budget) {
+  if (UNLIKELY(cpu->jammed)) {
+    cpu->stop_reason = kStopJammed;
+    return 0;
+  } else if (UNLIKELY(cpu->tracer)) {
+    return stepped_run(cpu, count, budget);
+#ifdef B6502_PROFILER
+  } else if (cpu->profiler) {
+    return stepped_run(cpu, count, budget);
+#endif
+  } else if (cpu->aot) {
+    return aot_run(cpu, count, budget);
+  } else if (cpu->blocks) {
+    return block_run(cpu, count, budget);
+  }
+
+  return cpu->core->fused_run(cpu, count, budget);
+}
+
+#undef EXECUTE
+
 /////////////////////////////////////////////////
 ///     Reset handler and Destructor
 /////////////////////////////////////////////////
 
+static void block_cache_deinit(void* obj) {
+  BlockCache* cache = obj;
+  if (cache->jit) {
+    rc_strong_release((void*)&cache->jit);
+  }
+  if (cache->pairs) {
+    rc_strong_release((void*)&cache->pairs);
+  }
+}
+
 static void cpu_deinit(void* obj) {
   Mos6502* cpu = obj;
-  for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
-    rc_weak_release((void*)&cpu->bus->handlers[page]);
+  if (cpu->blocks) {
+    rc_strong_release((void*)&cpu->blocks);
+  }
+  if (cpu->aot) {
+    rc_strong_release((void*)&cpu->aot);
   }
+  if (cpu->profiler) {
+    rc_strong_release((void*)&cpu->profiler);
+  }
+  if (cpu->tracer) {
+    rc_strong_release((void*)&cpu->tracer);
+  }
+
+  rc_strong_release((void*)&cpu->scheduler);
   rc_strong_release((void*)&cpu->bus);
 }
 
@@ -818,7 +2463,10 @@ static void cpu_reset(void* obj) {
   cpu->addr = 0;
   cpu->sr = 0x34;
   cpu->sp = 0xFD;
-  cpu->cycles = 8;
+  // The reset sequence takes time like any other, so that event deadlines and the cycles devices
+  // were synced to stay in the past.
+  cpu->cycles += 8;
+  cpu->jammed = false;
   cpu->pc = read16(cpu->bus, RES_VECTOR);
 }
 
@@ -826,11 +2474,17 @@ static void cpu_reset(void* obj) {
 ///     Public API
 /////////////////////////////////////////////////
 
-Mos6502* mos6502_create(ResetManager* rm) {
+Mos6502* mos6502_create(ResetManager* rm, CpuVariant variant) {
   Mos6502* cpu = rc_alloc(sizeof(*cpu), cpu_deinit);
-  cpu->bus = rc_alloc(sizeof(*cpu->bus), NULL);
+  cpu->variant = variant;
+  cpu->core = cores[variant];
+  cpu->bus = bus_create();
+  cpu->scheduler = scheduler_create();
+  cpu->bus->clock = &cpu->cycles;
+  cpu->skip_idle = true;
   cpu->sr = 0x34;
   cpu->sp = 0xFD;
+  cpu->breakpoint = NO_BREAKPOINT;
   add_rm_device(rm, cpu, cpu_reset);
   return cpu;
 }
@@ -843,25 +2497,298 @@ void raise_irq(Mos6502* cpu) {
 
 void raise_nmi(Mos6502* cpu) { cpu->intr_status = kNMI; }
 
+void get_opcode_info(CpuVariant variant, uint8_t opcode, OpcodeInfo* info) {
+  const struct Opcode* op = &cores[variant]->opcodes[opcode];
+  info->name = op->name;
+  info->mode = op->mode;
+  info->cycles = op->cycles;
+  info->length = op->length;
+}
+
 void step(Mos6502* cpu) {
-  switch (cpu->intr_status) {
-    case kNone:
-      break;
-    case kIRQ:
-      interrupt(cpu, IRQ_VECTOR);
+  if (UNLIKELY(cpu->jammed)) {
+    return;
+  }
+
+#ifdef B6502_PROFILER
+  const uint64_t start = cpu->cycles;
+  const uint8_t sp = cpu->sp;
+#endif
+
+  load_flags(cpu);
+  poll_interrupts(cpu, &cpu->intr_status);
+
+#ifdef B6502_PROFILER
+  // Taking an interrupt is the only thing here that moves the stack pointer.
+  if (cpu->profiler && cpu->sp != sp) {
+    profile_interrupt(cpu->profiler, cpu->pc, cpu->sp);
+  }
+  const uint16_t pc = cpu->pc;
+#endif
+
+  const uint8_t opcode = read(cpu->bus, cpu->pc);
+  const struct Opcode* op = &cpu->core->opcodes[opcode];
+  uint16_t operand = fetch_operand(cpu->bus, cpu->pc, op->length);
+  cpu->current_mode = op->mode;
+
+  if (UNLIKELY(cpu->tracer)) {
+    const TraceRecord record = {.cycle = cpu->cycles,
+                                .pc = cpu->pc,
+                                .opcode = opcode,
+                                .length = op->length,
+                                .operand = {(uint8_t)operand, (uint8_t)(operand >> 8)},
+                                .a = cpu->a,
+                                .x = cpu->x,
+                                .y = cpu->y,
+                                .sp = cpu->sp,
+                                .sr = get_sr(cpu)};
+    trace_append(cpu->tracer, &record);
+  }
+
+  int mode_cycles = (*op->mode_handler)(cpu, operand);
+  cpu->cycles += op->cycles;
+  cpu->pc += (uint16_t)(op->length);
+  int opcode_cycles = (*op->opcode_handler)(cpu);
+
+  cpu->cycles += (uint32_t)(mode_cycles & opcode_cycles);
+  store_flags(cpu);
+
+#ifdef B6502_PROFILER
+  if (cpu->profiler) {
+    profile_instruction(cpu->profiler, pc, opcode, (uint32_t)(cpu->cycles - start), cpu->pc,
+                        cpu->sp);
+  }
+#endif
+}
+
+size_t mos6502_execute(Mos6502* cpu, size_t count) {
+  size_t executed = 0;
+  while (executed < count) {
+    executed += run_batch(cpu, count - executed, UINT32_MAX);
+    if (cpu->stop_reason == kStopHalt || cpu->stop_reason == kStopBreakpoint
+        || cpu->stop_reason == kStopJammed) {
       break;
-    case kNMI:
-      interrupt(cpu, NMI_VECTOR);
+    }
+  }
+
+  return executed;
+}
+
+uint32_t mos6502_run(Mos6502* cpu, uint32_t cycle_budget) {
+  uint64_t start = cpu->cycles;
+  (void)(run_batch(cpu, SIZE_MAX, cycle_budget));
+  return (uint32_t)(cpu->cycles - start);
+}
+
+// A halted CPU sits on JMP *, a branch to itself or WAI until the next event. Each iteration takes
+// 3 cycles, or 4 for a branch whose next instruction is on another page. JMP (ind) reads its
+// pointer from the bus on every iteration, so it is left alone.
+static void skip_halt(Mos6502* cpu, uint64_t deadline) {
+  const uint8_t opcode = read(cpu->bus, cpu->pc);
+  const struct Opcode* op = &cpu->core->opcodes[opcode];
+  if ((opcode != 0x4C && op->mode != kRel && op->opcode_handler != &op_wai)
+      || cpu->cycles >= deadline) {
+    return;
+  }
+
+  const uint16_t next = (uint16_t)(cpu->pc + 2);
+  const uint64_t iteration = op->mode == kRel && (next >> 8) != (cpu->pc >> 8) ? 4 : 3;
+  const uint64_t skipped = (deadline - cpu->cycles) / iteration * iteration;
+  cpu->cycles += skipped;
+  cpu->skipped_cycles += skipped;
+}
+
+uint64_t mos6502_run_until(Mos6502* cpu, uint64_t cycle) {
+  const uint64_t start = cpu->cycles;
+  run_events(cpu->scheduler, cpu->cycles);
+  while (cpu->cycles < cycle) {
+    // Every event that is due has run, so the deadline is always ahead.
+    uint64_t deadline = next_deadline(cpu->scheduler);
+    if (deadline > cycle) {
+      deadline = cycle;
+    }
+    const uint64_t budget = deadline - cpu->cycles;
+
+    (void)(run_batch(cpu, SIZE_MAX, budget < UINT32_MAX ? (uint32_t)(budget) : UINT32_MAX));
+    if (cpu->stop_reason == kStopHalt && cpu->skip_idle) {
+      skip_halt(cpu, deadline);
+    }
+    run_events(cpu->scheduler, cpu->cycles);
+    if (cpu->stop_reason == kStopBreakpoint || cpu->stop_reason == kStopJammed) {
       break;
+    }
   }
 
-  uint8_t opcode = read(cpu->bus, cpu->pc);
-  cpu->current_mode = opcodes[opcode].mode;
+  return cpu->cycles - start;
+}
 
-  int mode_cycles = (*opcodes[opcode].mode_handler)(cpu);
-  cpu->cycles += opcodes[opcode].cycles;
-  cpu->pc += (uint16_t)(opcodes[opcode].length);
-  int opcode_cycles = (*opcodes[opcode].opcode_handler)(cpu);
+static void irq_event(void* obj, uint64_t UNUSED(deadline)) { raise_irq(obj); }
 
-  cpu->cycles += (uint32_t)(mode_cycles & opcode_cycles);
+static void nmi_event(void* obj, uint64_t UNUSED(deadline)) { raise_nmi(obj); }
+
+uint32_t schedule_interrupt(Mos6502* cpu, uint64_t cycle, Interrupt type) {
+  return schedule_event(cpu->scheduler, cycle, type == kNMI ? nmi_event : irq_event, cpu);
+}
+
+// The fused engine counts cycles in a local copy of the CPU while a batch runs, so a stall from a
+// bus handler goes to whichever counter the bus clock points at.
+void mos6502_stall(Mos6502* cpu, uint32_t cycles) { *cpu->bus->clock += cycles; }
+
+void set_idle_skip(Mos6502* cpu, bool enabled) { cpu->skip_idle = enabled; }
+
+void set_breakpoint(Mos6502* cpu, uint16_t addr) { cpu->breakpoint = addr; }
+
+void clear_breakpoint(Mos6502* cpu) { cpu->breakpoint = NO_BREAKPOINT; }
+
+void set_block_cache(Mos6502* cpu, bool enabled) {
+  if (enabled && !cpu->blocks) {
+    cpu->blocks = rc_alloc(sizeof(*cpu->blocks), block_cache_deinit);
+  } else if (!enabled && cpu->blocks) {
+    rc_strong_release((void*)&cpu->blocks);
+  }
+}
+
+bool set_jit(Mos6502* cpu, bool enabled) {
+#ifdef B6502_JIT
+  if (enabled) {
+    set_block_cache(cpu, true);
+    if (!cpu->blocks->jit) {
+      cpu->blocks->jit = jit_create();
+    }
+    return cpu->blocks->jit != NULL;
+  }
+
+  if (cpu->blocks && cpu->blocks->jit) {
+    rc_strong_release((void*)&cpu->blocks->jit);
+  }
+  return false;
+#else
+  (void)(cpu);
+  (void)(enabled);
+  return false;
+#endif
+}
+
+bool set_profiler(Mos6502* cpu, Profiler* profiler) {
+#ifdef B6502_PROFILER
+  if (cpu->profiler) {
+    rc_strong_release((void*)&cpu->profiler);
+  }
+  if (profiler) {
+    cpu->profiler = rc_strong_retain(profiler);
+  }
+  return profiler != NULL;
+#else
+  (void)(cpu);
+  (void)(profiler);
+  return false;
+#endif
+}
+
+void set_tracer(Mos6502* cpu, Tracer* tracer) {
+  if (cpu->tracer) {
+    rc_strong_release((void*)&cpu->tracer);
+  }
+  if (tracer) {
+    cpu->tracer = rc_strong_retain(tracer);
+  }
+}
+
+bool set_aot_program(Mos6502* cpu, const AotProgram* program) {
+  if (cpu->aot) {
+    rc_strong_release((void*)&cpu->aot);
+  }
+  if (program && program->variant != cpu->variant) {
+    LOG_ERROR("%s was recompiled for another CPU variant\n", program->name);
+    return false;
+  }
+  if (program) {
+    cpu->aot = rc_alloc(sizeof(*cpu->aot) + program->num_blocks * sizeof(bool), aot_state_deinit);
+    cpu->aot->program = program;
+    index_aot_pages(cpu->bus, cpu->aot);
+    for (size_t page = 0; page < NUMBER_OF_PAGES; page++) {
+      invalidate_page(cpu->bus, page);
+    }
+    validate_aot(cpu, cpu->aot);
+  }
+  return program != NULL;
+}
+
+uint64_t aot_stale_blocks(const Mos6502* cpu) { return cpu->aot ? cpu->aot->stale_blocks : 0; }
+
+void set_pair_profiling(Mos6502* cpu, bool enabled) {
+  if (enabled) {
+    set_block_cache(cpu, true);
+    if (!cpu->blocks->pairs) {
+      cpu->blocks->pairs = rc_alloc(NUM_OF_OPCODES * NUM_OF_OPCODES * sizeof(uint64_t), NULL);
+    }
+  } else if (cpu->blocks && cpu->blocks->pairs) {
+    rc_strong_release((void*)&cpu->blocks->pairs);
+  }
+}
+
+uint64_t pair_frequency(const Mos6502* cpu, uint8_t first, uint8_t second) {
+  if (!cpu->blocks || !cpu->blocks->pairs) {
+    return 0;
+  }
+  return cpu->blocks->pairs[first * NUM_OF_OPCODES + second];
+}
+
+typedef struct PairCount {
+  uint64_t count;
+  uint8_t first;
+  uint8_t second;
+} PairCount;
+
+static int compare_pair_counts(const void* x, const void* y) {
+  const uint64_t a = ((const PairCount*)x)->count;
+  const uint64_t b = ((const PairCount*)y)->count;
+  return (a < b) - (a > b);
+}
+
+void dump_pair_frequencies(const Mos6502* cpu, FILE* out, size_t limit) {
+  if (!cpu->blocks || !cpu->blocks->pairs) {
+    return;
+  }
+
+  PairCount* counts = malloc(NUM_OF_OPCODES * NUM_OF_OPCODES * sizeof(*counts));
+  if (!counts) {
+    return;
+  }
+
+  uint64_t total = 0;
+  size_t used = 0;
+  for (size_t i = 0; i < NUM_OF_OPCODES * NUM_OF_OPCODES; i++) {
+    const uint64_t count = cpu->blocks->pairs[i];
+    if (count) {
+      counts[used++] = (PairCount){count, (uint8_t)(i / NUM_OF_OPCODES), (uint8_t)i};
+      total += count;
+    }
+  }
+
+  qsort(counts, used, sizeof(*counts), compare_pair_counts);
+  for (size_t i = 0; i < used && i < limit; i++) {
+    const PairCount* pair = &counts[i];
+    fprintf(out, "    SUPER(0x%02X, 0x%02X),  // %s %s: %" PRIu64 ", %" PRIu64 " per mille%s\n",
+            pair->first, pair->second, cpu->core->opcodes[pair->first].name,
+            cpu->core->opcodes[pair->second].name, pair->count, pair->count * 1000 / total,
+            find_superinstruction(cpu->core, pair->first, pair->second) ? "" : ", not fused");
+  }
+  free(counts);
+}
+
+void get_block_cache_stats(const Mos6502* cpu, BlockCacheStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->invalidations = cpu->bus->code_invalidations;
+  if (cpu->blocks) {
+    stats->hits = cpu->blocks->hits;
+    stats->misses = cpu->blocks->misses;
+    stats->transfers = cpu->blocks->transfers;
+    stats->superinstructions = cpu->blocks->superinstructions;
+#ifdef B6502_JIT
+    if (cpu->blocks->jit) {
+      stats->compiled = jit_compiled(cpu->blocks->jit);
+    }
+#endif
+  }
 }
@@ -0,0 +1,218 @@
+#include "b6502/profiler.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "b6502/rc.h"
+
+#define JSR 0x20
+#define BRK 0x00
+#define PATH_SLOTS (2 * PROFILER_MAX_PATHS)
+
+Profiler* profiler_create(CpuVariant variant, uint32_t sample_period) {
+  Profiler* profiler = rc_alloc(sizeof(*profiler), NULL);
+  profiler->variant = variant;
+  profiler->sample_period = sample_period ? sample_period : 1;
+  profiler->countdown = profiler->sample_period;
+  profiler->paths[PROFILER_ROOT] = (ProfilerPath){0, PROFILER_ROOT, PROFILER_ROOT};
+  profiler->num_paths = 1;
+  return profiler;
+}
+
+/////////////////////////////////////////////////
+///     Call stack
+/////////////////////////////////////////////////
+
+static inline uint32_t current_path(const Profiler* profiler) {
+  return profiler->depth ? profiler->stack[profiler->depth - 1].path : PROFILER_ROOT;
+}
+
+// Find or add the path of a routine called from another path. Slots hold a path index plus one.
+static uint32_t child_path(Profiler* profiler, uint32_t parent, uint32_t routine) {
+  size_t slot = (parent * 0x9E3779B1u ^ routine) & (PATH_SLOTS - 1);
+  for (;;) {
+    const uint32_t index = profiler->path_slots[slot];
+    if (!index) {
+      if (profiler->num_paths == PROFILER_MAX_PATHS) {
+        return parent;
+      }
+      const uint32_t added = profiler->num_paths++;
+      profiler->paths[added] = (ProfilerPath){0, parent, routine};
+      profiler->path_slots[slot] = added + 1;
+      return added;
+    }
+
+    const ProfilerPath* path = &profiler->paths[index - 1];
+    if (path->parent == parent && path->routine == routine) {
+      return index - 1;
+    }
+    slot = (slot + 1) & (PATH_SLOTS - 1);
+  }
+}
+
+static void push_frame(Profiler* profiler, uint16_t entry, uint8_t sp, bool interrupt) {
+  if (profiler->depth == PROFILER_MAX_DEPTH) {
+    return;
+  }
+
+  const uint32_t routine = entry | (interrupt ? PROFILER_INTERRUPT : 0);
+  ProfilerFrame* frame = &profiler->stack[profiler->depth];
+  frame->path = child_path(profiler, current_path(profiler), routine);
+  frame->start = profiler->cycles;
+  frame->entry = entry;
+  frame->sp = sp;
+  profiler->depth++;
+  profiler->calls[entry]++;
+  profiler->active[entry]++;
+}
+
+// A recursive routine only adds the cycles of its outermost call to its inclusive cycles.
+static void pop_frame(Profiler* profiler) {
+  const ProfilerFrame* frame = &profiler->stack[--profiler->depth];
+  if (!--profiler->active[frame->entry]) {
+    profiler->inclusive[frame->entry] += profiler->cycles - frame->start;
+  }
+}
+
+void profile_interrupt(Profiler* profiler, uint16_t handler, uint8_t sp) {
+  push_frame(profiler, handler, sp, true);
+}
+
+void profile_instruction(Profiler* profiler, uint16_t pc, uint8_t opcode, uint32_t cycles,
+                         uint16_t next_pc, uint8_t sp) {
+  profiler->instructions++;
+  profiler->cycles += cycles;
+  if (!--profiler->countdown) {
+    const uint32_t period = profiler->sample_period;
+    const uint64_t weighted = (uint64_t)cycles * period;
+    profiler->countdown = period;
+    profiler->pc_count[pc] += period;
+    profiler->pc_cycles[pc] += weighted;
+    profiler->opcode_count[opcode] += period;
+    profiler->opcode_cycles[opcode] += weighted;
+    profiler->paths[current_path(profiler)].cycles += weighted;
+    if (profiler->depth) {
+      profiler->exclusive[profiler->stack[profiler->depth - 1].entry] += weighted;
+    }
+  }
+
+  // RTS, RTI, and anything else that moves the stack pointer back above a frame returns from it.
+  while (profiler->depth && sp > profiler->stack[profiler->depth - 1].sp) {
+    pop_frame(profiler);
+  }
+  if (opcode == JSR || opcode == BRK) {
+    push_frame(profiler, next_pc, sp, opcode == BRK);
+  }
+}
+
+uint64_t profiler_inclusive(const Profiler* profiler, uint16_t entry) {
+  uint64_t cycles = profiler->inclusive[entry];
+  for (size_t i = 0; i < profiler->depth; i++) {
+    if (profiler->stack[i].entry == entry) {
+      return cycles + profiler->cycles - profiler->stack[i].start;
+    }
+  }
+  return cycles;
+}
+
+/////////////////////////////////////////////////
+///     Reports
+/////////////////////////////////////////////////
+
+typedef struct Ranked {
+  uint64_t key;
+  uint32_t index;
+} Ranked;
+
+static int compare_ranked(const void* x, const void* y) {
+  const uint64_t a = ((const Ranked*)x)->key;
+  const uint64_t b = ((const Ranked*)y)->key;
+  return (a < b) - (a > b);
+}
+
+// Sort the nonzero keys in descending order, returning how many there are.
+static size_t rank(Ranked* ranked, const uint64_t* keys, size_t n) {
+  size_t used = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (keys[i]) {
+      ranked[used++] = (Ranked){keys[i], (uint32_t)i};
+    }
+  }
+  qsort(ranked, used, sizeof(*ranked), compare_ranked);
+  return used;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total ? (double)part * 100.0 / (double)total : 0.0;
+}
+
+void profiler_write_flat(const Profiler* profiler, FILE* out, size_t limit) {
+  Ranked* ranked = malloc(0x10000 * sizeof(*ranked));
+  uint64_t* inclusive = malloc(0x10000 * sizeof(*inclusive));
+  if (!ranked || !inclusive) {
+    free(ranked);
+    free(inclusive);
+    return;
+  }
+
+  const uint64_t total = profiler->cycles;
+  fprintf(out, "%" PRIu64 " instructions, %" PRIu64 " cycles, sampled every %" PRIu32 "\n\n",
+          profiler->instructions, total, profiler->sample_period);
+
+  OpcodeInfo info;
+  size_t used = rank(ranked, profiler->pc_cycles, 0x10000);
+  fprintf(out, "%14s %7s %14s  %s\n", "cycles", "%", "count", "pc");
+  for (size_t i = 0; i < used && i < limit; i++) {
+    const uint32_t pc = ranked[i].index;
+    fprintf(out, "%14" PRIu64 " %6.2f%% %14" PRIu64 "  $%04" PRIX32 "\n", ranked[i].key,
+            percent(ranked[i].key, total), profiler->pc_count[pc], pc);
+  }
+
+  used = rank(ranked, profiler->opcode_cycles, 256);
+  fprintf(out, "\n%14s %7s %14s  %-5s  %s\n", "cycles", "%", "count", "op", "name");
+  for (size_t i = 0; i < used && i < limit; i++) {
+    const uint32_t opcode = ranked[i].index;
+    get_opcode_info(profiler->variant, (uint8_t)opcode, &info);
+    fprintf(out, "%14" PRIu64 " %6.2f%% %14" PRIu64 "  $%02" PRIX32 "    %s\n", ranked[i].key,
+            percent(ranked[i].key, total), profiler->opcode_count[opcode], opcode, info.name);
+  }
+
+  for (uint32_t entry = 0; entry < 0x10000; entry++) {
+    inclusive[entry] = profiler->calls[entry] ? profiler_inclusive(profiler, (uint16_t)entry) : 0;
+  }
+  used = rank(ranked, inclusive, 0x10000);
+  fprintf(out, "\n%14s %7s %14s %7s %10s  %s\n", "inclusive", "%", "exclusive", "%", "calls",
+          "routine");
+  for (size_t i = 0; i < used && i < limit; i++) {
+    const uint32_t entry = ranked[i].index;
+    fprintf(out, "%14" PRIu64 " %6.2f%% %14" PRIu64 " %6.2f%% %10" PRIu64 "  $%04" PRIX32 "\n",
+            ranked[i].key, percent(ranked[i].key, total), profiler->exclusive[entry],
+            percent(profiler->exclusive[entry], total), profiler->calls[entry], entry);
+  }
+
+  free(inclusive);
+  free(ranked);
+}
+
+void profiler_write_folded(const Profiler* profiler, FILE* out) {
+  uint32_t frames[PROFILER_MAX_DEPTH + 1];
+  for (uint32_t i = 0; i < profiler->num_paths; i++) {
+    const ProfilerPath* path = &profiler->paths[i];
+    if (!path->cycles) {
+      continue;
+    }
+
+    size_t depth = 0;
+    for (uint32_t p = i; p != PROFILER_ROOT; p = profiler->paths[p].parent) {
+      frames[depth++] = profiler->paths[p].routine;
+    }
+
+    fprintf(out, "main");
+    while (depth--) {
+      const uint32_t routine = frames[depth];
+      fprintf(out, ";%s_%04" PRIX32, routine & PROFILER_INTERRUPT ? "int" : "sub",
+              routine & 0xFFFF);
+    }
+    fprintf(out, " %" PRIu64 "\n", path->cycles);
+  }
+}
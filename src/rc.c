@@ -1,128 +1,486 @@
 #include "b6502/rc.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define ALIGN_UP(n, align) (((n) + (align)-1) / (align) * (align))
+
+#define SLAB_MIN_SLOT (size_t)64
+#define SLAB_CHUNK_SIZE ((size_t)64 << 10)
+#define SLAB_POISON 0xDD
+
+#define RC_SHARED (uint16_t)1
+
+#ifdef B6502_RC_ATOMIC
+#  define RC_DEFAULT_FLAGS RC_SHARED
+#else
+#  define RC_DEFAULT_FLAGS (uint16_t)0
+#endif
+
+// The strong references together hold one of the weak references in weak_count, so the header
+// outlives the object until both the last strong and the last weak reference are gone.
+// arena_offset is how far the header is from the start of its arena, or 0 outside of one.
+// slab_class is the slab size class plus one, or 0 outside of a slab.
 typedef struct Rc {
-  size_t strong_count;
-  size_t weak_count;
+  atomic_size_t strong_count;
+  atomic_size_t weak_count;
   Destructor destructor;
+  uint32_t arena_offset;
+  uint16_t slab_class;
+  uint16_t flags;
 } Rc;
 
+// The arena's objects come right after this header. live counts the objects that are not freed
+// yet, plus the creator until it releases the arena.
+struct RcArena {
+  size_t size;
+  size_t used;
+  atomic_size_t live;
+  bool mapped;
+};
+
+static _Thread_local RcArena* current_arena = NULL;
+
+// A free slot keeps the next free slot of its class where its header was.
+typedef struct FreeSlot {
+  struct FreeSlot* next;
+} FreeSlot;
+
+// Slabs are carved out of chunks, each starting with a link in the list of all chunks.
+typedef struct SlabChunk {
+  struct SlabChunk* next;
+} SlabChunk;
+
+typedef struct SlabCache {
+  FreeSlot* free;
+  uint8_t* bump;
+  uint8_t* end;
+} SlabCache;
+
+// A slot goes on the free list of the thread that frees it. When a thread exits, its free slots
+// and what is left of its chunks go to slab_pool, where threads that run out take them from.
+static _Thread_local SlabCache slab_caches[RC_SLAB_CLASSES];
+static _Thread_local bool slab_caches_registered = false;
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+static FreeSlot* slab_pool[RC_SLAB_CLASSES];
+static pthread_mutex_t slab_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(SlabChunk*) slab_chunks = NULL;
+static atomic_size_t slab_reserved = 0;
+static struct {
+  atomic_size_t live;
+  atomic_size_t peak;
+} slab_usage[RC_SLAB_CLASSES];
+
 static inline Rc* get_rc(void* obj) { return (Rc*)obj - 1; }
 static inline void* get_obj(Rc* rc) { return rc + 1; }
 
-void* rc_alloc(size_t size, Destructor destructor) {
-  Rc* rc = calloc(1, size + sizeof(*rc));
-  rc->strong_count = 1;
-  rc->destructor = destructor;
-  return get_obj(rc);
+static inline size_t slot_size(size_t slab_class) { return SLAB_MIN_SLOT << slab_class; }
+
+static void pool_slot(size_t slab_class, FreeSlot* slot) {
+  slot->next = slab_pool[slab_class];
+  slab_pool[slab_class] = slot;
 }
 
-void* rc_strong_retain(void* obj) {
-  Rc* rc = get_rc(obj);
-  assert(rc->strong_count != 0);
-  rc->strong_count += 1;
-  return get_obj(rc);
+// Called when a thread exits, with the thread's caches.
+static void flush_slab_caches(void* caches) {
+  pthread_mutex_lock(&slab_pool_lock);
+  for (size_t i = 0; i < RC_SLAB_CLASSES; i++) {
+    SlabCache* cache = &((SlabCache*)caches)[i];
+    while (cache->free) {
+      FreeSlot* slot = cache->free;
+      cache->free = slot->next;
+      pool_slot(i, slot);
+    }
+    for (; (size_t)(cache->end - cache->bump) >= slot_size(i); cache->bump += slot_size(i)) {
+#ifdef B6502_RC_DEBUG
+      memset(cache->bump, SLAB_POISON, slot_size(i));
+#endif
+      pool_slot(i, (FreeSlot*)cache->bump);
+    }
+  }
+  pthread_mutex_unlock(&slab_pool_lock);
 }
 
-void rc_strong_release(void** obj) {
-  Rc* rc = get_rc(*obj);
-  assert(rc->strong_count != 0);
-  if (--rc->strong_count) {
-    *obj = NULL;
-    return;
+static void create_slab_key(void) { pthread_key_create(&slab_key, flush_slab_caches); }
+
+// The thread's caches, which are flushed when it exits once it has used them.
+static SlabCache* thread_slab_caches(void) {
+  if (!slab_caches_registered) {
+    pthread_once(&slab_key_once, create_slab_key);
+    pthread_setspecific(slab_key, slab_caches);
+    slab_caches_registered = true;
   }
+  return slab_caches;
+}
 
-  if (rc->destructor) {
-    (rc->destructor)(*obj);
+// Take every pooled slot of a class, or none if the pool is empty.
+static FreeSlot* take_pooled_slots(size_t slab_class) {
+  pthread_mutex_lock(&slab_pool_lock);
+  FreeSlot* slots = slab_pool[slab_class];
+  slab_pool[slab_class] = NULL;
+  pthread_mutex_unlock(&slab_pool_lock);
+  return slots;
+}
+
+static bool refill_slab(SlabCache* cache) {
+  SlabChunk* chunk = aligned_alloc(SLAB_MIN_SLOT, SLAB_CHUNK_SIZE);
+  if (!chunk) {
+    return false;
   }
 
-  if (!rc->weak_count) {
-    free(rc);
+  chunk->next = atomic_load_explicit(&slab_chunks, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&slab_chunks, &chunk->next, chunk,
+                                                memory_order_release, memory_order_relaxed)) {
   }
+  atomic_fetch_add_explicit(&slab_reserved, SLAB_CHUNK_SIZE, memory_order_relaxed);
+  cache->bump = (uint8_t*)chunk + SLAB_MIN_SLOT;
+  cache->end = (uint8_t*)chunk + SLAB_CHUNK_SIZE;
+  return true;
+}
 
-  *obj = NULL;
+static void count_slab_alloc(size_t slab_class) {
+  const size_t live =
+      atomic_fetch_add_explicit(&slab_usage[slab_class].live, 1, memory_order_relaxed) + 1;
+  size_t peak = atomic_load_explicit(&slab_usage[slab_class].peak, memory_order_relaxed);
+  while (live > peak
+         && !atomic_compare_exchange_weak_explicit(&slab_usage[slab_class].peak, &peak, live,
+                                                   memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+#ifdef B6502_RC_DEBUG
+static bool slot_poisoned(const FreeSlot* slot, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)slot;
+  for (size_t i = sizeof(*slot); i < size; i++) {
+    if (bytes[i] != SLAB_POISON) {
+      return false;
+    }
+  }
+  return true;
 }
+#endif
 
-size_t rc_strong_count(void* obj) { return get_rc(obj)->strong_count; }
+static Rc* slab_alloc(size_t size) {
+  const size_t total = size + sizeof(Rc);
+  size_t slab_class = 0;
+  while (slab_class < RC_SLAB_CLASSES && slot_size(slab_class) < total) {
+    slab_class++;
+  }
+  if (slab_class == RC_SLAB_CLASSES) {
+    return NULL;
+  }
 
-void* rc_weak_retain(void* obj) {
-  Rc* rc = get_rc(obj);
-  assert(rc->strong_count != 0);
-  rc->weak_count += 1;
-  return get_obj(rc);
+  SlabCache* cache = &thread_slab_caches()[slab_class];
+  if (!cache->free && (size_t)(cache->end - cache->bump) < slot_size(slab_class)) {
+    cache->free = take_pooled_slots(slab_class);
+  }
+
+  Rc* rc = NULL;
+  if (cache->free) {
+    FreeSlot* slot = cache->free;
+    cache->free = slot->next;
+#ifdef B6502_RC_DEBUG
+    assert(slot_poisoned(slot, slot_size(slab_class)) && "a freed object was written to");
+#endif
+    rc = (Rc*)slot;
+  } else {
+    if ((size_t)(cache->end - cache->bump) < slot_size(slab_class) && !refill_slab(cache)) {
+      return NULL;
+    }
+    rc = (Rc*)cache->bump;
+    cache->bump += slot_size(slab_class);
+  }
+
+  memset(rc, 0, total);
+  rc->slab_class = (uint16_t)(slab_class + 1);
+  count_slab_alloc(slab_class);
+  return rc;
 }
 
-void rc_weak_release(void** obj) {
-  Rc* rc = get_rc(*obj);
-  assert(rc->weak_count != 0);
-  *obj = NULL;
-  if (--rc->weak_count) {
-    return;
+static void slab_free(Rc* rc) {
+  const size_t slab_class = rc->slab_class - 1;
+  FreeSlot* slot = (FreeSlot*)rc;
+#ifdef B6502_RC_DEBUG
+  memset(slot, SLAB_POISON, slot_size(slab_class));
+#endif
+  SlabCache* cache = &thread_slab_caches()[slab_class];
+  slot->next = cache->free;
+  cache->free = slot;
+  atomic_fetch_sub_explicit(&slab_usage[slab_class].live, 1, memory_order_relaxed);
+}
+
+void rc_get_stats(RcStats* stats) {
+  stats->live_bytes = 0;
+  for (size_t i = 0; i < RC_SLAB_CLASSES; i++) {
+    RcSlabStats* usage = &stats->classes[i];
+    usage->slot_size = slot_size(i);
+    usage->live = atomic_load_explicit(&slab_usage[i].live, memory_order_relaxed);
+    usage->peak = atomic_load_explicit(&slab_usage[i].peak, memory_order_relaxed);
+    stats->live_bytes += usage->live * usage->slot_size;
+  }
+  stats->reserved_bytes = atomic_load_explicit(&slab_reserved, memory_order_relaxed);
+}
+
+// Put the object on a cache line of its own, with its header at the end of the line before.
+static Rc* arena_alloc(RcArena* arena, size_t size) {
+  const size_t start = ALIGN_UP(arena->used + sizeof(Rc), RC_ARENA_ALIGN) - sizeof(Rc);
+  if (start + sizeof(Rc) + size > arena->size || start > UINT32_MAX) {
+    return NULL;
   }
 
-  if (!rc->weak_count && !rc->strong_count) {
+  Rc* rc = (Rc*)((uint8_t*)arena + start);
+  arena->used = start + sizeof(Rc) + size;
+  atomic_fetch_add_explicit(&arena->live, 1, memory_order_relaxed);
+  rc->arena_offset = (uint32_t)start;
+  return rc;
+}
+
+static void arena_free(RcArena* arena) {
+  if (arena->mapped) {
+    munmap(arena, arena->size);
+  } else {
+    free(arena);
+  }
+}
+
+static void rc_free(Rc* rc) {
+  if (rc->slab_class) {
+    slab_free(rc);
+    return;
+  } else if (!rc->arena_offset) {
     free(rc);
+    return;
+  }
+
+  RcArena* arena = (RcArena*)((uint8_t*)rc - rc->arena_offset);
+  if (atomic_fetch_sub_explicit(&arena->live, 1, memory_order_acq_rel) == 1) {
+    arena_free(arena);
   }
 }
 
-size_t rc_weak_count(void* obj) { return get_rc(obj)->weak_count; }
+static void* allocate(size_t size, Destructor destructor, uint16_t flags) {
+  Rc* rc = current_arena ? arena_alloc(current_arena, size) : NULL;
+  if (!rc) {
+    rc = slab_alloc(size);
+  }
+  if (!rc) {
+    rc = calloc(1, size + sizeof(*rc));
+  }
+  atomic_init(&rc->strong_count, 1);
+  atomic_init(&rc->weak_count, 1);
+  rc->destructor = destructor;
+  rc->flags = flags;
+  return get_obj(rc);
+}
 
-void* rc_weak_check(void** obj) {
-  Rc* rc = get_rc(*obj);
+void* rc_alloc(size_t size, Destructor destructor) {
+  return allocate(size, destructor, RC_DEFAULT_FLAGS);
+}
 
-  assert(rc->weak_count != 0);
+void* rc_alloc_shared(size_t size, Destructor destructor) {
+  return allocate(size, destructor, RC_SHARED);
+}
 
-  if (!rc->strong_count) {
-    rc_weak_release(obj);
+// A zeroed block, from huge pages if asked for and available.
+static RcArena* allocate_block(size_t size, bool huge_pages) {
+  if (huge_pages) {
+    const size_t mapped_size = ALIGN_UP(size, HUGE_PAGE_SIZE);
+    void* block =
+        mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block != MAP_FAILED) {
+      madvise(block, mapped_size, MADV_HUGEPAGE);
+      RcArena* arena = block;
+      arena->size = mapped_size;
+      arena->mapped = true;
+      return arena;
+    }
   }
 
-  return *obj;
+  RcArena* arena = aligned_alloc(RC_ARENA_ALIGN, size);
+  if (arena) {
+    memset(arena, 0, size);
+    arena->size = size;
+  }
+  return arena;
 }
 
-void* rc_upgrade(void** obj) {
-  Rc* rc = get_rc(*obj);
-  assert(rc->weak_count != 0);
+RcArena* rc_arena_create(size_t capacity, bool huge_pages) {
+  const size_t header = ALIGN_UP(sizeof(RcArena) + sizeof(Rc), RC_ARENA_ALIGN);
+  RcArena* arena = allocate_block(header + ALIGN_UP(capacity, RC_ARENA_ALIGN), huge_pages);
+  if (arena) {
+    arena->used = sizeof(*arena);
+    atomic_init(&arena->live, 1);
+  }
+  return arena;
+}
 
-  rc->weak_count -= 1;
+size_t rc_arena_footprint(size_t size) { return ALIGN_UP(size + sizeof(Rc), RC_ARENA_ALIGN); }
 
-  if (!rc->strong_count) {
-    *obj = NULL;
+void rc_arena_enter(RcArena* arena) { current_arena = arena; }
 
-    if (!rc->weak_count) {
-      free(rc);
-    }
+void rc_arena_release(RcArena** arena) {
+  if (atomic_fetch_sub_explicit(&(*arena)->live, 1, memory_order_acq_rel) == 1) {
+    arena_free(*arena);
+  }
+  *arena = NULL;
+}
 
+RcArena* rc_arena_clone(const RcArena* arena, ptrdiff_t* offset) {
+  RcArena* clone = allocate_block(arena->size, arena->mapped);
+  if (!clone) {
     return NULL;
   }
 
-  rc->strong_count += 1;
+  const size_t size = clone->size;
+  const bool mapped = clone->mapped;
+  memcpy(clone, arena, arena->used);
+  clone->size = size;
+  clone->mapped = mapped;
+  *offset = (uint8_t*)clone - (const uint8_t*)arena;
+  return clone;
+}
 
-  return get_obj(rc);
+bool rc_arena_contains(const RcArena* arena, const void* obj) {
+  const uintptr_t start = (uintptr_t)arena;
+  return (uintptr_t)obj >= start && (uintptr_t)obj < start + arena->size;
 }
 
-void* rc_downcast(void** obj) {
-  Rc* rc = get_rc(*obj);
-  assert(rc->strong_count != 0);
+// Counts are atomic either way. Objects that are not shared update them with relaxed loads and
+// stores, which compile to ordinary moves, and only shared objects pay for atomic instructions.
+static inline size_t load(atomic_size_t* count) {
+  return atomic_load_explicit(count, memory_order_relaxed);
+}
 
-  rc->strong_count -= 1;
-  if (!rc->strong_count) {
-    if (rc->destructor) {
-      (rc->destructor)(*obj);
-    }
+static inline void increment(const Rc* rc, atomic_size_t* count) {
+  if (rc->flags & RC_SHARED) {
+    atomic_fetch_add_explicit(count, 1, memory_order_relaxed);
+  } else {
+    atomic_store_explicit(count, load(count) + 1, memory_order_relaxed);
+  }
+}
+
+// Return the new count. The decrement is acquire-release, so that whatever other threads did
+// with the object happens before the thread that takes the count to zero destroys it.
+static inline size_t decrement(const Rc* rc, atomic_size_t* count) {
+  if (rc->flags & RC_SHARED) {
+    return atomic_fetch_sub_explicit(count, 1, memory_order_acq_rel) - 1;
+  }
 
-    *obj = NULL;
+  const size_t value = load(count) - 1;
+  atomic_store_explicit(count, value, memory_order_relaxed);
+  return value;
+}
 
-    if (!rc->weak_count) {
-      free(rc);
+// Take a strong reference unless the count has already dropped to zero, which is final.
+static bool try_retain(Rc* rc) {
+  size_t strong = load(&rc->strong_count);
+  if (!(rc->flags & RC_SHARED)) {
+    if (strong) {
+      atomic_store_explicit(&rc->strong_count, strong + 1, memory_order_relaxed);
     }
+    return strong != 0;
+  }
+
+  while (strong && !atomic_compare_exchange_weak_explicit(&rc->strong_count, &strong, strong + 1,
+                                                          memory_order_acquire,
+                                                          memory_order_relaxed)) {
+  }
+  return strong != 0;
+}
+
+static void release_weak(Rc* rc) {
+  if (!decrement(rc, &rc->weak_count)) {
+    rc_free(rc);
+  }
+}
+
+// Destroy the object once the last strong reference is gone, then drop their weak reference.
+static void destroy(Rc* rc) {
+  if (rc->destructor) {
+    (rc->destructor)(get_obj(rc));
+  }
+  release_weak(rc);
+}
 
+void* rc_strong_retain(void* obj) {
+  Rc* rc = get_rc(obj);
+  assert(load(&rc->strong_count) != 0);
+  increment(rc, &rc->strong_count);
+  return obj;
+}
+
+void rc_strong_release(void** obj) {
+  Rc* rc = get_rc(*obj);
+  assert(load(&rc->strong_count) != 0);
+  *obj = NULL;
+  if (!decrement(rc, &rc->strong_count)) {
+    destroy(rc);
+  }
+}
+
+size_t rc_strong_count(void* obj) { return load(&get_rc(obj)->strong_count); }
+
+void* rc_weak_retain(void* obj) {
+  Rc* rc = get_rc(obj);
+  assert(load(&rc->strong_count) != 0);
+  increment(rc, &rc->weak_count);
+  return obj;
+}
+
+void rc_weak_release(void** obj) {
+  Rc* rc = get_rc(*obj);
+  assert(load(&rc->weak_count) != 0);
+  *obj = NULL;
+  release_weak(rc);
+}
+
+size_t rc_weak_count(void* obj) {
+  Rc* rc = get_rc(obj);
+  return load(&rc->weak_count) - (load(&rc->strong_count) ? 1 : 0);
+}
+
+void* rc_weak_check(void** obj) {
+  Rc* rc = get_rc(*obj);
+  assert(load(&rc->weak_count) != 0);
+  if (!load(&rc->strong_count)) {
+    rc_weak_release(obj);
+  }
+
+  return *obj;
+}
+
+void* rc_upgrade(void** obj) {
+  Rc* rc = get_rc(*obj);
+  assert(load(&rc->weak_count) != 0);
+  if (!try_retain(rc)) {
+    rc_weak_release(obj);
     return NULL;
   }
 
-  rc->weak_count += 1;
+  // The strong references' own weak reference keeps this from reaching zero.
+  decrement(rc, &rc->weak_count);
+  return *obj;
+}
 
-  return get_obj(rc);
+void* rc_downcast(void** obj) {
+  Rc* rc = get_rc(*obj);
+  assert(load(&rc->strong_count) != 0);
+
+  // The weak reference is taken first, so that the header can't go away in between.
+  increment(rc, &rc->weak_count);
+  if (decrement(rc, &rc->strong_count)) {
+    return *obj;
+  }
+
+  *obj = NULL;
+  destroy(rc);
+  release_weak(rc);
+  return NULL;
 }
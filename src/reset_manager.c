@@ -27,8 +27,8 @@ void add_rm_device(ResetManager* rm, void* obj, reset_handler reset) {
 void reset_devices(ResetManager* rm) {
   for (size_t i = 0; i < rm->num_devices; i++) {
     if (LIKELY(rm->devices[i].obj)) {
-      void* obj = rm->devices[rm->num_devices].obj;
-      reset_handler reset = rm->devices[rm->num_devices].reset;
+      void* obj = rm->devices[i].obj;
+      reset_handler reset = rm->devices[i].reset;
       (reset)(obj);
     }
   }
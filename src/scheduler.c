@@ -0,0 +1,110 @@
+#include "b6502/scheduler.h"
+
+#include <inttypes.h>
+
+#include "b6502/rc.h"
+
+static void deinit(void* obj) {
+  Scheduler* scheduler = obj;
+  for (size_t i = 0; i < scheduler->num_events; i++) {
+    if (scheduler->events[i].obj) {
+      rc_weak_release((void*)&scheduler->events[i].obj);
+    }
+  }
+}
+
+Scheduler* scheduler_create(void) {
+  Scheduler* scheduler = rc_alloc(sizeof(*scheduler), deinit);
+  scheduler->next_id = 1;
+  return scheduler;
+}
+
+static inline void swap_events(Event* events, size_t i, size_t j) {
+  Event tmp = events[i];
+  events[i] = events[j];
+  events[j] = tmp;
+}
+
+static void sift_up(Event* events, size_t i) {
+  while (i > 0 && events[(i - 1) / 2].deadline > events[i].deadline) {
+    swap_events(events, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void sift_down(Event* events, size_t count, size_t i) {
+  for (;;) {
+    size_t smallest = i;
+    const size_t left = 2 * i + 1;
+    const size_t right = 2 * i + 2;
+    if (left < count && events[left].deadline < events[smallest].deadline) {
+      smallest = left;
+    }
+    if (right < count && events[right].deadline < events[smallest].deadline) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+
+    swap_events(events, i, smallest);
+    i = smallest;
+  }
+}
+
+// Take an event out of the heap. The caller owns its weak reference afterwards.
+static void remove_event(Scheduler* scheduler, size_t i, Event* event) {
+  *event = scheduler->events[i];
+  scheduler->events[i] = scheduler->events[--scheduler->num_events];
+  if (i < scheduler->num_events) {
+    sift_up(scheduler->events, i);
+    sift_down(scheduler->events, scheduler->num_events, i);
+  }
+}
+
+uint32_t schedule_event(Scheduler* scheduler, uint64_t deadline, event_handler handler,
+                        void* obj) {
+  if (scheduler->num_events == MAX_EVENTS) {
+    LOG_ERROR("No room for an event at cycle %" PRIu64 "\n", deadline);
+    return 0;
+  }
+
+  Event* event = &scheduler->events[scheduler->num_events];
+  event->deadline = deadline;
+  event->id = scheduler->next_id++;
+  event->obj = obj ? rc_weak_retain(obj) : NULL;
+  event->handler = handler;
+  if (!scheduler->next_id) {
+    scheduler->next_id = 1;
+  }
+
+  const uint32_t id = event->id;
+  sift_up(scheduler->events, scheduler->num_events++);
+  return id;
+}
+
+void cancel_event(Scheduler* scheduler, uint32_t id) {
+  for (size_t i = 0; i < scheduler->num_events; i++) {
+    if (scheduler->events[i].id == id) {
+      Event event;
+      remove_event(scheduler, i, &event);
+      if (event.obj) {
+        rc_weak_release((void*)&event.obj);
+      }
+      return;
+    }
+  }
+}
+
+void run_events(Scheduler* scheduler, uint64_t cycle) {
+  while (scheduler->num_events && scheduler->events[0].deadline <= cycle) {
+    Event event;
+    remove_event(scheduler, 0, &event);
+    if (!event.obj || rc_weak_check(&event.obj)) {
+      event.handler(event.obj, event.deadline);
+    }
+    if (event.obj) {
+      rc_weak_release((void*)&event.obj);
+    }
+  }
+}
@@ -0,0 +1,229 @@
+#include "b6502/trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "b6502/rc.h"
+
+_Static_assert(sizeof(TraceRecord) == 24, "trace records must stay fixed-size");
+
+static size_t round_up_capacity(size_t capacity) {
+  size_t rounded = 1;
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+static void tracer_deinit(void* obj) {
+  Tracer* tracer = obj;
+  if (tracer->mapped_size) {
+    munmap(tracer->header, tracer->mapped_size);
+  } else {
+    free(tracer->header);
+  }
+}
+
+static Tracer* tracer_init(TraceHeader* header, CpuVariant variant, size_t capacity,
+                           size_t mapped_size) {
+  memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+  header->version = TRACE_VERSION;
+  header->record_size = sizeof(TraceRecord);
+  header->capacity = capacity;
+  header->written = 0;
+  header->variant = (uint32_t)variant;
+
+  Tracer* tracer = rc_alloc(sizeof(*tracer), tracer_deinit);
+  tracer->header = header;
+  tracer->records = (TraceRecord*)(header + 1);
+  tracer->mask = capacity - 1;
+  tracer->mapped_size = mapped_size;
+  tracer_set_trigger(tracer, TRACE_NO_PC, 0);
+  return tracer;
+}
+
+Tracer* tracer_create(CpuVariant variant, size_t capacity) {
+  capacity = round_up_capacity(capacity);
+  TraceHeader* header = calloc(1, sizeof(*header) + capacity * sizeof(TraceRecord));
+  if (!header) {
+    LOG_ERROR("Out of memory\n");
+    return NULL;
+  }
+  return tracer_init(header, variant, capacity, 0);
+}
+
+Tracer* tracer_create_file(CpuVariant variant, const char* path, size_t capacity) {
+  capacity = round_up_capacity(capacity);
+  const size_t size = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+  FILE* f = fopen(path, "w+b");
+  if (!f || fseek(f, (long)(size - 1), SEEK_SET) || fputc(0, f) == EOF || fflush(f)) {
+    LOG_ERROR("Error creating %s: %s\n", path, strerror(errno));
+    if (f) {
+      fclose(f);
+    }
+    return NULL;
+  }
+
+  // The mapping keeps the file open, and its pages reach the file even if the process crashes.
+  void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+  fclose(f);
+  if (mapped == MAP_FAILED) {
+    LOG_ERROR("Error mapping %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  return tracer_init(mapped, variant, capacity, size);
+}
+
+void tracer_set_trigger(Tracer* tracer, uint32_t pc, uint64_t cycle) {
+  tracer->trigger_pc = pc;
+  tracer->trigger_cycle = cycle;
+  tracer->capturing = false;
+}
+
+static size_t count_records(const TraceHeader* header) {
+  return header->written < header->capacity ? (size_t)header->written : (size_t)header->capacity;
+}
+
+static const TraceRecord* oldest_first(const TraceHeader* header, const TraceRecord* records,
+                                       size_t index) {
+  const uint64_t first = header->written - count_records(header);
+  return &records[(first + index) % header->capacity];
+}
+
+size_t tracer_count(const Tracer* tracer) { return count_records(tracer->header); }
+
+const TraceRecord* tracer_record(const Tracer* tracer, size_t index) {
+  return oldest_first(tracer->header, tracer->records, index);
+}
+
+/////////////////////////////////////////////////
+///     Exporter
+/////////////////////////////////////////////////
+
+static void format_operand(const OpcodeInfo* info, const TraceRecord* record, char* buffer,
+                           size_t size) {
+  const uint8_t lo = record->operand[0];
+  const uint16_t word = (uint16_t)(record->operand[1] << 8 | lo);
+  const uint16_t next = (uint16_t)(record->pc + record->length);
+  switch (info->mode) {
+    case kAcc:
+      snprintf(buffer, size, " A");
+      break;
+    case kImm:
+      snprintf(buffer, size, " #$%02X", lo);
+      break;
+    case kZeroP:
+      snprintf(buffer, size, " $%02X", lo);
+      break;
+    case kZeroPX:
+      snprintf(buffer, size, " $%02X,X", lo);
+      break;
+    case kZeroPY:
+      snprintf(buffer, size, " $%02X,Y", lo);
+      break;
+    case kZeroPInd:
+      snprintf(buffer, size, " ($%02X)", lo);
+      break;
+    case kIdxInd:
+      snprintf(buffer, size, " ($%02X,X)", lo);
+      break;
+    case kIndIdx:
+      snprintf(buffer, size, " ($%02X),Y", lo);
+      break;
+    case kAbs:
+      snprintf(buffer, size, " $%04X", word);
+      break;
+    case kAbsX:
+      snprintf(buffer, size, " $%04X,X", word);
+      break;
+    case kAbsY:
+      snprintf(buffer, size, " $%04X,Y", word);
+      break;
+    case kInd:
+      snprintf(buffer, size, " ($%04X)", word);
+      break;
+    case kAbsXInd:
+      snprintf(buffer, size, " ($%04X,X)", word);
+      break;
+    case kRel:
+      snprintf(buffer, size, " $%04X", (uint16_t)(next + (int8_t)lo));
+      break;
+    case kZeroPRel:
+      snprintf(buffer, size, " $%02X,$%04X", lo, (uint16_t)(next + (int8_t)record->operand[1]));
+      break;
+    default:
+      buffer[0] = '\0';
+      break;
+  }
+}
+
+void format_trace_record(CpuVariant variant, const TraceRecord* record, char* buffer,
+                         size_t size) {
+  OpcodeInfo info;
+  get_opcode_info(variant, record->opcode, &info);
+
+  char bytes[9] = "";
+  if (record->length == 1) {
+    snprintf(bytes, sizeof(bytes), "%02X", record->opcode);
+  } else if (record->length == 2) {
+    snprintf(bytes, sizeof(bytes), "%02X %02X", record->opcode, record->operand[0]);
+  } else {
+    snprintf(bytes, sizeof(bytes), "%02X %02X %02X", record->opcode, record->operand[0],
+             record->operand[1]);
+  }
+
+  char operand[16];
+  char disassembly[32];
+  format_operand(&info, record, operand, sizeof(operand));
+  snprintf(disassembly, sizeof(disassembly), "%s%s", info.name, operand);
+  snprintf(buffer, size, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%" PRIu64,
+           record->pc, bytes, disassembly, record->a, record->x, record->y, record->sr, record->sp,
+           record->cycle);
+}
+
+static void export_records(const TraceHeader* header, const TraceRecord* records, FILE* out) {
+  char line[128];
+  const size_t count = count_records(header);
+  for (size_t i = 0; i < count; i++) {
+    format_trace_record((CpuVariant)header->variant, oldest_first(header, records, i), line,
+                        sizeof(line));
+    fprintf(out, "%s\n", line);
+  }
+}
+
+void tracer_export(const Tracer* tracer, FILE* out) {
+  export_records(tracer->header, tracer->records, out);
+}
+
+bool trace_export_file(const char* path, FILE* out) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    LOG_ERROR("Error opening file: %s\n", strerror(errno));
+    return false;
+  }
+
+  TraceHeader header;
+  TraceRecord* records = NULL;
+  bool valid = fread(&header, sizeof(header), 1, f) == 1
+               && !memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+               && header.version == TRACE_VERSION && header.record_size == sizeof(TraceRecord)
+               && header.capacity && header.capacity <= SIZE_MAX / sizeof(TraceRecord)
+               && header.variant <= kWDC65C02;
+  if (valid) {
+    records = malloc((size_t)header.capacity * sizeof(TraceRecord));
+    valid = records
+            && fread(records, sizeof(TraceRecord), (size_t)header.capacity, f) == header.capacity;
+  }
+  fclose(f);
+
+  if (!valid) {
+    LOG_ERROR("%s is not a complete trace\n", path);
+  } else {
+    export_records(&header, records, out);
+  }
+  free(records);
+  return valid;
+}
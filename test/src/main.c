@@ -3,7 +3,13 @@
 
 static void RunAllTests(void) {
   RUN_TEST_GROUP(RC)
+  RUN_TEST_GROUP(MEMORY)
+  RUN_TEST_GROUP(MACHINE)
   RUN_TEST_GROUP(MOS6502)
+  RUN_TEST_GROUP(SCHEDULER)
+  RUN_TEST_GROUP(AOT)
+  RUN_TEST_GROUP(PROFILER)
+  RUN_TEST_GROUP(TRACE)
 }
 
 int main(int argc, const char* argv[]) { return UnityMain(argc, argv, RunAllTests); }
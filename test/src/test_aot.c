@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "b6502/aot.h"
+#include "b6502/memory.h"
+#include "b6502/mos6502.h"
+#include "b6502/reset_manager.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+#define MEM_SIZE 65536
+
+// Generated by b6502-recompile from test/resources/6502_functional_test.bin, see
+// test/CMakeLists.txt.
+extern const AotProgram klaus_aot;
+
+static Mos6502* cpu = NULL;
+static Memory* mem = NULL;
+static ResetManager* rm = NULL;
+
+TEST_GROUP(AOT);
+
+TEST_SETUP(AOT) {
+  rm = reset_manager_create();
+  cpu = mos6502_create(rm, kNMOS6502);
+  mem = memory_generic_create(rm, MEM_SIZE);
+  map_handler(cpu->bus, mem, 0, 0xFFFF);
+  if (read_rom("test/resources/6502_functional_test.bin", mem->bytes, sizeof(*mem->bytes), 0x10000)
+      == -1) {
+    TEST_ASSERT(false);
+  }
+  TEST_ASSERT(set_aot_program(cpu, &klaus_aot));
+}
+
+TEST_TEAR_DOWN(AOT) {
+  rc_strong_release((void*)&rm);
+  rc_strong_release((void*)&cpu);
+  rc_strong_release((void*)&mem);
+}
+
+TEST(AOT, klaus_test) {
+  cpu->pc = 0x400;
+  set_breakpoint(cpu, 0x3469);
+  do {
+    mos6502_run(cpu, 29781);
+  } while (cpu->stop_reason == kStopBudget);
+
+  if (cpu->stop_reason != kStopBreakpoint || cpu->pc != 0x3469) {
+    LOG_ERROR("Error at PC: 0x%04X\n", cpu->pc);
+    TEST_ASSERT(false);
+  }
+
+  // The test modifies some of its own code.
+  TEST_ASSERT(aot_stale_blocks(cpu) > 0);
+}
+
+TEST(AOT, lockstep) {
+  Mos6502* ref = mos6502_create(rm, kNMOS6502);
+  Memory* ref_mem = memory_generic_create(rm, MEM_SIZE);
+  map_handler(ref->bus, ref_mem, 0, 0xFFFF);
+  memcpy(ref_mem->bytes, mem->bytes, MEM_SIZE);
+
+  // Recompiled blocks run as a whole, so compare against the interpreter at block boundaries.
+  ref->pc = cpu->pc = 0x400;
+  for (size_t i = 0; i < 200000; i++) {
+    size_t executed = mos6502_execute(cpu, 64);
+    for (size_t j = 0; j < executed; j++) {
+      step(ref);
+    }
+
+    TEST_ASSERT_EQUAL_HEX16(ref->pc, cpu->pc);
+    TEST_ASSERT_EQUAL_HEX8(ref->a, cpu->a);
+    TEST_ASSERT_EQUAL_HEX8(ref->x, cpu->x);
+    TEST_ASSERT_EQUAL_HEX8(ref->y, cpu->y);
+    TEST_ASSERT_EQUAL_HEX8(ref->sp, cpu->sp);
+    TEST_ASSERT_EQUAL_HEX8(ref->sr, cpu->sr);
+    TEST_ASSERT_EQUAL_UINT64(ref->cycles, cpu->cycles);
+  }
+  TEST_ASSERT_EQUAL_MEMORY(ref_mem->bytes, mem->bytes, MEM_SIZE);
+
+  rc_strong_release((void*)&ref);
+  rc_strong_release((void*)&ref_mem);
+}
+
+TEST(AOT, breakpoint_inside_block) {
+  // $0400 is CLD, LDX #$FF, TXS, which is recompiled as one block.
+  cpu->pc = 0x400;
+  set_breakpoint(cpu, 0x401);
+  TEST_ASSERT_EQUAL_size_t(1, mos6502_execute(cpu, 100));
+  TEST_ASSERT_EQUAL(kStopBreakpoint, cpu->stop_reason);
+  TEST_ASSERT_EQUAL_HEX16(0x401, cpu->pc);
+}
+
+TEST(AOT, modified_code_is_interpreted) {
+  // Patch LDX #$FF into LDX #$80 through the bus: the block recompiled with the old operand must
+  // not run.
+  write(cpu->bus, 0x402, 0x80);
+  cpu->pc = 0x400;
+  mos6502_execute(cpu, 3);
+  TEST_ASSERT_EQUAL_HEX8(0x80, cpu->x);
+  TEST_ASSERT_EQUAL_HEX8(0x80, cpu->sp);
+  TEST_ASSERT(aot_stale_blocks(cpu) > 0);
+}
+
+TEST_GROUP_RUNNER(AOT) {
+  RUN_TEST_CASE(AOT, klaus_test)
+  RUN_TEST_CASE(AOT, lockstep)
+  RUN_TEST_CASE(AOT, breakpoint_inside_block)
+  RUN_TEST_CASE(AOT, modified_code_is_interpreted)
+}
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "b6502/machine.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+static const MachineConfig config = {
+    .variant = kNMOS6502,
+    .ram_size = 0x800,
+    .ram_end = 0x1FFF,
+    .rom_size = 0x1000,
+    .rom_start = 0xF000,
+};
+
+static Machine* machine = NULL;
+
+TEST_GROUP(MACHINE);
+
+TEST_SETUP(MACHINE) {
+  machine = machine_create(&config);
+
+  // LDX #0; INX; STX $10; CPX #$20; BNE -7; KIL
+  const uint8_t program[] = {0xA2, 0x00, 0xE8, 0x86, 0x10, 0xE0, 0x20, 0xD0, 0xF9, 0x02};
+  memcpy(machine->rom->bytes, program, sizeof(program));
+  machine->cpu->pc = 0xF000;
+}
+
+TEST_TEAR_DOWN(MACHINE) {
+  if (machine) {
+    rc_strong_release((void*)&machine);
+  }
+}
+
+TEST(MACHINE, one_arena) {
+  Mos6502* cpu = machine->cpu;
+  TEST_ASSERT_NOT_NULL(machine);
+  TEST_ASSERT(rc_arena_contains(machine->arena, cpu));
+  TEST_ASSERT(rc_arena_contains(machine->arena, machine->ram->bytes));
+  TEST_ASSERT(rc_arena_contains(machine->arena, machine->rom->bytes));
+  TEST_ASSERT_EQUAL_size_t(0, (uintptr_t)cpu % RC_ARENA_ALIGN);
+  TEST_ASSERT_EQUAL_PTR((uint8_t*)cpu + rc_arena_footprint(sizeof(Mos6502)), cpu->bus);
+
+  // RAM is mirrored four times, and ROM fills the top 4KB.
+  TEST_ASSERT_EQUAL_PTR(machine->ram->bytes, cpu->bus->read_pages[0x18]);
+  TEST_ASSERT_EQUAL_PTR(machine->rom->bytes, cpu->bus->read_pages[0xF0]);
+  TEST_ASSERT_NULL(cpu->bus->write_pages[0xF0]);
+}
+
+TEST(MACHINE, clone_runs_on_its_own) {
+  mos6502_execute(machine->cpu, 10);
+  Machine* clone = machine_clone(machine);
+  TEST_ASSERT_NOT_NULL(clone);
+  TEST_ASSERT(clone->arena != machine->arena);
+  TEST_ASSERT(rc_arena_contains(clone->arena, clone->cpu->bus));
+  TEST_ASSERT_EQUAL_PTR(&clone->cpu->cycles, clone->cpu->bus->clock);
+  TEST_ASSERT_EQUAL_PTR(clone->ram->bytes, clone->cpu->bus->write_pages[0x08]);
+  TEST_ASSERT_EQUAL_HEX8(machine->cpu->x, clone->cpu->x);
+  TEST_ASSERT_EQUAL_UINT64(machine->cpu->cycles, clone->cpu->cycles);
+
+  clone->ram->bytes[0x300] = 0xAA;
+  TEST_ASSERT_EQUAL_HEX8(0x00, machine->ram->bytes[0x300]);
+
+  mos6502_execute(machine->cpu, 1000);
+  mos6502_execute(clone->cpu, 1000);
+  TEST_ASSERT_EQUAL(kStopJammed, clone->cpu->stop_reason);
+  TEST_ASSERT_EQUAL_HEX8(0x20, clone->cpu->x);
+  TEST_ASSERT_EQUAL_HEX8(0x20, clone->ram->bytes[0x10]);
+  TEST_ASSERT_EQUAL_UINT64(machine->cpu->cycles, clone->cpu->cycles);
+
+  // Resetting the copy leaves the original alone.
+  reset_devices(clone->rm);
+  TEST_ASSERT_EQUAL_HEX8(0x00, clone->ram->bytes[0x10]);
+  TEST_ASSERT_EQUAL_HEX8(0x20, machine->ram->bytes[0x10]);
+  rc_strong_release((void*)&clone);
+}
+
+static void count_event(void* obj, uint64_t UNUSED(deadline)) { *(int*)obj += 1; }
+
+TEST(MACHINE, clone_shares_outside_events) {
+  int* device = rc_alloc(sizeof(*device), NULL);
+  const uint64_t deadline = machine->cpu->cycles + 100;
+  schedule_event(machine->cpu->scheduler, deadline, count_event, device);
+  Machine* clone = machine_clone(machine);
+  TEST_ASSERT_NOT_NULL(clone);
+  TEST_ASSERT_EQUAL_size_t(2, rc_weak_count(device));
+
+  // Each scheduler fires its own copy of the event, and drops its own reference.
+  run_events(clone->cpu->scheduler, deadline);
+  TEST_ASSERT_EQUAL_INT(1, *device);
+  TEST_ASSERT_EQUAL_size_t(1, rc_weak_count(device));
+  rc_strong_release((void*)&clone);
+  run_events(machine->cpu->scheduler, deadline);
+  TEST_ASSERT_EQUAL_INT(2, *device);
+  TEST_ASSERT_EQUAL_size_t(0, rc_weak_count(device));
+
+  // An event still pending when the device goes away is released with the machine.
+  schedule_event(machine->cpu->scheduler, deadline + 100, count_event, device);
+  rc_strong_release((void*)&device);
+}
+
+TEST(MACHINE, clone_needs_sole_ownership) {
+  Mos6502* cpu = rc_strong_retain(machine->cpu);
+  TEST_ASSERT_NULL(machine_clone(machine));
+
+  // The CPU outlives the machine, and takes the arena with it.
+  rc_strong_release((void*)&machine);
+  TEST_ASSERT_EQUAL_HEX16(0xF000, cpu->pc);
+  rc_strong_release((void*)&cpu);
+}
+
+TEST_GROUP_RUNNER(MACHINE) {
+  RUN_TEST_CASE(MACHINE, one_arena)
+  RUN_TEST_CASE(MACHINE, clone_runs_on_its_own)
+  RUN_TEST_CASE(MACHINE, clone_shares_outside_events)
+  RUN_TEST_CASE(MACHINE, clone_needs_sole_ownership)
+}
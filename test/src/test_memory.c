@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "b6502/bus.h"
+#include "b6502/memory.h"
+#include "b6502/rc.h"
+#include "b6502/reset_manager.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+#define ROM_SIZE 0x4000
+
+static char path[] = "/tmp/b6502_romXXXXXX";
+static Bus* bus = NULL;
+
+TEST_GROUP(MEMORY);
+
+static void write_rom(char* rom_path) {
+  static uint8_t rom[ROM_SIZE];
+  for (size_t i = 0; i < ROM_SIZE; i++) {
+    rom[i] = (uint8_t)(i * 7);
+  }
+
+  FILE* f = fdopen(mkstemp(rom_path), "wb");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL_size_t(ROM_SIZE, fwrite(rom, 1, ROM_SIZE, f));
+  fclose(f);
+}
+
+TEST_SETUP(MEMORY) {
+  snprintf(path, sizeof(path), "/tmp/b6502_romXXXXXX");
+  write_rom(path);
+  bus = bus_create();
+}
+
+TEST_TEAR_DOWN(MEMORY) {
+  rc_strong_release((void*)&bus);
+  remove(path);
+}
+
+TEST(MEMORY, rom_map_shares_one_mapping) {
+  Memory* first = rom_map(path, false);
+  Memory* second = rom_map(path, true);
+  TEST_ASSERT_NOT_NULL(first);
+  TEST_ASSERT_NOT_NULL(second);
+  TEST_ASSERT(first != second);
+  TEST_ASSERT_EQUAL_PTR(first->bytes, second->bytes);
+  TEST_ASSERT_EQUAL_size_t(ROM_SIZE, second->size);
+
+  map_mirrored(bus, first, 0xC000, 0xFFFF, ROM_SIZE - 1);
+  TEST_ASSERT_NOT_NULL(bus->read_pages[0xC0]);
+  TEST_ASSERT_NULL(bus->write_pages[0xC0]);
+  TEST_ASSERT_EQUAL_HEX8((uint8_t)(0x123 * 7), read(bus, 0xC123));
+  write(bus, 0xC123, 0xFF);
+  TEST_ASSERT_EQUAL_HEX8((uint8_t)(0x123 * 7), read(bus, 0xC123));
+
+  // The mapping outlives the device it was first mapped for.
+  rc_strong_release((void*)&first);
+  TEST_ASSERT_EQUAL_HEX8((uint8_t)(0x3FFF * 7), second->bytes[0x3FFF]);
+  rc_strong_release((void*)&second);
+
+  Memory* again = rom_map(path, false);
+  TEST_ASSERT_NOT_NULL(again);
+  TEST_ASSERT_EQUAL_HEX8(7, again->bytes[1]);
+  rc_strong_release((void*)&again);
+}
+
+TEST(MEMORY, rom_map_missing_file) {
+  TEST_ASSERT_NULL(rom_map("/nonexistent/rom.bin", false));
+}
+
+#define MAPPING_THREADS 4
+
+static void* map_repeatedly(void* arg) {
+  const uint8_t** bytes = arg;
+  for (int i = 0; i < 1000; i++) {
+    Memory* rom = rom_map(path, false);
+    if (!rom || (*bytes && rom->bytes != *bytes)) {
+      *bytes = NULL;
+      break;
+    }
+    *bytes = rom->bytes;
+    rc_strong_release((void*)&rom);
+  }
+  return NULL;
+}
+
+TEST(MEMORY, rom_map_from_threads) {
+  // One mapping stays alive throughout, so every thread has to share it.
+  Memory* held = rom_map(path, false);
+  TEST_ASSERT_NOT_NULL(held);
+
+  pthread_t threads[MAPPING_THREADS];
+  const uint8_t* bytes[MAPPING_THREADS] = {NULL};
+  for (int i = 0; i < MAPPING_THREADS; i++) {
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, map_repeatedly, &bytes[i]));
+  }
+  for (int i = 0; i < MAPPING_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    TEST_ASSERT_EQUAL_PTR(held->bytes, bytes[i]);
+  }
+  rc_strong_release((void*)&held);
+}
+
+TEST(MEMORY, rom_map_full_registry) {
+  char paths[17][sizeof(path)];
+  Memory* roms[17];
+  for (size_t i = 0; i < 17; i++) {
+    snprintf(paths[i], sizeof(paths[i]), "/tmp/b6502_romXXXXXX");
+    write_rom(paths[i]);
+    roms[i] = rom_map(paths[i], false);
+    TEST_ASSERT_NOT_NULL(roms[i]);
+  }
+
+  // The file past the end of the table is mapped again every time, instead of being shared.
+  Memory* first = rom_map(paths[0], false);
+  Memory* last = rom_map(paths[16], false);
+  TEST_ASSERT_EQUAL_PTR(roms[0]->bytes, first->bytes);
+  TEST_ASSERT(roms[16]->bytes != last->bytes);
+  TEST_ASSERT_EQUAL_HEX8(7, last->bytes[1]);
+  rc_strong_release((void*)&first);
+  rc_strong_release((void*)&last);
+  for (size_t i = 0; i < 17; i++) {
+    rc_strong_release((void*)&roms[i]);
+    remove(paths[i]);
+  }
+}
+
+TEST(MEMORY, mirrored_ram_aliases_pages) {
+  ResetManager* rm = reset_manager_create();
+  Memory* ram = ram_mirrored_create(rm, 0x4000, 0x10000);
+  if (ram->size != 0x10000) {
+    rc_strong_release((void*)&ram);
+    rc_strong_release((void*)&rm);
+    TEST_IGNORE_MESSAGE("Host pages too large to alias 16KB");
+  }
+
+  ram->bytes[0x123] = 0x42;
+  TEST_ASSERT_EQUAL_HEX8(0x42, ram->bytes[0x4123]);
+  TEST_ASSERT_EQUAL_HEX8(0x42, ram->bytes[0xC123]);
+
+  // Every mirrored page points at its own copy, and code is still tracked on the masked page.
+  map_mirrored(bus, ram, 0x0000, 0xFFFF, 0x3FFF);
+  TEST_ASSERT_EQUAL_PTR(ram->bytes + 0x8100, bus->read_pages[0x81]);
+  TEST_ASSERT_EQUAL_PTR(ram->bytes + 0x8100, bus->write_pages[0x81]);
+  write(bus, 0x8123, 0x99);
+  TEST_ASSERT_EQUAL_HEX8(0x99, read(bus, 0x0123));
+  TEST_ASSERT_EQUAL_size_t(0x01, code_page(bus, 0xC123));
+
+  reset_devices(rm);
+  TEST_ASSERT_EQUAL_HEX8(0x00, read(bus, 0xC123));
+  rc_strong_release((void*)&ram);
+  rc_strong_release((void*)&rm);
+}
+
+TEST(MEMORY, mirrored_ram_falls_back_below_host_pages) {
+  ResetManager* rm = reset_manager_create();
+  Memory* ram = ram_mirrored_create(rm, 0x800, 0x2000);
+  TEST_ASSERT_EQUAL_size_t(0x800, ram->size);
+  TEST_ASSERT_EQUAL_size_t(0, ram->alias_size);
+
+  map_mirrored(bus, ram, 0x0000, 0x1FFF, 0x07FF);
+  write(bus, 0x1801, 0x5A);
+  TEST_ASSERT_EQUAL_HEX8(0x5A, read(bus, 0x0001));
+  TEST_ASSERT_EQUAL_PTR(ram->bytes, bus->read_pages[0x18]);
+  rc_strong_release((void*)&ram);
+  rc_strong_release((void*)&rm);
+}
+
+TEST_GROUP_RUNNER(MEMORY) {
+  RUN_TEST_CASE(MEMORY, rom_map_shares_one_mapping)
+  RUN_TEST_CASE(MEMORY, rom_map_missing_file)
+  RUN_TEST_CASE(MEMORY, rom_map_from_threads)
+  RUN_TEST_CASE(MEMORY, rom_map_full_registry)
+  RUN_TEST_CASE(MEMORY, mirrored_ram_aliases_pages)
+  RUN_TEST_CASE(MEMORY, mirrored_ram_falls_back_below_host_pages)
+}
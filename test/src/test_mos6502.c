@@ -14,7 +14,7 @@ TEST_GROUP(MOS6502);
 
 TEST_SETUP(MOS6502) {
   rm = reset_manager_create();
-  cpu = mos6502_create(rm);
+  cpu = mos6502_create(rm, kNMOS6502);
   mem = memory_generic_create(rm, MEM_SIZE);
   map_handler(cpu->bus, mem, 0, 0xFFFF);
 }
@@ -25,24 +25,805 @@ TEST_TEAR_DOWN(MOS6502) {
   rc_strong_release((void*)&mem);
 }
 
-TEST(MOS6502, klaus_test) {
+static void load_klaus(void) {
   if (read_rom("test/resources/6502_functional_test.bin", mem->bytes, sizeof(*mem->bytes), 0x10000)
       == -1) {
     TEST_ASSERT(false);
   }
+}
+
+// Runs the functional test from the start on a fresh CPU of the given variant, which replaces the
+// fixture's, and checks that it reaches the success trap. setup picks the engine, and run drives it
+// until the test traps. Returns false without running it if setup finds the engine unavailable.
+static bool run_klaus(CpuVariant variant, bool (*setup)(Mos6502*), void (*run)(Mos6502*)) {
+  rc_strong_release((void*)&cpu);
+  cpu = mos6502_create(rm, variant);
+  map_handler(cpu->bus, mem, 0, 0xFFFF);
+  if (setup && !setup(cpu)) {
+    return false;
+  }
 
+  load_klaus();
   cpu->pc = 0x400;
-  while (cpu->pc != 0x3469) {
-    uint16_t opc = cpu->pc;
-    step(cpu);
-    if (cpu->pc == opc) {
-      LOG_ERROR("Error at PC: 0x%04X\n", cpu->pc);
-      TEST_ASSERT(false);
+  run(cpu);
+  if (cpu->pc != 0x3469) {
+    LOG_ERROR("Error at PC: 0x%04X\n", cpu->pc);
+    TEST_ASSERT(false);
+  }
+  return true;
+}
+
+// Runs the functional test on the fixture's CPU in batches of mos6502_execute(), and on the
+// interpreter alongside it, and compares the two after every batch.
+static void klaus_lockstep(size_t batches, size_t batch_size) {
+  Mos6502* ref = mos6502_create(rm, kNMOS6502);
+  Memory* ref_mem = memory_generic_create(rm, MEM_SIZE);
+  map_handler(ref->bus, ref_mem, 0, 0xFFFF);
+  load_klaus();
+  memcpy(ref_mem->bytes, mem->bytes, MEM_SIZE);
+
+  ref->pc = cpu->pc = 0x400;
+  for (size_t i = 0; i < batches; i++) {
+    size_t executed = mos6502_execute(cpu, batch_size);
+    for (size_t j = 0; j < executed; j++) {
+      step(ref);
+    }
+
+    TEST_ASSERT_EQUAL_HEX16(ref->pc, cpu->pc);
+    TEST_ASSERT_EQUAL_HEX8(ref->a, cpu->a);
+    TEST_ASSERT_EQUAL_HEX8(ref->x, cpu->x);
+    TEST_ASSERT_EQUAL_HEX8(ref->y, cpu->y);
+    TEST_ASSERT_EQUAL_HEX8(ref->sp, cpu->sp);
+    TEST_ASSERT_EQUAL_HEX8(ref->sr, cpu->sr);
+    TEST_ASSERT_EQUAL_UINT64(ref->cycles, cpu->cycles);
+  }
+  TEST_ASSERT_EQUAL_MEMORY(ref_mem->bytes, mem->bytes, MEM_SIZE);
+
+  rc_strong_release((void*)&ref);
+  rc_strong_release((void*)&ref_mem);
+}
+
+static void step_to_trap(Mos6502* target) {
+  for (;;) {
+    uint16_t opc = target->pc;
+    step(target);
+    if (target->pc == opc) {
+      return;
+    }
+  }
+}
+
+// Run in large batches, and single-step only to tell a trap (JMP * or a branch to itself) apart
+// from progress.
+static void execute_to_trap(Mos6502* target) {
+  for (;;) {
+    mos6502_execute(target, 10000);
+    uint16_t opc = target->pc;
+    mos6502_execute(target, 1);
+    if (target->pc == opc) {
+      return;
+    }
+  }
+}
+
+// One NTSC NES frame worth of cycles per call, until the success trap's breakpoint or another
+// trap stops the run.
+static void run_to_trap(Mos6502* target) {
+  set_breakpoint(target, 0x3469);
+  do {
+    mos6502_run(target, 29781);
+  } while (target->stop_reason == kStopBudget);
+}
+
+static bool enable_block_cache(Mos6502* target) {
+  set_block_cache(target, true);
+  return true;
+}
+
+static bool enable_jit(Mos6502* target) { return set_jit(target, true); }
+
+TEST(MOS6502, klaus_test) { run_klaus(kNMOS6502, NULL, step_to_trap); }
+
+TEST(MOS6502, klaus_test_threaded) { run_klaus(kNMOS6502, NULL, execute_to_trap); }
+
+TEST(MOS6502, klaus_test_run) { run_klaus(kNMOS6502, NULL, run_to_trap); }
+
+TEST(MOS6502, klaus_test_block_cache) {
+  run_klaus(kNMOS6502, enable_block_cache, run_to_trap);
+
+  BlockCacheStats stats;
+  get_block_cache_stats(cpu, &stats);
+  TEST_ASSERT(stats.hits > stats.misses);
+}
+
+TEST(MOS6502, block_cache_self_modifying) {
+  // LDA #$42; STA $0206; LDA #$00; JMP $0207. The store rewrites the operand of the second LDA,
+  // which was decoded into the same block.
+  const uint8_t program[] = {0xA9, 0x42, 0x8D, 0x06, 0x02, 0xA9, 0x00, 0x4C, 0x07, 0x02};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+
+  set_block_cache(cpu, true);
+  cpu->pc = 0x200;
+  mos6502_run(cpu, 1000);
+  TEST_ASSERT_EQUAL_INT(kStopHalt, cpu->stop_reason);
+  TEST_ASSERT_EQUAL_HEX8(0x42, cpu->a);
+
+  // Patch the operand back through the bus and run again: the cached block must not survive.
+  write(cpu->bus, 0x206, 0x00);
+  write(cpu->bus, 0x201, 0x17);
+  cpu->pc = 0x200;
+  mos6502_run(cpu, 1000);
+  TEST_ASSERT_EQUAL_HEX8(0x17, cpu->a);
+
+  BlockCacheStats stats;
+  get_block_cache_stats(cpu, &stats);
+  TEST_ASSERT(stats.invalidations >= 2);
+}
+
+TEST(MOS6502, block_cache_transfer_loops) {
+  // A (zp),Y copy, an abs,X fill counting down across a page and an abs,X copy whose loads cross
+  // a page, then JMP *.
+  const uint8_t program[] = {
+      0xA0, 0x00, 0xB1, 0x20, 0x91, 0x22, 0xC8, 0xD0, 0xF9,  // LDY #0; LDA ($20),Y; STA ($22),Y
+      0xA2, 0x10, 0xA9, 0xAA, 0x9D, 0xF8, 0x04, 0xCA, 0xD0, 0xFA,  // LDX #$10; STA $04F8,X; DEX
+      0xA2, 0xF0, 0xBD, 0x10, 0x06, 0x9D, 0x00, 0x07, 0xE8, 0xD0, 0xF7,  // LDA $0610,X; STA $0700,X
+      0x4C, 0x1E, 0x02};
+
+  uint8_t expected[MEM_SIZE];
+  uint64_t used[2];
+  uint8_t regs[2][4];
+  for (int cached = 0; cached < 2; cached++) {
+    memset(mem->bytes, 0, MEM_SIZE);
+    memcpy(&mem->bytes[0x200], program, sizeof(program));
+    for (size_t i = 0; i < 0x100; i++) {
+      mem->bytes[0x400 + i] = (uint8_t)(i * 7);
+    }
+    mem->bytes[0x20] = 0x00;
+    mem->bytes[0x21] = 0x04;
+    mem->bytes[0x22] = 0x80;
+    mem->bytes[0x23] = 0x05;
+
+    set_block_cache(cpu, cached == 1);
+    cpu->pc = 0x200;
+    const uint64_t start = cpu->cycles;
+    mos6502_run(cpu, 10000);
+    used[cached] = cpu->cycles - start;
+    regs[cached][0] = cpu->a;
+    regs[cached][1] = cpu->x;
+    regs[cached][2] = cpu->y;
+    regs[cached][3] = cpu->sr;
+    TEST_ASSERT_EQUAL_HEX16(0x21E, cpu->pc);
+    if (!cached) {
+      memcpy(expected, mem->bytes, MEM_SIZE);
     }
   }
 
-  LOG_DEBUG("Functional test passed!\n");
-  TEST_ASSERT(true);
+  // The native loops produce what interpreting every instruction does.
+  TEST_ASSERT_EQUAL_UINT64(used[0], used[1]);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(regs[0], regs[1], 4);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, mem->bytes, MEM_SIZE);
+  TEST_ASSERT_EQUAL_HEX8((uint8_t)(0x80 * 7), mem->bytes[0x600]);
+
+  BlockCacheStats stats;
+  get_block_cache_stats(cpu, &stats);
+  TEST_ASSERT_EQUAL_UINT64(3, stats.transfers);
 }
 
-TEST_GROUP_RUNNER(MOS6502) { RUN_TEST_CASE(MOS6502, klaus_test) }
+TEST(MOS6502, block_cache_superinstructions) {
+  // INY/CPY, CPY/BNE, LDA/STA, CLC/ADC, CMP/BEQ and DEX/BNE pairs in a loop that runs five times.
+  const uint8_t program[] = {
+      0xA2, 0x05, 0xA0, 0x00,  // LDX #5; LDY #0
+      0xC8, 0xC0, 0x03, 0xD0, 0x02, 0xA0, 0x00,  // INY; CPY #3; BNE +2; LDY #0
+      0xA9, 0x07, 0x85, 0x10, 0x18, 0x69, 0xF9,  // LDA #7; STA $10; CLC; ADC #$F9
+      0xC9, 0x00, 0xF0, 0x00, 0xCA, 0xD0, 0xEB,  // CMP #0; BEQ +0; DEX; BNE $0204
+      0x4C, 0x19, 0x02};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+
+  uint64_t used[2];
+  uint8_t regs[2][4];
+  for (int cached = 0; cached < 2; cached++) {
+    if (cached) {
+      set_pair_profiling(cpu, true);
+    }
+    cpu->pc = 0x200;
+    const uint64_t start = cpu->cycles;
+    mos6502_run(cpu, 1000);
+    used[cached] = cpu->cycles - start;
+    regs[cached][0] = cpu->a;
+    regs[cached][1] = cpu->x;
+    regs[cached][2] = cpu->y;
+    regs[cached][3] = cpu->sr;
+    TEST_ASSERT_EQUAL_HEX16(0x219, cpu->pc);
+  }
+
+  TEST_ASSERT_EQUAL_UINT64(used[0], used[1]);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(regs[0], regs[1], 4);
+  TEST_ASSERT_EQUAL_UINT64(5, pair_frequency(cpu, 0xCA, 0xD0));
+  TEST_ASSERT_EQUAL_UINT64(0, pair_frequency(cpu, 0xD0, 0xCA));
+
+  BlockCacheStats stats;
+  get_block_cache_stats(cpu, &stats);
+  TEST_ASSERT(stats.superinstructions >= 5 * 5);
+
+  set_pair_profiling(cpu, false);
+  TEST_ASSERT_EQUAL_UINT64(0, pair_frequency(cpu, 0xCA, 0xD0));
+}
+
+static uint8_t nmi_read(void* UNUSED(obj), uint16_t UNUSED(addr)) {
+  raise_nmi(cpu);
+  return 0x42;
+}
+
+TEST(MOS6502, superinstruction_interrupted) {
+  // LDA $4000 raises an NMI, which must be taken before the STA fused with it. The handler
+  // changes A, so $10 tells which happened first.
+  const uint8_t program[] = {0xAD, 0x00, 0x40, 0x85, 0x10, 0x4C, 0x05, 0x02};
+  const uint8_t handler[] = {0xA9, 0x55, 0x40};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  memcpy(&mem->bytes[0x300], handler, sizeof(handler));
+  mem->bytes[NMI_VECTOR] = 0x00;
+  mem->bytes[NMI_VECTOR + 1] = 0x03;
+  map_register(cpu->bus, mem, 0x4000, 0x4000, nmi_read, NULL);
+
+  set_block_cache(cpu, true);
+  cpu->pc = 0x200;
+  mos6502_run(cpu, 1000);
+  TEST_ASSERT_EQUAL_INT(kStopInterrupt, cpu->stop_reason);
+  TEST_ASSERT_EQUAL_HEX16(0x203, cpu->pc);
+
+  mos6502_run(cpu, 1000);
+  TEST_ASSERT_EQUAL_HEX16(0x205, cpu->pc);
+  TEST_ASSERT_EQUAL_HEX8(0x55, mem->bytes[0x10]);
+}
+
+static size_t mmio_accesses = 0;
+
+static uint8_t mmio_read(void* UNUSED(obj), uint16_t addr) {
+  mmio_accesses++;
+  return (uint8_t)addr;
+}
+
+static void mmio_write(void* UNUSED(obj), uint16_t UNUSED(addr), uint8_t UNUSED(val)) {
+  mmio_accesses++;
+}
+
+TEST(MOS6502, bus_direct_pages) {
+  Component* mmio = rc_alloc(sizeof(*mmio), NULL);
+  mmio->read = mmio_read;
+  mmio->write = mmio_write;
+  map_handler(cpu->bus, mmio, 0x4000, 0x40FF);
+  mmio_accesses = 0;
+
+  TEST_ASSERT_NOT_NULL(cpu->bus->read_pages[0x3F]);
+  TEST_ASSERT_NULL(cpu->bus->read_pages[0x40]);
+  TEST_ASSERT_NULL(cpu->bus->write_pages[0x40]);
+
+  write(cpu->bus, 0x3FFF, 0x12);
+  TEST_ASSERT_EQUAL_HEX8(0x12, mem->bytes[0x3FFF]);
+  TEST_ASSERT_EQUAL_HEX8(0x12, read(cpu->bus, 0x3FFF));
+  TEST_ASSERT_EQUAL_size_t(0, mmio_accesses);
+
+  write(cpu->bus, 0x4034, 0x56);
+  TEST_ASSERT_EQUAL_HEX8(0x00, mem->bytes[0x4034]);
+  TEST_ASSERT_EQUAL_HEX8(0x34, read(cpu->bus, 0x4034));
+  TEST_ASSERT_EQUAL_size_t(2, mmio_accesses);
+
+  // Mapping the memory back restores the direct pointers.
+  map_handler(cpu->bus, mem, 0x4000, 0x40FF);
+  TEST_ASSERT_NOT_NULL(cpu->bus->write_pages[0x40]);
+  rc_strong_release((void*)&mmio);
+}
+
+static uint8_t status_read(void* UNUSED(obj), uint16_t addr) { return (uint8_t)(0x80 | addr); }
+
+TEST(MOS6502, bus_mirrors_and_registers) {
+  Memory* ram = memory_generic_create(rm, 0x800);
+  map_mirrored(cpu->bus, ram, 0x0000, 0x1FFF, 0x07FF);
+  write(cpu->bus, 0x1803, 0x5A);
+  TEST_ASSERT_EQUAL_HEX8(0x5A, ram->bytes[0x003]);
+  TEST_ASSERT_EQUAL_HEX8(0x5A, read(cpu->bus, 0x0803));
+  TEST_ASSERT_NOT_NULL(cpu->bus->read_pages[0x18]);
+
+  // A mask that reaches past the end of the memory is refused.
+  map_mirrored(cpu->bus, ram, 0x2000, 0x3FFF, 0x0FFF);
+  TEST_ASSERT_EQUAL_PTR(mem, cpu->bus->handlers[0x20]);
+
+  Component* mmio = rc_alloc(sizeof(*mmio), NULL);
+  mmio->read = mmio_read;
+  mmio->write = mmio_write;
+  map_mirrored(cpu->bus, mmio, 0x2000, 0x3FFF, 0x2007);
+  map_register(cpu->bus, mmio, 0x2002, 0x2002, status_read, NULL);
+  mmio_accesses = 0;
+
+  TEST_ASSERT_EQUAL_HEX8(0x82, read(cpu->bus, 0x3FFA));
+  TEST_ASSERT_EQUAL_HEX8(0x05, read(cpu->bus, 0x2F0D));
+  write(cpu->bus, 0x2002, 0xFF);
+  TEST_ASSERT_EQUAL_size_t(1, mmio_accesses);
+
+  rc_strong_release((void*)&mmio);
+  rc_strong_release((void*)&ram);
+}
+
+TEST(MOS6502, bus_bank_switching) {
+  // Four 8KB banks, each starting with LDA #bank; JMP $8002.
+  Memory* banks = memory_generic_create(rm, 0x8000);
+  for (uint8_t bank = 0; bank < 4; bank++) {
+    const uint8_t program[] = {0xA9, bank, 0x4C, 0x02, 0x80};
+    memcpy(&banks->bytes[bank * 0x2000], program, sizeof(program));
+  }
+
+  int window = map_bank_window(cpu->bus, banks, 0x8000, 0x9FFF);
+  TEST_ASSERT_EQUAL_INT(0, window);
+  TEST_ASSERT_EQUAL_HEX8(0x00, read(cpu->bus, 0x8001));
+
+  set_block_cache(cpu, true);
+  for (size_t bank = 0; bank < 6; bank++) {
+    switch_bank(cpu->bus, (size_t)window, bank);
+    cpu->pc = 0x8000;
+    mos6502_run(cpu, 100);
+    TEST_ASSERT_EQUAL_HEX8(bank % 4, cpu->a);
+  }
+
+  TEST_ASSERT_EQUAL_UINT32(6, frame_bank_switches(cpu->bus));
+  TEST_ASSERT_EQUAL_UINT32(0, frame_bank_switches(cpu->bus));
+
+  // Mapping over part of the window takes those pages out of it for good.
+  Memory* other = memory_generic_create(rm, 0x1000);
+  other->bytes[0x123] = 0xEE;
+  map_mirrored(cpu->bus, other, 0x9000, 0x9FFF, 0x0FFF);
+  switch_bank(cpu->bus, (size_t)window, 2);
+  TEST_ASSERT_EQUAL_HEX8(0x02, read(cpu->bus, 0x8001));
+  TEST_ASSERT_EQUAL_HEX8(0xEE, read(cpu->bus, 0x9123));
+  TEST_ASSERT_EQUAL_PTR(other->bytes + 0x100, cpu->bus->read_pages[0x91]);
+
+  // The window only holds a weak reference, and stops switching once the banks are gone.
+  TEST_ASSERT_EQUAL_size_t(1, rc_strong_count(banks));
+  rc_strong_release((void*)&banks);
+  switch_bank(cpu->bus, (size_t)window, 1);
+  TEST_ASSERT_EQUAL_HEX8(0xEE, read(cpu->bus, 0x9123));
+  map_handler(cpu->bus, mem, 0x8000, 0x9FFF);
+  TEST_ASSERT_NULL(cpu->bus->windows[window].obj);
+  rc_strong_release((void*)&other);
+}
+
+TEST(MOS6502, bus_block_transfers) {
+  Component* mmio = rc_alloc(sizeof(*mmio), NULL);
+  mmio->read = mmio_read;
+  mmio->write = mmio_write;
+  map_handler(cpu->bus, mmio, 0x4000, 0x40FF);
+  mmio_accesses = 0;
+
+  uint8_t bytes[0x300];
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    bytes[i] = (uint8_t)(i * 7);
+  }
+
+  // Spans a direct page, the MMIO page and another direct page.
+  TEST_ASSERT_EQUAL_UINT32(0x200, bus_write_block(cpu->bus, 0x3F80, bytes, 0x200));
+  TEST_ASSERT_EQUAL_size_t(0x100, mmio_accesses);
+  TEST_ASSERT_EQUAL_MEMORY(bytes, &mem->bytes[0x3F80], 0x80);
+  TEST_ASSERT_EQUAL_MEMORY(&bytes[0x180], &mem->bytes[0x4100], 0x80);
+
+  uint8_t out[0x200];
+  TEST_ASSERT_EQUAL_UINT32(0x200, bus_read_block(cpu->bus, 0x3F80, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8(0x10, out[0x90]);
+
+  // A page-sized DMA, and an overlapping one that replicates its first byte like the hardware.
+  TEST_ASSERT_EQUAL_UINT32(512, bus_dma(cpu->bus, 0x3F00, 0x0200, 0x100));
+  TEST_ASSERT_EQUAL_MEMORY(&mem->bytes[0x3F00], &mem->bytes[0x0200], 0x100);
+  mem->bytes[0x0300] = 0xAB;
+  bus_dma(cpu->bus, 0x0300, 0x0301, 0x10);
+  TEST_ASSERT_EQUAL_HEX8(0xAB, mem->bytes[0x0310]);
+
+  uint64_t cycles = cpu->cycles;
+  mos6502_stall(cpu, 513);
+  TEST_ASSERT_EQUAL_UINT64(cycles + 513, cpu->cycles);
+  rc_strong_release((void*)&mmio);
+}
+
+static void dma_write(void* obj, uint16_t UNUSED(addr), uint8_t UNUSED(val)) {
+  mos6502_stall(obj, 513);
+}
+
+TEST(MOS6502, stall_from_handler) {
+  // LDA #$02; STA $4014; JMP *, where the store starts a DMA that stalls the CPU.
+  const uint8_t program[] = {0xA9, 0x02, 0x8D, 0x14, 0x40, 0x4C, 0x05, 0x02};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  map_register(cpu->bus, cpu, 0x4014, 0x4014, NULL, dma_write);
+
+  // step(), the fused engine through both entry points, the block cache and the JIT.
+  for (int engine = 0; engine < 5; engine++) {
+    set_block_cache(cpu, engine == 3);
+    if (engine == 4 && !set_jit(cpu, true)) {
+      break;
+    }
+
+    cpu->pc = 0x200;
+    const uint64_t start = cpu->cycles;
+    if (engine == 0) {
+      step(cpu);
+      step(cpu);
+    } else if (engine == 1) {
+      TEST_ASSERT_EQUAL_size_t(2, mos6502_execute(cpu, 2));
+    } else {
+      mos6502_run(cpu, 10);
+    }
+    TEST_ASSERT_EQUAL_HEX16(0x205, cpu->pc);
+    TEST_ASSERT_EQUAL_UINT64(2 + 4 + 513, cpu->cycles - start);
+  }
+}
+
+TEST(MOS6502, scheduled_interrupts) {
+  // The main program spins on JMP *, and the NMI handler does INC $10; RTI.
+  const uint8_t program[] = {0x4C, 0x00, 0x02};
+  const uint8_t handler[] = {0xE6, 0x10, 0x40};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  memcpy(&mem->bytes[0x300], handler, sizeof(handler));
+  mem->bytes[NMI_VECTOR] = 0x00;
+  mem->bytes[NMI_VECTOR + 1] = 0x03;
+
+  cpu->pc = 0x200;
+  const uint64_t start = cpu->cycles;
+  schedule_interrupt(cpu, start + 1000, kNMI);
+  schedule_interrupt(cpu, start + 2000, kNMI);
+  uint32_t id = schedule_interrupt(cpu, start + 2500, kNMI);
+  cancel_event(cpu->scheduler, id);
+
+  uint64_t used = mos6502_run_until(cpu, start + 3000);
+  TEST_ASSERT(used >= 3000 && used < 3010);
+  TEST_ASSERT_EQUAL_HEX8(2, mem->bytes[0x10]);
+  TEST_ASSERT_EQUAL_HEX16(0x200, cpu->pc);
+}
+
+TEST(MOS6502, reset_keeps_deadlines) {
+  // The main program spins on JMP *, and the NMI handler does INC $10; RTI.
+  const uint8_t program[] = {0x4C, 0x00, 0x02};
+  const uint8_t handler[] = {0xE6, 0x10, 0x40};
+  cpu->pc = 0x200;
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  mos6502_run(cpu, 5000);
+
+  // Time keeps running through a reset, so an event scheduled before it still fires on time.
+  const uint64_t before = cpu->cycles;
+  schedule_interrupt(cpu, before + 1000, kNMI);
+  reset_devices(rm);
+  TEST_ASSERT_EQUAL_UINT64(before + 8, cpu->cycles);
+
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  memcpy(&mem->bytes[0x300], handler, sizeof(handler));
+  mem->bytes[NMI_VECTOR] = 0x00;
+  mem->bytes[NMI_VECTOR + 1] = 0x03;
+  cpu->pc = 0x200;
+  mos6502_run_until(cpu, before + 990);
+  TEST_ASSERT_EQUAL_HEX8(0, mem->bytes[0x10]);
+  mos6502_run_until(cpu, before + 1020);
+  TEST_ASSERT_EQUAL_HEX8(1, mem->bytes[0x10]);
+}
+
+typedef struct {
+  struct Component;
+  uint64_t ran;
+} Timer;
+
+static void timer_catch_up(void* obj, uint64_t cycle) {
+  Timer* timer = obj;
+  timer->ran += cycle - timer->synced;
+}
+
+static uint8_t timer_read(void* obj, uint16_t UNUSED(addr)) {
+  Timer* timer = obj;
+  return (uint8_t)timer->synced;
+}
+
+TEST(MOS6502, device_catch_up) {
+  Timer* timer = rc_alloc(sizeof(*timer), NULL);
+  timer->read = timer_read;
+  timer->catch_up = timer_catch_up;
+  map_handler(cpu->bus, timer, 0x4000, 0x40FF);
+
+  // Ten NOPs, LDA $4000, JMP *.
+  memset(&mem->bytes[0x200], 0xEA, 10);
+  const uint8_t program[] = {0xAD, 0x00, 0x40, 0x4C, 0x0D, 0x02};
+  memcpy(&mem->bytes[0x20A], program, sizeof(program));
+
+  for (int engine = 0; engine < 2; engine++) {
+    set_block_cache(cpu, engine == 1);
+    cpu->pc = 0x200;
+    const uint64_t start = cpu->cycles;
+    mos6502_run(cpu, 1000);
+
+    // The timer was only run when it was read, and saw the cycle the read happened on.
+    TEST_ASSERT_EQUAL_HEX8((uint8_t)(start + 20), cpu->a);
+    TEST_ASSERT_EQUAL_UINT64(start + 20, timer->synced);
+
+    sync_devices(cpu->bus);
+    TEST_ASSERT_EQUAL_UINT64(cpu->cycles, timer->synced);
+    TEST_ASSERT_EQUAL_UINT64(cpu->cycles, timer->ran);
+  }
+
+  rc_strong_release((void*)&timer);
+}
+
+TEST(MOS6502, idle_loop_skipping) {
+  // LDA $10; BEQ - waits for the NMI handler (INC $10; RTI), then the program ends on JMP *.
+  const uint8_t program[] = {0xA5, 0x10, 0xF0, 0xFC, 0x4C, 0x04, 0x02};
+  const uint8_t handler[] = {0xE6, 0x10, 0x40};
+  memcpy(&mem->bytes[0x300], handler, sizeof(handler));
+  mem->bytes[NMI_VECTOR] = 0x00;
+  mem->bytes[NMI_VECTOR + 1] = 0x03;
+
+  uint64_t used[2];
+  for (int skip = 0; skip < 2; skip++) {
+    memcpy(&mem->bytes[0x200], program, sizeof(program));
+    mem->bytes[0x10] = 0;
+    set_block_cache(cpu, true);
+    set_idle_skip(cpu, skip == 1);
+    cpu->pc = 0x200;
+    cpu->skipped_cycles = 0;
+
+    const uint64_t start = cpu->cycles;
+    schedule_interrupt(cpu, start + 3000, kNMI);
+    used[skip] = mos6502_run_until(cpu, start + 6000);
+    TEST_ASSERT_EQUAL_HEX8(1, mem->bytes[0x10]);
+    TEST_ASSERT_EQUAL_HEX16(0x204, cpu->pc);
+    if (skip) {
+      TEST_ASSERT(cpu->skipped_cycles > 2000);
+    } else {
+      TEST_ASSERT_EQUAL_UINT64(0, cpu->skipped_cycles);
+    }
+  }
+
+  // Skipping doesn't change where the CPU ends up.
+  TEST_ASSERT_EQUAL_UINT64(used[0], used[1]);
+}
+
+TEST(MOS6502, halt_skipping) {
+  const uint8_t program[] = {0x4C, 0x00, 0x02};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+
+  uint64_t used[2];
+  for (int skip = 0; skip < 2; skip++) {
+    set_idle_skip(cpu, skip == 1);
+    cpu->pc = 0x200;
+    cpu->skipped_cycles = 0;
+    used[skip] = mos6502_run_until(cpu, cpu->cycles + 10000);
+    TEST_ASSERT_EQUAL_HEX16(0x200, cpu->pc);
+  }
+
+  TEST_ASSERT(cpu->skipped_cycles > 9900);
+  TEST_ASSERT_EQUAL_UINT64(used[0], used[1]);
+}
+
+static uint64_t nmi_cycle = 0;
+
+static void record_nmi(void* obj, uint16_t UNUSED(addr), uint8_t UNUSED(val)) {
+  const Mos6502* nmi_cpu = obj;
+  nmi_cycle = *nmi_cpu->bus->clock;
+}
+
+TEST(MOS6502, halt_skipping_across_pages) {
+  // LDA #$01; BNE *, where the branch at $10FE takes 4 cycles because $1100 is on the next page.
+  // The NMI handler does STA $4000; RTI, and the store records when it ran.
+  const uint8_t program[] = {0xA9, 0x01, 0xD0, 0xFE};
+  const uint8_t handler[] = {0x8D, 0x00, 0x40, 0x40};
+  memcpy(&mem->bytes[0x10FC], program, sizeof(program));
+  memcpy(&mem->bytes[0x300], handler, sizeof(handler));
+  mem->bytes[NMI_VECTOR] = 0x00;
+  mem->bytes[NMI_VECTOR + 1] = 0x03;
+  map_register(cpu->bus, cpu, 0x4000, 0x4000, NULL, record_nmi);
+
+  // The NMI is taken on the same cycle whether the loop is skipped or run.
+  uint64_t taken[2];
+  for (int skip = 0; skip < 2; skip++) {
+    set_idle_skip(cpu, skip == 1);
+    cpu->pc = 0x10FC;
+    cpu->skipped_cycles = 0;
+    const uint64_t start = cpu->cycles;
+    schedule_interrupt(cpu, start + 1017, kNMI);
+    mos6502_run_until(cpu, start + 2000);
+    taken[skip] = nmi_cycle - start;
+  }
+
+  TEST_ASSERT(cpu->skipped_cycles > 900);
+  TEST_ASSERT_EQUAL_UINT64(taken[0], taken[1]);
+}
+
+TEST(MOS6502, klaus_test_jit) {
+  if (!run_klaus(kNMOS6502, enable_jit, run_to_trap)) {
+    TEST_IGNORE_MESSAGE("JIT not available");
+  }
+
+  BlockCacheStats stats;
+  get_block_cache_stats(cpu, &stats);
+  TEST_ASSERT(stats.compiled > 0);
+}
+
+TEST(MOS6502, jit_lockstep) {
+  if (!enable_jit(cpu)) {
+    TEST_IGNORE_MESSAGE("JIT not available");
+  }
+
+  // Translated blocks run as a whole, so compare against the interpreter at block boundaries.
+  klaus_lockstep(200000, 64);
+}
+
+TEST(MOS6502, threaded_lockstep) {
+  // The fused engine must leave exactly the same state behind as step() after every instruction.
+  klaus_lockstep(100000, 1);
+}
+
+TEST(MOS6502, variant_decimal_mode) {
+  // SED; CLC; LDA #$09; ADC #$01
+  const uint8_t program[] = {0xF8, 0x18, 0xA9, 0x09, 0x69, 0x01};
+  const CpuVariant variants[] = {kNMOS6502, kRicoh2A03, kWDC65C02};
+  const uint8_t results[] = {0x10, 0x0A, 0x10};
+  const uint64_t cycles[] = {8, 8, 9};
+
+  for (size_t i = 0; i < 3; i++) {
+    Mos6502* other = mos6502_create(rm, variants[i]);
+    Memory* other_mem = memory_generic_create(rm, MEM_SIZE);
+    map_handler(other->bus, other_mem, 0, 0xFFFF);
+    memcpy(&other_mem->bytes[0x200], program, sizeof(program));
+    other->pc = 0x200;
+
+    const uint64_t start = other->cycles;
+    TEST_ASSERT_EQUAL_size_t(4, mos6502_execute(other, 4));
+    TEST_ASSERT_EQUAL_HEX8(results[i], other->a);
+    TEST_ASSERT_EQUAL_UINT64(cycles[i], other->cycles - start);
+
+    rc_strong_release((void*)&other);
+    rc_strong_release((void*)&other_mem);
+  }
+}
+
+TEST(MOS6502, wdc65c02_opcodes) {
+  const uint8_t program[] = {
+      0xA9, 0xFF,        // LDA #$FF
+      0x85, 0x10,        // STA $10
+      0x64, 0x10,        // STZ $10
+      0xA2, 0x34,        // LDX #$34
+      0xDA,              // PHX
+      0x7A,              // PLY
+      0x1A,              // INC A
+      0xA9, 0x0F,        // LDA #$0F
+      0x04, 0x11,        // TSB $11
+      0x87, 0x12,        // SMB0 $12
+      0x8F, 0x12, 0x02,  // BBS0 $12, +2
+      0xA9, 0xEE,        // LDA #$EE, skipped
+      0xB2, 0x20,        // LDA ($20)
+      0x80, 0x01,        // BRA +1
+      0xDB,              // STP, skipped
+      0x6C, 0xFF, 0x04,  // JMP ($04FF)
+  };
+
+  // The 65C02 runs on every engine.
+  for (int blocks = 0; blocks < 2; blocks++) {
+    Mos6502* other = mos6502_create(rm, kWDC65C02);
+    Memory* other_mem = memory_generic_create(rm, MEM_SIZE);
+    map_handler(other->bus, other_mem, 0, 0xFFFF);
+    memcpy(&other_mem->bytes[0x200], program, sizeof(program));
+    other_mem->bytes[0x11] = 0xF0;
+    other_mem->bytes[0x20] = 0x00;
+    other_mem->bytes[0x21] = 0x03;
+    other_mem->bytes[0x300] = 0x5A;
+    other_mem->bytes[0x4FF] = 0x00;
+    other_mem->bytes[0x500] = 0x06;
+    set_block_cache(other, blocks == 1);
+    other->pc = 0x200;
+
+    TEST_ASSERT_EQUAL_size_t(14, mos6502_execute(other, 14));
+    TEST_ASSERT_EQUAL_HEX8(0x00, other_mem->bytes[0x10]);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, other_mem->bytes[0x11]);
+    TEST_ASSERT_EQUAL_HEX8(0x01, other_mem->bytes[0x12]);
+    TEST_ASSERT_EQUAL_HEX8(0x34, other->y);
+    TEST_ASSERT_EQUAL_HEX8(0x5A, other->a);
+    TEST_ASSERT_EQUAL_HEX16(0x600, other->pc);
+
+    rc_strong_release((void*)&other);
+    rc_strong_release((void*)&other_mem);
+  }
+}
+
+TEST(MOS6502, klaus_test_wdc65c02) {
+  // The functional test only uses what the 65C02 kept from the NMOS 6502.
+  run_klaus(kWDC65C02, NULL, run_to_trap);
+}
+
+TEST(MOS6502, nmos_indirect_jump_bug) {
+  // JMP ($04FF) reads the high byte of the target from $0400, not $0500.
+  const uint8_t program[] = {0x6C, 0xFF, 0x04};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  mem->bytes[0x4FF] = 0x00;
+  mem->bytes[0x400] = 0x07;
+  mem->bytes[0x500] = 0x06;
+  cpu->pc = 0x200;
+  step(cpu);
+  TEST_ASSERT_EQUAL_HEX16(0x700, cpu->pc);
+}
+
+TEST(MOS6502, wdc65c02_wai) {
+  // SED; CLI; WAI; JMP *, and an IRQ handler that counts in $10 whether D was cleared for it.
+  const uint8_t program[] = {0xF8, 0x58, 0xCB, 0x4C, 0x03, 0x02};
+  const uint8_t handler[] = {0x08, 0x68, 0x29, 0x08, 0xD0, 0x02, 0xE6, 0x10, 0x40};
+  Mos6502* other = mos6502_create(rm, kWDC65C02);
+  Memory* other_mem = memory_generic_create(rm, MEM_SIZE);
+  map_handler(other->bus, other_mem, 0, 0xFFFF);
+  memcpy(&other_mem->bytes[0x200], program, sizeof(program));
+  memcpy(&other_mem->bytes[0x300], handler, sizeof(handler));
+  other_mem->bytes[IRQ_VECTOR] = 0x00;
+  other_mem->bytes[IRQ_VECTOR + 1] = 0x03;
+  other->pc = 0x200;
+
+  const uint64_t start = other->cycles;
+  schedule_interrupt(other, start + 1000, kIRQ);
+  mos6502_run_until(other, start + 2000);
+  TEST_ASSERT_EQUAL_HEX8(1, other_mem->bytes[0x10]);
+  TEST_ASSERT_EQUAL_HEX16(0x203, other->pc);
+  TEST_ASSERT(other->skipped_cycles > 900);
+
+  rc_strong_release((void*)&other);
+  rc_strong_release((void*)&other_mem);
+}
+
+TEST(MOS6502, kil_jams_until_reset) {
+  // LDA #$01; KIL; LDA #$02
+  const uint8_t program[] = {0xA9, 0x01, 0x02, 0xA9, 0x02};
+  for (int cache = 0; cache < 2; cache++) {
+    memcpy(&mem->bytes[0x200], program, sizeof(program));
+    mem->bytes[RES_VECTOR] = 0x00;
+    mem->bytes[RES_VECTOR + 1] = 0x02;
+    set_block_cache(cpu, cache == 1);
+    cpu->pc = 0x200;
+    TEST_ASSERT_EQUAL_size_t(2, mos6502_execute(cpu, 10));
+    TEST_ASSERT_EQUAL(kStopJammed, cpu->stop_reason);
+    TEST_ASSERT(cpu->jammed);
+    TEST_ASSERT_EQUAL_HEX16(0x202, cpu->pc);
+
+    // Nothing runs until a reset, and no time passes meanwhile.
+    const uint64_t cycles = cpu->cycles;
+    step(cpu);
+    TEST_ASSERT_EQUAL_size_t(0, mos6502_execute(cpu, 10));
+    TEST_ASSERT_EQUAL_UINT32(0, mos6502_run(cpu, 1000));
+    TEST_ASSERT_EQUAL(kStopJammed, cpu->stop_reason);
+    mos6502_run_until(cpu, cycles + 1000);
+    TEST_ASSERT_EQUAL_UINT64(cycles, cpu->cycles);
+    TEST_ASSERT_EQUAL_HEX16(0x202, cpu->pc);
+    TEST_ASSERT_EQUAL_HEX8(0x01, cpu->a);
+
+    reset_devices(rm);
+    TEST_ASSERT_FALSE(cpu->jammed);
+    TEST_ASSERT_EQUAL_HEX16(0x200, cpu->pc);
+  }
+  TEST_ASSERT_EQUAL_UINT64(2, cpu->jams);
+}
+
+TEST_GROUP_RUNNER(MOS6502) {
+  RUN_TEST_CASE(MOS6502, klaus_test)
+  RUN_TEST_CASE(MOS6502, klaus_test_threaded)
+  RUN_TEST_CASE(MOS6502, klaus_test_run)
+  RUN_TEST_CASE(MOS6502, klaus_test_block_cache)
+  RUN_TEST_CASE(MOS6502, block_cache_self_modifying)
+  RUN_TEST_CASE(MOS6502, block_cache_transfer_loops)
+  RUN_TEST_CASE(MOS6502, block_cache_superinstructions)
+  RUN_TEST_CASE(MOS6502, superinstruction_interrupted)
+  RUN_TEST_CASE(MOS6502, bus_direct_pages)
+  RUN_TEST_CASE(MOS6502, bus_mirrors_and_registers)
+  RUN_TEST_CASE(MOS6502, bus_bank_switching)
+  RUN_TEST_CASE(MOS6502, bus_block_transfers)
+  RUN_TEST_CASE(MOS6502, stall_from_handler)
+  RUN_TEST_CASE(MOS6502, scheduled_interrupts)
+  RUN_TEST_CASE(MOS6502, reset_keeps_deadlines)
+  RUN_TEST_CASE(MOS6502, device_catch_up)
+  RUN_TEST_CASE(MOS6502, idle_loop_skipping)
+  RUN_TEST_CASE(MOS6502, halt_skipping)
+  RUN_TEST_CASE(MOS6502, halt_skipping_across_pages)
+  RUN_TEST_CASE(MOS6502, klaus_test_jit)
+  RUN_TEST_CASE(MOS6502, jit_lockstep)
+  RUN_TEST_CASE(MOS6502, threaded_lockstep)
+  RUN_TEST_CASE(MOS6502, variant_decimal_mode)
+  RUN_TEST_CASE(MOS6502, wdc65c02_opcodes)
+  RUN_TEST_CASE(MOS6502, klaus_test_wdc65c02)
+  RUN_TEST_CASE(MOS6502, nmos_indirect_jump_bug)
+  RUN_TEST_CASE(MOS6502, wdc65c02_wai)
+  RUN_TEST_CASE(MOS6502, kil_jams_until_reset)
+}
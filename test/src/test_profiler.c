@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "b6502/memory.h"
+#include "b6502/mos6502.h"
+#include "b6502/profiler.h"
+#include "b6502/reset_manager.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+static Profiler* profiler = NULL;
+
+TEST_GROUP(PROFILER);
+
+TEST_SETUP(PROFILER) { profiler = profiler_create(kNMOS6502, 1); }
+
+TEST_TEAR_DOWN(PROFILER) { rc_strong_release((void*)&profiler); }
+
+// Read back everything written to a temporary file.
+static void read_back(FILE* f, char* buffer, size_t size) {
+  rewind(f);
+  const size_t n = fread(buffer, 1, size - 1, f);
+  buffer[n] = '\0';
+  fclose(f);
+}
+
+TEST(PROFILER, call_stack_attribution) {
+  // NOP; JSR $1000 / LDA #0; JSR $2000 / NOP; RTS / RTS; NOP
+  profile_instruction(profiler, 0x0200, 0xEA, 2, 0x0201, 0xFD);
+  profile_instruction(profiler, 0x0201, 0x20, 6, 0x1000, 0xFB);
+  profile_instruction(profiler, 0x1000, 0xA9, 2, 0x1002, 0xFB);
+  profile_instruction(profiler, 0x1002, 0x20, 6, 0x2000, 0xF9);
+  profile_instruction(profiler, 0x2000, 0xEA, 2, 0x2001, 0xF9);
+  TEST_ASSERT_EQUAL_UINT64(2, profiler_inclusive(profiler, 0x2000));
+  profile_instruction(profiler, 0x2001, 0x60, 6, 0x1005, 0xFB);
+  profile_instruction(profiler, 0x1005, 0x60, 6, 0x0204, 0xFD);
+  profile_instruction(profiler, 0x0204, 0xEA, 2, 0x0205, 0xFD);
+
+  TEST_ASSERT_EQUAL_size_t(0, profiler->depth);
+  TEST_ASSERT_EQUAL_UINT64(8, profiler->instructions);
+  TEST_ASSERT_EQUAL_UINT64(32, profiler->cycles);
+  TEST_ASSERT_EQUAL_UINT64(2, profiler->opcode_count[0x60]);
+  TEST_ASSERT_EQUAL_UINT64(12, profiler->opcode_cycles[0x20]);
+  TEST_ASSERT_EQUAL_UINT64(1, profiler->calls[0x1000]);
+  TEST_ASSERT_EQUAL_UINT64(1, profiler->calls[0x2000]);
+  TEST_ASSERT_EQUAL_UINT64(14, profiler->exclusive[0x1000]);
+  TEST_ASSERT_EQUAL_UINT64(22, profiler_inclusive(profiler, 0x1000));
+  TEST_ASSERT_EQUAL_UINT64(8, profiler->exclusive[0x2000]);
+  TEST_ASSERT_EQUAL_UINT64(8, profiler_inclusive(profiler, 0x2000));
+
+  char folded[256];
+  FILE* f = tmpfile();
+  TEST_ASSERT_NOT_NULL(f);
+  profiler_write_folded(profiler, f);
+  read_back(f, folded, sizeof(folded));
+  TEST_ASSERT_EQUAL_STRING("main 10\nmain;sub_1000 14\nmain;sub_1000;sub_2000 8\n", folded);
+}
+
+TEST(PROFILER, recursion_and_interrupts) {
+  // A routine that calls itself once, interrupted by a handler that ends with RTI.
+  profile_instruction(profiler, 0x0200, 0x20, 6, 0x1000, 0xFB);
+  profile_instruction(profiler, 0x1000, 0x20, 6, 0x1000, 0xF9);
+  profile_interrupt(profiler, 0x3000, 0xF6);
+  profile_instruction(profiler, 0x3000, 0x40, 13, 0x1000, 0xF9);
+  profile_instruction(profiler, 0x1000, 0x20, 6, 0x1000, 0xF7);
+  profile_instruction(profiler, 0x1000, 0x60, 6, 0x1003, 0xF9);
+  profile_instruction(profiler, 0x1003, 0x60, 6, 0x1003, 0xFB);
+  profile_instruction(profiler, 0x1003, 0x60, 6, 0x0203, 0xFD);
+
+  TEST_ASSERT_EQUAL_size_t(0, profiler->depth);
+  TEST_ASSERT_EQUAL_UINT64(3, profiler->calls[0x1000]);
+  TEST_ASSERT_EQUAL_UINT64(43, profiler_inclusive(profiler, 0x1000));
+  TEST_ASSERT_EQUAL_UINT64(1, profiler->calls[0x3000]);
+  TEST_ASSERT_EQUAL_UINT64(13, profiler_inclusive(profiler, 0x3000));
+
+  char folded[256];
+  FILE* f = tmpfile();
+  TEST_ASSERT_NOT_NULL(f);
+  profiler_write_folded(profiler, f);
+  read_back(f, folded, sizeof(folded));
+  TEST_ASSERT_NOT_NULL(strstr(folded, "main;sub_1000;sub_1000;int_3000 13\n"));
+}
+
+TEST(PROFILER, sampling) {
+  Profiler* sampled = profiler_create(kNMOS6502, 4);
+  for (int i = 0; i < 10; i++) {
+    profile_instruction(sampled, 0x0200, 0xEA, 2, 0x0201, 0xFD);
+  }
+
+  TEST_ASSERT_EQUAL_UINT64(10, sampled->instructions);
+  TEST_ASSERT_EQUAL_UINT64(20, sampled->cycles);
+  TEST_ASSERT_EQUAL_UINT64(8, sampled->pc_count[0x0200]);
+  TEST_ASSERT_EQUAL_UINT64(16, sampled->pc_cycles[0x0200]);
+  TEST_ASSERT_EQUAL_UINT64(8, sampled->opcode_count[0xEA]);
+  rc_strong_release((void*)&sampled);
+}
+
+TEST(PROFILER, attached_to_cpu) {
+  ResetManager* rm = reset_manager_create();
+  Mos6502* cpu = mos6502_create(rm, kNMOS6502);
+  Memory* mem = memory_generic_create(rm, 0x10000);
+  map_handler(cpu->bus, mem, 0, 0xFFFF);
+  if (!set_profiler(cpu, profiler)) {
+    rc_strong_release((void*)&cpu);
+    rc_strong_release((void*)&mem);
+    rc_strong_release((void*)&rm);
+    TEST_IGNORE_MESSAGE("Profiler not built");
+  }
+
+  // LDX #4; JSR $0300; DEX; BNE -6; JMP * / INY; RTS
+  const uint8_t program[] = {0xA2, 0x04, 0x20, 0x00, 0x03, 0xCA, 0xD0, 0xFA, 0x4C, 0x08, 0x02};
+  const uint8_t routine[] = {0xC8, 0x60};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  memcpy(&mem->bytes[0x300], routine, sizeof(routine));
+  set_block_cache(cpu, true);
+  cpu->pc = 0x200;
+  mos6502_execute(cpu, 1000);
+
+  TEST_ASSERT_EQUAL(kStopHalt, cpu->stop_reason);
+  TEST_ASSERT_EQUAL_HEX8(4, cpu->y);
+  TEST_ASSERT_EQUAL_UINT64(4, profiler->calls[0x300]);
+  TEST_ASSERT_EQUAL_UINT64(4, profiler->pc_count[0x300]);
+  TEST_ASSERT_EQUAL_UINT64(4 * (2 + 6), profiler_inclusive(profiler, 0x300));
+
+  TEST_ASSERT(set_profiler(cpu, NULL) == false);
+  TEST_ASSERT_NULL(cpu->profiler);
+  rc_strong_release((void*)&cpu);
+  rc_strong_release((void*)&mem);
+  rc_strong_release((void*)&rm);
+}
+
+TEST_GROUP_RUNNER(PROFILER) {
+  RUN_TEST_CASE(PROFILER, call_stack_attribution)
+  RUN_TEST_CASE(PROFILER, recursion_and_interrupts)
+  RUN_TEST_CASE(PROFILER, sampling)
+  RUN_TEST_CASE(PROFILER, attached_to_cpu)
+}
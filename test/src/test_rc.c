@@ -1,3 +1,8 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "b6502/base.h"
 #include "b6502/rc.h"
 #include "unity.h"
 #include "unity_fixture.h"
@@ -105,10 +110,165 @@ TEST(RC, test_rc_array) {
   TEST_ASSERT_NULL(array);
 }
 
+static int destroyed = 0;
+
+static void count_destroyed(void* UNUSED(obj)) { destroyed++; }
+
+TEST(RC, test_rc_arena) {
+  RcArena* arena = rc_arena_create(2 * rc_arena_footprint(sizeof(int)), false);
+  TEST_ASSERT_NOT_NULL(arena);
+
+  destroyed = 0;
+  rc_arena_enter(arena);
+  int* first = rc_alloc(sizeof(*first), count_destroyed);
+  int* second = rc_alloc(sizeof(*second), count_destroyed);
+  int* full = rc_alloc(sizeof(*full), count_destroyed);
+  rc_arena_enter(NULL);
+  int* heap = rc_alloc(sizeof(*heap), NULL);
+
+  TEST_ASSERT(rc_arena_contains(arena, first));
+  TEST_ASSERT(rc_arena_contains(arena, second));
+  TEST_ASSERT_FALSE(rc_arena_contains(arena, full));
+  TEST_ASSERT_FALSE(rc_arena_contains(arena, heap));
+  TEST_ASSERT_EQUAL_size_t(0, (uintptr_t)second % RC_ARENA_ALIGN);
+  TEST_ASSERT_EQUAL_PTR((uint8_t*)first + rc_arena_footprint(sizeof(int)), second);
+
+  // Objects in the arena behave as usual, and the arena goes away along with the last of them.
+  rc_arena_release(&arena);
+  int* weak = rc_weak_retain(second);
+  rc_strong_release((void*)&first);
+  rc_strong_release((void*)&second);
+  TEST_ASSERT_EQUAL_INT(2, destroyed);
+  TEST_ASSERT_NULL(rc_weak_check((void*)&weak));
+  rc_strong_release((void*)&full);
+  rc_strong_release((void*)&heap);
+}
+
+TEST(RC, test_rc_slabs) {
+  RcStats before;
+  RcStats after;
+  rc_get_stats(&before);
+  int* small = rc_alloc(sizeof(*small), NULL);
+  char* large = rc_alloc(1000, NULL);
+  rc_get_stats(&after);
+
+  TEST_ASSERT_EQUAL_size_t(64, after.classes[0].slot_size);
+  TEST_ASSERT_EQUAL_size_t(before.classes[0].live + 1, after.classes[0].live);
+  TEST_ASSERT_EQUAL_size_t(before.classes[5].live + 1, after.classes[5].live);
+  TEST_ASSERT(after.classes[5].peak >= after.classes[5].live);
+  TEST_ASSERT(after.live_bytes >= 64 + 2048);
+  TEST_ASSERT(after.reserved_bytes >= after.live_bytes);
+
+  // A freed slot is the next one handed out in its class, zeroed again.
+  int* freed = small;
+  *small = 42;
+  rc_strong_release((void*)&small);
+#ifdef B6502_RC_DEBUG
+  TEST_ASSERT_EQUAL_HEX8(0xDD, *(uint8_t*)freed);
+#endif
+  small = rc_alloc(sizeof(*small), NULL);
+  TEST_ASSERT_EQUAL_PTR(freed, small);
+  TEST_ASSERT_EQUAL_INT(0, *small);
+
+  rc_strong_release((void*)&small);
+  rc_strong_release((void*)&large);
+  rc_get_stats(&after);
+  TEST_ASSERT_EQUAL_size_t(before.classes[0].live, after.classes[0].live);
+  TEST_ASSERT_EQUAL_size_t(before.classes[5].live, after.classes[5].live);
+}
+
+static void* churn_slabs(void* UNUSED(arg)) {
+  void* objs[8];
+  for (int i = 0; i < 8; i++) {
+    objs[i] = rc_alloc(400, NULL);
+  }
+  for (int i = 0; i < 8; i++) {
+    rc_strong_release(&objs[i]);
+  }
+  return NULL;
+}
+
+TEST(RC, test_rc_slabs_outlive_threads) {
+  pthread_t thread;
+  TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, churn_slabs, NULL));
+  pthread_join(thread, NULL);
+
+  // The first thread's slots are handed over when it exits, so the next one reserves nothing.
+  RcStats before;
+  RcStats after;
+  rc_get_stats(&before);
+  TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, churn_slabs, NULL));
+  pthread_join(thread, NULL);
+  rc_get_stats(&after);
+  TEST_ASSERT_EQUAL_size_t(before.reserved_bytes, after.reserved_bytes);
+  TEST_ASSERT_EQUAL_size_t(before.classes[3].live, after.classes[3].live);
+}
+
+#define STRESS_THREADS 4
+#define STRESS_ROUNDS 10000
+
+static atomic_int shared_destroyed;
+
+static void count_shared_destroyed(void* UNUSED(obj)) { atomic_fetch_add(&shared_destroyed, 1); }
+
+typedef struct Stress {
+  int* strong;
+  int* weak;
+} Stress;
+
+static void* stress(void* arg) {
+  Stress* s = arg;
+  for (int i = 0; i < STRESS_ROUNDS; i++) {
+    int* strong = rc_strong_retain(s->strong);
+    int* weak = rc_weak_retain(strong);
+    rc_strong_release((void*)&strong);
+    strong = rc_upgrade((void*)&weak);
+    rc_strong_release((void*)&strong);
+  }
+  rc_strong_release((void*)&s->strong);
+
+  // Race the other threads' last releases, which have to win against every upgrade eventually.
+  for (int i = 0; i < STRESS_ROUNDS && s->weak; i++) {
+    int* strong = rc_upgrade((void*)&s->weak);
+    if (strong) {
+      s->weak = rc_downcast((void*)&strong);
+    }
+  }
+  if (s->weak) {
+    rc_weak_release((void*)&s->weak);
+  }
+  return NULL;
+}
+
+TEST(RC, test_rc_shared) {
+  atomic_store(&shared_destroyed, 0);
+  int* shared = rc_alloc_shared(sizeof(*shared), count_shared_destroyed);
+
+  pthread_t threads[STRESS_THREADS];
+  Stress stresses[STRESS_THREADS];
+  for (int i = 0; i < STRESS_THREADS; i++) {
+    stresses[i].strong = rc_strong_retain(shared);
+    stresses[i].weak = rc_weak_retain(shared);
+  }
+  rc_strong_release((void*)&shared);
+  for (int i = 0; i < STRESS_THREADS; i++) {
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, stress, &stresses[i]));
+  }
+  for (int i = 0; i < STRESS_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    TEST_ASSERT_NULL(stresses[i].weak);
+  }
+  TEST_ASSERT_EQUAL_INT(1, atomic_load(&shared_destroyed));
+}
+
 TEST_GROUP_RUNNER(RC) {
   RUN_TEST_CASE(RC, test_rc_strong)
   RUN_TEST_CASE(RC, test_rc_weak)
   RUN_TEST_CASE(RC, test_rc_upgrade)
   RUN_TEST_CASE(RC, test_rc_downcast)
   RUN_TEST_CASE(RC, test_rc_array)
+  RUN_TEST_CASE(RC, test_rc_arena)
+  RUN_TEST_CASE(RC, test_rc_slabs)
+  RUN_TEST_CASE(RC, test_rc_slabs_outlive_threads)
+  RUN_TEST_CASE(RC, test_rc_shared)
 }
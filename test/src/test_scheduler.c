@@ -0,0 +1,107 @@
+#include "b6502/rc.h"
+#include "b6502/scheduler.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(SCHEDULER);
+
+static Scheduler* scheduler = NULL;
+static int* device = NULL;
+
+static uint64_t fired[8];
+static size_t num_fired = 0;
+
+static void record(void* UNUSED(obj), uint64_t deadline) { fired[num_fired++] = deadline; }
+
+// Fires every 100 cycles, like a timer.
+static void periodic(void* obj, uint64_t deadline) {
+  record(obj, deadline);
+  if (num_fired < 4) {
+    schedule_event(scheduler, deadline + 100, periodic, obj);
+  }
+}
+
+TEST_SETUP(SCHEDULER) {
+  scheduler = scheduler_create();
+  device = rc_alloc(sizeof(*device), NULL);
+  num_fired = 0;
+}
+
+TEST_TEAR_DOWN(SCHEDULER) {
+  rc_strong_release((void*)&scheduler);
+  if (device) {
+    rc_strong_release((void*)&device);
+  }
+}
+
+TEST(SCHEDULER, events_fire_in_order) {
+  TEST_ASSERT_EQUAL_UINT64(NO_DEADLINE, next_deadline(scheduler));
+
+  const uint64_t deadlines[] = {50, 10, 40, 20, 30};
+  for (size_t i = 0; i < 5; i++) {
+    schedule_event(scheduler, deadlines[i], record, device);
+  }
+  TEST_ASSERT_EQUAL_UINT64(10, next_deadline(scheduler));
+
+  run_events(scheduler, 35);
+  TEST_ASSERT_EQUAL_size_t(3, num_fired);
+  TEST_ASSERT_EQUAL_UINT64(40, next_deadline(scheduler));
+
+  run_events(scheduler, 100);
+  TEST_ASSERT_EQUAL_size_t(5, num_fired);
+  TEST_ASSERT_EQUAL_UINT64(NO_DEADLINE, next_deadline(scheduler));
+}
+
+TEST(SCHEDULER, cancel_event) {
+  schedule_event(scheduler, 10, record, device);
+  uint32_t id = schedule_event(scheduler, 5, record, device);
+  cancel_event(scheduler, id);
+  cancel_event(scheduler, id);
+
+  TEST_ASSERT_EQUAL_UINT64(10, next_deadline(scheduler));
+  run_events(scheduler, 10);
+  TEST_ASSERT_EQUAL_size_t(1, num_fired);
+}
+
+TEST(SCHEDULER, handlers_reschedule) {
+  schedule_event(scheduler, 100, periodic, device);
+  run_events(scheduler, 250);
+  TEST_ASSERT_EQUAL_size_t(2, num_fired);
+  TEST_ASSERT_EQUAL_UINT64(300, next_deadline(scheduler));
+
+  // A late call catches up on every deadline that has passed.
+  run_events(scheduler, 1000);
+  TEST_ASSERT_EQUAL_size_t(4, num_fired);
+  TEST_ASSERT_EQUAL_UINT64(400, fired[3]);
+}
+
+TEST(SCHEDULER, released_objects_are_skipped) {
+  schedule_event(scheduler, 10, record, device);
+  rc_strong_release((void*)&device);
+  run_events(scheduler, 10);
+  TEST_ASSERT_EQUAL_size_t(0, num_fired);
+}
+
+TEST(SCHEDULER, full_heap) {
+  for (uint64_t i = 0; i < MAX_EVENTS; i++) {
+    TEST_ASSERT(schedule_event(scheduler, 100 + i, record, device));
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, schedule_event(scheduler, 1, record, device));
+  TEST_ASSERT_EQUAL_UINT64(100, next_deadline(scheduler));
+
+  // The event that didn't fit holds no reference to the device.
+  run_events(scheduler, 107);
+  TEST_ASSERT_EQUAL_size_t(8, num_fired);
+  TEST_ASSERT_EQUAL_UINT64(100, fired[0]);
+  rc_strong_release((void*)&device);
+  run_events(scheduler, NO_DEADLINE);
+  TEST_ASSERT_EQUAL_size_t(8, num_fired);
+}
+
+TEST_GROUP_RUNNER(SCHEDULER) {
+  RUN_TEST_CASE(SCHEDULER, events_fire_in_order)
+  RUN_TEST_CASE(SCHEDULER, cancel_event)
+  RUN_TEST_CASE(SCHEDULER, handlers_reschedule)
+  RUN_TEST_CASE(SCHEDULER, released_objects_are_skipped)
+  RUN_TEST_CASE(SCHEDULER, full_heap)
+}
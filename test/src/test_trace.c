@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b6502/memory.h"
+#include "b6502/mos6502.h"
+#include "b6502/reset_manager.h"
+#include "b6502/trace.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+#define MEM_SIZE 65536
+
+static Mos6502* cpu = NULL;
+static Memory* mem = NULL;
+static ResetManager* rm = NULL;
+
+TEST_GROUP(TRACE);
+
+TEST_SETUP(TRACE) {
+  rm = reset_manager_create();
+  cpu = mos6502_create(rm, kNMOS6502);
+  mem = memory_generic_create(rm, MEM_SIZE);
+  map_handler(cpu->bus, mem, 0, 0xFFFF);
+
+  // LDX #$10; INX; CPX #$20; BNE -5; KIL
+  const uint8_t program[] = {0xA2, 0x10, 0xE8, 0xE0, 0x20, 0xD0, 0xFB, 0x02};
+  memcpy(&mem->bytes[0x200], program, sizeof(program));
+  cpu->pc = 0x200;
+}
+
+TEST_TEAR_DOWN(TRACE) {
+  rc_strong_release((void*)&rm);
+  rc_strong_release((void*)&cpu);
+  rc_strong_release((void*)&mem);
+}
+
+// Read back everything written to a file.
+static void read_back(FILE* f, char* buffer, size_t size) {
+  rewind(f);
+  const size_t n = fread(buffer, 1, size - 1, f);
+  buffer[n] = '\0';
+  fclose(f);
+}
+
+TEST(TRACE, nestest_format) {
+  const TraceRecord jmp = {7, 0xC000, 0x4C, 3, {0xF5, 0xC5}, 0x00, 0x00, 0x00, 0xFD, 0x24};
+  const TraceRecord bne = {27, 0xC72D, 0xD0, 2, {0x03, 0x00}, 0x80, 0x01, 0x02, 0xFB, 0xA5};
+  const TraceRecord lsr = {9, 0xE000, 0x4A, 1, {0x00, 0x00}, 0x00, 0x00, 0x00, 0xFD, 0x24};
+  char line[128];
+
+  format_trace_record(kNMOS6502, &jmp, line, sizeof(line));
+  TEST_ASSERT_EQUAL_STRING(
+      "C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:7", line);
+  format_trace_record(kNMOS6502, &bne, line, sizeof(line));
+  TEST_ASSERT_EQUAL_STRING(
+      "C72D  D0 03     BNE $C732                       A:80 X:01 Y:02 P:A5 SP:FB CYC:27", line);
+  format_trace_record(kNMOS6502, &lsr, line, sizeof(line));
+  TEST_ASSERT_EQUAL_STRING(
+      "E000  4A        LSR A                           A:00 X:00 Y:00 P:24 SP:FD CYC:9", line);
+}
+
+TEST(TRACE, ring_keeps_the_last_records) {
+  Tracer* tracer = tracer_create(kNMOS6502, 6);
+  set_tracer(cpu, tracer);
+  set_block_cache(cpu, true);
+  mos6502_execute(cpu, 1000);
+
+  // The loop runs 16 times, then KIL jams the CPU, which ends the trace.
+  TEST_ASSERT_EQUAL(kStopJammed, cpu->stop_reason);
+  TEST_ASSERT_EQUAL_UINT64(2 + 16 * 3, tracer->header->written);
+  TEST_ASSERT_EQUAL_size_t(8, tracer_count(tracer));
+
+  const TraceRecord* last = tracer_record(tracer, 7);
+  TEST_ASSERT_EQUAL_HEX16(0x207, last->pc);
+  TEST_ASSERT_EQUAL_HEX8(0x02, last->opcode);
+  TEST_ASSERT_EQUAL_HEX8(0x20, last->x);
+  const TraceRecord* oldest = tracer_record(tracer, 0);
+  TEST_ASSERT_EQUAL_HEX16(0x205, oldest->pc);
+  TEST_ASSERT_EQUAL_HEX8(0x1E, oldest->x);
+  TEST_ASSERT(oldest->cycle < last->cycle);
+
+  set_tracer(cpu, NULL);
+  TEST_ASSERT_NULL(cpu->tracer);
+  rc_strong_release((void*)&tracer);
+}
+
+TEST(TRACE, trigger) {
+  Tracer* tracer = tracer_create(kNMOS6502, 256);
+  tracer_set_trigger(tracer, 0x207, TRACE_NO_CYCLE);
+  set_tracer(cpu, tracer);
+  mos6502_execute(cpu, 1000);
+  TEST_ASSERT_EQUAL_size_t(1, tracer_count(tracer));
+  TEST_ASSERT_EQUAL_HEX16(0x207, tracer_record(tracer, 0)->pc);
+
+  // After a reset, LDX #$10; INX; KIL with a trigger two cycles in, at the INX.
+  reset_devices(rm);
+  memcpy(&mem->bytes[0x200], (const uint8_t[]){0xA2, 0x10, 0xE8, 0x02}, 4);
+  cpu->pc = 0x200;
+  tracer_set_trigger(tracer, TRACE_NO_PC, cpu->cycles + 2);
+  mos6502_execute(cpu, 1000);
+  TEST_ASSERT_EQUAL_size_t(3, tracer_count(tracer));
+  TEST_ASSERT_EQUAL_HEX16(0x202, tracer_record(tracer, 1)->pc);
+  rc_strong_release((void*)&tracer);
+}
+
+TEST(TRACE, file_round_trip) {
+  char path[] = "/tmp/b6502_traceXXXXXX";
+  FILE* f = fdopen(mkstemp(path), "w");
+  TEST_ASSERT_NOT_NULL(f);
+  fclose(f);
+
+  Tracer* tracer = tracer_create_file(kNMOS6502, path, 32);
+  TEST_ASSERT_NOT_NULL(tracer);
+  set_tracer(cpu, tracer);
+  mos6502_execute(cpu, 1000);
+
+  static char expected[8192];
+  static char exported[8192];
+  f = tmpfile();
+  TEST_ASSERT_NOT_NULL(f);
+  tracer_export(tracer, f);
+  read_back(f, expected, sizeof(expected));
+  set_tracer(cpu, NULL);
+  rc_strong_release((void*)&tracer);
+
+  f = tmpfile();
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT(trace_export_file(path, f));
+  read_back(f, exported, sizeof(exported));
+  remove(path);
+
+  TEST_ASSERT_EQUAL_STRING(expected, exported);
+  TEST_ASSERT_NOT_NULL(strstr(exported, "0207  02        KIL"));
+}
+
+TEST_GROUP_RUNNER(TRACE) {
+  RUN_TEST_CASE(TRACE, nestest_format)
+  RUN_TEST_CASE(TRACE, ring_keeps_the_last_records)
+  RUN_TEST_CASE(TRACE, trigger)
+  RUN_TEST_CASE(TRACE, file_round_trip)
+}
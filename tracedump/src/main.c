@@ -0,0 +1,56 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b6502/base.h"
+#include "b6502/trace.h"
+
+static struct option long_options[] = {
+    {"output", required_argument, 0, 'o'}, {"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+
+static void print_help(void) {
+  printf(
+      "Usage: b6502-tracedump [options] TRACE\n"
+      "Render a trace file written by tracer_create_file() in the format of nestest.log.\n\n"
+      "  -o, --output FILE  where to write the text (default: stdout)\n"
+      "  -h, --help         show this help\n");
+}
+
+int main(int argc, char** argv) {
+  const char* output = NULL;
+
+  int c = 0;
+  while ((c = getopt_long(argc, argv, "o:h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'o':
+        output = optarg;
+        break;
+      case 'h':
+        print_help();
+        return EXIT_SUCCESS;
+      case '?':
+        return EXIT_FAILURE;
+      default:
+        abort();
+    }
+  }
+
+  if (optind != argc - 1) {
+    print_help();
+    return EXIT_FAILURE;
+  }
+
+  FILE* out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    LOG_ERROR("Error opening file: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  const bool exported = trace_export_file(argv[optind], out);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return exported ? EXIT_SUCCESS : EXIT_FAILURE;
+}